@@ -9,6 +9,7 @@
 std::string Config::filename{};
 std::map<std::string, std::string> Config::values{};
 std::vector<t_config_changed_callback> Config::callbacks{};
+std::atomic<unsigned long> Config::generation{0};
 
 std::string Config::get(const std::string& option, const std::string& def)
 {
@@ -31,6 +32,7 @@ int Config::get_int(const std::string& option, const int& def)
 void Config::set(const std::string& option, const std::string& value, bool save)
 {
   Config::values[option] = value;
+  Config::generation++;
   if (save)
     {
       Config::save_to_file();
@@ -46,6 +48,7 @@ void Config::connect(t_config_changed_callback callback)
 void Config::clear()
 {
   Config::values.clear();
+  Config::generation++;
 }
 
 /**
@@ -88,6 +91,7 @@ bool Config::read_conf(const std::string& name)
       value = line.substr(pos+1);
       Config::values[option] = value;
     }
+  Config::generation++;
   return true;
 }
 
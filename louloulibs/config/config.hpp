@@ -18,6 +18,7 @@
 
 #include <functional>
 #include <fstream>
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <string>
@@ -65,6 +66,12 @@ public:
    * Read the configuration file at the given path.
    */
   static bool read_conf(const std::string& name="");
+  /**
+   * A number incremented each time a value is changed, to let anyone
+   * caching some values know that they must be read again.
+   */
+  static unsigned long get_generation()
+  { return Config::generation.load(); }
   /**
    * Get the filename
    */
@@ -87,6 +94,7 @@ private:
   static void trigger_configuration_change();
 
   static std::map<std::string, std::string> values;
+  static std::atomic<unsigned long> generation;
   static std::vector<t_config_changed_callback> callbacks;
 
 };
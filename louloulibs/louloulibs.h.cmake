@@ -5,6 +5,7 @@
 #cmakedefine POLLER ${POLLER}
 #cmakedefine BOTAN_FOUND
 #cmakedefine CARES_FOUND
+#cmakedefine ZLIB_FOUND
 #cmakedefine SOFTWARE_VERSION "${SOFTWARE_VERSION}"
 #cmakedefine PROJECT_NAME "${PROJECT_NAME}"
 #cmakedefine HAS_GET_TIME
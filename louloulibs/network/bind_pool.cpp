@@ -0,0 +1,164 @@
+#include <network/bind_pool.hpp>
+
+#include <algorithm>
+#include <functional>
+
+constexpr std::chrono::minutes BindPool::rejection_duration;
+
+BindPolicy to_bind_policy(const std::string& value)
+{
+  if (value == "least-connections")
+    return BindPolicy::least_connections;
+  if (value == "sticky")
+    return BindPolicy::sticky;
+  return BindPolicy::round_robin;
+}
+
+BindPool& BindPool::instance()
+{
+  static BindPool inst;
+  return inst;
+}
+
+std::string BindPool::choose(const std::vector<std::string>& addresses, const BindPolicy policy,
+                             const std::string& server, const std::string& user)
+{
+  if (addresses.empty())
+    return {};
+  this->purge_rejections();
+  std::vector<std::size_t> candidates;
+  for (std::size_t i = 0; i < addresses.size(); ++i)
+    if (!this->is_rejected(addresses[i], server))
+      candidates.push_back(i);
+  // They are all rejected: try them anyway, the limit may be over
+  if (candidates.empty())
+    for (std::size_t i = 0; i < addresses.size(); ++i)
+      candidates.push_back(i);
+
+  std::size_t chosen;
+  switch (policy)
+    {
+    case BindPolicy::least_connections:
+      chosen = *std::min_element(candidates.begin(), candidates.end(),
+                                         [this, &addresses, &server](const std::size_t a, const std::size_t b)
+                                         {
+                                           return std::make_pair(this->get_connections(addresses[a], server),
+                                                                 this->get_connections(addresses[a])) <
+                                             std::make_pair(this->get_connections(addresses[b], server),
+                                                            this->get_connections(addresses[b]));
+                                         });
+      break;
+    case BindPolicy::sticky:
+      {
+        // The first address not rejected, starting at the one of that user
+        const auto preferred = std::hash<std::string>{}(user) % addresses.size();
+        const auto it = std::lower_bound(candidates.begin(), candidates.end(), preferred);
+        chosen = it == candidates.end() ? candidates.front() : *it;
+        break;
+      }
+    case BindPolicy::round_robin:
+    default:
+      {
+        const auto start = this->next % addresses.size();
+        const auto it = std::lower_bound(candidates.begin(), candidates.end(), start);
+        chosen = it == candidates.end() ? candidates.front() : *it;
+        this->next = chosen + 1;
+        break;
+      }
+    }
+  this->acquire(addresses[chosen], server);
+  return addresses[chosen];
+}
+
+void BindPool::acquire(const std::string& address, const std::string& server)
+{
+  auto& source = this->sources[address];
+  source.connections++;
+  source.servers[server]++;
+}
+
+void BindPool::release(const std::string& address, const std::string& server)
+{
+  const auto it = this->sources.find(address);
+  if (it == this->sources.end())
+    return;
+  auto& source = it->second;
+  const auto server_it = source.servers.find(server);
+  if (server_it == source.servers.end())
+    return;
+  source.connections--;
+  if (--server_it->second == 0)
+    source.servers.erase(server_it);
+  if (source.connections == 0 && source.rejections.empty())
+    this->sources.erase(it);
+}
+
+void BindPool::reject(const std::string& address, const std::string& server)
+{
+  this->sources[address].rejections[server] = std::chrono::steady_clock::now() + BindPool::rejection_duration;
+}
+
+void BindPool::purge_rejections()
+{
+  const auto now = std::chrono::steady_clock::now();
+  for (auto it = this->sources.begin(); it != this->sources.end();)
+    {
+      auto& rejections = it->second.rejections;
+      for (auto rejection = rejections.begin(); rejection != rejections.end();)
+        {
+          if (now < rejection->second)
+            ++rejection;
+          else
+            rejection = rejections.erase(rejection);
+        }
+      if (it->second.connections == 0 && rejections.empty())
+        it = this->sources.erase(it);
+      else
+        ++it;
+    }
+}
+
+bool BindPool::is_rejected(const std::string& address, const std::string& server) const
+{
+  const auto it = this->sources.find(address);
+  if (it == this->sources.end())
+    return false;
+  const auto rejection = it->second.rejections.find(server);
+  return rejection != it->second.rejections.end() &&
+    std::chrono::steady_clock::now() < rejection->second;
+}
+
+std::size_t BindPool::get_connections(const std::string& address) const
+{
+  const auto it = this->sources.find(address);
+  if (it == this->sources.end())
+    return 0;
+  return it->second.connections;
+}
+
+std::size_t BindPool::get_connections(const std::string& address, const std::string& server) const
+{
+  const auto it = this->sources.find(address);
+  if (it == this->sources.end())
+    return 0;
+  const auto server_it = it->second.servers.find(server);
+  if (server_it == it->second.servers.end())
+    return 0;
+  return server_it->second;
+}
+
+std::vector<std::pair<std::string, std::size_t>> BindPool::get_counts() const
+{
+  std::vector<std::pair<std::string, std::size_t>> res;
+  for (const auto& source: this->sources)
+    if (source.second.connections > 0)
+      res.emplace_back(source.first, source.second.connections);
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+void BindPool::clear()
+{
+  this->sources.clear();
+  this->next = 0;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <unordered_map>
+#include <cstddef>
+#include <utility>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * How the source address of a new connection is chosen among the
+ * configured ones.
+ */
+enum class BindPolicy
+{
+  /**
+   * Each address in turn.
+   */
+  round_robin,
+  /**
+   * The address with the fewest connections to the same server.
+   */
+  least_connections,
+  /**
+   * Always the same address for a given user (unless it is rejected).
+   */
+  sticky,
+};
+
+/**
+ * Parse "round-robin", "least-connections" or "sticky".  Anything else is
+ * round_robin.
+ */
+BindPolicy to_bind_policy(const std::string& value);
+
+/**
+ * Keep the number of connections from each source address to each server,
+ * to choose the address a new outgoing connection is bound to.  IRC
+ * servers limit the number of connections from each IP, so spreading them
+ * over several addresses lets more users connect to the same server.
+ */
+
+class BindPool
+{
+public:
+  /**
+   * How long an address is avoided for a server, once that server
+   * rejected it because of the number of connections from it.
+   */
+  static constexpr std::chrono::minutes rejection_duration{10};
+
+  ~BindPool() = default;
+  BindPool(const BindPool&) = delete;
+  BindPool(BindPool&&) = delete;
+  BindPool& operator=(const BindPool&) = delete;
+  BindPool& operator=(BindPool&&) = delete;
+
+  static BindPool& instance();
+
+  /**
+   * Choose among these addresses the one to bind a new connection to that
+   * server to, for that user.  The addresses recently rejected by that
+   * server are skipped, unless they all are.  Returns an empty string if
+   * there is no address.
+   *
+   * The chosen address is counted right away, so that the connections
+   * started at the same time are spread too: release() must be called
+   * once that connection failed or is closed.
+   */
+  std::string choose(const std::vector<std::string>& addresses, const BindPolicy policy,
+                     const std::string& server, const std::string& user);
+  /**
+   * A connection bound to that address, to that server, was started, or
+   * failed or was closed.
+   */
+  void acquire(const std::string& address, const std::string& server);
+  void release(const std::string& address, const std::string& server);
+  /**
+   * That server refused a connection from that address because too many
+   * connections come from it.
+   */
+  void reject(const std::string& address, const std::string& server);
+  bool is_rejected(const std::string& address, const std::string& server) const;
+
+  std::size_t get_connections(const std::string& address) const;
+  std::size_t get_connections(const std::string& address, const std::string& server) const;
+  /**
+   * The number of connections from each address that had some, sorted by
+   * address.
+   */
+  std::vector<std::pair<std::string, std::size_t>> get_counts() const;
+  void clear();
+
+private:
+  BindPool() = default;
+  /**
+   * Forget the rejections that are over, and the addresses with neither
+   * connection nor rejection.
+   */
+  void purge_rejections();
+
+  struct Source
+  {
+    std::size_t connections{0};
+    std::unordered_map<std::string, std::size_t> servers;
+    /**
+     * The servers that rejected this address, and until when it is
+     * avoided for them.
+     */
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> rejections;
+  };
+  std::unordered_map<std::string, Source> sources;
+  std::size_t next{0};
+};
@@ -0,0 +1,83 @@
+#include <network/completion_queue.hpp>
+#include <network/poller.hpp>
+#include <logger/logger.hpp>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cstring>
+#include <stdexcept>
+
+static socket_t make_eventfd()
+{
+  const int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1)
+    {
+      log_error("eventfd failed: ", strerror(errno));
+      throw std::runtime_error("Could not create eventfd");
+    }
+  return fd;
+}
+
+CompletionQueue::CompletionQueue(std::shared_ptr<Poller> poller):
+  SocketHandler(poller, make_eventfd()),
+  expected(0)
+{
+}
+
+CompletionQueue::~CompletionQueue()
+{
+  if (this->poller->is_managing_socket(this->socket))
+    this->poller->remove_socket_handler(this->socket);
+  ::close(this->socket);
+}
+
+void CompletionQueue::expect()
+{
+  if (this->expected++ == 0)
+    this->poller->add_socket_handler(this);
+}
+
+void CompletionQueue::push(std::function<void()>&& completion)
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->ready.push_back(std::move(completion));
+  }
+  ::eventfd_write(this->socket, 1);
+}
+
+void CompletionQueue::on_recv()
+{
+  eventfd_t value;
+  ::eventfd_read(this->socket, &value);
+
+  std::vector<std::function<void()>> completions;
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    completions.swap(this->ready);
+  }
+  for (auto& completion: completions)
+    {
+      // Decrement first: the completion may expect() a new one
+      this->expected--;
+      if (completion)
+        completion();
+    }
+  if (this->expected == 0 && this->poller->is_managing_socket(this->socket))
+    this->poller->remove_socket_handler(this->socket);
+}
+
+void CompletionQueue::on_send()
+{
+}
+
+void CompletionQueue::connect()
+{
+}
+
+bool CompletionQueue::is_connected() const
+{
+  return true;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <network/socket_handler.hpp>
+
+#include <functional>
+#include <cstddef>
+#include <vector>
+#include <mutex>
+
+/**
+ * An eventfd, watched by the Poller, used by other threads to hand back
+ * callbacks that must run on the thread running the event loop.
+ *
+ * The eventfd is only managed by the poller while some completions are
+ * expected, so that an idle queue never prevents the main loop from
+ * exiting once every connection is closed.
+ */
+
+class CompletionQueue: public SocketHandler
+{
+public:
+  explicit CompletionQueue(std::shared_ptr<Poller> poller);
+  ~CompletionQueue();
+  CompletionQueue(const CompletionQueue&) = delete;
+  CompletionQueue(CompletionQueue&&) = delete;
+  CompletionQueue& operator=(const CompletionQueue&) = delete;
+  CompletionQueue& operator=(CompletionQueue&&) = delete;
+
+  /**
+   * Signal that one more completion will be pushed later. Must be called
+   * from the event loop thread, before the work producing that completion
+   * is handed to another thread.
+   */
+  void expect();
+  /**
+   * Queue a callback, to be run by the event loop thread. This is the only
+   * method that can be called from any thread.
+   */
+  void push(std::function<void()>&& completion);
+  /**
+   * Run all the queued completions.
+   */
+  void on_recv() override final;
+  void on_send() override final;
+  void connect() override final;
+  bool is_connected() const override final;
+  /**
+   * The number of expected completions that did not run yet.
+   */
+  std::size_t pending() const
+  { return this->expected; }
+
+private:
+  std::mutex mutex;
+  std::vector<std::function<void()>> ready;
+  std::size_t expected;
+};
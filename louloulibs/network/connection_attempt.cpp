@@ -0,0 +1,96 @@
+#include <network/connection_attempt.hpp>
+#include <network/poller.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+
+ConnectionAttempt::ConnectionAttempt(std::shared_ptr<Poller> poller, const socket_t socket,
+                                     const struct sockaddr_storage& addr, const socklen_t addrlen,
+                                     const std::string& port, const bool tls, Callback callback):
+  SocketHandler(poller, socket),
+  addr(addr),
+  addrlen(addrlen),
+  port(port),
+  tls(tls),
+  callback(std::move(callback))
+{
+}
+
+ConnectionAttempt::~ConnectionAttempt()
+{
+  this->cancel();
+}
+
+int ConnectionAttempt::start()
+{
+  if (::connect(this->socket, reinterpret_cast<const struct sockaddr*>(&this->addr), this->addrlen) == 0)
+    return 0;
+  const int error = errno;
+  if (error != EINPROGRESS)
+    return error;
+  this->poller->add_socket_handler(this);
+  this->poller->watch_send_events(this);
+  return EINPROGRESS;
+}
+
+socket_t ConnectionAttempt::release()
+{
+  if (this->poller->is_managing_socket(this->socket))
+    this->poller->remove_socket_handler(this->socket);
+  const auto res = this->socket;
+  this->socket = -1;
+  this->callback = nullptr;
+  return res;
+}
+
+void ConnectionAttempt::cancel()
+{
+  const auto socket = this->release();
+  if (socket != -1)
+    ::close(socket);
+}
+
+void ConnectionAttempt::connect()
+{
+  // The poller may still have an event for a cancelled attempt
+  if (!this->callback)
+    return;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (::getsockopt(this->socket, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+    error = errno;
+  if (error == EINPROGRESS || error == EALREADY)
+    return;
+  const auto callback = std::move(this->callback);
+  this->callback = nullptr;
+  callback(*this, error);
+}
+
+void ConnectionAttempt::on_recv()
+{
+  this->connect();
+}
+
+void ConnectionAttempt::on_send()
+{
+  this->connect();
+}
+
+bool ConnectionAttempt::is_connected() const
+{
+  return false;
+}
+
+std::string ConnectionAttempt::get_ip() const
+{
+  char buf[INET6_ADDRSTRLEN] = {};
+  if (this->addr.ss_family == AF_INET)
+    ::inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in*>(&this->addr)->sin_addr,
+                buf, sizeof(buf));
+  else if (this->addr.ss_family == AF_INET6)
+    ::inet_ntop(AF_INET6, &reinterpret_cast<const struct sockaddr_in6*>(&this->addr)->sin6_addr,
+                buf, sizeof(buf));
+  return buf;
+}
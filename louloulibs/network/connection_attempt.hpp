@@ -0,0 +1,76 @@
+#pragma once
+
+#include <network/socket_handler.hpp>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <functional>
+#include <string>
+
+/**
+ * One of the connections started in parallel by a TCPSocketHandler, to one
+ * address and port of the remote server.  The callback is called once the
+ * socket is connected, or failed to, and the TCPSocketHandler takes the
+ * socket of the first one that succeeds with release().
+ */
+
+class ConnectionAttempt: public SocketHandler
+{
+public:
+  /**
+   * Called with 0 once connected, or with the errno value of the failure.
+   */
+  using Callback = std::function<void(ConnectionAttempt&, const int error)>;
+
+  explicit ConnectionAttempt(std::shared_ptr<Poller> poller, const socket_t socket,
+                             const struct sockaddr_storage& addr, const socklen_t addrlen,
+                             const std::string& port, const bool tls, Callback callback);
+  ~ConnectionAttempt();
+  ConnectionAttempt(const ConnectionAttempt&) = delete;
+  ConnectionAttempt(ConnectionAttempt&&) = delete;
+  ConnectionAttempt& operator=(const ConnectionAttempt&) = delete;
+  ConnectionAttempt& operator=(ConnectionAttempt&&) = delete;
+
+  /**
+   * Call connect() on the socket.  Returns 0 if it is connected right
+   * away, EINPROGRESS if the result will be given to the callback, or the
+   * errno value of the failure.
+   */
+  int start();
+  /**
+   * Stop watching the socket, and hand it to the caller.
+   */
+  socket_t release();
+  /**
+   * Stop watching and close the socket.  The callback will not be called.
+   */
+  void cancel();
+  /**
+   * Called by the poller when the socket becomes writable or fails: check
+   * the result of the connection and give it to the callback.
+   */
+  void connect() override final;
+  void on_recv() override final;
+  void on_send() override final;
+  /**
+   * Always false, so that the poller calls connect() on any event.
+   */
+  bool is_connected() const override final;
+
+  const std::string& get_port() const
+  { return this->port; }
+  bool use_tls() const
+  { return this->tls; }
+  /**
+   * The IP address, for the logs.
+   */
+  std::string get_ip() const;
+
+private:
+  struct sockaddr_storage addr;
+  const socklen_t addrlen;
+  const std::string port;
+  const bool tls;
+  Callback callback;
+};
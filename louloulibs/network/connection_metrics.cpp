@@ -0,0 +1,62 @@
+#include <network/connection_metrics.hpp>
+
+#include <algorithm>
+
+constexpr std::size_t ConnectionMetrics::max_samples;
+
+std::ostream& operator<<(std::ostream& os, const ConnectionStats& stats)
+{
+  return os << stats.connections << " succeeded, " << stats.failures << " failed, time to connect p50 "
+            << stats.p50.count() << "ms, p90 " << stats.p90.count() << "ms, p99 " << stats.p99.count() << "ms";
+}
+
+ConnectionMetrics& ConnectionMetrics::instance()
+{
+  static ConnectionMetrics inst;
+  return inst;
+}
+
+void ConnectionMetrics::record_success(const std::string& server, const std::chrono::milliseconds duration)
+{
+  auto& stats = this->servers[server];
+  stats.connections++;
+  if (stats.samples.size() < ConnectionMetrics::max_samples)
+    stats.samples.push_back(duration);
+  else
+    stats.samples[stats.next] = duration;
+  stats.next = (stats.next + 1) % ConnectionMetrics::max_samples;
+}
+
+void ConnectionMetrics::record_failure(const std::string& server)
+{
+  this->servers[server].failures++;
+}
+
+ConnectionStats ConnectionMetrics::get(const std::string& server) const
+{
+  ConnectionStats res;
+  const auto it = this->servers.find(server);
+  if (it == this->servers.end())
+    return res;
+  res.connections = it->second.connections;
+  res.failures = it->second.failures;
+  auto samples = it->second.samples;
+  if (samples.empty())
+    return res;
+  std::sort(samples.begin(), samples.end());
+  // Nearest-rank percentiles
+  auto percentile = [&samples](const std::size_t p)
+    {
+      const auto rank = (p * samples.size() + 99) / 100;
+      return samples[std::max<std::size_t>(rank, 1) - 1];
+    };
+  res.p50 = percentile(50);
+  res.p90 = percentile(90);
+  res.p99 = percentile(99);
+  return res;
+}
+
+void ConnectionMetrics::clear()
+{
+  this->servers.clear();
+}
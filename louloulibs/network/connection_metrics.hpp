@@ -0,0 +1,71 @@
+#pragma once
+
+#include <unordered_map>
+#include <cstdint>
+#include <ostream>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * The time it took to connect to a server (from the start of the name
+ * resolution, to the first connected socket), over its last connections.
+ */
+struct ConnectionStats
+{
+  std::uint64_t connections{0};
+  std::uint64_t failures{0};
+  std::chrono::milliseconds p50{0};
+  std::chrono::milliseconds p90{0};
+  std::chrono::milliseconds p99{0};
+};
+
+/**
+ * Write these stats on one line, for the logs.
+ */
+std::ostream& operator<<(std::ostream& os, const ConnectionStats& stats);
+
+/**
+ * Keep the time-to-connected of the last connections to each server.
+ */
+
+class ConnectionMetrics
+{
+public:
+  /**
+   * Number of connection times kept for each server.
+   */
+  static constexpr std::size_t max_samples = 256;
+
+  ~ConnectionMetrics() = default;
+  ConnectionMetrics(const ConnectionMetrics&) = delete;
+  ConnectionMetrics(ConnectionMetrics&&) = delete;
+  ConnectionMetrics& operator=(const ConnectionMetrics&) = delete;
+  ConnectionMetrics& operator=(ConnectionMetrics&&) = delete;
+
+  static ConnectionMetrics& instance();
+
+  void record_success(const std::string& server, const std::chrono::milliseconds duration);
+  void record_failure(const std::string& server);
+  /**
+   * The percentiles of the kept connection times to that server.  All zero
+   * if we never connected to it.
+   */
+  ConnectionStats get(const std::string& server) const;
+  void clear();
+
+private:
+  ConnectionMetrics() = default;
+
+  struct Server
+  {
+    std::uint64_t connections{0};
+    std::uint64_t failures{0};
+    /**
+     * A ring of the last max_samples durations.
+     */
+    std::vector<std::chrono::milliseconds> samples;
+    std::size_t next{0};
+  };
+  std::unordered_map<std::string, Server> servers;
+};
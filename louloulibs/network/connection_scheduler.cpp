@@ -0,0 +1,300 @@
+#include <network/connection_scheduler.hpp>
+#include <utils/timed_events.hpp>
+#include <logger/logger.hpp>
+
+#include <algorithm>
+
+using namespace std::string_literals;
+
+constexpr std::chrono::seconds ConnectionScheduler::min_backoff;
+constexpr std::chrono::seconds ConnectionScheduler::max_backoff;
+
+ConnectionScheduler::ConnectionScheduler():
+  random(std::random_device{}())
+{
+}
+
+ConnectionScheduler& ConnectionScheduler::instance()
+{
+  static ConnectionScheduler inst;
+  return inst;
+}
+
+void ConnectionScheduler::set_limits(const std::size_t concurrency, const double rate)
+{
+  this->concurrency = concurrency;
+  this->rate = rate;
+}
+
+ConnectionScheduler::Server& ConnectionScheduler::get_server(const std::string& server)
+{
+  auto it = this->servers.find(server);
+  if (it == this->servers.end())
+    {
+      it = this->servers.emplace(server, Server{}).first;
+      it->second.tokens = std::max<std::size_t>(this->concurrency, 1);
+      it->second.refill_time = std::chrono::steady_clock::now();
+    }
+  return it->second;
+}
+
+ConnectionScheduler::Ticket ConnectionScheduler::request(const std::string& server, const std::string& user,
+                                                         const ConnectionPriority priority, std::function<void()> start)
+{
+  auto ticket = std::make_shared<std::function<void()>>(std::move(start));
+  auto& queue = this->get_server(server).queues[static_cast<int>(priority)];
+  queue.push_back({ticket, user, std::chrono::steady_clock::now()});
+  this->process(server);
+  const bool queued = std::any_of(queue.begin(), queue.end(), [&ticket](const Request& request)
+                                  {
+                                    return request.start.lock() == ticket;
+                                  });
+  if (!queued)
+    return nullptr;
+  return ticket;
+}
+
+void ConnectionScheduler::add_failure(Backoff& backoff)
+{
+  backoff.failures++;
+  const auto duration = std::min<std::chrono::steady_clock::duration>(
+      ConnectionScheduler::min_backoff * (1u << std::min(backoff.failures - 1, 16u)),
+      ConnectionScheduler::max_backoff);
+  // Between half the backoff and all of it, so that the clients that
+  // failed together do not all come back at once
+  std::uniform_int_distribution<std::chrono::steady_clock::rep> jitter(duration.count() / 2, duration.count());
+  backoff.not_before = std::max(backoff.not_before, std::chrono::steady_clock::now() +
+                                std::chrono::steady_clock::duration(jitter(this->random)));
+}
+
+bool ConnectionScheduler::is_over(const Backoff& backoff, const std::chrono::steady_clock::time_point& now)
+{
+  return backoff.failures == 0 || now >= backoff.not_before + ConnectionScheduler::max_backoff;
+}
+
+void ConnectionScheduler::done(const std::string& server, const std::string& user, const Outcome outcome)
+{
+  auto& state = this->get_server(server);
+  if (state.in_progress > 0)
+    state.in_progress--;
+  if (outcome == Outcome::connected)
+    {
+      state.backoff.failures = 0;
+      state.users.erase(user);
+    }
+  else if (outcome == Outcome::failed)
+    {
+      this->metrics.failures++;
+      this->add_failure(state.backoff);
+      log_debug("Connections to ", server, " delayed for ",
+                std::chrono::duration_cast<std::chrono::milliseconds>(state.backoff.not_before - std::chrono::steady_clock::now()).count(),
+                "ms after ", state.backoff.failures, " failure(s)");
+    }
+  else if (outcome == Outcome::rejected)
+    {
+      this->metrics.rejections++;
+      auto& backoff = state.users[user];
+      this->add_failure(backoff);
+      log_debug("Connections of ", user, " to ", server, " delayed for ",
+                std::chrono::duration_cast<std::chrono::milliseconds>(backoff.not_before - std::chrono::steady_clock::now()).count(),
+                "ms after ", backoff.failures, " rejection(s)");
+    }
+  // Not right now: the caller may be in the middle of destroying a
+  // connection waiting in the queue
+  this->process_at(server, std::chrono::steady_clock::now());
+}
+
+void ConnectionScheduler::process_at(const std::string& server, const std::chrono::steady_clock::time_point& time_point)
+{
+  if (!TimedEventsManager::instance().reschedule(ConnectionScheduler::get_timer_name(server), time_point))
+    TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::time_point(time_point),
+                                                        [this, server]()
+                                                        {
+                                                          this->process(server);
+                                                          this->prune();
+                                                        },
+                                                        ConnectionScheduler::get_timer_name(server)));
+}
+
+void ConnectionScheduler::process(const std::string& server)
+{
+  auto& state = this->get_server(server);
+  while (true)
+    {
+      for (auto& queue: state.queues)
+        while (!queue.empty() && queue.front().start.expired())
+          queue.pop_front();
+      // done() will process the queue again
+      if (this->concurrency != 0 && state.in_progress >= this->concurrency)
+        break;
+
+      const auto now = std::chrono::steady_clock::now();
+      // The first request, by priority, of a user that this server did not
+      // refuse recently
+      std::deque<Request>* queue = nullptr;
+      std::deque<Request>::iterator request;
+      auto user_time = std::chrono::steady_clock::time_point::max();
+      for (auto& candidates: state.queues)
+        {
+          for (auto it = candidates.begin(); it != candidates.end() && !queue; ++it)
+            {
+              if (it->start.expired())
+                continue;
+              const auto user = state.users.find(it->user);
+              if (user != state.users.end() && now < user->second.not_before)
+                user_time = std::min(user_time, user->second.not_before);
+              else
+                {
+                  queue = &candidates;
+                  request = it;
+                }
+            }
+          if (queue)
+            break;
+        }
+      if (!queue)
+        {
+          if (user_time != std::chrono::steady_clock::time_point::max())
+            this->process_at(server, user_time);
+          break;
+        }
+
+      auto next_time = state.backoff.not_before;
+      if (this->rate > 0)
+        {
+          const double burst = std::max<std::size_t>(this->concurrency, 1);
+          state.tokens = std::min(burst, state.tokens + this->rate *
+                                  std::chrono::duration<double>(now - state.refill_time).count());
+          state.refill_time = now;
+          if (state.tokens < 1)
+            next_time = std::max(next_time, now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>((1 - state.tokens) / this->rate)));
+        }
+      if (next_time > now)
+        {
+          this->process_at(server, next_time);
+          break;
+        }
+
+      const auto start = request->start.lock();
+      const auto waited = std::chrono::duration_cast<std::chrono::milliseconds>(now - request->since);
+      auto& wait = queue == &state.queues[0] ? this->metrics.interactive : this->metrics.reconnect;
+      queue->erase(request);
+      if (this->rate > 0)
+        state.tokens -= 1;
+      state.in_progress++;
+      wait.admitted++;
+      wait.total += waited;
+      wait.max = std::max(wait.max, waited);
+      if (waited >= std::chrono::seconds(1))
+        log_info("Connection to ", server, " started after waiting ", waited.count(), "ms in the queue");
+      else
+        log_debug("Connection to ", server, " started after waiting ", waited.count(), "ms in the queue");
+      // May call done() or request() again, for that server
+      (*start)();
+    }
+}
+
+void ConnectionScheduler::prune()
+{
+  const auto now = std::chrono::steady_clock::now();
+  const double burst = std::max<std::size_t>(this->concurrency, 1);
+  for (auto it = this->servers.begin(); it != this->servers.end();)
+    {
+      auto& state = it->second;
+      for (auto user = state.users.begin(); user != state.users.end();)
+        {
+          if (ConnectionScheduler::is_over(user->second, now))
+            user = state.users.erase(user);
+          else
+            ++user;
+        }
+      const bool idle = state.in_progress == 0 && state.users.empty() &&
+        std::all_of(std::begin(state.queues), std::end(state.queues),
+                    [](const std::deque<Request>& queue)
+                    {
+                      return std::all_of(queue.begin(), queue.end(), [](const Request& request)
+                                         {
+                                           return request.start.expired();
+                                         });
+                    });
+      const bool refilled = this->rate <= 0 ||
+        state.tokens + this->rate * std::chrono::duration<double>(now - state.refill_time).count() >= burst;
+      // A timer still pending for it only finds an empty queue
+      if (idle && refilled && ConnectionScheduler::is_over(state.backoff, now))
+        it = this->servers.erase(it);
+      else
+        ++it;
+    }
+}
+
+std::size_t ConnectionScheduler::get_queued(const std::string& server) const
+{
+  const auto it = this->servers.find(server);
+  if (it == this->servers.end())
+    return 0;
+  std::size_t res = 0;
+  for (const auto& queue: it->second.queues)
+    res += std::count_if(queue.begin(), queue.end(), [](const Request& request)
+                         {
+                           return !request.start.expired();
+                         });
+  return res;
+}
+
+std::size_t ConnectionScheduler::get_in_progress(const std::string& server) const
+{
+  const auto it = this->servers.find(server);
+  if (it == this->servers.end())
+    return 0;
+  return it->second.in_progress;
+}
+
+std::chrono::steady_clock::duration ConnectionScheduler::get_backoff(const std::string& server) const
+{
+  const auto it = this->servers.find(server);
+  if (it == this->servers.end())
+    return {};
+  return std::max(it->second.backoff.not_before - std::chrono::steady_clock::now(),
+                  std::chrono::steady_clock::duration::zero());
+}
+
+std::chrono::steady_clock::duration ConnectionScheduler::get_backoff(const std::string& server,
+                                                                     const std::string& user) const
+{
+  const auto it = this->servers.find(server);
+  if (it == this->servers.end())
+    return {};
+  const auto user_it = it->second.users.find(user);
+  if (user_it == it->second.users.end())
+    return {};
+  return std::max(user_it->second.not_before - std::chrono::steady_clock::now(),
+                  std::chrono::steady_clock::duration::zero());
+}
+
+std::size_t ConnectionScheduler::size() const
+{
+  return this->servers.size();
+}
+
+ConnectionSchedulerMetrics ConnectionScheduler::get_metrics() const
+{
+  auto metrics = this->metrics;
+  metrics.queued = 0;
+  for (const auto& server: this->servers)
+    metrics.queued += this->get_queued(server.first);
+  return metrics;
+}
+
+void ConnectionScheduler::clear()
+{
+  for (const auto& server: this->servers)
+    TimedEventsManager::instance().cancel(ConnectionScheduler::get_timer_name(server.first));
+  this->servers.clear();
+  this->metrics = {};
+}
+
+std::string ConnectionScheduler::get_timer_name(const std::string& server)
+{
+  return "connection_scheduler"s + server;
+}
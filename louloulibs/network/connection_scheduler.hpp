@@ -0,0 +1,207 @@
+#pragma once
+
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <string>
+#include <deque>
+
+/**
+ * Which requests are admitted first, when several wait for the same
+ * server.
+ */
+enum class ConnectionPriority
+{
+  /**
+   * A user is waiting for that connection, to join a room.
+   */
+  interactive,
+  /**
+   * A connection opened again without a user asking for it right now: a
+   * reconnection, or the clients joining all their rooms again after the
+   * XMPP server restarted.
+   */
+  reconnect,
+};
+
+/**
+ * How long the admitted requests of one priority waited in the queue.
+ */
+struct ConnectionQueueWait
+{
+  std::uint64_t admitted{0};
+  std::chrono::milliseconds total{0};
+  std::chrono::milliseconds max{0};
+};
+
+struct ConnectionSchedulerMetrics
+{
+  ConnectionQueueWait interactive;
+  ConnectionQueueWait reconnect;
+  /**
+   * The connections that failed because of the server or the network, and
+   * the ones the server refused to one user.
+   */
+  std::uint64_t failures{0};
+  std::uint64_t rejections{0};
+  /**
+   * The requests waiting right now, for all the servers.
+   */
+  std::size_t queued{0};
+};
+
+/**
+ * Decide when the new connections to each server are started, so that
+ * thousands of them (when all the users join their rooms again at once)
+ * are not opened in the same second: servers answer that with throttling
+ * bans.
+ *
+ * For each server, at most `concurrency` connections are in progress (from
+ * their start until they are registered, or have failed), they are started
+ * at `rate` per second at most (with bursts of `concurrency`), and none is
+ * started for some time after a failure of the network or a throttling by
+ * the server: an exponential backoff, with jitter.  When the server
+ * refuses a connection because of that user only (a wrong password, a
+ * ban…), the same backoff only applies to that user's connections to it.
+ * The requests that have to wait are queued, the interactive ones ahead of
+ * the reconnections.
+ */
+class ConnectionScheduler
+{
+public:
+  /**
+   * The function starting the connection, kept alive by its owner as long
+   * as the request should stay in the queue.
+   */
+  using Ticket = std::shared_ptr<std::function<void()>>;
+
+  enum class Outcome
+  {
+    connected,
+    /**
+     * The server could not be reached, or throttled us: all the connections
+     * to it are delayed.
+     */
+    failed,
+    /**
+     * The server refused that user: only their connections are delayed.
+     */
+    rejected,
+    /**
+     * The connection was abandoned, without telling anything about the
+     * server.
+     */
+    cancelled,
+  };
+
+  /**
+   * The backoff after the first failure, doubled by each following one.
+   */
+  static constexpr std::chrono::seconds min_backoff{2};
+  static constexpr std::chrono::seconds max_backoff{300};
+
+  ~ConnectionScheduler() = default;
+  ConnectionScheduler(const ConnectionScheduler&) = delete;
+  ConnectionScheduler(ConnectionScheduler&&) = delete;
+  ConnectionScheduler& operator=(const ConnectionScheduler&) = delete;
+  ConnectionScheduler& operator=(ConnectionScheduler&&) = delete;
+
+  static ConnectionScheduler& instance();
+
+  /**
+   * The limits applied to each server.  0 means no limit.
+   */
+  void set_limits(const std::size_t concurrency, const double rate);
+  /**
+   * Call start once a connection of that user to that server can be
+   * started.  If that is right now, start is called before this returns,
+   * and nullptr is returned.  Otherwise the request is queued: the
+   * returned ticket must be kept until start is called, and releasing it
+   * cancels the request.
+   *
+   * Once started, the connection must be reported with done().  The
+   * queue of that server is then processed from a timed event.
+   */
+  Ticket request(const std::string& server, const std::string& user,
+                 const ConnectionPriority priority, std::function<void()> start);
+  void done(const std::string& server, const std::string& user, const Outcome outcome);
+
+  std::size_t get_queued(const std::string& server) const;
+  std::size_t get_in_progress(const std::string& server) const;
+  /**
+   * How long the connections to that server, or the ones of that user to
+   * it, are still delayed because of the last failures.
+   */
+  std::chrono::steady_clock::duration get_backoff(const std::string& server) const;
+  std::chrono::steady_clock::duration get_backoff(const std::string& server, const std::string& user) const;
+  /**
+   * The number of servers for which some state is kept.
+   */
+  std::size_t size() const;
+  ConnectionSchedulerMetrics get_metrics() const;
+  void clear();
+
+private:
+  ConnectionScheduler();
+
+  /**
+   * Start the queued requests of that server that can be, and set a timer
+   * to do it again when the next one can, if needed.
+   */
+  void process(const std::string& server);
+  void process_at(const std::string& server, const std::chrono::steady_clock::time_point& time_point);
+  /**
+   * Forget the servers with nothing queued or in progress, whose tokens
+   * are all back, and whose failures (and the ones of their users) are
+   * old enough to not delay anything anymore.
+   */
+  void prune();
+  static std::string get_timer_name(const std::string& server);
+
+  struct Request
+  {
+    std::weak_ptr<std::function<void()>> start;
+    std::string user;
+    std::chrono::steady_clock::time_point since;
+  };
+  struct Backoff
+  {
+    unsigned int failures{0};
+    std::chrono::steady_clock::time_point not_before;
+  };
+  /**
+   * Delay the next connections a bit more.
+   */
+  void add_failure(Backoff& backoff);
+  /**
+   * Whether that backoff does not delay anything anymore, and would not
+   * make the next one any longer.
+   */
+  static bool is_over(const Backoff& backoff, const std::chrono::steady_clock::time_point& now);
+  struct Server
+  {
+    /**
+     * Indexed by priority.
+     */
+    std::deque<Request> queues[2];
+    std::size_t in_progress{0};
+    double tokens{0};
+    std::chrono::steady_clock::time_point refill_time;
+    Backoff backoff;
+    /**
+     * The users this server refused recently.
+     */
+    std::unordered_map<std::string, Backoff> users;
+  };
+  Server& get_server(const std::string& server);
+
+  std::unordered_map<std::string, Server> servers;
+  std::size_t concurrency{0};
+  double rate{0};
+  ConnectionSchedulerMetrics metrics;
+  std::minstd_rand random;
+};
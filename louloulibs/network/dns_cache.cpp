@@ -0,0 +1,112 @@
+#include <network/dns_cache.hpp>
+
+#include <algorithm>
+
+constexpr std::chrono::seconds DNSCache::not_found_ttl;
+constexpr std::chrono::seconds DNSCache::failure_ttl;
+constexpr std::chrono::seconds DNSCache::max_ttl;
+constexpr std::chrono::seconds DNSCache::sweep_interval;
+constexpr std::size_t DNSCache::default_max_entries;
+
+DNSCache::DNSCache(Lookup lookup, const std::size_t max_entries):
+  lookup(std::move(lookup)),
+  max_entries(std::max<std::size_t>(max_entries, 1)),
+  next_sweep(std::chrono::steady_clock::now() + DNSCache::sweep_interval)
+{
+}
+
+void DNSCache::resolve(const std::string& hostname, Callback callback)
+{
+  const auto now = std::chrono::steady_clock::now();
+  auto it = this->entries.find(hostname);
+  if (it == this->entries.end())
+    {
+      if (this->entries.size() >= this->max_entries || now >= this->next_sweep)
+        this->evict(now);
+      it = this->entries.emplace(hostname, Entry{}).first;
+    }
+  auto& entry = it->second;
+  if (entry.waiters.empty() && entry.resolved && now < entry.expiration)
+    {
+      this->metrics.hits++;
+      callback(entry.answer);
+      return;
+    }
+  entry.waiters.push_back(std::move(callback));
+  if (entry.waiters.size() > 1)
+    {
+      this->metrics.coalesced++;
+      return;
+    }
+  this->metrics.misses++;
+  this->lookup(hostname, [this, hostname](DNSAnswer&& answer, const std::chrono::seconds ttl)
+               {
+                 this->on_answer(hostname, std::move(answer), ttl);
+               });
+}
+
+void DNSCache::on_answer(const std::string& hostname, DNSAnswer&& answer, const std::chrono::seconds ttl)
+{
+  auto& entry = this->entries[hostname];
+  entry.answer = std::move(answer);
+  entry.expiration = std::chrono::steady_clock::now() + std::min(ttl, DNSCache::max_ttl);
+  entry.resolved = true;
+  // A waiter may query that hostname again
+  const auto waiters = std::move(entry.waiters);
+  entry.waiters.clear();
+  const auto result = entry.answer;
+  for (const auto& waiter: waiters)
+    waiter(result);
+}
+
+std::size_t DNSCache::flush()
+{
+  std::size_t res = 0;
+  for (auto it = this->entries.begin(); it != this->entries.end();)
+    {
+      if (it->second.waiters.empty())
+        {
+          res += it->second.resolved;
+          it = this->entries.erase(it);
+        }
+      else
+        ++it;
+    }
+  return res;
+}
+
+void DNSCache::evict(const std::chrono::steady_clock::time_point now)
+{
+  this->next_sweep = now + DNSCache::sweep_interval;
+  std::vector<decltype(this->entries)::iterator> candidates;
+  for (auto it = this->entries.begin(); it != this->entries.end();)
+    {
+      if (!it->second.waiters.empty())
+        ++it;
+      else if (!it->second.resolved || now >= it->second.expiration)
+        {
+          this->metrics.evicted++;
+          it = this->entries.erase(it);
+        }
+      else
+        candidates.push_back(it++);
+    }
+  if (this->entries.size() < this->max_entries)
+    return;
+  const auto excess = std::min(this->entries.size() - this->max_entries + 1, candidates.size());
+  std::partial_sort(candidates.begin(), candidates.begin() + excess, candidates.end(),
+                    [](const auto& a, const auto& b)
+                    {
+                      return a->second.expiration < b->second.expiration;
+                    });
+  for (std::size_t i = 0; i < excess; ++i)
+    this->entries.erase(candidates[i]);
+  this->metrics.evicted += excess;
+}
+
+DNSCacheMetrics DNSCache::get_metrics() const
+{
+  auto metrics = this->metrics;
+  metrics.entries = this->entries.size();
+  return metrics;
+}
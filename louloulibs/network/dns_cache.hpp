@@ -0,0 +1,123 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <chrono>
+#include <string>
+#include <vector>
+
+/**
+ * The addresses of a hostname (without port), or the reason why it could
+ * not be resolved.
+ */
+struct DNSAnswer
+{
+  std::vector<struct sockaddr_storage> addresses;
+  std::string error;
+};
+
+struct DNSCacheMetrics
+{
+  std::uint64_t hits{0};
+  std::uint64_t misses{0};
+  /**
+   * Queries that waited for a lookup already in progress for the same
+   * hostname, instead of starting their own.
+   */
+  std::uint64_t coalesced{0};
+  /**
+   * Answers forgotten before anyone asked for them again: the expired ones
+   * removed by a sweep, and the ones removed to keep the cache under its
+   * maximum size.
+   */
+  std::uint64_t evicted{0};
+  std::size_t entries{0};
+};
+
+/**
+ * The answers of the DNS lookups, shared by all the connections, and kept
+ * as long as the TTL of their records allows.  A failure is kept for a
+ * short time too, so that many clients reconnecting to a broken hostname
+ * do not all query it.
+ *
+ * While a lookup is in progress, the other queries for the same hostname
+ * wait for its answer instead of starting their own.
+ */
+class DNSCache
+{
+public:
+  using Callback = std::function<void(const DNSAnswer&)>;
+  /**
+   * Called with the answer, and how long it can be kept.  Must be called
+   * on the event loop thread, possibly before lookup() returns.
+   */
+  using LookupCallback = std::function<void(DNSAnswer&&, std::chrono::seconds ttl)>;
+  using Lookup = std::function<void(const std::string& hostname, LookupCallback callback)>;
+
+  /**
+   * How long failures are kept: the ones saying that the name has no
+   * address, and the others (a timeout, a broken server…).
+   */
+  static constexpr std::chrono::seconds not_found_ttl{30};
+  static constexpr std::chrono::seconds failure_ttl{5};
+  /**
+   * The TTLs are capped, so that a changed record is eventually seen.
+   */
+  static constexpr std::chrono::seconds max_ttl{3600};
+  /**
+   * The expired answers are removed, at most this often, when a new
+   * hostname is looked up.  When the cache is full, the answers that
+   * expire first are removed to make room.
+   */
+  static constexpr std::chrono::seconds sweep_interval{60};
+  static constexpr std::size_t default_max_entries{4096};
+
+  explicit DNSCache(Lookup lookup, const std::size_t max_entries=DNSCache::default_max_entries);
+  ~DNSCache() = default;
+  DNSCache(const DNSCache&) = delete;
+  DNSCache(DNSCache&&) = delete;
+  DNSCache& operator=(const DNSCache&) = delete;
+  DNSCache& operator=(DNSCache&&) = delete;
+
+  /**
+   * Call callback with the answer for that hostname: right away if it is
+   * known, or else once the lookup is done.
+   */
+  void resolve(const std::string& hostname, Callback callback);
+  /**
+   * Forget all the answers, and return how many there were.  The lookups
+   * in progress are not affected.
+   */
+  std::size_t flush();
+  DNSCacheMetrics get_metrics() const;
+
+private:
+  void on_answer(const std::string& hostname, DNSAnswer&& answer, const std::chrono::seconds ttl);
+  /**
+   * Remove the expired answers and, if there is still no room for a new
+   * one, the answers that expire first.  The lookups in progress are
+   * never removed.
+   */
+  void evict(const std::chrono::steady_clock::time_point now);
+
+  struct Entry
+  {
+    DNSAnswer answer;
+    std::chrono::steady_clock::time_point expiration;
+    bool resolved{false};
+    /**
+     * The queries waiting for the lookup in progress, if any.
+     */
+    std::vector<Callback> waiters;
+  };
+
+  const Lookup lookup;
+  const std::size_t max_entries;
+  std::unordered_map<std::string, Entry> entries;
+  std::chrono::steady_clock::time_point next_sweep;
+  DNSCacheMetrics metrics;
+};
@@ -7,14 +7,15 @@
 
 #include <utils/timed_events.hpp>
 
-#include <algorithm>
 #include <stdexcept>
 
 DNSHandler DNSHandler::instance;
 
 using namespace std::string_literals;
 DNSHandler::DNSHandler():
+  poller{},
   socket_handlers{},
+  closed_socket_handlers{},
   channel{nullptr}
 {
   int ares_error;
@@ -24,9 +25,11 @@ DNSHandler::DNSHandler():
   // The default timeout values are way too high
   options.timeout = 1000;
   options.tries = 3;
+  options.sock_state_cb = &DNSHandler::on_socket_state;
+  options.sock_state_cb_data = this;
   if ((ares_error = ::ares_init_options(&this->channel,
                                         &options,
-                                        ARES_OPT_TIMEOUTMS|ARES_OPT_TRIES)) != ARES_SUCCESS)
+                                        ARES_OPT_TIMEOUTMS|ARES_OPT_TRIES|ARES_OPT_SOCK_STATE_CB)) != ARES_SUCCESS)
     throw std::runtime_error("Failed to initialize c-ares channel: "s + ares_strerror(ares_error));
 }
 
@@ -37,94 +40,90 @@ ares_channel& DNSHandler::get_channel()
 
 void DNSHandler::destroy()
 {
-  this->remove_all_sockets_from_poller();
-  this->socket_handlers.clear();
+  this->stop_watching();
   ::ares_destroy(this->channel);
   ::ares_library_cleanup();
+  this->socket_handlers.clear();
+  this->closed_socket_handlers.clear();
+  TimedEventsManager::instance().cancel("DNS sockets cleanup");
 }
 
-void DNSHandler::gethostbyname(const std::string& name, ares_host_callback callback,
-                               void* data, int family)
+void DNSHandler::getaddrinfo(const std::string& name, ares_addrinfo_callback callback, void* data)
 {
-  ::ares_gethostbyname(this->channel, name.data(), family,
-                         callback, data);
+  struct ares_addrinfo_hints hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  ::ares_getaddrinfo(this->channel, name.data(), nullptr, &hints, callback, data);
+  this->update_timer();
 }
 
-void DNSHandler::watch_dns_sockets(std::shared_ptr<Poller>& poller)
+void DNSHandler::watch_sockets(std::shared_ptr<Poller> poller)
 {
-  fd_set readers;
-  fd_set writers;
+  this->poller = poller;
+  for (const auto& pair: this->socket_handlers)
+    pair.second->watch(poller);
+  this->update_timer();
+}
 
-  FD_ZERO(&readers);
-  FD_ZERO(&writers);
+void DNSHandler::stop_watching()
+{
+  for (const auto& pair: this->socket_handlers)
+    pair.second->remove_from_poller();
+  this->poller.reset();
+  TimedEventsManager::instance().cancel("DNS timeout");
+}
 
-  int ndfs = ::ares_fds(this->channel, &readers, &writers);
-  // For each existing DNS socket, see if we are still supposed to watch it,
-  // if not then erase it
-  this->socket_handlers.erase(
-      std::remove_if(this->socket_handlers.begin(), this->socket_handlers.end(),
-                     [&readers](const auto& dns_socket)
-                     {
-                       return !FD_ISSET(dns_socket->get_socket(), &readers);
-                     }),
-      this->socket_handlers.end());
+void DNSHandler::process(const ares_socket_t read_fd, const ares_socket_t write_fd)
+{
+  ::ares_process_fd(this->channel, read_fd, write_fd);
+  this->update_timer();
+}
 
-  for (auto i = 0; i < ndfs; ++i)
-    {
-      bool read = FD_ISSET(i, &readers);
-      bool write = FD_ISSET(i, &writers);
-      // Look for the DNSSocketHandler with this fd
-      auto it = std::find_if(this->socket_handlers.begin(),
-                             this->socket_handlers.end(),
-                             [i](const auto& socket_handler)
-                             {
-        return i == socket_handler->get_socket();
-      });
-      if (!read && !write)      // No need to read or write to it
-        { // If found, erase it and stop watching it because it is not
-          // needed anymore
-          if (it != this->socket_handlers.end())
-            // The socket destructor removes it from the poller
-            this->socket_handlers.erase(it);
-        }
-      else            // We need to write and/or read to it
-        { // If not found, create it because we need to watch it
-          if (it == this->socket_handlers.end())
-            {
-              this->socket_handlers.emplace(this->socket_handlers.begin(),
-                                            std::make_unique<DNSSocketHandler>(poller, *this, i));
-              it = this->socket_handlers.begin();
-            }
-          poller->add_socket_handler(it->get());
-          if (write)
-            poller->watch_send_events(it->get());
-        }
-    }
-  // Cancel previous timer, if any.
-  TimedEventsManager::instance().cancel("DNS timeout");
-  struct timeval tv;
-  struct timeval* tvp;
-  tvp = ::ares_timeout(this->channel, NULL, &tv);
-  if (tvp)
-    {
-      auto future_time = std::chrono::steady_clock::now() + std::chrono::seconds(tvp->tv_sec) + \
-        std::chrono::microseconds(tvp->tv_usec);
-      TimedEventsManager::instance().add_event(TimedEvent(std::move(future_time),
-                                                          [this]()
-             {
-               for (auto& dns_socket_handler: this->socket_handlers)
-                 dns_socket_handler->on_recv();
-             },
-                                                          "DNS timeout"));
+void DNSHandler::on_socket_state(void* data, ares_socket_t socket, int readable, int writable)
+{
+  auto handler = static_cast<DNSHandler*>(data);
+  auto it = handler->socket_handlers.find(socket);
+  if (!readable && !writable)
+    { // The socket is being closed
+      if (it == handler->socket_handlers.end())
+        return;
+      it->second->remove_from_poller();
+      if (handler->closed_socket_handlers.empty())
+        TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::now(),
+                                                            [handler]()
+                                                            {
+                                                              handler->closed_socket_handlers.clear();
+                                                            }, "DNS sockets cleanup"));
+      handler->closed_socket_handlers.push_back(std::move(it->second));
+      handler->socket_handlers.erase(it);
+      return;
     }
+  if (it == handler->socket_handlers.end())
+    it = handler->socket_handlers.emplace(socket, std::make_unique<DNSSocketHandler>(*handler, socket)).first;
+  it->second->set_writable(writable);
+  if (handler->poller)
+    it->second->watch(handler->poller);
 }
 
-void DNSHandler::remove_all_sockets_from_poller()
+void DNSHandler::update_timer()
 {
-  for (const auto& socket_handler: this->socket_handlers)
-  {
-    socket_handler->remove_from_poller();
-  }
+  if (!this->poller)
+    return;
+  struct timeval tv;
+  const struct timeval* tvp = ::ares_timeout(this->channel, nullptr, &tv);
+  if (!tvp)
+    {
+      TimedEventsManager::instance().cancel("DNS timeout");
+      return;
+    }
+  auto time_point = std::chrono::steady_clock::now() + std::chrono::seconds(tvp->tv_sec) +
+    std::chrono::microseconds(tvp->tv_usec);
+  if (!TimedEventsManager::instance().reschedule("DNS timeout", time_point))
+    TimedEventsManager::instance().add_event(TimedEvent(std::move(time_point),
+                                                        [this]()
+                                                        {
+                                                          this->process(ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+                                                        }, "DNS timeout"));
 }
 
 #endif /* CARES_FOUND */
@@ -8,6 +8,7 @@ class Poller;
 class DNSSocketHandler;
 
 # include <ares.h>
+# include <unordered_map>
 # include <memory>
 # include <string>
 # include <vector>
@@ -16,6 +17,10 @@ class DNSSocketHandler;
  * Class managing DNS resolution.  It should only be statically instanciated
  * once in SocketHandler.  It manages ares channel and calls various
  * functions of that library.
+ *
+ * c-ares tells us, through its socket state callback, when it opens or
+ * closes a socket, or changes the events it waits on it, and the poller is
+ * only updated then.  When no query is in progress, nothing is done.
  */
 
 class DNSHandler
@@ -28,30 +33,54 @@ public:
   DNSHandler& operator=(const DNSHandler&) = delete;
   DNSHandler& operator=(DNSHandler&&) = delete;
 
-  void gethostbyname(const std::string& name, ares_host_callback callback,
-                     void* socket_handler, int family);
   /**
-   * Call ares_fds to know what fd needs to be watched by the poller, create
-   * or destroy DNSSocketHandlers depending on the result.
+   * Look up the IPv4 and IPv6 addresses of that name.
    */
-  void watch_dns_sockets(std::shared_ptr<Poller>& poller);
+  void getaddrinfo(const std::string& name, ares_addrinfo_callback callback, void* data);
   /**
-   * Destroy and stop watching all the DNS sockets. Then de-init the channel
-   * and library.
+   * Watch the sockets of c-ares with that poller: the ones already opened,
+   * and the next ones.
+   */
+  void watch_sockets(std::shared_ptr<Poller> poller);
+  /**
+   * Remove all the sockets from the poller and stop the timer.  The
+   * queries in progress are not cancelled, but they will not progress
+   * anymore.
+   */
+  void stop_watching();
+  /**
+   * Stop watching all the DNS sockets. Then de-init the channel and
+   * library.
    */
   void destroy();
-  void remove_all_sockets_from_poller();
+  /**
+   * Let c-ares read from, or write to, that socket (ARES_SOCKET_BAD for
+   * none), and handle the timeouts.
+   */
+  void process(const ares_socket_t read_fd, const ares_socket_t write_fd);
   ares_channel& get_channel();
 
   static DNSHandler instance;
 
 private:
+  static void on_socket_state(void* data, ares_socket_t socket, int readable, int writable);
+  /**
+   * Move the "DNS timeout" event to the next timeout of c-ares, add it if
+   * there is none, or remove it if no query is in progress.
+   */
+  void update_timer();
+
+  std::shared_ptr<Poller> poller;
+  /**
+   * The sockets that c-ares currently has opened.
+   */
+  std::unordered_map<ares_socket_t, std::unique_ptr<DNSSocketHandler>> socket_handlers;
   /**
-   * The list of sockets that needs to be watched, according to the last
-   * call to ares_fds.  DNSSocketHandlers are added to it or removed from it
-   * in the watch_dns_sockets() method
+   * The sockets closed by c-ares, while we may be in one of their
+   * callbacks, or the poller may have pending events for them.  They are
+   * destroyed by the "DNS sockets cleanup" event.
    */
-  std::vector<std::unique_ptr<DNSSocketHandler>> socket_handlers;
+  std::vector<std::unique_ptr<DNSSocketHandler>> closed_socket_handlers;
   ares_channel channel;
 };
 
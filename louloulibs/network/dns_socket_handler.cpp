@@ -7,11 +7,12 @@
 
 #include <ares.h>
 
-DNSSocketHandler::DNSSocketHandler(std::shared_ptr<Poller> poller,
-                                   DNSHandler& handler,
+DNSSocketHandler::DNSSocketHandler(DNSHandler& handler,
                                    const socket_t socket):
-  SocketHandler(poller, socket),
-  handler(handler)
+  SocketHandler(nullptr, socket),
+  handler(handler),
+  writable(false),
+  watching_send_events(false)
 {
 }
 
@@ -21,18 +22,12 @@ void DNSSocketHandler::connect()
 
 void DNSSocketHandler::on_recv()
 {
-  // always stop watching send and read events. We will re-watch them if the
-  // next call to ares_fds tell us to
-  this->handler.remove_all_sockets_from_poller();
-  ::ares_process_fd(DNSHandler::instance.get_channel(), this->socket, ARES_SOCKET_BAD);
+  this->handler.process(this->socket, ARES_SOCKET_BAD);
 }
 
 void DNSSocketHandler::on_send()
 {
-  // always stop watching send and read events. We will re-watch them if the
-  // next call to ares_fds tell us to
-  this->handler.remove_all_sockets_from_poller();
-  ::ares_process_fd(DNSHandler::instance.get_channel(), ARES_SOCKET_BAD, this->socket);
+  this->handler.process(ARES_SOCKET_BAD, this->socket);
 }
 
 bool DNSSocketHandler::is_connected() const
@@ -40,10 +35,35 @@ bool DNSSocketHandler::is_connected() const
   return true;
 }
 
+void DNSSocketHandler::set_writable(const bool writable)
+{
+  this->writable = writable;
+}
+
+void DNSSocketHandler::watch(std::shared_ptr<Poller> poller)
+{
+  if (this->poller != poller)
+    {
+      this->remove_from_poller();
+      this->poller = poller;
+    }
+  if (!this->poller->is_managing_socket(this->socket))
+    {
+      this->poller->add_socket_handler(this);
+      this->watching_send_events = false;
+    }
+  if (this->writable && !this->watching_send_events)
+    this->poller->watch_send_events(this);
+  else if (!this->writable && this->watching_send_events)
+    this->poller->stop_watching_send_events(this);
+  this->watching_send_events = this->writable;
+}
+
 void DNSSocketHandler::remove_from_poller()
 {
-  if (this->poller->is_managing_socket(this->socket))
+  if (this->poller && this->poller->is_managing_socket(this->socket))
     this->poller->remove_socket_handler(this->socket);
+  this->poller.reset();
 }
 
 #endif /* CARES_FOUND */
@@ -7,10 +7,11 @@
 #include <ares.h>
 
 /**
- * Manage a socket returned by ares_fds. We do not create, open or close the
- * socket ourself: this is done by c-ares.  We just call ares_process_fd()
- * with the correct parameters, depending on what can be done on that socket
- * (Poller reported it to be writable or readeable)
+ * Manage a socket opened by c-ares. We do not create, open or close the
+ * socket ourself: this is done by c-ares, and it tells the DNSHandler
+ * about it.  We just call ares_process_fd() with the correct parameters,
+ * depending on what can be done on that socket (Poller reported it to be
+ * writable or readeable)
  */
 
 class DNSHandler;
@@ -18,7 +19,7 @@ class DNSHandler;
 class DNSSocketHandler: public SocketHandler
 {
 public:
-  explicit DNSSocketHandler(std::shared_ptr<Poller> poller, DNSHandler& handler, const socket_t socket);
+  explicit DNSSocketHandler(DNSHandler& handler, const socket_t socket);
   ~DNSSocketHandler() = default;
   DNSSocketHandler(const DNSSocketHandler&) = delete;
   DNSSocketHandler(DNSSocketHandler&&) = delete;
@@ -40,10 +41,25 @@ public:
    * Always true, see the comment for connect()
    */
   bool is_connected() const override final;
+  /**
+   * Whether c-ares wants to write on that socket.  Only applied to the
+   * poller by the next call to watch().
+   */
+  void set_writable(const bool writable);
+  /**
+   * Add the socket to that poller if needed, and watch its send events if
+   * c-ares wants to write on it.
+   */
+  void watch(std::shared_ptr<Poller> poller);
   void remove_from_poller();
 
 private:
   DNSHandler& handler;
+  bool writable;
+  /**
+   * Whether the send events are currently watched by the poller.
+   */
+  bool watching_send_events;
 };
 
 #endif // CARES_FOUND
@@ -8,10 +8,13 @@
 #include <signal.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
 
+constexpr std::size_t Poller::default_max_events;
+
 Poller::Poller()
 {
 #if POLLER == POLL
@@ -23,6 +26,7 @@ Poller::Poller()
       log_error("epoll failed: ", strerror(errno));
       throw std::runtime_error("Could not create epoll instance");
     }
+  this->revents.resize(Poller::default_max_events);
 #endif
 }
 
@@ -43,14 +47,14 @@ void Poller::add_socket_handler(SocketHandler* socket_handler)
 
   this->socket_handlers.emplace(socket_handler->get_socket(), socket_handler);
 
-  // We always watch all sockets for receive events
+  // We always watch all sockets for receive events, unless they are paused
 #if POLLER == POLL
   this->fds[this->nfds].fd = socket_handler->get_socket();
-  this->fds[this->nfds].events = POLLIN;
+  this->fds[this->nfds].events = this->is_receiving(socket_handler) ? POLLIN : 0;
   this->nfds++;
 #endif
 #if POLLER == EPOLL
-  struct epoll_event event = {EPOLLIN, {socket_handler}};
+  struct epoll_event event = {this->is_receiving(socket_handler) ? EPOLLIN : 0u, {socket_handler}};
   const int res = ::epoll_ctl(this->epfd, EPOLL_CTL_ADD, socket_handler->get_socket(), &event);
   if (res == -1)
     {
@@ -66,6 +70,8 @@ void Poller::remove_socket_handler(const socket_t socket)
   if (it == this->socket_handlers.end())
     throw std::runtime_error("Trying to remove a SocketHandler that is not managed");
   this->socket_handlers.erase(it);
+  this->sending.erase(socket);
+  this->deferred.erase(socket);
 
 #if POLLER == POLL
   for (size_t i = 0; i < this->nfds; i++)
@@ -94,41 +100,125 @@ void Poller::remove_socket_handler(const socket_t socket)
 
 void Poller::watch_send_events(SocketHandler* socket_handler)
 {
-#if POLLER == POLL
-  for (size_t i = 0; i < this->nfds; ++i)
+  this->sending.insert(socket_handler->get_socket());
+  this->update_events(socket_handler);
+}
+
+void Poller::stop_watching_send_events(SocketHandler* socket_handler)
+{
+  this->sending.erase(socket_handler->get_socket());
+  this->update_events(socket_handler);
+}
+
+void Poller::pause_receiving()
+{
+  if (this->receiving_paused)
+    return;
+  this->receiving_paused = true;
+  for (const auto& pair: this->socket_handlers)
+    if (pair.second->can_pause_receiving())
+      this->update_events(pair.second);
+}
+
+void Poller::resume_receiving()
+{
+  if (!this->receiving_paused)
+    return;
+  this->receiving_paused = false;
+  for (const auto& pair: this->socket_handlers)
+    if (pair.second->can_pause_receiving())
+      this->update_events(pair.second);
+}
+
+bool Poller::is_receiving_paused() const
+{
+  return this->receiving_paused;
+}
+
+bool Poller::is_paused(const SocketHandler* socket_handler) const
+{
+  return this->receiving_paused && socket_handler->can_pause_receiving();
+}
+
+bool Poller::is_receiving(const SocketHandler* socket_handler) const
+{
+  return !this->is_paused(socket_handler) &&
+      this->deferred.count(socket_handler->get_socket()) == 0;
+}
+
+void Poller::defer_input(SocketHandler* socket_handler)
+{
+  const auto socket = socket_handler->get_socket();
+  if (!this->deferred.insert(socket).second)
+    return;
+  this->deferred_queue.push_back(socket);
+  // Otherwise its receive events are already not watched
+  if (socket != this->current_deferred)
+    this->update_events(socket_handler);
+}
+
+void Poller::set_max_events(const std::size_t max_events)
+{
+#if POLLER == EPOLL
+  this->revents.resize(std::max<std::size_t>(max_events, 1));
+#else
+  static_cast<void>(max_events);
+#endif
+}
+
+bool Poller::has_deferred_input() const
+{
+  return std::any_of(this->deferred.begin(), this->deferred.end(), [this](const socket_t socket)
+                     {
+                       return !this->is_paused(this->socket_handlers.at(socket));
+                     });
+}
+
+int Poller::process_deferred_input(std::size_t count)
+{
+  int res = 0;
+  while (count-- > 0 && !this->deferred_queue.empty())
     {
-      if (this->fds[i].fd == socket_handler->get_socket())
+      const auto socket = this->deferred_queue.front();
+      this->deferred_queue.pop_front();
+      // It may have been removed since
+      if (this->deferred.count(socket) == 0)
+        continue;
+      auto socket_handler = this->socket_handlers.at(socket);
+      if (this->is_paused(socket_handler))
         {
-          this->fds[i].events = POLLIN|POLLOUT;
-          return;
+          this->deferred_queue.push_back(socket);
+          continue;
         }
+      this->deferred.erase(socket);
+      this->current_deferred = socket;
+      socket_handler->on_deferred_input();
+      this->current_deferred = -1;
+      res++;
+      // Done with its input, read from its socket again
+      const auto it = this->socket_handlers.find(socket);
+      if (it != this->socket_handlers.end() && this->deferred.count(socket) == 0)
+        this->update_events(it->second);
     }
-  throw std::runtime_error("Cannot watch a non-registered socket for send events");
-#elif POLLER == EPOLL
-  struct epoll_event event = {EPOLLIN|EPOLLOUT, {socket_handler}};
-  const int res = ::epoll_ctl(this->epfd, EPOLL_CTL_MOD, socket_handler->get_socket(), &event);
-  if (res == -1)
-    {
-      log_error("epoll_ctl failed: ", strerror(errno));
-      throw std::runtime_error("Could not modify socket flags in epoll");
-    }
-#endif
+  return res;
 }
 
-void Poller::stop_watching_send_events(SocketHandler* socket_handler)
+void Poller::update_events(SocketHandler* socket_handler)
 {
+  const bool receive = this->is_receiving(socket_handler);
+  const bool send = this->sending.count(socket_handler->get_socket()) > 0;
 #if POLLER == POLL
-  for (size_t i = 0; i <= this->nfds; ++i)
+  for (size_t i = 0; i < this->nfds; ++i)
     {
       if (this->fds[i].fd == socket_handler->get_socket())
         {
-          this->fds[i].events = POLLIN;
+          this->fds[i].events = (receive ? POLLIN : 0) | (send ? POLLOUT : 0);
           return;
         }
     }
   throw std::runtime_error("Cannot watch a non-registered socket for send events");
 #elif POLLER == EPOLL
-  struct epoll_event event = {EPOLLIN, {socket_handler}};
+  struct epoll_event event = {(receive ? EPOLLIN : 0u) | (send ? EPOLLOUT : 0u), {socket_handler}};
   const int res = ::epoll_ctl(this->epfd, EPOLL_CTL_MOD, socket_handler->get_socket(), &event);
   if (res == -1)
     {
@@ -155,6 +245,13 @@ int Poller::poll(const std::chrono::milliseconds& timeout)
     }
   else
     timeout_tsp = nullptr;
+  // The deferred input is waiting for its turn: only check for events
+  const auto deferred_count = this->deferred_queue.size();
+  if (this->has_deferred_input())
+    {
+      timeout_ts = {0, 0};
+      timeout_tsp = &timeout_ts;
+    }
 
   // Unblock all signals, only during the ppoll call
   sigset_t empty_signal_set;
@@ -178,7 +275,9 @@ int Poller::poll(const std::chrono::milliseconds& timeout)
         continue;
       else if (this->fds[i].revents & POLLIN && socket_handler->is_connected())
         {
-          socket_handler->on_recv();
+          // Unless its receive events were paused during this iteration
+          if (this->is_receiving(socket_handler))
+            socket_handler->on_recv();
           nb_events--;
         }
       else if (this->fds[i].revents & POLLOUT && socket_handler->is_connected())
@@ -192,15 +291,25 @@ int Poller::poll(const std::chrono::milliseconds& timeout)
           socket_handler->connect();
           nb_events--;
         }
+      else if (this->fds[i].revents & (POLLHUP|POLLERR) && socket_handler->is_connected())
+        {
+          // Even if its receive events are paused: reading tells what
+          // happened, and closes it
+          socket_handler->on_recv();
+          nb_events--;
+        }
     }
+  this->process_deferred_input(deferred_count);
   return 1;
 #elif POLLER == EPOLL
-  static const size_t max_events = 12;
-  struct epoll_event revents[max_events];
+  auto revents = this->revents.data();
+  // The deferred input is waiting for its turn: only check for events
+  const auto deferred_count = this->deferred_queue.size();
+  const int wait_timeout = this->has_deferred_input() ? 0 : timeout.count();
   // Unblock all signals, only during the epoll_pwait call
   sigset_t empty_signal_set;
   sigemptyset(&empty_signal_set);
-  const int nb_events = ::epoll_pwait(this->epfd, revents, max_events, timeout.count(),
+  const int nb_events = ::epoll_pwait(this->epfd, revents, this->revents.size(), wait_timeout,
                                       &empty_signal_set);
   if (nb_events == -1)
     {
@@ -213,13 +322,21 @@ int Poller::poll(const std::chrono::milliseconds& timeout)
     {
       auto socket_handler = static_cast<SocketHandler*>(revents[i].data.ptr);
       if (revents[i].events & EPOLLIN && socket_handler->is_connected())
-        socket_handler->on_recv();
+        {
+          // Unless its receive events were paused during this iteration
+          if (this->is_receiving(socket_handler))
+            socket_handler->on_recv();
+        }
       else if (revents[i].events & EPOLLOUT && socket_handler->is_connected())
         socket_handler->on_send();
       else if (revents[i].events & EPOLLOUT)
         socket_handler->connect();
+      else if (revents[i].events & (EPOLLHUP|EPOLLERR) && socket_handler->is_connected())
+        // Even if its receive events are paused: reading tells what
+        // happened, and closes it
+        socket_handler->on_recv();
     }
-  return nb_events;
+  return nb_events + this->process_deferred_input(deferred_count);
 #endif
 }
 
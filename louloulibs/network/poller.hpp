@@ -4,8 +4,11 @@
 #include <network/socket_handler.hpp>
 
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <chrono>
+#include <vector>
+#include <deque>
 
 #define POLL 1
 #define EPOLL 2
@@ -61,11 +64,37 @@ public:
    * this SocketHandler.
    */
   void stop_watching_send_events(SocketHandler* socket_handler);
+  /**
+   * Stop watching the receive events of the SocketHandlers that allow it
+   * (see SocketHandler::can_pause_receiving()), including the ones added
+   * later, until resume_receiving() is called.  The data they receive
+   * meanwhile waits in the kernel buffers, and then the peers are slowed
+   * down by TCP.
+   */
+  void pause_receiving();
+  void resume_receiving();
+  bool is_receiving_paused() const;
+  /**
+   * Signal that this SocketHandler stopped processing the data it received
+   * before the end, to let the other ones have their turn: its receive
+   * events are not watched anymore, and its on_deferred_input() is called
+   * at the next iterations, in turn with the other SocketHandlers that
+   * deferred some input, until it does not call this function again.
+   */
+  void defer_input(SocketHandler* socket_handler);
+  /**
+   * The maximum number of events handled by each wait.  Only used with
+   * epoll, poll always returns all of them.
+   */
+  void set_max_events(const std::size_t max_events);
+  static constexpr std::size_t default_max_events = 12;
   /**
    * Wait for all watched events, and call the SocketHandlers' callbacks
    * when one is ready.  Returns if nothing happened before the provided
    * timeout.  If the timeout is 0, it waits forever.  If there is no
    * watched event, returns -1 immediately, ignoring the timeout value.
+   * If some input was deferred, it does not wait, and processes it after
+   * the events.
    * Otherwise, returns the number of event handled. If 0 is returned this
    * means that we were interrupted by a signal, or the timeout occured.
    */
@@ -80,18 +109,49 @@ public:
    bool is_managing_socket(const socket_t socket) const;
 
 private:
+  bool is_paused(const SocketHandler* socket_handler) const;
+  bool is_receiving(const SocketHandler* socket_handler) const;
+  /**
+   * Whether some deferred input can be processed now.
+   */
+  bool has_deferred_input() const;
+  /**
+   * Call on_deferred_input() on the first count SocketHandlers of the
+   * deferred queue.  Returns how many were called.
+   */
+  int process_deferred_input(std::size_t count);
+  /**
+   * Watch the events that this SocketHandler currently needs.
+   */
+  void update_events(SocketHandler* socket_handler);
+
   /**
    * A "list" of all the SocketHandlers that we manage, indexed by socket,
    * because that's what is returned by select/poll/etc when an event
    * occures.
    */
   std::unordered_map<socket_t, SocketHandler*> socket_handlers;
+  /**
+   * The sockets whose send events are watched.
+   */
+  std::unordered_set<socket_t> sending;
+  bool receiving_paused{false};
+  /**
+   * The sockets that deferred some input, in the order of their next turn.
+   */
+  std::deque<socket_t> deferred_queue;
+  std::unordered_set<socket_t> deferred;
+  /**
+   * The socket whose on_deferred_input() is running.
+   */
+  socket_t current_deferred{-1};
 
 #if POLLER == POLL
   struct pollfd fds[MAX_POLL_FD_NUMBER];
   nfds_t nfds;
 #elif POLLER == EPOLL
   int epfd;
+  std::vector<struct epoll_event> revents;
 #endif
 };
 
@@ -2,18 +2,14 @@
 #include <network/resolver.hpp>
 #include <string.h>
 #include <arpa/inet.h>
+#include <algorithm>
 #include <cstdlib>
 
 using namespace std::string_literals;
 
 Resolver::Resolver():
-#ifdef CARES_FOUND
-  resolved4(false),
-  resolved6(false),
-  resolving(false),
-  cares_addrinfo(nullptr),
   port{},
-#endif
+  resolving(false),
   resolved(false),
   error_msg{}
 {
@@ -24,155 +20,161 @@ void Resolver::resolve(const std::string& hostname, const std::string& port,
 {
   this->error_cb = error_cb;
   this->success_cb = success_cb;
-#ifdef CARES_FOUND
   this->port = port;
-#endif
 
-  this->start_resolving(hostname, port);
+  this->start_resolving(hostname);
 }
 
-#ifdef CARES_FOUND
-void Resolver::start_resolving(const std::string& hostname, const std::string&)
+/**
+ * Fill the answer if the hostname is an IP address, which needs no lookup.
+ */
+static bool parse_ip_address(const std::string& hostname, DNSAnswer& answer)
+{
+  struct sockaddr_storage address;
+  memset(&address, 0, sizeof(address));
+  auto addr4 = reinterpret_cast<struct sockaddr_in*>(&address);
+  auto addr6 = reinterpret_cast<struct sockaddr_in6*>(&address);
+  if (::inet_pton(AF_INET, hostname.data(), &addr4->sin_addr) == 1)
+    addr4->sin_family = AF_INET;
+  else if (::inet_pton(AF_INET6, hostname.data(), &addr6->sin6_addr) == 1)
+    addr6->sin6_family = AF_INET6;
+  else
+    return false;
+  answer.addresses.push_back(address);
+  return true;
+}
+
+void Resolver::start_resolving(const std::string& hostname)
 {
   this->resolving = true;
   this->resolved = false;
-  this->resolved4 = false;
-  this->resolved6 = false;
-
   this->error_msg.clear();
-  this->cares_addrinfo = nullptr;
+  // If the resolution fails, the addr will be unset
+  this->addr.reset(nullptr);
 
-  auto hostname4_resolved = [](void* arg, int status, int,
-                                  struct hostent* hostent)
+  DNSAnswer answer;
+  if (parse_ip_address(hostname, answer))
     {
-      Resolver* resolver = static_cast<Resolver*>(arg);
-      resolver->on_hostname4_resolved(status, hostent);
-    };
-  auto hostname6_resolved = [](void* arg, int status, int,
-                                  struct hostent* hostent)
-    {
-      Resolver* resolver = static_cast<Resolver*>(arg);
-      resolver->on_hostname6_resolved(status, hostent);
-    };
-
-  DNSHandler::instance.gethostbyname(hostname, hostname6_resolved,
-                                     this, AF_INET6);
-  DNSHandler::instance.gethostbyname(hostname, hostname4_resolved,
-                                     this, AF_INET);
-}
-
-void Resolver::on_hostname4_resolved(int status, struct hostent* hostent)
-{
-  this->resolved4 = true;
-  if (status == ARES_SUCCESS)
-    this->fill_ares_addrinfo4(hostent);
-  else
-    this->error_msg = ::ares_strerror(status);
-
-  if (this->resolved4 && this->resolved6)
-    this->on_resolved();
-}
-
-void Resolver::on_hostname6_resolved(int status, struct hostent* hostent)
-{
-  this->resolved6 = true;
-  if (status == ARES_SUCCESS)
-    this->fill_ares_addrinfo6(hostent);
-  else
-    this->error_msg = ::ares_strerror(status);
+      this->on_resolved(answer);
+      return;
+    }
 
-  if (this->resolved4 && this->resolved6)
-    this->on_resolved();
+  this->query = std::make_shared<Resolver*>(this);
+  Resolver::get_cache().resolve(hostname, [query = std::weak_ptr<Resolver*>(this->query)](const DNSAnswer& answer)
+                                {
+                                  auto resolver = query.lock();
+                                  if (resolver)
+                                    (*resolver)->on_resolved(answer);
+                                });
 }
 
-void Resolver::on_resolved()
+void Resolver::on_resolved(const DNSAnswer& answer)
 {
-  this->resolved = true;
+  this->query.reset();
   this->resolving = false;
-  if (!this->cares_addrinfo)
+  this->resolved = true;
+
+  if (answer.addresses.empty())
     {
+      this->error_msg = answer.error;
       if (this->error_cb)
         this->error_cb(this->error_msg.data());
+      return;
     }
-  else
-    {
-      this->addr.reset(this->cares_addrinfo);
-      if (this->success_cb)
-        this->success_cb(this->addr.get());
-    }
-}
-
-void Resolver::fill_ares_addrinfo4(const struct hostent* hostent)
-{
-  struct addrinfo* prev = this->cares_addrinfo;
-  struct in_addr** address = reinterpret_cast<struct in_addr**>(hostent->h_addr_list);
-
-  while (*address)
+  // Build the list in the same order as the answer
+  const auto port = htons(std::strtoul(this->port.data(), nullptr, 10));
+  struct addrinfo* first = nullptr;
+  struct addrinfo** next = &first;
+  for (const auto& address: answer.addresses)
     {
-      // Create a new addrinfo list element, and fill it
       struct addrinfo* current = new struct addrinfo;
-      current->ai_flags = 0;
-      current->ai_family = hostent->h_addrtype;
+      memset(current, 0, sizeof(struct addrinfo));
+      current->ai_family = address.ss_family;
       current->ai_socktype = SOCK_STREAM;
-      current->ai_protocol = 0;
-      current->ai_addrlen = sizeof(struct sockaddr_in);
-
-      struct sockaddr_in* ai_addr = new struct sockaddr_in;
-      
-      ai_addr->sin_family = hostent->h_addrtype;
-      ai_addr->sin_port = htons(std::strtoul(this->port.data(), nullptr, 10));
-      ai_addr->sin_addr.s_addr = (*address)->s_addr;
-
+      auto ai_addr = new struct sockaddr_storage(address);
+      if (address.ss_family == AF_INET6)
+        {
+          current->ai_addrlen = sizeof(struct sockaddr_in6);
+          reinterpret_cast<struct sockaddr_in6*>(ai_addr)->sin6_port = port;
+        }
+      else
+        {
+          current->ai_addrlen = sizeof(struct sockaddr_in);
+          reinterpret_cast<struct sockaddr_in*>(ai_addr)->sin_port = port;
+        }
       current->ai_addr = reinterpret_cast<struct sockaddr*>(ai_addr);
-      current->ai_next = nullptr;
-      current->ai_canonname = nullptr;
-
-      current->ai_next = prev;
-      this->cares_addrinfo = current;
-      prev = current;
-      ++address;
+      *next = current;
+      next = &current->ai_next;
     }
+  this->addr.reset(first);
+  if (this->success_cb)
+    this->success_cb(this->addr.get());
 }
 
-void Resolver::fill_ares_addrinfo6(const struct hostent* hostent)
+#ifdef CARES_FOUND
+/**
+ * Look the hostname up with c-ares, and return the addresses with the
+ * smallest TTL of their records.
+ */
+static void lookup_hostname(const std::string& hostname, DNSCache::LookupCallback callback)
 {
-  struct addrinfo* prev = this->cares_addrinfo;
-  struct in6_addr** address = reinterpret_cast<struct in6_addr**>(hostent->h_addr_list);
-
-  while (*address)
+  auto on_result = [](void* arg, int status, int, struct ares_addrinfo* result)
     {
-      // Create a new addrinfo list element, and fill it
-      struct addrinfo* current = new struct addrinfo;
-      current->ai_flags = 0;
-      current->ai_family = hostent->h_addrtype;
-      current->ai_socktype = SOCK_STREAM;
-      current->ai_protocol = 0;
-      current->ai_addrlen = sizeof(struct sockaddr_in6);
+      std::unique_ptr<DNSCache::LookupCallback> callback(static_cast<DNSCache::LookupCallback*>(arg));
+      DNSAnswer answer;
+      auto ttl = DNSCache::max_ttl;
+      if (status == ARES_SUCCESS && result)
+        {
+          for (auto node = result->nodes; node; node = node->ai_next)
+            {
+              if (node->ai_family != AF_INET && node->ai_family != AF_INET6)
+                continue;
+              struct sockaddr_storage address;
+              memset(&address, 0, sizeof(address));
+              memcpy(&address, node->ai_addr, std::min<std::size_t>(node->ai_addrlen, sizeof(address)));
+              answer.addresses.push_back(address);
+              ttl = std::min(ttl, std::chrono::seconds(std::max(node->ai_ttl, 0)));
+            }
+          ::ares_freeaddrinfo(result);
+        }
+      if (answer.addresses.empty())
+        {
+          answer.error = ::ares_strerror(status == ARES_SUCCESS ? ARES_ENODATA : status);
+          ttl = (status == ARES_SUCCESS || status == ARES_ENOTFOUND || status == ARES_ENODATA) ?
+            DNSCache::not_found_ttl : DNSCache::failure_ttl;
+        }
+      (*callback)(std::move(answer), ttl);
+    };
+  DNSHandler::instance.getaddrinfo(hostname, on_result, new DNSCache::LookupCallback(std::move(callback)));
+}
 
-      struct sockaddr_in6* ai_addr = new struct sockaddr_in6;
-      ai_addr->sin6_family = hostent->h_addrtype;
-      ai_addr->sin6_port = htons(std::strtoul(this->port.data(), nullptr, 10));
-      ::memcpy(ai_addr->sin6_addr.s6_addr, (*address)->s6_addr, sizeof(ai_addr->sin6_addr.s6_addr));
-      ai_addr->sin6_flowinfo = 0;
-      ai_addr->sin6_scope_id = 0;
+#else  // ifdef CARES_FOUND
 
-      current->ai_addr = reinterpret_cast<struct sockaddr*>(ai_addr);
-      current->ai_canonname = nullptr;
+std::unique_ptr<Worker> Resolver::pool;
 
-      current->ai_next = prev;
-      this->cares_addrinfo = current;
-      prev = current;
-      ++address;
-    }
-}
+/**
+ * How long the answers of getaddrinfo(), which does not give the TTL of
+ * the records, are kept.
+ */
+static constexpr std::chrono::seconds getaddrinfo_ttl{60};
 
-#else  // ifdef CARES_FOUND
+void Resolver::start_pool(std::shared_ptr<Poller> poller, const std::size_t threads)
+{
+  Resolver::pool = std::make_unique<Worker>(poller, threads);
+}
 
-void Resolver::start_resolving(const std::string& hostname, const std::string& port)
+void Resolver::stop_pool()
 {
-  // If the resolution fails, the addr will be unset
-  this->addr.reset(nullptr);
+  if (Resolver::pool)
+    Resolver::pool->stop();
+  Resolver::pool.reset(nullptr);
+}
 
+/**
+ * Call getaddrinfo(), and return its answer and how long it can be kept.
+ */
+static std::chrono::seconds call_getaddrinfo(const std::string& hostname, DNSAnswer& answer)
+{
   struct addrinfo hints;
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_flags = 0;
@@ -181,26 +183,56 @@ void Resolver::start_resolving(const std::string& hostname, const std::string& p
   hints.ai_protocol = 0;
 
   struct addrinfo* addr_res = nullptr;
-  const int res = ::getaddrinfo(hostname.data(), port.data(),
-                                &hints, &addr_res);
-
-  this->resolved = true;
-
+  const int res = ::getaddrinfo(hostname.data(), nullptr, &hints, &addr_res);
   if (res != 0)
     {
-      this->error_msg = gai_strerror(res);
-      if (this->error_cb)
-        this->error_cb(this->error_msg.data());
+      answer.error = gai_strerror(res);
+      return res == EAI_NONAME ? DNSCache::not_found_ttl : DNSCache::failure_ttl;
     }
-  else
+  for (auto rp = addr_res; rp; rp = rp->ai_next)
+    {
+      struct sockaddr_storage address;
+      memset(&address, 0, sizeof(address));
+      memcpy(&address, rp->ai_addr, std::min<std::size_t>(rp->ai_addrlen, sizeof(address)));
+      answer.addresses.push_back(address);
+    }
+  ::freeaddrinfo(addr_res);
+  return getaddrinfo_ttl;
+}
+
+/**
+ * Look the hostname up with getaddrinfo(), in the pool if it is started.
+ */
+static void lookup_hostname(const std::string& hostname, DNSCache::LookupCallback callback, Worker* pool)
+{
+  if (!pool)
     {
-      this->addr.reset(addr_res);
-      if (this->success_cb)
-        this->success_cb(this->addr.get());
+      DNSAnswer answer;
+      const auto ttl = call_getaddrinfo(hostname, answer);
+      callback(std::move(answer), ttl);
+      return;
     }
+  auto answer = std::make_shared<DNSAnswer>();
+  auto ttl = std::make_shared<std::chrono::seconds>();
+  pool->post("getaddrinfo",
+             [hostname, answer, ttl]() { *ttl = call_getaddrinfo(hostname, *answer); },
+             [callback = std::move(callback), answer, ttl]() { callback(std::move(*answer), *ttl); });
 }
 #endif  // ifdef CARES_FOUND
 
+DNSCache& Resolver::get_cache()
+{
+#ifdef CARES_FOUND
+  static DNSCache cache(&lookup_hostname);
+#else
+  static DNSCache cache([](const std::string& hostname, DNSCache::LookupCallback callback)
+                        {
+                          lookup_hostname(hostname, std::move(callback), Resolver::pool.get());
+                        });
+#endif
+  return cache;
+}
+
 std::string addr_to_string(const struct addrinfo* rp)
 {
   char buf[INET6_ADDRSTRLEN];
@@ -3,6 +3,11 @@
 
 #include "louloulibs.h"
 
+#include <network/dns_cache.hpp>
+#ifndef CARES_FOUND
+# include <network/worker.hpp>
+#endif
+
 #include <functional>
 #include <memory>
 #include <string>
@@ -16,20 +21,24 @@ class AddrinfoDeleter
  public:
   void operator()(struct addrinfo* addr)
   {
-#ifdef CARES_FOUND
     while (addr)
       {
-        delete addr->ai_addr;
+        delete reinterpret_cast<struct sockaddr_storage*>(addr->ai_addr);
         auto next = addr->ai_next;
         delete addr;
         addr = next;
       }
-#else
-    freeaddrinfo(addr);
-#endif
   }
 };
 
+/**
+ * Resolve a hostname, without blocking the event loop: with c-ares if
+ * available, or else with getaddrinfo() called by the threads of a pool,
+ * once start_pool() has been called.  Without that pool, getaddrinfo() is
+ * called directly.
+ *
+ * The answers are shared by all the resolvers, through a DNSCache.
+ */
 class Resolver
 {
 public:
@@ -45,11 +54,7 @@ public:
 
   bool is_resolving() const
   {
-#ifdef CARES_FOUND
     return this->resolving;
-#else
-    return false;
-#endif
   }
 
   bool is_resolved() const
@@ -68,13 +73,9 @@ public:
 
   void clear()
   {
-#ifdef CARES_FOUND
-    this->resolved6 = false;
-    this->resolved4 = false;
-    this->resolving = false;
-    this->cares_addrinfo = nullptr;
+    this->query.reset();
     this->port.clear();
-#endif
+    this->resolving = false;
     this->resolved = false;
     this->addr.reset();
     this->error_msg.clear();
@@ -83,33 +84,38 @@ public:
   void resolve(const std::string& hostname, const std::string& port,
                SuccessCallbackType success_cb, ErrorCallbackType error_cb);
 
-private:
-  void start_resolving(const std::string& hostname, const std::string& port);
-#ifdef CARES_FOUND
-  void on_hostname4_resolved(int status, struct hostent* hostent);
-  void on_hostname6_resolved(int status, struct hostent* hostent);
-
-  void fill_ares_addrinfo4(const struct hostent* hostent);
-  void fill_ares_addrinfo6(const struct hostent* hostent);
-
-  void on_resolved();
+  /**
+   * The answers of all the lookups.
+   */
+  static DNSCache& get_cache();
 
-  bool resolved4;
-  bool resolved6;
+#ifndef CARES_FOUND
+  /**
+   * Start the threads calling getaddrinfo(). The callbacks of the
+   * resolutions are then called by the given poller's loop.
+   */
+  static void start_pool(std::shared_ptr<Poller> poller, const std::size_t threads=4);
+  /**
+   * Wait for the resolutions in progress, and join the threads.
+   */
+  static void stop_pool();
+#endif
 
-  bool resolving;
+private:
+  void start_resolving(const std::string& hostname);
+  void on_resolved(const DNSAnswer& answer);
 
   /**
-   * When using c-ares to resolve the host asynchronously, we need the
-   * c-ares callbacks to fill a structure (a struct addrinfo, for
-   * compatibility with getaddrinfo and the rest of the code that works when
-   * c-ares is not used) with all returned values (for example an IPv6 and
-   * an IPv4). The pointer is given to the unique_ptr to manage its lifetime.
+   * Shared with the query to the cache, which only calls us back if this
+   * is still the same query: it is reset by clear(), and destroyed with
+   * us.
    */
-  struct addrinfo* cares_addrinfo;
+  std::shared_ptr<Resolver*> query;
   std::string port;
-
+#ifndef CARES_FOUND
+  static std::unique_ptr<Worker> pool;
 #endif
+  bool resolving;
  /**
   * Tells if we finished the resolution process. It doesn't indicate if it
   * was successful (it is true even if the result is an error).
@@ -24,6 +24,17 @@ public:
   virtual void on_send() = 0;
   virtual void connect() = 0;
   virtual bool is_connected() const = 0;
+  /**
+   * Whether the poller may stop watching our receive events, when it is
+   * told to pause them.
+   */
+  virtual bool can_pause_receiving() const
+  { return false; }
+  /**
+   * Process some more of the data that was received but left for later
+   * (see Poller::defer_input()).
+   */
+  virtual void on_deferred_input() {}
 
   socket_t get_socket() const
   { return this->socket; }
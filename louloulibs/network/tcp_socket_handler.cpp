@@ -1,17 +1,23 @@
 #include <network/tcp_socket_handler.hpp>
+#include <network/connection_metrics.hpp>
+#include <network/bind_pool.hpp>
 #include <network/dns_handler.hpp>
 
 #include <utils/timed_events.hpp>
-#include <utils/scopeguard.hpp>
 #include <network/poller.hpp>
+#include <config/config.hpp>
 
 #include <logger/logger.hpp>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <unordered_map>
 #include <stdexcept>
 #include <unistd.h>
 #include <errno.h>
 #include <cstring>
+#include <cstdint>
 #include <fcntl.h>
 
 #ifdef BOTAN_FOUND
@@ -33,8 +39,13 @@ using namespace std::chrono_literals;
 
 namespace ph = std::placeholders;
 
+constexpr std::chrono::milliseconds TCPSocketHandler::connection_attempt_delay;
+constexpr std::chrono::seconds TCPSocketHandler::connection_attempt_timeout;
+
 TCPSocketHandler::TCPSocketHandler(std::shared_ptr<Poller> poller):
   SocketHandler(poller, -1),
+  out_buf_size(0),
+  next_candidate(0),
   use_tls(false),
   connected(false),
   connecting(false),
@@ -49,31 +60,68 @@ TCPSocketHandler::~TCPSocketHandler()
   this->close();
 }
 
+/**
+ * The addresses of each bind address, resolved once for each generation
+ * of the configuration, instead of on each connection.  A numeric address
+ * (the usual value) never queries the DNS, a hostname only blocks the
+ * first connection bound to it after each change of the configuration.
+ * Returns nullptr, and sets error, if the resolution failed.
+ */
+static const struct addrinfo* get_bind_addresses(const std::string& bind_addr, int& error)
+{
+  struct Entry
+  {
+    int error;
+    std::unique_ptr<struct addrinfo, decltype(&::freeaddrinfo)> result{nullptr, &::freeaddrinfo};
+  };
+  static unsigned long generation = 0;
+  static std::unordered_map<std::string, Entry> entries;
+
+  if (generation != Config::get_generation())
+    {
+      entries.clear();
+      generation = Config::get_generation();
+    }
+  auto it = entries.find(bind_addr);
+  if (it == entries.end())
+    {
+      struct addrinfo hints;
+      memset(&hints, 0, sizeof(struct addrinfo));
+      hints.ai_flags = AI_NUMERICHOST;
+      struct addrinfo* addr_res = nullptr;
+      Entry entry;
+      entry.error = ::getaddrinfo(bind_addr.data(), nullptr, &hints, &addr_res);
+      if (entry.error == EAI_NONAME)
+        entry.error = ::getaddrinfo(bind_addr.data(), nullptr, nullptr, &addr_res);
+      entry.result.reset(entry.error == 0 ? addr_res : nullptr);
+      it = entries.emplace(bind_addr, std::move(entry)).first;
+    }
+  error = it->second.error;
+  return it->second.result.get();
+}
 
-void TCPSocketHandler::init_socket(const struct addrinfo* rp)
+socket_t TCPSocketHandler::init_socket(const int family) const
 {
-  if (this->socket != -1)
-    ::close(this->socket);
-  if ((this->socket = ::socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1)
+  const socket_t socket = ::socket(family, SOCK_STREAM, 0);
+  if (socket == -1)
     throw std::runtime_error("Could not create socket: "s + strerror(errno));
   // Bind the socket to a specific address, if specified
   if (!this->bind_addr.empty())
     {
       // Convert the address from string format to a sockaddr that can be
       // used in bind()
-      struct addrinfo* result;
-      int err = ::getaddrinfo(this->bind_addr.data(), nullptr, nullptr, &result);
-      if (err != 0 || !result)
+      int err = 0;
+      const struct addrinfo* result = get_bind_addresses(this->bind_addr, err);
+      if (!result)
         log_error("Failed to bind socket to ", this->bind_addr, ": ",
                   gai_strerror(err));
       else
         {
-          utils::ScopeGuard sg([result](){ freeaddrinfo(result); });
-          struct addrinfo* rp;
+          const struct addrinfo* rp;
           int bind_error = 0;
           for (rp = result; rp; rp = rp->ai_next)
             {
-              if ((bind_error = ::bind(this->socket,
+              if ((bind_error = ::bind(socket,
                          reinterpret_cast<const struct sockaddr*>(rp->ai_addr),
                          rp->ai_addrlen)) == 0)
                 break;
@@ -86,152 +134,279 @@ void TCPSocketHandler::init_socket(const struct addrinfo* rp)
         }
     }
   int optval = 1;
-  if (::setsockopt(this->socket, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval)) == -1)
+  if (::setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval)) == -1)
     log_warning("Failed to enable TCP keepalive on socket: ", strerror(errno));
   // Set the socket on non-blocking mode.  This is useful to receive a EAGAIN
   // error when connect() would block, to not block the whole process if a
   // remote is not responsive.
-  const int existing_flags = ::fcntl(this->socket, F_GETFL, 0);
+  const int existing_flags = ::fcntl(socket, F_GETFL, 0);
   if ((existing_flags == -1) ||
-      (::fcntl(this->socket, F_SETFL, existing_flags | O_NONBLOCK) == -1))
-    throw std::runtime_error("Could not initialize socket: "s + strerror(errno));
+      (::fcntl(socket, F_SETFL, existing_flags | O_NONBLOCK) == -1))
+    {
+      const std::string error = strerror(errno);
+      ::close(socket);
+      throw std::runtime_error("Could not initialize socket: "s + error);
+    }
+  return socket;
+}
+
+/**
+ * Destroy that attempt once the current poll iteration is over, because
+ * the poller may still have an event for it: the timed event holds the
+ * last reference to it.
+ */
+static void dispose(std::unique_ptr<ConnectionAttempt> attempt)
+{
+  attempt->cancel();
+  TimedEventsManager::instance().cancel("connection_timeout"s +
+                                        std::to_string(reinterpret_cast<std::uintptr_t>(attempt.get())));
+  std::shared_ptr<ConnectionAttempt> shared(std::move(attempt));
+  TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::now(),
+                                                      [shared]() {}));
 }
 
 void TCPSocketHandler::connect(const std::string& address, const std::string& port, const bool tls)
 {
+  this->connect(address, Ports{{port, tls}});
+}
+
+void TCPSocketHandler::connect(const std::string& address, const Ports& ports)
+{
+  if (this->is_connecting() || this->connected || ports.empty())
+    return;
   this->address = address;
-  this->port = port;
-  this->use_tls = tls;
+  this->ports = ports;
+  this->port = ports.front().first;
+  this->use_tls = ports.front().second;
+  this->hostname_resolution_failed = false;
+  this->connection_start = std::chrono::steady_clock::now();
+
+  log_info("Trying to connect to ", address, ":", this->port);
+  // Start the asynchronous process of resolving the hostname.  Once the
+  // addresses have been found, the connection attempts start.
+  this->resolver.resolve(address, this->port,
+                         [this](const struct addrinfo*)
+                         {
+                           log_debug("Resolution success, starting the connection attempts");
+                           this->start_connection_attempts();
+                         },
+                         [this](const char*)
+                         {
+                           log_debug("Resolution failed");
+                           this->start_connection_attempts();
+                         });
+}
 
-  struct addrinfo* addr_res;
+void TCPSocketHandler::start_connection_attempts()
+{
+  const struct addrinfo* addr_res = this->resolver.get_result().get();
+  if (!addr_res)
+    {
+      this->hostname_resolution_failed = true;
+      const auto msg = this->resolver.get_error_message();
+      auto& metrics = ConnectionMetrics::instance();
+      metrics.record_failure(this->address);
+      log_info("Connections to ", this->address, ": ", metrics.get(this->address));
+      this->close();
+      this->on_connection_failed(msg);
+      return ;
+    }
+  // Alternate between the address families, starting with the one of the
+  // first address (RFC 8305, section 4)
+  std::vector<const struct addrinfo*> first_family;
+  std::vector<const struct addrinfo*> other_family;
+  for (auto rp = addr_res; rp; rp = rp->ai_next)
+    {
+      if (rp->ai_family == addr_res->ai_family)
+        first_family.push_back(rp);
+      else
+        other_family.push_back(rp);
+    }
+  std::vector<const struct addrinfo*> addresses;
+  for (std::size_t i = 0; i < std::max(first_family.size(), other_family.size()); ++i)
+    {
+      if (i < first_family.size())
+        addresses.push_back(first_family[i]);
+      if (i < other_family.size())
+        addresses.push_back(other_family[i]);
+    }
+  this->candidates.clear();
+  for (const auto& port: this->ports)
+    {
+      const auto port_number = htons(std::strtoul(port.first.data(), nullptr, 10));
+      for (const auto rp: addresses)
+        {
+          Candidate candidate;
+          memset(&candidate.addr, 0, sizeof(candidate.addr));
+          memcpy(&candidate.addr, rp->ai_addr, std::min<std::size_t>(rp->ai_addrlen, sizeof(candidate.addr)));
+          candidate.addrlen = rp->ai_addrlen;
+          if (rp->ai_family == AF_INET6)
+            reinterpret_cast<struct sockaddr_in6*>(&candidate.addr)->sin6_port = port_number;
+          else
+            reinterpret_cast<struct sockaddr_in*>(&candidate.addr)->sin_port = port_number;
+          candidate.port = port.first;
+          candidate.tls = port.second;
+          this->candidates.push_back(std::move(candidate));
+        }
+    }
+  // The ports without TLS are only a fallback, see start_next_attempt()
+  std::stable_partition(this->candidates.begin(), this->candidates.end(),
+                        [](const Candidate& candidate) { return candidate.tls; });
+  this->next_candidate = 0;
+  this->last_error.clear();
+  this->connecting = true;
+  this->start_next_attempt();
+}
 
-  if (!this->connecting)
+void TCPSocketHandler::start_next_attempt()
+{
+  TimedEventsManager::instance().cancel(this->get_attempt_timer_name());
+  while (this->next_candidate < this->candidates.size())
     {
-      // Get the addrinfo from getaddrinfo (or ares_gethostbyname), only if
-      // this is the first call of this function.
-      if (!this->resolver.is_resolved())
+      const auto& candidate = this->candidates[this->next_candidate];
+      // Never race a connection without TLS against one with TLS: the
+      // first one would often win.  Wait for all the TLS attempts to fail.
+      if (!candidate.tls && std::any_of(this->attempts.begin(), this->attempts.end(),
+                                        [](const auto& attempt) { return attempt->use_tls(); }))
+        return;
+      this->next_candidate++;
+      socket_t socket;
+      try {
+        socket = this->init_socket(candidate.addr.ss_family);
+      }
+      catch (const std::runtime_error& error) {
+        log_error("Failed to init socket: ", error.what());
+        this->last_error = error.what();
+        continue;
+      }
+      auto attempt = std::make_unique<ConnectionAttempt>(this->poller, socket, candidate.addr, candidate.addrlen,
+                                                         candidate.port, candidate.tls,
+                                                         [this](ConnectionAttempt& attempt, const int error)
+                                                         {
+                                                           this->on_attempt_done(attempt, error);
+                                                         });
+      log_debug("Trying ", candidate.addr.ss_family == AF_INET6 ? "IPv6": "IPv4", " address ",
+                attempt->get_ip(), " on port ", candidate.port);
+      const int res = attempt->start();
+      if (res == EINPROGRESS)
         {
-          log_info("Trying to connect to ", address, ":", port);
-          // Start the asynchronous process of resolving the hostname. Once
-          // the addresses have been found and `resolved` has been set to true
-          // (but connecting will still be false), TCPSocketHandler::connect()
-          // needs to be called, again.
-          this->resolver.resolve(address, port,
-                                 [this](const struct addrinfo*)
-                                 {
-                                   log_debug("Resolution success, calling connect() again");
-                                   this->connect();
-                                 },
-                                 [this](const char*)
-                                 {
-                                   log_debug("Resolution failed, calling connect() again");
-                                   this->connect();
-                                 });
+          auto& started = *attempt;
+          this->attempts.push_back(std::move(attempt));
+          // If the connection has not succeeded or failed in time, we
+          // consider it to have failed
+          TimedEventsManager::instance().add_event(
+              TimedEvent(std::chrono::steady_clock::now() + TCPSocketHandler::connection_attempt_timeout,
+                         [this, &started]() { this->on_attempt_done(started, ETIMEDOUT); },
+                         "connection_timeout"s + std::to_string(reinterpret_cast<std::uintptr_t>(&started))));
+          if (this->next_candidate < this->candidates.size() &&
+              (!candidate.tls || this->candidates[this->next_candidate].tls))
+            TimedEventsManager::instance().add_event(
+                TimedEvent(std::chrono::steady_clock::now() + TCPSocketHandler::connection_attempt_delay,
+                           [this]() { this->start_next_attempt(); },
+                           this->get_attempt_timer_name()));
           return;
         }
-      else
+      if (res == 0)
         {
-          // The c-ares resolved the hostname and the available addresses
-          // where saved in the cares_addrinfo linked list. Now, just use
-          // this list to try to connect.
-          addr_res = this->resolver.get_result().get();
-          if (!addr_res)
-            {
-              this->hostname_resolution_failed = true;
-              const auto msg = this->resolver.get_error_message();
-              this->close();
-              this->on_connection_failed(msg);
-              return ;
-            }
+          auto& connected = *attempt;
+          this->attempts.push_back(std::move(attempt));
+          this->on_attempt_connected(connected);
+          return;
         }
+      log_info("Connection failed: ", strerror(res));
+      this->last_error = strerror(res);
     }
-  else
-    { // This function is called again, use the saved addrinfo structure,
-      // instead of re-doing the whole getaddrinfo process.
-      addr_res = &this->addrinfo;
+  if (this->attempts.empty())
+    {
+      log_error("All connection attempts failed.");
+      const auto error = this->last_error;
+      auto& metrics = ConnectionMetrics::instance();
+      metrics.record_failure(this->address);
+      log_info("Connections to ", this->address, ": ", metrics.get(this->address));
+      this->close();
+      this->on_connection_failed(error);
     }
+}
 
-  for (struct addrinfo* rp = addr_res; rp; rp = rp->ai_next)
+void TCPSocketHandler::on_attempt_done(ConnectionAttempt& attempt, const int error)
+{
+  if (error == 0)
     {
-      if (!this->connecting)
-        {
-          try {
-            this->init_socket(rp);
-          }
-          catch (const std::runtime_error& error) {
-            log_error("Failed to init socket: ", error.what());
-            break;
-          }
-        }
-
-      this->display_resolved_ip(rp);
+      this->on_attempt_connected(attempt);
+      return;
+    }
+  log_info("Connection to ", attempt.get_ip(), " on port ", attempt.get_port(), " failed: ", strerror(error));
+  this->last_error = strerror(error);
+  const auto it = std::find_if(this->attempts.begin(), this->attempts.end(),
+                               [&attempt](const auto& item) { return item.get() == &attempt; });
+  if (it != this->attempts.end())
+    {
+      dispose(std::move(*it));
+      this->attempts.erase(it);
+    }
+  // Do not wait for the delay to start the next one
+  this->start_next_attempt();
+}
 
-      if (::connect(this->socket, rp->ai_addr, rp->ai_addrlen) == 0
-          || errno == EISCONN)
-        {
-          log_info("Connection success.");
-          TimedEventsManager::instance().cancel("connection_timeout"s +
-                                                std::to_string(this->socket));
-          this->poller->add_socket_handler(this);
-          this->connected = true;
-          this->connecting = false;
+void TCPSocketHandler::on_attempt_connected(ConnectionAttempt& attempt)
+{
+  TimedEventsManager::instance().cancel("connection_timeout"s +
+                                        std::to_string(reinterpret_cast<std::uintptr_t>(&attempt)));
+  this->socket = attempt.release();
+  this->port = attempt.get_port();
+  this->use_tls = attempt.use_tls();
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                             this->connection_start);
+  log_info("Connected to ", attempt.get_ip(), " on port ", this->port, " in ", elapsed.count(), "ms.");
+  auto& metrics = ConnectionMetrics::instance();
+  metrics.record_success(this->address, elapsed);
+  log_info("Connections to ", this->address, ": ", metrics.get(this->address));
+  this->stop_connection_attempts();
+  this->poller->add_socket_handler(this);
+  this->connected = true;
+  this->connecting = false;
 #ifdef BOTAN_FOUND
-          if (this->use_tls)
-            this->start_tls();
+  if (this->use_tls)
+    this->start_tls();
 #endif
-          this->on_connected();
-          return ;
-        }
-      else if (errno == EINPROGRESS || errno == EALREADY)
-        {   // retry this process later, when the socket
-            // is ready to be written on.
-          this->connecting = true;
-          this->poller->add_socket_handler(this);
-          this->poller->watch_send_events(this);
-          // Save the addrinfo structure, to use it on the next call
-          this->ai_addrlen = rp->ai_addrlen;
-          memcpy(&this->ai_addr, rp->ai_addr, this->ai_addrlen);
-          memcpy(&this->addrinfo, rp, sizeof(struct addrinfo));
-          this->addrinfo.ai_addr = reinterpret_cast<struct sockaddr*>(&this->ai_addr);
-          this->addrinfo.ai_next = nullptr;
-          // If the connection has not succeeded or failed in 5s, we consider
-          // it to have failed
-          TimedEventsManager::instance().add_event(
-                                                   TimedEvent(std::chrono::steady_clock::now() + 5s,
-                                                              std::bind(&TCPSocketHandler::on_connection_timeout, this),
-                                                              "connection_timeout"s + std::to_string(this->socket)));
-          return ;
-        }
-      log_info("Connection failed:", strerror(errno));
-    }
-  log_error("All connection attempts failed.");
-  this->close();
-  this->on_connection_failed(strerror(errno));
-  return ;
+  this->on_connected();
 }
 
-void TCPSocketHandler::on_connection_timeout()
+void TCPSocketHandler::stop_connection_attempts()
 {
-  this->close();
-  this->on_connection_failed("connection timed out");
+  TimedEventsManager::instance().cancel(this->get_attempt_timer_name());
+  for (auto& attempt: this->attempts)
+    dispose(std::move(attempt));
+  this->attempts.clear();
+  this->candidates.clear();
+  this->next_candidate = 0;
+}
+
+std::string TCPSocketHandler::get_attempt_timer_name() const
+{
+  return "connection_attempt"s + std::to_string(reinterpret_cast<std::uintptr_t>(this));
 }
 
 void TCPSocketHandler::connect()
 {
-  this->connect(this->address, this->port, this->use_tls);
 }
 
 void TCPSocketHandler::on_recv()
 {
+  this->on_input_turn();
+  bool filled;
+  do
+    {
 #ifdef BOTAN_FOUND
-  if (this->use_tls)
-    this->tls_recv();
-  else
+      if (this->use_tls)
+        filled = this->tls_recv();
+      else
 #endif
-    this->plain_recv();
+        filled = this->plain_recv();
+    } while (filled && this->connected && this->wants_more_input());
 }
 
-void TCPSocketHandler::plain_recv()
+bool TCPSocketHandler::plain_recv()
 {
   static constexpr size_t buf_size = 4096;
   char buf[buf_size];
@@ -253,6 +428,7 @@ void TCPSocketHandler::plain_recv()
         }
       this->parse_in_buffer(size);
     }
+  return size == static_cast<ssize_t>(buf_size);
 }
 
 ssize_t TCPSocketHandler::do_recv(void* recv_buf, const size_t buf_size)
@@ -263,6 +439,9 @@ ssize_t TCPSocketHandler::do_recv(void* recv_buf, const size_t buf_size)
       this->on_connection_close("");
       this->close();
     }
+  else if (-1 == size && (errno == EAGAIN || errno == EWOULDBLOCK))
+    // Nothing more to read for now: the previous read emptied the socket
+    return size;
   else if (-1 == size)
     {
       if (this->connecting)
@@ -305,6 +484,7 @@ void TCPSocketHandler::on_send()
     }
   else
     {
+      this->out_buf_size -= res;
       // remove all the strings that were successfully sent.
       auto it = this->out_buf.begin();
       while (it != this->out_buf.end())
@@ -326,15 +506,20 @@ void TCPSocketHandler::on_send()
       this->out_buf.erase(this->out_buf.begin(), it);
       if (this->out_buf.empty())
         this->poller->stop_watching_send_events(this);
+      this->on_data_sent();
     }
 }
 
 void TCPSocketHandler::close()
 {
-  TimedEventsManager::instance().cancel("connection_timeout"s +
-                                        std::to_string(this->socket));
-  if (this->connected || this->connecting)
+  this->stop_connection_attempts();
+  if (this->connected)
     this->poller->remove_socket_handler(this->get_socket());
+  if (!this->bind_addr.empty())
+    {
+      BindPool::instance().release(this->bind_addr, this->address);
+      this->bind_addr.clear();
+    }
   if (this->socket != -1)
     {
       ::close(this->socket);
@@ -344,18 +529,11 @@ void TCPSocketHandler::close()
   this->connecting = false;
   this->in_buf.clear();
   this->out_buf.clear();
+  this->out_buf_size = 0;
   this->port.clear();
   this->resolver.clear();
 }
 
-void TCPSocketHandler::display_resolved_ip(struct addrinfo* rp) const
-{
-  if (rp->ai_family == AF_INET)
-    log_debug("Trying IPv4 address ", addr_to_string(rp));
-  else if (rp->ai_family == AF_INET6)
-    log_debug("Trying IPv6 address ", addr_to_string(rp));
-}
-
 void TCPSocketHandler::send_data(std::string&& data)
 {
 #ifdef BOTAN_FOUND
@@ -376,6 +554,7 @@ void TCPSocketHandler::raw_send(std::string&& data)
 {
   if (data.empty())
     return ;
+  this->out_buf_size += data.size();
   this->out_buf.emplace_back(std::move(data));
   if (this->connected)
     this->poller->watch_send_events(this);
@@ -387,6 +566,11 @@ void TCPSocketHandler::send_pending_data()
     this->poller->watch_send_events(this);
 }
 
+std::size_t TCPSocketHandler::get_out_buf_size() const
+{
+  return this->out_buf_size;
+}
+
 bool TCPSocketHandler::is_connected() const
 {
   return this->connected;
@@ -415,7 +599,7 @@ void TCPSocketHandler::start_tls()
       rng, server_info, Botan::TLS::Protocol_Version::latest_tls_version());
 }
 
-void TCPSocketHandler::tls_recv()
+bool TCPSocketHandler::tls_recv()
 {
   static constexpr size_t buf_size = 4096;
   Botan::byte recv_buf[buf_size];
@@ -432,11 +616,12 @@ void TCPSocketHandler::tls_recv()
         // plain-text)
         this->on_connection_close("TLS error: "s + e.what());
         this->close();
-        return ;
+        return false;
       }
       if (!was_active && this->tls->is_active())
         this->on_tls_activated();
     }
+  return size == static_cast<ssize_t>(buf_size);
 }
 
 void TCPSocketHandler::tls_send(std::string&& data)
@@ -3,6 +3,7 @@
 
 #include "louloulibs.h"
 
+#include <network/connection_attempt.hpp>
 #include <network/socket_handler.hpp>
 #include <network/resolver.hpp>
 
@@ -13,9 +14,11 @@
 #include <netinet/in.h>
 #include <netdb.h>
 
+#include <utility>
 #include <vector>
 #include <memory>
 #include <string>
+#include <chrono>
 #include <list>
 
 /**
@@ -35,16 +38,47 @@ public:
   TCPSocketHandler& operator=(const TCPSocketHandler&) = delete;
   TCPSocketHandler& operator=(TCPSocketHandler&&) = delete;
 
+  /**
+   * Ports to connect to, and whether to use TLS on each of them.
+   */
+  using Ports = std::vector<std::pair<std::string, bool>>;
+  /**
+   * The delay between the start of two connection attempts, and the time
+   * after which an attempt is considered to have failed.
+   */
+  static constexpr std::chrono::milliseconds connection_attempt_delay{250};
+  static constexpr std::chrono::seconds connection_attempt_timeout{5};
+
   /**
    * Connect to the remote server, and call on_connected() if this
    * succeeds. If tls is true, we set use_tls to true and will also call
    * start_tls() when the connection succeeds.
    */
   void connect(const std::string& address, const std::string& port, const bool tls);
+  /**
+   * Same thing, on whichever of these ports, given by order of preference,
+   * accepts the connection first.
+   *
+   * The attempts on each address of the hostname and each port are
+   * started one after the other, every connection_attempt_delay (or as
+   * soon as one fails), without waiting for the previous ones to fail, as
+   * described in RFC 8305.  The addresses alternate between IPv6 and IPv4,
+   * so that a broken route for one family does not delay the connection.
+   * The first connected socket is kept, and the other attempts are
+   * cancelled.  on_connection_failed() is called once they all failed.
+   */
+  void connect(const std::string& address, const Ports& ports);
+  /**
+   * Do nothing: the connection attempts are watched by the poller, and
+   * this handler is only given to it once connected.
+   */
   void connect() override final;
   /**
    * Reads raw data from the socket. And pass it to parse_in_buffer()
    * If we are using TLS on this connection, we call tls_recv()
+   *
+   * While the reads fill the buffer, and wants_more_input() says so, the
+   * socket is read again in the same turn of the poller.
    */
   void on_recv() override final;
   /**
@@ -67,11 +101,6 @@ public:
    * Close the connection, remove us from the poller
    */
   void close();
-  /**
-   * Called by a TimedEvent, when the connection did not succeed or fail
-   * after a given time.
-   */
-  void on_connection_timeout();
   /**
    * Called when the connection is successful.
    */
@@ -106,26 +135,67 @@ public:
 #endif
   bool is_connected() const override final;
   bool is_connecting() const;
+  /**
+   * The number of bytes waiting to be written in the socket.
+   */
+  std::size_t get_out_buf_size() const;
+
+protected:
+  /**
+   * Called after some of the data of out_buf was written in the socket.
+   */
+  virtual void on_data_sent() {}
+  /**
+   * Called by on_recv() before its first read, at each turn of the poller.
+   */
+  virtual void on_input_turn() {}
+  /**
+   * Whether on_recv() should read again, after a read that filled its
+   * buffer was given to parse_in_buffer().  By default, the socket is read
+   * once in each turn.
+   */
+  virtual bool wants_more_input() const
+  { return false; }
 
 private:
   /**
-   * Initialize the socket with the parameters contained in the given
-   * addrinfo structure.
+   * Create a non-blocking socket of that family, bound to bind_addr if
+   * needed.
+   */
+  socket_t init_socket(const int family) const;
+  /**
+   * Called once the hostname is resolved: build the list of candidates and
+   * start the first attempt.
+   */
+  void start_connection_attempts();
+  /**
+   * Start the attempt on the next candidate, and schedule the one after
+   * it.  If there is none, and no attempt is in progress, the connection
+   * failed.
+   */
+  void start_next_attempt();
+  void on_attempt_done(ConnectionAttempt& attempt, const int error);
+  void on_attempt_connected(ConnectionAttempt& attempt);
+  /**
+   * Cancel all the attempts in progress, and the ones not started yet.
    */
-  void init_socket(const struct addrinfo* rp);
+  void stop_connection_attempts();
+  std::string get_attempt_timer_name() const;
   /**
    * Reads from the socket into the provided buffer.  If an error occurs
-   * (read returns <= 0), the handling of the error is done here (close the
-   * connection, log a message, etc).
+   * (read returns <= 0, except when there is just nothing to read), the
+   * handling of the error is done here (close the connection, log a
+   * message, etc).
    *
    * Returns the value returned by ::recv(), so the buffer should not be
    * used if it’s not positive.
    */
   ssize_t do_recv(void* recv_buf, const size_t buf_size);
   /**
-   * Reads data from the socket and calls parse_in_buffer with it.
+   * Reads data from the socket and calls parse_in_buffer with it.  Returns
+   * whether the read filled the buffer, so that more data may be waiting.
    */
-  void plain_recv();
+  bool plain_recv();
   /**
    * Mark the given data as ready to be sent, as-is, on the socket, as soon
    * as we can.
@@ -141,9 +211,10 @@ private:
   void start_tls();
   /**
    * An additional step to pass the data into our tls object to decrypt it
-   * before passing it to parse_in_buffer.
+   * before passing it to parse_in_buffer.  Returns the same as
+   * plain_recv().
    */
-  void tls_recv();
+  bool tls_recv();
   /**
    * Pass the data to the tls object in order to encrypt it. The tls object
    * will then call raw_send as a callback whenever data as been encrypted
@@ -181,18 +252,40 @@ private:
    * Where data is added, when we want to send something to the client.
    */
   std::vector<std::string> out_buf;
+  std::size_t out_buf_size;
   /**
    * DNS resolver
    */
   Resolver resolver;
   /**
-   * Keep the details of the addrinfo returned by the resolver that
-   * triggered a EINPROGRESS error when connect()ing to it, to reuse it
-   * directly when connect() is called again.
+   * The ports given to the last connect() call.
+   */
+  Ports ports;
+  /**
+   * One address and port to connect to.
    */
-  struct addrinfo addrinfo;
-  struct sockaddr_in6 ai_addr;
-  socklen_t ai_addrlen;
+  struct Candidate
+  {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    std::string port;
+    bool tls;
+  };
+  /**
+   * All the addresses and ports, in the order in which they are tried, and
+   * the next one to try.
+   */
+  std::vector<Candidate> candidates;
+  std::size_t next_candidate;
+  /**
+   * The attempts in progress.
+   */
+  std::vector<std::unique_ptr<ConnectionAttempt>> attempts;
+  /**
+   * The error of the last failed attempt, reported if they all fail.
+   */
+  std::string last_error;
+  std::chrono::steady_clock::time_point connection_start;
 
 protected:
   /**
@@ -230,16 +323,13 @@ protected:
 
   /**
    * Address to bind the socket to, before calling connect().
-   * If empty, it’s equivalent to binding to INADDR_ANY.
+   * If empty, it’s equivalent to binding to INADDR_ANY.  It must have been
+   * counted by the BindPool, as BindPool::choose() does: close() releases
+   * it, and clears it.
    */
   std::string bind_addr;
 
 private:
-  /**
-   * Display the resolved IP, just for information purpose.
-   */
-  void display_resolved_ip(struct addrinfo* rp) const;
-
 #ifdef BOTAN_FOUND
   /**
    * Botan stuff to manipulate a TLS session.
@@ -0,0 +1,127 @@
+#include <network/worker.hpp>
+#include <network/poller.hpp>
+#include <logger/logger.hpp>
+
+#include <algorithm>
+#include <future>
+
+using namespace std::chrono;
+
+Worker::Worker(std::shared_ptr<Poller> poller, const std::size_t threads):
+  completions(poller),
+  stopping(false)
+{
+  for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); ++i)
+    this->threads.emplace_back(&Worker::loop, this);
+}
+
+Worker::~Worker()
+{
+  this->stop();
+}
+
+void Worker::post(const char* label, std::function<void()>&& job, std::function<void()>&& completion)
+{
+  if (this->threads.empty())
+    {
+      job();
+      if (completion)
+        completion();
+      return;
+    }
+  this->completions.expect();
+  auto shared_completion = std::make_shared<std::function<void()>>(std::move(completion));
+  this->push({label, std::move(job),
+        [this, shared_completion]()
+        {
+          this->completions.push(std::move(*shared_completion));
+        }, steady_clock::now()});
+}
+
+void Worker::run(const char* label, std::function<void()>&& job)
+{
+  if (this->threads.empty() || this->is_worker_thread())
+    {
+      job();
+      return;
+    }
+  std::promise<void> done;
+  auto future = done.get_future();
+  this->push({label, std::move(job),
+        [&done]() { done.set_value(); }, steady_clock::now()});
+  future.wait();
+}
+
+void Worker::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+  }
+  this->cond.notify_all();
+  for (auto& thread: this->threads)
+    thread.join();
+  this->threads.clear();
+}
+
+bool Worker::is_worker_thread() const
+{
+  const auto id = std::this_thread::get_id();
+  return std::any_of(this->threads.begin(), this->threads.end(),
+                     [id](const std::thread& thread) { return thread.get_id() == id; });
+}
+
+WorkerMetrics Worker::get_metrics() const
+{
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->metrics;
+}
+
+void Worker::push(Job&& job)
+{
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->queue.push_back(std::move(job));
+    this->metrics.queue_depth = this->queue.size();
+    this->metrics.max_queue_depth = std::max(this->metrics.max_queue_depth,
+                                             this->metrics.queue_depth);
+  }
+  this->cond.notify_one();
+}
+
+void Worker::loop()
+{
+  while (true)
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->cond.wait(lock, [this]() { return this->stopping || !this->queue.empty(); });
+      if (this->queue.empty())
+        return;
+      Job job = std::move(this->queue.front());
+      this->queue.pop_front();
+      this->metrics.queue_depth = this->queue.size();
+      this->metrics.total_wait += duration_cast<microseconds>(steady_clock::now() - job.posted);
+      lock.unlock();
+      this->execute(job);
+    }
+}
+
+void Worker::execute(Job& job)
+{
+  const auto start = steady_clock::now();
+  try {
+      job.run();
+    } catch (const std::exception& e) {
+      log_error("Job ", job.label, " failed: ", e.what());
+    }
+  const auto elapsed = duration_cast<microseconds>(steady_clock::now() - start);
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto& job_metrics = this->metrics.jobs[job.label];
+    job_metrics.count++;
+    job_metrics.total += elapsed;
+    job_metrics.max = std::max(job_metrics.max, elapsed);
+  }
+  if (job.done)
+    job.done();
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <network/completion_queue.hpp>
+
+#include <condition_variable>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+class Poller;
+
+/**
+ * Latency of one kind of job, identified by the label given when posting
+ * it.
+ */
+struct JobMetrics
+{
+  std::uint64_t count{0};
+  std::chrono::microseconds total{0};
+  std::chrono::microseconds max{0};
+};
+
+struct WorkerMetrics
+{
+  /**
+   * Number of jobs waiting to be picked by a thread, and the largest value
+   * ever seen.
+   */
+  std::size_t queue_depth{0};
+  std::size_t max_queue_depth{0};
+  /**
+   * Time spent between being posted and being picked by a thread, summed
+   * over all the processed jobs.
+   */
+  std::chrono::microseconds total_wait{0};
+  /**
+   * Time spent running each kind of job.
+   */
+  std::unordered_map<std::string, JobMetrics> jobs;
+};
+
+/**
+ * A set of threads running blocking jobs (database queries, name
+ * resolution, etc) outside of the event loop.
+ *
+ * Each job may come with a completion, run by the event loop thread once
+ * the job is done, through a CompletionQueue watched by the poller.
+ */
+
+class Worker
+{
+public:
+  explicit Worker(std::shared_ptr<Poller> poller, const std::size_t threads=1);
+  ~Worker();
+  Worker(const Worker&) = delete;
+  Worker(Worker&&) = delete;
+  Worker& operator=(const Worker&) = delete;
+  Worker& operator=(Worker&&) = delete;
+
+  /**
+   * Run the job on one of our threads, and then the completion on the
+   * event loop thread. Must be called from the event loop thread.
+   */
+  void post(const char* label, std::function<void()>&& job, std::function<void()>&& completion);
+  /**
+   * Run the job on one of our threads, and block until it is done.
+   */
+  void run(const char* label, std::function<void()>&& job);
+  /**
+   * Run all the jobs already posted, then join the threads. Completions
+   * that did not reach the event loop yet are never called.
+   */
+  void stop();
+  /**
+   * Whether the caller is running on one of our threads.
+   */
+  bool is_worker_thread() const;
+  WorkerMetrics get_metrics() const;
+
+private:
+  struct Job
+  {
+    const char* label;
+    std::function<void()> run;
+    /**
+     * Called on the worker thread once run() returned, even if it threw.
+     */
+    std::function<void()> done;
+    std::chrono::steady_clock::time_point posted;
+  };
+  void loop();
+  void push(Job&& job);
+  void execute(Job& job);
+
+  CompletionQueue completions;
+  mutable std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<Job> queue;
+  bool stopping;
+  WorkerMetrics metrics;
+  std::vector<std::thread> threads;
+};
@@ -0,0 +1,174 @@
+#include <utils/compression.hpp>
+
+#ifdef ZLIB_FOUND
+
+#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+
+/**
+ * The deflate output is made NUL-free by escaping 0x00 as 0x01 0x01, and
+ * 0x01 as 0x01 0x02.
+ */
+static constexpr char escape_byte = '\x01';
+
+static void append_escaped(std::string& res, const unsigned char* data, const std::size_t size)
+{
+  for (std::size_t i = 0; i < size; ++i)
+    {
+      if (data[i] == 0 || data[i] == 1)
+        {
+          res += escape_byte;
+          res += static_cast<char>(data[i] + 1);
+        }
+      else
+        res += static_cast<char>(data[i]);
+    }
+}
+
+static std::string unescape(const std::string& data)
+{
+  std::string res;
+  res.reserve(data.size());
+  for (std::size_t i = 0; i < data.size(); ++i)
+    {
+      if (data[i] != escape_byte)
+        res += data[i];
+      else if (i + 1 < data.size() && (data[i + 1] == '\x01' || data[i + 1] == '\x02'))
+        res += static_cast<char>(data[++i] - 1);
+      else
+        throw std::runtime_error("Invalid compressed data");
+    }
+  return res;
+}
+
+namespace utils
+{
+  Compressor::Compressor(const std::string& dictionary):
+    dictionary(dictionary),
+    stream{}
+  {
+    // Raw deflate: no header nor checksum, that would be bigger than most
+    // of the lines
+    if (deflateInit2(&this->stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+      throw std::runtime_error("Failed to initialize the compression");
+  }
+
+  Compressor::~Compressor()
+  {
+    deflateEnd(&this->stream);
+  }
+
+  std::string Compressor::compress(const std::string& data)
+  {
+    // The reset forgets the dictionary, but keeps the allocated state
+    if (deflateReset(&this->stream) != Z_OK)
+      throw std::runtime_error("Failed to reset the compression");
+    if (!this->dictionary.empty() &&
+        deflateSetDictionary(&this->stream, reinterpret_cast<const Bytef*>(this->dictionary.data()),
+                             static_cast<uInt>(this->dictionary.size())) != Z_OK)
+      throw std::runtime_error("Failed to set the compression dictionary");
+
+    this->buffer.resize(deflateBound(&this->stream, static_cast<uLong>(data.size())));
+    this->stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    this->stream.avail_in = static_cast<uInt>(data.size());
+    this->stream.next_out = this->buffer.data();
+    this->stream.avail_out = static_cast<uInt>(this->buffer.size());
+    if (deflate(&this->stream, Z_FINISH) != Z_STREAM_END)
+      throw std::runtime_error("Failed to compress");
+
+    std::string res;
+    res.reserve(this->stream.total_out + this->stream.total_out / 64);
+    append_escaped(res, this->buffer.data(), this->stream.total_out);
+    return res;
+  }
+
+  Decompressor::Decompressor(const std::string& dictionary):
+    dictionary(dictionary),
+    stream{}
+  {
+    if (inflateInit2(&this->stream, -MAX_WBITS) != Z_OK)
+      throw std::runtime_error("Failed to initialize the decompression");
+  }
+
+  Decompressor::~Decompressor()
+  {
+    inflateEnd(&this->stream);
+  }
+
+  std::string Decompressor::decompress(const std::string& data)
+  {
+    const auto raw = unescape(data);
+    if (inflateReset(&this->stream) != Z_OK)
+      throw std::runtime_error("Failed to reset the decompression");
+    // With raw inflate, the dictionary is set before any input
+    if (!this->dictionary.empty() &&
+        inflateSetDictionary(&this->stream, reinterpret_cast<const Bytef*>(this->dictionary.data()),
+                             static_cast<uInt>(this->dictionary.size())) != Z_OK)
+      throw std::runtime_error("Failed to set the decompression dictionary");
+
+    this->stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(raw.data()));
+    this->stream.avail_in = static_cast<uInt>(raw.size());
+    std::string res;
+    unsigned char buffer[4096];
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END)
+      {
+        this->stream.next_out = buffer;
+        this->stream.avail_out = sizeof(buffer);
+        ret = inflate(&this->stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+          throw std::runtime_error("Invalid compressed data");
+        res.append(reinterpret_cast<const char*>(buffer), sizeof(buffer) - this->stream.avail_out);
+        if (ret == Z_OK && this->stream.avail_in == 0 && this->stream.avail_out != 0)
+          throw std::runtime_error("Truncated compressed data");
+      }
+    return res;
+  }
+
+  std::string compress(const std::string& data, const std::string& dictionary)
+  {
+    return Compressor(dictionary).compress(data);
+  }
+
+  std::string decompress(const std::string& data, const std::string& dictionary)
+  {
+    return Decompressor(dictionary).decompress(data);
+  }
+
+  std::string train_dictionary(const std::vector<std::string>& samples, const std::size_t max_size)
+  {
+    std::unordered_map<std::string, std::size_t> counts;
+    for (const auto& sample: samples)
+      {
+        std::size_t pos = 0;
+        while (pos < sample.size())
+          {
+            const auto end = std::min(sample.find(' ', pos), sample.size());
+            if (end - pos >= 3)
+              counts[sample.substr(pos, end - pos) + ' ']++;
+            pos = end + 1;
+          }
+      }
+    // A word seen once is not worth its place
+    std::vector<std::pair<std::size_t, std::string>> words;
+    for (auto& word: counts)
+      if (word.second > 1)
+        words.emplace_back(word.second * word.first.size(), std::move(word.first));
+    std::sort(words.begin(), words.end(),
+              [](const auto& a, const auto& b) { return a.first > b.first || (a.first == b.first && a.second < b.second); });
+
+    // The best words are kept, and then put last
+    std::size_t size = 0;
+    auto last = words.begin();
+    for (; last != words.end() && size + last->second.size() <= max_size; ++last)
+      size += last->second.size();
+    std::string res;
+    res.reserve(size);
+    for (auto it = std::make_reverse_iterator(last); it != words.rend(); ++it)
+      res += it->second;
+    return res;
+  }
+}
+
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "louloulibs.h"
+
+#include <string>
+#include <vector>
+
+#ifdef ZLIB_FOUND
+#include <zlib.h>
+
+namespace utils
+{
+  /**
+   * A raw deflate stream using a preset dictionary (it may be empty),
+   * reset for each string instead of allocating its state (about 256KiB)
+   * every time.
+   */
+  class Compressor
+  {
+  public:
+    explicit Compressor(const std::string& dictionary);
+    ~Compressor();
+    Compressor(const Compressor&) = delete;
+    Compressor(Compressor&&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+    Compressor& operator=(Compressor&&) = delete;
+
+    /**
+     * The result never contains a NUL byte, so that it can be stored as a
+     * string.
+     */
+    std::string compress(const std::string& data);
+
+  private:
+    const std::string dictionary;
+    z_stream stream;
+    std::vector<unsigned char> buffer;
+  };
+
+  /**
+   * The inflate stream reversing Compressor::compress(), with the same
+   * dictionary, reset for each string.
+   */
+  class Decompressor
+  {
+  public:
+    explicit Decompressor(const std::string& dictionary);
+    ~Decompressor();
+    Decompressor(const Decompressor&) = delete;
+    Decompressor(Decompressor&&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+    Decompressor& operator=(Decompressor&&) = delete;
+
+    /**
+     * Throws std::runtime_error if data is not valid.
+     */
+    std::string decompress(const std::string& data);
+
+  private:
+    const std::string dictionary;
+    z_stream stream;
+  };
+
+  /**
+   * Compress or decompress a single string, with a stream used only once.
+   */
+  std::string compress(const std::string& data, const std::string& dictionary);
+  std::string decompress(const std::string& data, const std::string& dictionary);
+  /**
+   * Build a preset dictionary of at most max_size bytes from a sample of
+   * the strings to compress: their most common words, each followed by a
+   * space, the most common ones last (deflate references the end of the
+   * dictionary with shorter distances).
+   */
+  std::string train_dictionary(const std::vector<std::string>& samples, const std::size_t max_size);
+}
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <unordered_map>
+#include <utility>
+#include <list>
+
+namespace utils
+{
+
+struct CacheMetrics
+{
+  std::size_t hits;
+  std::size_t misses;
+  std::size_t evictions;
+  std::size_t size;
+};
+
+/**
+ * A hash map holding at most `capacity` values. When it is full, inserting
+ * a new value evicts the least recently used one.
+ */
+template <typename Key, typename Value>
+class LruCache
+{
+public:
+  explicit LruCache(const std::size_t capacity):
+    capacity(capacity),
+    hits(0),
+    misses(0),
+    evictions(0)
+  {}
+  ~LruCache() = default;
+
+  LruCache(const LruCache&) = delete;
+  LruCache(LruCache&&) = delete;
+  LruCache& operator=(const LruCache&) = delete;
+  LruCache& operator=(LruCache&&) = delete;
+
+  /**
+   * Returns a pointer to the cached value, or nullptr if there is none. A
+   * successful lookup makes that value the most recently used one.  The
+   * pointer is valid until the next modification of the cache.
+   */
+  const Value* get(const Key& key)
+  {
+    const auto it = this->index.find(key);
+    if (it == this->index.end())
+      {
+        this->misses++;
+        return nullptr;
+      }
+    this->hits++;
+    this->entries.splice(this->entries.begin(), this->entries, it->second);
+    return &it->second->second;
+  }
+
+  void put(const Key& key, Value value)
+  {
+    const auto it = this->index.find(key);
+    if (it != this->index.end())
+      {
+        it->second->second = std::move(value);
+        this->entries.splice(this->entries.begin(), this->entries, it->second);
+        return;
+      }
+    if (this->capacity == 0)
+      return;
+    if (this->entries.size() >= this->capacity)
+      {
+        this->index.erase(this->entries.back().first);
+        this->entries.pop_back();
+        this->evictions++;
+      }
+    this->entries.emplace_front(key, std::move(value));
+    this->index.emplace(key, this->entries.begin());
+  }
+
+  void clear()
+  {
+    this->index.clear();
+    this->entries.clear();
+  }
+
+  std::size_t size() const
+  {
+    return this->entries.size();
+  }
+
+  CacheMetrics get_metrics() const
+  {
+    return {this->hits, this->misses, this->evictions, this->entries.size()};
+  }
+
+private:
+  using Entries = std::list<std::pair<Key, Value>>;
+
+  const std::size_t capacity;
+  /**
+   * The most recently used entry is at the front
+   */
+  Entries entries;
+  std::unordered_map<Key, typename Entries::iterator> index;
+
+  std::size_t hits;
+  std::size_t misses;
+  std::size_t evictions;
+};
+
+}
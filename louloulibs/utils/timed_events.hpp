@@ -121,6 +121,11 @@ public:
    * Returns the number of canceled events.
    */
   std::size_t cancel(const std::string& name);
+  /**
+   * Move the first timed event with the given name to that time point,
+   * keeping its callback.  Returns false if there is no such event.
+   */
+  bool reschedule(const std::string& name, const std::chrono::steady_clock::time_point& time_point);
   /**
    * Return the number of managed events.
    */
@@ -67,6 +67,24 @@ std::size_t TimedEventsManager::cancel(const std::string& name)
   return res;
 }
 
+bool TimedEventsManager::reschedule(const std::string& name, const std::chrono::steady_clock::time_point& time_point)
+{
+  for (auto it = this->events.begin(); it != this->events.end(); ++it)
+    {
+      if (it->get_name() == name)
+        {
+          if (it->time_point == time_point)
+            return true;
+          TimedEvent event(std::move(*it));
+          this->events.erase(it);
+          event.time_point = time_point;
+          this->add_event(std::move(event));
+          return true;
+        }
+    }
+  return false;
+}
+
 std::size_t TimedEventsManager::size() const
 {
   return this->events.size();
@@ -1,6 +1,7 @@
 #include <xmpp/adhoc_command.hpp>
 #include <xmpp/xmpp_component.hpp>
 #include <utils/reload.hpp>
+#include <network/resolver.hpp>
 
 using namespace std::string_literals;
 
@@ -87,3 +88,18 @@ void Reload(XmppComponent&, AdhocSession&, XmlNode& command_node)
   note.set_inner("Configuration reloaded.");
   command_node.add_child(std::move(note));
 }
+
+void FlushDnsCache(XmppComponent&, AdhocSession&, XmlNode& command_node)
+{
+  auto& cache = Resolver::get_cache();
+  const auto metrics = cache.get_metrics();
+  const auto entries = cache.flush();
+  command_node.delete_all_children();
+  XmlNode note("note");
+  note["type"] = "info";
+  note.set_inner("Removed "s + std::to_string(entries) + " entries from the DNS cache (" +
+                 std::to_string(metrics.hits) + " hits, " + std::to_string(metrics.misses) + " misses, " +
+                 std::to_string(metrics.coalesced) + " coalesced queries, " +
+                 std::to_string(metrics.evicted) + " evicted entries since startup).");
+  command_node.add_child(std::move(note));
+}
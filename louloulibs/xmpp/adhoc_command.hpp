@@ -42,3 +42,4 @@ void PingStep1(XmppComponent&, AdhocSession& session, XmlNode& command_node);
 void HelloStep1(XmppComponent&, AdhocSession& session, XmlNode& command_node);
 void HelloStep2(XmppComponent&, AdhocSession& session, XmlNode& command_node);
 void Reload(XmppComponent&, AdhocSession& session, XmlNode& command_node);
+void FlushDnsCache(XmppComponent&, AdhocSession& session, XmlNode& command_node);
@@ -1,12 +1,14 @@
 #pragma once
 
+#include <string>
+#include <tuple>
 
 namespace Xmpp
 {
 // Contains:
 // - an XMPP-valid UTF-8 body
-// - an XML node representing the XHTML-IM body, or null
-  using body = std::tuple<const std::string, std::unique_ptr<XmlNode>>;
+// - the serialized XHTML-IM <body/> element, or an empty string
+  using body = std::tuple<const std::string, const std::string>;
 }
 
 
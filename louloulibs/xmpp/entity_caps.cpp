@@ -0,0 +1,173 @@
+#include <xmpp/entity_caps.hpp>
+#include <xmpp/xmpp_component.hpp>
+#include <xmpp/xmpp_stanza.hpp>
+#include <utils/timed_events.hpp>
+#include <utils/sha1.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace
+{
+std::string base64_encode(const uint8_t* data, const std::size_t size)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string res;
+  res.reserve((size + 2) / 3 * 4);
+  for (std::size_t i = 0; i < size; i += 3)
+    {
+      const uint32_t n = (data[i] << 16) | (i + 1 < size ? data[i + 1] << 8: 0) | (i + 2 < size ? data[i + 2]: 0);
+      res += alphabet[(n >> 18) & 63];
+      res += alphabet[(n >> 12) & 63];
+      res += i + 1 < size ? alphabet[(n >> 6) & 63]: '=';
+      res += i + 2 < size ? alphabet[n & 63]: '=';
+    }
+  return res;
+}
+
+const std::string& get_lang(const XmlNode& node)
+{
+  const std::string& lang = node.get_tag("xml:lang");
+  if (!lang.empty())
+    return lang;
+  // The name given by the parser to that attribute
+  return node.get_tag("http://www.w3.org/XML/1998/namespace:lang");
+}
+}
+
+constexpr std::chrono::seconds EntityCaps::default_query_timeout;
+
+EntityCaps::EntityCaps(const std::chrono::milliseconds query_timeout):
+  query_timeout(query_timeout)
+{
+}
+
+EntityCaps::~EntityCaps()
+{
+  for (const auto& ver: this->pending)
+    TimedEventsManager::instance().cancel(this->get_timer_name(ver));
+}
+
+bool EntityCaps::set_jid_ver(const std::string& full_jid, const std::string& ver)
+{
+  this->jids_ver[full_jid] = ver;
+  if (this->features.find(ver) != this->features.end())
+    return false;
+  if (!this->pending.insert(ver).second)
+    return false;
+  TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::now() + this->query_timeout,
+                                                      [this, ver]() { this->query_failed(ver); },
+                                                      this->get_timer_name(ver)));
+  return true;
+}
+
+void EntityCaps::set_features(const std::string& ver, std::set<std::string>&& features)
+{
+  if (this->pending.erase(ver))
+    TimedEventsManager::instance().cancel(this->get_timer_name(ver));
+  this->features[ver] = std::move(features);
+}
+
+void EntityCaps::query_failed(const std::string& ver)
+{
+  if (this->pending.erase(ver))
+    TimedEventsManager::instance().cancel(this->get_timer_name(ver));
+}
+
+void EntityCaps::forget_jid(const std::string& full_jid)
+{
+  this->jids_ver.erase(full_jid);
+}
+
+void EntityCaps::forget_bare_jid(const std::string& bare_jid)
+{
+  auto it = this->jids_ver.begin();
+  while (it != this->jids_ver.end())
+    {
+      const std::string& jid = it->first;
+      if (jid.size() > bare_jid.size() && jid[bare_jid.size()] == '/' &&
+          jid.compare(0, bare_jid.size(), bare_jid) == 0)
+        it = this->jids_ver.erase(it);
+      else
+        ++it;
+    }
+}
+
+bool EntityCaps::may_support(const std::string& full_jid, const std::string& feature) const
+{
+  const auto jid_it = this->jids_ver.find(full_jid);
+  if (jid_it == this->jids_ver.end())
+    return true;
+  const auto features_it = this->features.find(jid_it->second);
+  if (features_it == this->features.end())
+    return true;
+  return features_it->second.count(feature) != 0;
+}
+
+std::size_t EntityCaps::size() const
+{
+  return this->features.size();
+}
+
+std::string EntityCaps::get_timer_name(const std::string& ver) const
+{
+  return "entity_caps" + std::to_string(reinterpret_cast<std::uintptr_t>(this)) + ver;
+}
+
+std::string EntityCaps::compute_ver(const XmlNode& query)
+{
+  std::vector<std::string> identities;
+  for (const XmlNode* identity: query.get_children("identity", DISCO_INFO_NS))
+    identities.push_back(identity->get_tag("category") + "/" + identity->get_tag("type") + "/" +
+                         get_lang(*identity) + "/" + identity->get_tag("name"));
+  std::sort(identities.begin(), identities.end());
+  std::vector<std::string> features;
+  for (const XmlNode* feature: query.get_children("feature", DISCO_INFO_NS))
+    features.push_back(feature->get_tag("var"));
+  std::sort(features.begin(), features.end());
+
+  // The extended information, sorted by FORM_TYPE
+  std::vector<std::pair<std::string, std::string>> forms;
+  for (const XmlNode* x: query.get_children("x", "jabber:x:data"))
+    {
+      std::string form_type;
+      std::vector<std::string> fields;
+      for (const XmlNode* field: x->get_children("field", "jabber:x:data"))
+        {
+          std::vector<std::string> values;
+          for (const XmlNode* value: field->get_children("value", "jabber:x:data"))
+            values.push_back(value->get_inner());
+          if (field->get_tag("var") == "FORM_TYPE")
+            {
+              if (!values.empty())
+                form_type = values.front();
+              continue;
+            }
+          std::sort(values.begin(), values.end());
+          std::string res = field->get_tag("var") + "<";
+          for (const auto& value: values)
+            res += value + "<";
+          fields.push_back(std::move(res));
+        }
+      std::sort(fields.begin(), fields.end());
+      std::string res;
+      for (const auto& field: fields)
+        res += field;
+      forms.emplace_back(form_type, std::move(res));
+    }
+  std::sort(forms.begin(), forms.end());
+
+  std::string s;
+  for (const auto& identity: identities)
+    s += identity + "<";
+  for (const auto& feature: features)
+    s += feature + "<";
+  for (const auto& form: forms)
+    s += form.first + "<" + form.second;
+
+  sha1nfo sha1;
+  sha1_init(&sha1);
+  sha1_write(&sha1, s.data(), s.size());
+  return base64_encode(sha1_result(&sha1), HASH_LENGTH);
+}
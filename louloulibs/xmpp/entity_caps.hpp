@@ -0,0 +1,94 @@
+#pragma once
+
+#include <unordered_map>
+#include <string>
+#include <chrono>
+#include <set>
+
+class XmlNode;
+
+/**
+ * Keep track of the XEP-0115 entity capabilities advertised by the XMPP
+ * clients we talk to.
+ *
+ * Each full JID is associated with the verification string found in its
+ * last presence, and each verification string is associated with the list
+ * of features returned by the disco#info query we sent about it. Since all
+ * the clients with the same build share the same verification string, the
+ * query is done only once for all of them.  A query that is not answered
+ * within query_timeout is considered failed.
+ */
+class EntityCaps
+{
+public:
+  static constexpr std::chrono::seconds default_query_timeout{30};
+
+  explicit EntityCaps(const std::chrono::milliseconds query_timeout=EntityCaps::default_query_timeout);
+  ~EntityCaps();
+
+  EntityCaps(const EntityCaps&) = delete;
+  EntityCaps(EntityCaps&&) = delete;
+  EntityCaps& operator=(const EntityCaps&) = delete;
+  EntityCaps& operator=(EntityCaps&&) = delete;
+
+  /**
+   * Associate the given full JID with that verification string.  Returns
+   * true if the features for that verification string are not known yet,
+   * and nobody is already resolving them: the caller is then expected to
+   * send a disco#info query and give the result to set_features().  If no
+   * result is given before the query timeout, query_failed() is called.
+   */
+  bool set_jid_ver(const std::string& full_jid, const std::string& ver);
+  /**
+   * Save the features associated with that verification string.
+   */
+  void set_features(const std::string& ver, std::set<std::string>&& features);
+  /**
+   * The disco#info query about that verification string failed, or its
+   * result did not match it: the next client advertising it will be asked
+   * again.
+   */
+  void query_failed(const std::string& ver);
+  /**
+   * Forget about that full JID, for example when it goes offline.
+   */
+  void forget_jid(const std::string& full_jid);
+  /**
+   * Forget about all the resources of that bare JID.
+   */
+  void forget_bare_jid(const std::string& bare_jid);
+  /**
+   * Returns false only if the features of that full JID are known and do
+   * not include the given one. If the client does not advertise its
+   * capabilities, or if we are still waiting for them, we assume the
+   * feature is supported.
+   */
+  bool may_support(const std::string& full_jid, const std::string& feature) const;
+  /**
+   * Number of distinct verification strings we know the features of.
+   */
+  std::size_t size() const;
+  /**
+   * The SHA-1 verification string of that disco#info query result, as
+   * described in XEP-0115 §5.1
+   */
+  static std::string compute_ver(const XmlNode& query);
+
+private:
+  std::string get_timer_name(const std::string& ver) const;
+
+  const std::chrono::milliseconds query_timeout;
+  /**
+   * full jid -> verification string
+   */
+  std::unordered_map<std::string, std::string> jids_ver;
+  /**
+   * verification string -> features
+   */
+  std::unordered_map<std::string, std::set<std::string>> features;
+  /**
+   * The verification strings for which a disco#info query has been sent,
+   * but no result received yet.
+   */
+  std::set<std::string> pending;
+};
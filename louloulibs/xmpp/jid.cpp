@@ -1,7 +1,6 @@
 #include <xmpp/jid.hpp>
 #include <algorithm>
 #include <cstring>
-#include <map>
 
 #include <louloulibs.h>
 #ifdef LIBIDN_FOUND
@@ -10,41 +9,48 @@
 
 #include <logger/logger.hpp>
 
-Jid::Jid(const std::string& jid)
+JidView::JidView(const std::string& jid)
 {
-  std::string::size_type slash = jid.find('/');
-  if (slash != std::string::npos)
-    {
-      this->resource = jid.substr(slash + 1);
-    }
+  const string_view view(jid);
+  string_view::size_type slash = view.find('/');
+  if (slash != string_view::npos)
+    this->resource = view.substr(slash + 1);
 
-  std::string::size_type at = jid.find('@');
-  if (at != std::string::npos && at < slash)
+  string_view::size_type at = view.find('@');
+  if (at != string_view::npos && at < slash)
     {
-      this->local = jid.substr(0, at);
+      this->local = view.substr(0, at);
       at++;
     }
   else
     at = 0;
 
-  this->domain = jid.substr(at, slash - at);
+  this->domain = view.substr(at, slash - at);
 }
 
-static constexpr size_t max_jid_part_len = 1023;
-
-std::string jidprep(const std::string& original)
+Jid::Jid(const std::string& jid)
 {
+  const JidView view(jid);
+  this->domain.assign(view.domain.data(), view.domain.size());
+  this->local.assign(view.local.data(), view.local.size());
+  this->resource.assign(view.resource.data(), view.resource.size());
+}
+
 #ifdef LIBIDN_FOUND
-  using CacheType = std::map<std::string, std::string>;
-  static CacheType cache;
-  std::pair<CacheType::iterator, bool> cached = cache.insert({original, {}});
-  if (std::get<1>(cached) == false)
-    { // Insertion failed: the result is already in the cache, return it
-      return std::get<0>(cached)->second;
-    }
+static constexpr size_t max_jid_part_len = 1023;
 
+/**
+ * Enough for all the nicks of a few busy channels, for a few users. Once
+ * full, the least recently used JIDs are prepared again when needed.
+ */
+static constexpr size_t jidprep_cache_size = 8192;
+
+static utils::LruCache<std::string, std::string> jidprep_cache(jidprep_cache_size);
+
+static std::string jidprep_uncached(const std::string& original)
+{
   const std::string error_msg("Failed to convert " + original + " into a valid JID:");
-  Jid jid(original);
+  JidView jid(original);
 
   char local[max_jid_part_len] = {};
   memcpy(local, jid.local.data(), std::min(max_jid_part_len, jid.local.size()));
@@ -74,10 +80,7 @@ std::string jidprep(const std::string& original)
 
   // If there is no resource, stop here
   if (jid.resource.empty())
-    {
-      std::get<0>(cached)->second = std::string(local) + "@" + domain;
-      return std::get<0>(cached)->second;
-    }
+    return std::string(local) + "@" + domain;
 
   // Otherwise, also process the resource part
   char resource[max_jid_part_len] = {};
@@ -89,11 +92,30 @@ std::string jidprep(const std::string& original)
       log_error(error_msg + stringprep_strerror(rc));
       return "";
     }
-  std::get<0>(cached)->second = std::string(local) + "@" + domain + "/" + resource;
-  return std::get<0>(cached)->second;
+  return std::string(local) + "@" + domain + "/" + resource;
+}
+#endif
 
+std::string jidprep(const std::string& original)
+{
+#ifdef LIBIDN_FOUND
+  if (const std::string* cached = jidprep_cache.get(original))
+    return *cached;
+  // Failures are cached as well, as an empty string
+  std::string res = jidprep_uncached(original);
+  jidprep_cache.put(original, res);
+  return res;
 #else
   (void)original;
   return "";
 #endif
 }
+
+utils::CacheMetrics get_jidprep_cache_metrics()
+{
+#ifdef LIBIDN_FOUND
+  return jidprep_cache.get_metrics();
+#else
+  return {0, 0, 0, 0};
+#endif
+}
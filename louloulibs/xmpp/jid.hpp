@@ -1,8 +1,43 @@
 #pragma once
 
 
+#include <utils/lru_cache.hpp>
+
+#include <experimental/string_view>
 #include <string>
 
+/**
+ * Parse a JID into its different parts, without copying anything: each
+ * part is a view into the given string, which must outlive this object.
+ */
+class JidView
+{
+public:
+  using string_view = std::experimental::string_view;
+
+  explicit JidView(const std::string& jid);
+  explicit JidView(std::string&&) = delete;
+
+  JidView(const JidView&) = delete;
+  JidView(JidView&&) = delete;
+  JidView& operator=(const JidView&) = delete;
+  JidView& operator=(JidView&&) = delete;
+
+  string_view domain;
+  string_view local;
+  string_view resource;
+
+  std::string bare() const
+  {
+    std::string res;
+    res.reserve(this->local.size() + 1 + this->domain.size());
+    res.append(this->local.data(), this->local.size());
+    res += '@';
+    res.append(this->domain.data(), this->domain.size());
+    return res;
+  }
+};
+
 /**
  * Parse a JID into its different subart
  */
@@ -46,4 +81,10 @@ public:
  */
 std::string jidprep(const std::string& original);
 
+/**
+ * The results of jidprep() are kept in a bounded LRU cache. Returns its
+ * hits, misses and evictions counters.
+ */
+utils::CacheMetrics get_jidprep_cache_metrics();
+
 
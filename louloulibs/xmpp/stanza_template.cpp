@@ -0,0 +1,89 @@
+#include <xmpp/stanza_template.hpp>
+#include <xmpp/xmpp_component.hpp>
+#include <xmpp/xmpp_stanza.hpp>
+
+StanzaWriter::StanzaWriter(const std::size_t size_hint)
+{
+  this->data.reserve(size_hint);
+}
+
+StanzaWriter& StanzaWriter::raw(const std::string& xml)
+{
+  this->data += xml;
+  return *this;
+}
+
+StanzaWriter& StanzaWriter::slot(const std::string& value)
+{
+  append_sanitized(this->data, value.data(), value.size());
+  return *this;
+}
+
+std::string StanzaWriter::release()
+{
+  return std::move(this->data);
+}
+
+namespace stanza_template
+{
+std::string muc_message(const std::string& from, const std::string& to,
+                        const std::string& body, const std::string& xhtml)
+{
+  StanzaWriter writer(64 + from.size() + to.size() + body.size() + xhtml.size());
+  writer.raw("<message").attribute("from", from).attribute("to", to)
+    .raw(" type='groupchat'>").text_element("body", body);
+  if (!xhtml.empty())
+    writer.raw("<html xmlns='" XHTMLIM_NS "'>").raw(xhtml).raw("</html>");
+  writer.raw("</message>");
+  return writer.release();
+}
+
+std::string user_join(const std::string& from, const std::string& to,
+                      const std::string& affiliation, const std::string& role,
+                      const std::string& jid, const bool self)
+{
+  StanzaWriter writer(128 + from.size() + to.size() + jid.size());
+  writer.raw("<presence").attribute("from", from).attribute("to", to)
+    .raw("><x xmlns='" MUC_USER_NS "'><item");
+  if (!affiliation.empty())
+    writer.attribute("affiliation", affiliation);
+  if (!jid.empty())
+    writer.attribute("jid", jid);
+  if (!role.empty())
+    writer.attribute("role", role);
+  writer.raw("/>");
+  if (self)
+    writer.raw("<status code='110'/>");
+  writer.raw("</x></presence>");
+  return writer.release();
+}
+
+std::string muc_leave(const std::string& from, const std::string& to,
+                      const std::string& message, const bool self)
+{
+  StanzaWriter writer(128 + from.size() + to.size() + message.size());
+  writer.raw("<presence").attribute("from", from).attribute("to", to)
+    .raw(" type='unavailable'>");
+  if (self)
+    writer.raw("<x xmlns='" MUC_USER_NS "'><status code='110'/></x>");
+  else
+    writer.raw("<x xmlns='" MUC_USER_NS "'/>");
+  if (!message.empty())
+    writer.text_element("status", message);
+  writer.raw("</presence>");
+  return writer.release();
+}
+
+std::string nick_change(const std::string& from, const std::string& to,
+                        const std::string& new_nick, const bool self)
+{
+  StanzaWriter writer(160 + from.size() + to.size() + new_nick.size());
+  writer.raw("<presence").attribute("from", from).attribute("to", to)
+    .raw(" type='unavailable'><x xmlns='" MUC_USER_NS "'><item").attribute("nick", new_nick)
+    .raw("/><status code='303'/>");
+  if (self)
+    writer.raw("<status code='110'/>");
+  writer.raw("</x></presence>");
+  return writer.release();
+}
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <string>
+
+/**
+ * Serialize stanzas whose shape is always the same without building any
+ * XmlNode tree.
+ *
+ * The fixed parts of the stanza are string literals (concatenated with
+ * the namespace macros at compile time, their size being known from their
+ * type), and only the variable parts—the slots—are escaped and appended
+ * at runtime.  The result is byte-identical to what XmlNode::to_string()
+ * gives for the same stanza: attributes must thus be written in
+ * alphabetical order, and an element without any content must be closed
+ * with “/>”.
+ */
+class StanzaWriter
+{
+public:
+  explicit StanzaWriter(const std::size_t size_hint);
+  ~StanzaWriter() = default;
+
+  StanzaWriter(const StanzaWriter&) = delete;
+  StanzaWriter(StanzaWriter&&) = delete;
+  StanzaWriter& operator=(const StanzaWriter&) = delete;
+  StanzaWriter& operator=(StanzaWriter&&) = delete;
+
+  /**
+   * Append a fixed part of the template, as-is.
+   */
+  template <std::size_t N>
+  StanzaWriter& raw(const char (&literal)[N])
+  {
+    this->data.append(literal, N - 1);
+    return *this;
+  }
+  /**
+   * Append some already-serialized XML, as-is.
+   */
+  StanzaWriter& raw(const std::string& xml);
+  /**
+   * Append a slot (an attribute value or some text), escaped.
+   */
+  StanzaWriter& slot(const std::string& value);
+  /**
+   * Append “ name='value'”, with the value escaped.
+   */
+  template <std::size_t N>
+  StanzaWriter& attribute(const char (&name)[N], const std::string& value)
+  {
+    this->data += ' ';
+    this->raw(name);
+    this->data += "='";
+    this->slot(value);
+    this->data += '\'';
+    return *this;
+  }
+  /**
+   * Append <name>text</name>, or <name/> if the text is empty.
+   */
+  template <std::size_t N>
+  StanzaWriter& text_element(const char (&name)[N], const std::string& text)
+  {
+    this->data += '<';
+    this->raw(name);
+    if (text.empty())
+      this->data += "/>";
+    else
+      {
+        this->data += '>';
+        this->slot(text);
+        this->data += "</";
+        this->raw(name);
+        this->data += '>';
+      }
+    return *this;
+  }
+
+  std::string release();
+
+private:
+  std::string data;
+};
+
+/**
+ * The stanzas that we send the most, one for each message or presence
+ * forwarded into a room, to each resource of each user.
+ */
+namespace stanza_template
+{
+/**
+ * A groupchat <message/>, with an optional (already serialized) XHTML-IM
+ * body.
+ */
+std::string muc_message(const std::string& from, const std::string& to,
+                        const std::string& body, const std::string& xhtml);
+/**
+ * The available <presence/> of a room participant.
+ */
+std::string user_join(const std::string& from, const std::string& to,
+                      const std::string& affiliation, const std::string& role,
+                      const std::string& jid, const bool self);
+/**
+ * The unavailable <presence/> of a participant leaving a room.
+ */
+std::string muc_leave(const std::string& from, const std::string& to,
+                      const std::string& message, const bool self);
+/**
+ * The unavailable <presence/> of a participant changing its nick.
+ */
+std::string nick_change(const std::string& from, const std::string& to,
+                        const std::string& new_nick, const bool self);
+}
@@ -4,9 +4,11 @@
 #include <logger/logger.hpp>
 
 #include <xmpp/xmpp_component.hpp>
+#include <network/poller.hpp>
 #include <config/config.hpp>
 #include <utils/time.hpp>
 #include <xmpp/auth.hpp>
+#include <xmpp/stanza_template.hpp>
 #include <xmpp/jid.hpp>
 
 #include <stdexcept>
@@ -42,6 +44,10 @@ XmppComponent::XmppComponent(std::shared_ptr<Poller> poller, const std::string&
   TCPSocketHandler(poller),
   ever_auth(false),
   first_connection_try(true),
+  output_limits{},
+  backpressure_metrics{},
+  dropping_stanzas(false),
+  closing_for_backpressure(false),
   secret(secret),
   authenticated(false),
   doc_open(false),
@@ -49,16 +55,32 @@ XmppComponent::XmppComponent(std::shared_ptr<Poller> poller, const std::string&
   stanza_handlers{},
   adhoc_commands_handler(*this)
 {
+  // Read the limits from the config on the first use
+  this->output_limits.generation = Config::get_generation() - 1;
   this->parser.add_stream_open_callback(std::bind(&XmppComponent::on_remote_stream_open, this,
                                                   std::placeholders::_1));
   this->parser.add_stanza_callback(std::bind(&XmppComponent::on_stanza, this,
                                                   std::placeholders::_1));
   this->parser.add_stream_close_callback(std::bind(&XmppComponent::on_remote_stream_close, this,
                                                   std::placeholders::_1));
-  this->stanza_handlers.emplace("handshake",
-                                std::bind(&XmppComponent::handle_handshake, this,std::placeholders::_1));
-  this->stanza_handlers.emplace("error",
-                                std::bind(&XmppComponent::handle_error, this,std::placeholders::_1));
+  this->set_stanza_handler(StanzaName::handshake,
+                           std::bind(&XmppComponent::handle_handshake, this,std::placeholders::_1));
+  this->set_stanza_handler(StanzaName::error,
+                           std::bind(&XmppComponent::handle_error, this,std::placeholders::_1));
+}
+
+XmppComponent::~XmppComponent()
+{
+  TimedEventsManager::instance().cancel(this->get_pause_timer_name());
+  TimedEventsManager::instance().cancel(this->get_close_timer_name());
+}
+
+std::ostream& operator<<(std::ostream& os, const OutputBackpressureMetrics& metrics)
+{
+  return os << metrics.pauses << " pauses (" << metrics.total_pause.count() << "ms in total, "
+            << metrics.max_pause.count() << "ms at most, " << metrics.pause_timeouts << " too long), "
+            << metrics.dropped_stanzas << " dropped stanzas, " << metrics.disconnections
+            << " disconnections, at most " << metrics.max_out_buf << " bytes waiting";
 }
 
 void XmppComponent::start()
@@ -73,9 +95,150 @@ bool XmppComponent::is_document_open() const
 
 void XmppComponent::send_stanza(const Stanza& stanza)
 {
-  std::string str = stanza.to_string();
+  this->send_serialized_stanza(stanza.to_string());
+}
+
+void XmppComponent::send_serialized_stanza(std::string&& str)
+{
+  if (this->closing_for_backpressure)
+    return;
+  const auto& limits = this->get_output_limits();
+  const bool too_big = limits.max != 0 && this->get_out_buf_size() + str.size() > limits.max;
+  if (too_big && limits.policy == OutputOverflowPolicy::disconnect)
+    {
+      log_error("The XMPP server does not read our stanzas: ", this->get_out_buf_size(),
+                " bytes are waiting to be sent. Closing the connection.");
+      this->closing_for_backpressure = true;
+      TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::now(),
+                                                          [this]() { this->close_for_backpressure(); },
+                                                          this->get_close_timer_name()));
+      return;
+    }
+  if (too_big || this->dropping_stanzas)
+    {
+      if (!this->dropping_stanzas)
+        log_warning("The XMPP server does not read our stanzas: ", this->get_out_buf_size(),
+                    " bytes are waiting to be sent. Dropping the stanzas until it catches up.");
+      this->dropping_stanzas = true;
+      this->backpressure_metrics.dropped_stanzas++;
+      return;
+    }
   log_debug("XMPP SENDING: ", str);
   this->send_data(std::move(str));
+  this->update_backpressure();
+}
+
+const XmppComponent::OutputLimits& XmppComponent::get_output_limits()
+{
+  const auto generation = Config::get_generation();
+  if (this->output_limits.generation != generation)
+    {
+      auto& limits = this->output_limits;
+      limits.generation = generation;
+      limits.high_water = static_cast<std::size_t>(std::max(Config::get_int("xmpp_out_high_water", 4 * 1024 * 1024), 0));
+      limits.low_water = std::min(static_cast<std::size_t>(std::max(Config::get_int("xmpp_out_low_water", 1024 * 1024), 0)),
+                                  limits.high_water);
+      limits.max = static_cast<std::size_t>(std::max(Config::get_int("xmpp_out_max", 64 * 1024 * 1024), 0));
+      limits.max_pause = std::chrono::seconds(std::max(Config::get_int("xmpp_out_max_pause", 30), 0));
+      const auto policy = Config::get("xmpp_out_max_policy", "drop");
+      if (policy == "disconnect")
+        limits.policy = OutputOverflowPolicy::disconnect;
+      else
+        {
+          if (policy != "drop")
+            log_warning("Invalid value for xmpp_out_max_policy: ", policy, ". Using drop instead.");
+          limits.policy = OutputOverflowPolicy::drop;
+        }
+    }
+  return this->output_limits;
+}
+
+void XmppComponent::update_backpressure()
+{
+  const auto& limits = this->get_output_limits();
+  const auto size = this->get_out_buf_size();
+  this->backpressure_metrics.max_out_buf = std::max(this->backpressure_metrics.max_out_buf, size);
+  if (this->dropping_stanzas && size <= limits.low_water)
+    {
+      this->dropping_stanzas = false;
+      log_info("The XMPP server caught up, not dropping stanzas anymore: ", this->backpressure_metrics);
+    }
+  if (!this->poller->is_receiving_paused())
+    {
+      // Pausing again would only lead to another timeout
+      if (limits.high_water != 0 && size >= limits.high_water && !this->dropping_stanzas)
+        {
+          log_warning("The XMPP server does not read our stanzas fast enough: ", size,
+                      " bytes are waiting to be sent. Not reading from the IRC servers until it catches up.");
+          this->poller->pause_receiving();
+          this->pause_start = std::chrono::steady_clock::now();
+          this->backpressure_metrics.pauses++;
+          if (limits.max_pause.count() > 0)
+            TimedEventsManager::instance().add_event(TimedEvent(this->pause_start + limits.max_pause,
+                                                                [this]() { this->on_pause_timeout(); },
+                                                                this->get_pause_timer_name()));
+        }
+    }
+  else if (limits.high_water == 0 || size <= limits.low_water)
+    this->resume_receiving();
+}
+
+void XmppComponent::resume_receiving()
+{
+  if (!this->poller->is_receiving_paused())
+    return;
+  TimedEventsManager::instance().cancel(this->get_pause_timer_name());
+  this->poller->resume_receiving();
+  const auto pause = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                           this->pause_start);
+  this->backpressure_metrics.total_pause += pause;
+  this->backpressure_metrics.max_pause = std::max(this->backpressure_metrics.max_pause, pause);
+  log_info("Reading from the IRC servers again, after a pause of ", pause.count(), "ms: ",
+           this->backpressure_metrics);
+}
+
+void XmppComponent::on_pause_timeout()
+{
+  if (!this->poller->is_receiving_paused())
+    return;
+  const auto& limits = this->get_output_limits();
+  this->backpressure_metrics.pause_timeouts++;
+  if (limits.policy == OutputOverflowPolicy::disconnect)
+    {
+      log_error("The XMPP server did not read our stanzas for ", limits.max_pause.count(), "s: ",
+                this->get_out_buf_size(), " bytes are waiting to be sent. Closing the connection.");
+      this->close_for_backpressure();
+    }
+  else
+    {
+      log_warning("The XMPP server did not read our stanzas for ", limits.max_pause.count(), "s: ",
+                  this->get_out_buf_size(), " bytes are waiting to be sent. Reading from the IRC servers "
+                  "again, and dropping the stanzas until it catches up.");
+      this->dropping_stanzas = true;
+      this->resume_receiving();
+    }
+}
+
+std::string XmppComponent::get_pause_timer_name() const
+{
+  return "xmpp_out_pause"s + std::to_string(reinterpret_cast<std::uintptr_t>(this));
+}
+
+void XmppComponent::close_for_backpressure()
+{
+  this->backpressure_metrics.disconnections++;
+  this->on_connection_close("Too much data waiting to be sent");
+  this->close();
+}
+
+std::string XmppComponent::get_close_timer_name() const
+{
+  return "xmpp_out_close"s + std::to_string(reinterpret_cast<std::uintptr_t>(this));
+}
+
+void XmppComponent::on_data_sent()
+{
+  this->update_backpressure();
 }
 
 void XmppComponent::on_connection_failed(const std::string& reason)
@@ -107,6 +270,12 @@ void XmppComponent::on_connection_close(const std::string& error)
     log_info("XMPP server closed connection");
   else
     log_info("XMPP server closed connection: ", error);
+  // What is waiting in the buffer will never be sent: do not keep the
+  // other sockets paused until we are connected again
+  this->resume_receiving();
+  this->dropping_stanzas = false;
+  this->closing_for_backpressure = false;
+  TimedEventsManager::instance().cancel(this->get_close_timer_name());
 }
 
 void XmppComponent::parse_in_buffer(const size_t size)
@@ -157,17 +326,46 @@ void XmppComponent::reset()
 void XmppComponent::on_stanza(const Stanza& stanza)
 {
   log_debug("XMPP RECEIVING: ", stanza.to_string());
-  std::function<void(const Stanza&)> handler;
-  try
-    {
-      handler = this->stanza_handlers.at(stanza.get_name());
-    }
-  catch (const std::out_of_range& exception)
+  const StanzaName name = to_stanza_name(stanza.get_name());
+  if (name == StanzaName::unknown || !this->stanza_handlers[static_cast<std::size_t>(name)])
     {
       log_warning("No handler for stanza of type ", stanza.get_name());
       return;
     }
-  handler(stanza);
+  this->stanza_handlers[static_cast<std::size_t>(name)](stanza);
+}
+
+void XmppComponent::set_stanza_handler(const StanzaName name, stanza_handler_t&& handler)
+{
+  this->stanza_handlers[static_cast<std::size_t>(name)] = std::move(handler);
+}
+
+StanzaName to_stanza_name(const std::string& name)
+{
+  switch (name.size())
+    {
+    case 2:
+      if (name == "iq")
+        return StanzaName::iq;
+      break;
+    case 5:
+      if (name == "error")
+        return StanzaName::error;
+      break;
+    case 7:
+      if (name == "message")
+        return StanzaName::message;
+      break;
+    case 8:
+      if (name == "presence")
+        return StanzaName::presence;
+      break;
+    case 9:
+      if (name == "handshake")
+        return StanzaName::handshake;
+      break;
+    }
+  return StanzaName::unknown;
 }
 
 void XmppComponent::send_stream_error(const std::string& name, const std::string& explanation)
@@ -226,6 +424,7 @@ void XmppComponent::handle_handshake(const Stanza&)
 {
   this->authenticated = true;
   this->ever_auth = true;
+  this->authentication_time = std::chrono::steady_clock::now();
   log_info("Authenticated with the XMPP server");
 #ifdef SYSTEMD_FOUND
   sd_notify(0, "READY=1");
@@ -261,7 +460,7 @@ void* XmppComponent::get_receive_buffer(const size_t size) const
   return this->parser.get_buffer(size);
 }
 
-void XmppComponent::send_message(const std::string& from, Xmpp::body&& body, const std::string& to,
+void XmppComponent::send_message(const std::string& from, const Xmpp::body& body, const std::string& to,
                                  const std::string& type, const bool fulljid, const bool nocopy)
 {
   XmlNode node("message");
@@ -275,12 +474,12 @@ void XmppComponent::send_message(const std::string& from, Xmpp::body&& body, con
   XmlNode body_node("body");
   body_node.set_inner(std::get<0>(body));
   node.add_child(std::move(body_node));
-  if (std::get<1>(body))
+  if (!std::get<1>(body).empty())
     {
       XmlNode html("html");
       html["xmlns"] = XHTMLIM_NS;
-      // Pass the ownership of the pointer to this xmlnode
-      html.add_child(std::move(std::get<1>(body)));
+      // The XHTML-IM body is already serialized
+      html.set_raw_inner(std::string(std::get<1>(body)));
       node.add_child(std::move(html));
     }
 
@@ -306,34 +505,11 @@ void XmppComponent::send_user_join(const std::string& from,
                                    const std::string& to,
                                    const bool self)
 {
-  XmlNode node("presence");
-  node["to"] = to;
-  node["from"] = from + "@" + this->served_hostname + "/" + nick;
-
-  XmlNode x("x");
-  x["xmlns"] = MUC_USER_NS;
-
-  XmlNode item("item");
-  if (!affiliation.empty())
-    item["affiliation"] = affiliation;
-  if (!role.empty())
-    item["role"] = role;
+  std::string preped_jid;
   if (!realjid.empty())
-    {
-      const std::string preped_jid = jidprep(realjid);
-      if (!preped_jid.empty())
-        item["jid"] = preped_jid;
-    }
-  x.add_child(std::move(item));
-
-  if (self)
-    {
-      XmlNode status("status");
-      status["code"] = "110";
-      x.add_child(std::move(status));
-    }
-  node.add_child(std::move(x));
-  this->send_stanza(node);
+    preped_jid = jidprep(realjid);
+  this->send_serialized_stanza(stanza_template::user_join(from + "@" + this->served_hostname + "/" + nick, to,
+                                                          affiliation, role, preped_jid, self));
 }
 
 void XmppComponent::send_invalid_room_error(const std::string& muc_name,
@@ -407,27 +583,14 @@ void XmppComponent::send_topic(const std::string& from, Xmpp::body&& topic, cons
   this->send_stanza(message);
 }
 
-void XmppComponent::send_muc_message(const std::string& muc_name, const std::string& nick, Xmpp::body&& xmpp_body, const std::string& jid_to)
+void XmppComponent::send_muc_message(const std::string& muc_name, const std::string& nick, const Xmpp::body& xmpp_body, const std::string& jid_to)
 {
-  Stanza message("message");
-  message["to"] = jid_to;
+  std::string from = muc_name + "@" + this->served_hostname;
   if (!nick.empty())
-    message["from"] = muc_name + "@" + this->served_hostname + "/" + nick;
-  else // Message from the room itself
-    message["from"] = muc_name + "@" + this->served_hostname;
-  message["type"] = "groupchat";
-  XmlNode body("body");
-  body.set_inner(std::get<0>(xmpp_body));
-  message.add_child(std::move(body));
-  if (std::get<1>(xmpp_body))
-    {
-      XmlNode html("html");
-      html["xmlns"] = XHTMLIM_NS;
-      // Pass the ownership of the pointer to this xmlnode
-      html.add_child(std::move(std::get<1>(xmpp_body)));
-      message.add_child(std::move(html));
-    }
-  this->send_stanza(message);
+    from += "/" + nick;
+  // else, message from the room itself
+  this->send_serialized_stanza(stanza_template::muc_message(from, jid_to, std::get<0>(xmpp_body),
+                                                            std::get<1>(xmpp_body)));
 }
 
 void XmppComponent::send_history_message(const std::string& muc_name, const std::string& nick, const std::string& body_txt, const std::string& jid_to, std::time_t timestamp)
@@ -455,27 +618,8 @@ void XmppComponent::send_history_message(const std::string& muc_name, const std:
 
 void XmppComponent::send_muc_leave(const std::string& muc_name, std::string&& nick, Xmpp::body&& message, const std::string& jid_to, const bool self)
 {
-  Stanza presence("presence");
-  presence["to"] = jid_to;
-  presence["from"] = muc_name + "@" + this->served_hostname + "/" + nick;
-  presence["type"] = "unavailable";
-  const std::string message_str = std::get<0>(message);
-  XmlNode x("x");
-  x["xmlns"] = MUC_USER_NS;
-  if (self)
-    {
-      XmlNode status("status");
-      status["code"] = "110";
-      x.add_child(std::move(status));
-    }
-  presence.add_child(std::move(x));
-  if (!message_str.empty())
-    {
-      XmlNode status("status");
-      status.set_inner(message_str);
-      presence.add_child(std::move(status));
-    }
-  this->send_stanza(presence);
+  this->send_serialized_stanza(stanza_template::muc_leave(muc_name + "@" + this->served_hostname + "/" + nick,
+                                                          jid_to, std::get<0>(message), self));
 }
 
 void XmppComponent::send_nick_change(const std::string& muc_name,
@@ -486,26 +630,8 @@ void XmppComponent::send_nick_change(const std::string& muc_name,
                                      const std::string& jid_to,
                                      const bool self)
 {
-  Stanza presence("presence");
-  presence["to"] = jid_to;
-  presence["from"] = muc_name + "@" + this->served_hostname + "/" + old_nick;
-  presence["type"] = "unavailable";
-  XmlNode x("x");
-  x["xmlns"] = MUC_USER_NS;
-  XmlNode item("item");
-  item["nick"] = new_nick;
-  x.add_child(std::move(item));
-  XmlNode status("status");
-  status["code"] = "303";
-  x.add_child(std::move(status));
-  if (self)
-    {
-      XmlNode status2("status");
-      status2["code"] = "110";
-      x.add_child(std::move(status2));
-    }
-  presence.add_child(std::move(x));
-  this->send_stanza(presence);
+  this->send_serialized_stanza(stanza_template::nick_change(muc_name + "@" + this->served_hostname + "/" + old_nick,
+                                                            jid_to, new_nick, self));
 
   this->send_user_join(muc_name, new_nick, "", affiliation, role, jid_to, self);
 }
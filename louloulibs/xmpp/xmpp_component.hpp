@@ -7,7 +7,12 @@
 #include <xmpp/body.hpp>
 
 #include <unordered_map>
+#include <functional>
 #include <memory>
+#include <cstdint>
+#include <ostream>
+#include <chrono>
+#include <array>
 #include <string>
 #include <ctime>
 #include <map>
@@ -20,6 +25,7 @@
 #define DISCO_NS         "http://jabber.org/protocol/disco"
 #define DISCO_ITEMS_NS   DISCO_NS"#items"
 #define DISCO_INFO_NS    DISCO_NS"#info"
+#define CAPS_NS          "http://jabber.org/protocol/caps"
 #define XHTMLIM_NS       "http://jabber.org/protocol/xhtml-im"
 #define STANZA_NS        "urn:ietf:params:xml:ns:xmpp-stanzas"
 #define STREAMS_NS       "urn:ietf:params:xml:ns:xmpp-streams"
@@ -36,6 +42,72 @@
 #define RSM_NS           "http://jabber.org/protocol/rsm"
 #define MUC_TRAFFIC_NS   "http://jabber.org/protocol/muc#traffic"
 
+/**
+ * The names of the top-level elements that a component can handle.  The
+ * name of each received stanza is interned into this enum, and the
+ * handler is then found with a simple index in an array.
+ */
+enum class StanzaName
+{
+  handshake,
+  error,
+  presence,
+  message,
+  iq,
+  unknown,
+};
+
+constexpr std::size_t stanza_names_count = static_cast<std::size_t>(StanzaName::unknown);
+
+/**
+ * Returns StanzaName::unknown if we do not know that name.
+ */
+StanzaName to_stanza_name(const std::string& name);
+
+using stanza_handler_t = std::function<void(const Stanza&)>;
+
+/**
+ * What is done with a stanza that would make the output buffer exceed
+ * its maximum size, or once the reading from the other sockets was paused
+ * for too long.
+ */
+enum class OutputOverflowPolicy
+{
+  /**
+   * The stanza is dropped.
+   */
+  drop,
+  /**
+   * The connection to the XMPP server is closed (and thus the whole
+   * buffer dropped), to connect again.
+   */
+  disconnect,
+};
+
+struct OutputBackpressureMetrics
+{
+  /**
+   * How many times, and how long, the reading from the other sockets was
+   * paused because the XMPP server did not read our stanzas fast enough.
+   */
+  std::uint64_t pauses{0};
+  std::chrono::milliseconds total_pause{0};
+  std::chrono::milliseconds max_pause{0};
+  std::size_t max_out_buf{0};
+  std::uint64_t dropped_stanzas{0};
+  std::uint64_t disconnections{0};
+  /**
+   * The pauses that lasted too long, and were ended by the overflow
+   * policy.
+   */
+  std::uint64_t pause_timeouts{0};
+};
+
+/**
+ * Write these metrics on one line, for the logs.
+ */
+std::ostream& operator<<(std::ostream& os, const OutputBackpressureMetrics& metrics);
+
 /**
  * An XMPP component, communicating with an XMPP server using the protocole
  * described in XEP-0114: Jabber Component Protocol
@@ -46,7 +118,7 @@ class XmppComponent: public TCPSocketHandler
 {
 public:
   explicit XmppComponent(std::shared_ptr<Poller> poller, const std::string& hostname, const std::string& secret);
-  virtual ~XmppComponent() = default;
+  virtual ~XmppComponent();
 
   XmppComponent(const XmppComponent&) = delete;
   XmppComponent(XmppComponent&&) = delete;
@@ -76,6 +148,10 @@ public:
    * server.
    */
   void send_stanza(const Stanza& stanza);
+  /**
+   * Send an already-serialized stanza
+   */
+  void send_serialized_stanza(std::string&& str);
   /**
    * Handle the opening of the remote stream
    */
@@ -111,7 +187,7 @@ public:
    * If fulljid is false, the provided 'from' doesn't contain the
    * server-part of the JID and must be added.
    */
-  void send_message(const std::string& from, Xmpp::body&& body, const std::string& to,
+  void send_message(const std::string& from, const Xmpp::body& body, const std::string& to,
                     const std::string& type, const bool fulljid, const bool nocopy=false);
   /**
    * Send a join from a new participant
@@ -142,7 +218,7 @@ public:
   /**
    * Send a (non-private) message to the MUC
    */
-  void send_muc_message(const std::string& muc_name, const std::string& nick, Xmpp::body&& body, const std::string& jid_to);
+  void send_muc_message(const std::string& muc_name, const std::string& nick, const Xmpp::body& body, const std::string& jid_to);
   /**
    * Send a message, with a <delay/> element, part of a MUC history
    */
@@ -218,6 +294,11 @@ public:
   void handle_error(const Stanza& stanza);
 
   virtual void after_handshake() {}
+  /**
+   * When the last successful handshake with the XMPP server happened.
+   */
+  std::chrono::steady_clock::time_point get_authentication_time() const
+  { return this->authentication_time; }
 
   const std::string& get_served_hostname() const
   { return this->served_hostname; }
@@ -239,18 +320,74 @@ private:
    * it, and avoiding some unnecessary copy.
    */
   void* get_receive_buffer(const size_t size) const override final;
+  /**
+   * Stop reading from the sockets that allow it once the data waiting to
+   * be sent to the XMPP server reaches the high-water mark, and start
+   * again once it is down to the low-water mark.
+   */
+  void update_backpressure();
+  void resume_receiving();
+  /**
+   * The reading was paused for longer than the limit: the IRC servers
+   * would soon disconnect the users for not answering their PINGs.  Read
+   * again, and apply the overflow policy to the stanzas that do not fit.
+   */
+  void on_pause_timeout();
+  std::string get_pause_timer_name() const;
+  /**
+   * Close the connection because the XMPP server does not read our
+   * stanzas.  When that is found while sending a stanza, the callers are
+   * still running: it is done from a timed event instead.
+   */
+  void close_for_backpressure();
+  std::string get_close_timer_name() const;
+  void on_data_sent() override final;
+
+  struct OutputLimits
+  {
+    unsigned long generation;
+    std::size_t high_water;
+    std::size_t low_water;
+    std::size_t max;
+    OutputOverflowPolicy policy;
+    std::chrono::seconds max_pause;
+  };
+  /**
+   * The limits of the output buffer, read again from the configuration
+   * when it changes.
+   */
+  const OutputLimits& get_output_limits();
+  OutputLimits output_limits;
+  OutputBackpressureMetrics backpressure_metrics;
+  std::chrono::steady_clock::time_point pause_start;
+  /**
+   * Whether stanzas are being dropped, until the buffer is down to the
+   * low-water mark.
+   */
+  bool dropping_stanzas;
+  /**
+   * Whether the connection is going to be closed by
+   * close_for_backpressure(): the stanzas are discarded until then.
+   */
+  bool closing_for_backpressure;
   XmppParser parser;
   std::string stream_id;
   std::string secret;
   bool authenticated;
+  std::chrono::steady_clock::time_point authentication_time;
   /**
    * Whether or not OUR XMPP document is open
    */
   bool doc_open;
 protected:
+  /**
+   * Call the given handler for each received stanza with that name.
+   */
+  void set_stanza_handler(const StanzaName name, stanza_handler_t&& handler);
+
   std::string served_hostname;
 
-  std::unordered_map<std::string, std::function<void(const Stanza&)>> stanza_handlers;
+  std::array<stanza_handler_t, stanza_names_count> stanza_handlers;
   AdhocCommandsHandler adhoc_commands_handler;
 };
 
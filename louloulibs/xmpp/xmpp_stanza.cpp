@@ -48,6 +48,43 @@ std::string sanitize(const std::string& data, const std::string& encoding)
     return xml_escape(utils::remove_invalid_xml_chars(utils::convert_to_utf8(data, encoding.data())));
 }
 
+void append_sanitized(std::string& out, const char* data, const std::size_t size)
+{
+  for (std::size_t pos = 0; pos != size; ++pos)
+    {
+      const char c = data[pos];
+      switch (c)
+        {
+        case '&':
+          out += "&amp;";
+          break;
+        case '<':
+          out += "&lt;";
+          break;
+        case '>':
+          out += "&gt;";
+          break;
+        case '\"':
+          out += "&quot;";
+          break;
+        case '\'':
+          out += "&apos;";
+          break;
+        default:
+          if (c >= 0x20 && c < 0x7F)
+            out += c;
+          else
+            {
+              // Control chars and non-ASCII: let sanitize() validate and
+              // convert the rest of the string.  Since everything before
+              // was ASCII, this gives the same result as for the whole data
+              out += sanitize({data + pos, size - pos});
+              return;
+            }
+        }
+    }
+}
+
 XmlNode::XmlNode(const std::string& name, XmlNode* parent):
   parent(parent)
 {
@@ -97,6 +134,11 @@ void XmlNode::add_to_inner(const std::string& data)
   this->inner += data;
 }
 
+void XmlNode::set_raw_inner(std::string&& xml)
+{
+  this->raw_inner = std::move(xml);
+}
+
 std::string XmlNode::get_inner() const
 {
   return this->inner;
@@ -168,7 +210,7 @@ void XmlNode::set_name(std::string&& name)
   this->name = std::move(name);
 }
 
-const std::string XmlNode::get_name() const
+const std::string& XmlNode::get_name() const
 {
   return this->name;
 }
@@ -179,11 +221,11 @@ std::string XmlNode::to_string() const
   res << "<" << this->name;
   for (const auto& it: this->attributes)
     res << " " << it.first << "='" << sanitize(it.second) + "'";
-  if (!this->has_children() && this->inner.empty())
+  if (!this->has_children() && this->inner.empty() && this->raw_inner.empty())
     res << "/>";
   else
     {
-      res << ">" + sanitize(this->inner);
+      res << ">" + sanitize(this->inner) << this->raw_inner;
       for (const auto& child: this->children)
         res << child->to_string();
       res << "</" << this->get_name() << ">";
@@ -9,6 +9,11 @@
 std::string xml_escape(const std::string& data);
 std::string xml_unescape(const std::string& data);
 std::string sanitize(const std::string& data, const std::string& encoding = "ISO-8859-1");
+/**
+ * Append sanitize(std::string(data, size)) to out. No temporary string is
+ * created as long as the data only contains printable ASCII chars.
+ */
+void append_sanitized(std::string& out, const char* data, const std::size_t size);
 
 /**
  * Represent an XML node. It has
@@ -35,6 +40,7 @@ public:
     attributes(node.attributes),
     children{},
     inner(node.inner),
+    raw_inner(node.raw_inner),
     tail(node.tail)
   {
     for (const auto& child: node.children)
@@ -68,6 +74,12 @@ public:
    * described in add_to_tail comment.
    */
   void add_to_inner(const std::string& data);
+  /**
+   * Set some already-serialized XML that is written verbatim, without any
+   * escaping, right after the inner text when the node is serialized.  The
+   * caller is responsible for its well-formedness.
+   */
+  void set_raw_inner(std::string&& xml);
   /**
    * Get the content of inner
    */
@@ -100,7 +112,7 @@ public:
   XmlNode* get_parent() const;
   void set_name(const std::string& name);
   void set_name(std::string&& name);
-  const std::string get_name() const;
+  const std::string& get_name() const;
   /**
    * Serialize the stanza into a string
    */
@@ -131,6 +143,7 @@ private:
   std::map<std::string, std::string> attributes;
   std::vector<std::unique_ptr<XmlNode>> children;
   std::string inner;
+  std::string raw_inner;
   std::string tail;
 };
 
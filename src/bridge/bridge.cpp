@@ -2,13 +2,17 @@
 #include <xmpp/biboumi_component.hpp>
 #include <network/poller.hpp>
 #include <utils/empty_if_fixed_server.hpp>
+#include <utils/config_snapshot.hpp>
 #include <utils/encoding.hpp>
 #include <utils/tolower.hpp>
 #include <logger/logger.hpp>
 #include <utils/revstr.hpp>
 #include <utils/split.hpp>
+#include <utils/time.hpp>
 #include <xmpp/jid.hpp>
 #include <database/database.hpp>
+#include <utils/history_writer.hpp>
+#include <utils/recent_history.hpp>
 #include "result_set_management.hpp"
 #include <algorithm>
 
@@ -86,7 +90,7 @@ void Bridge::clean()
   {
     IrcClient* client = it->second.get();
     if (!client->is_connected() && !client->is_connecting() &&
-        !client->get_resolver().is_resolving())
+        !client->is_waiting_to_connect() && !client->get_resolver().is_resolving())
       it = this->irc_clients.erase(it);
     else
       ++it;
@@ -98,81 +102,88 @@ const std::string& Bridge::get_jid() const
   return this->user_jid;
 }
 
+bool Bridge::is_rejoining() const
+{
+  return std::chrono::steady_clock::now() - this->xmpp.get_authentication_time() < std::chrono::seconds(60);
+}
+
+bool Bridge::is_irc_send_queue_full(const std::string& hostname) const
+{
+  const IrcClient* irc = this->find_irc_client(hostname);
+  return irc && irc->is_send_queue_full();
+}
+
 std::string Bridge::get_bare_jid() const
 {
-  Jid jid(this->user_jid);
-  return jid.local + "@" + jid.domain;
+  return JidView(this->user_jid).bare();
 }
 
-Xmpp::body Bridge::make_xmpp_body(const std::string& str, const std::string& encoding)
+Xmpp::body Bridge::make_xmpp_body(const std::string& str, const std::string& encoding, const bool xhtml)
 {
   std::string res;
   if (utils::is_valid_utf8(str.c_str()))
     res = str;
   else
     res = utils::convert_to_utf8(str, encoding.data());
-  return irc_format_to_xhtmlim(res);
+  if (!xhtml)
+    return std::make_tuple(remove_irc_format(res), std::string{});
+  std::string body;
+  std::string xhtml_body;
+  irc_format_to_serialized_xhtmlim(res, body, xhtml_body);
+  return std::make_tuple(std::move(body), std::move(xhtml_body));
 }
 
 IrcClient* Bridge::make_irc_client(const std::string& hostname, const std::string& nickname)
 {
-  try
-    {
-      return this->irc_clients.at(hostname).get();
-    }
-  catch (const std::out_of_range& exception)
+  const auto it = this->irc_clients.find(hostname);
+  if (it != this->irc_clients.end())
+    return it->second.get();
+
+  auto username = nickname;
+  auto realname = nickname;
+  Jid jid(this->user_jid);
+  if (get_config_snapshot()->realname_from_jid)
     {
-      auto username = nickname;
-      auto realname = nickname;
-      Jid jid(this->user_jid);
-      if (Config::get("realname_from_jid", "false") == "true")
-        {
-          username = jid.local;
-          realname = this->get_bare_jid();
-        }
-      this->irc_clients.emplace(hostname,
-                                std::make_shared<IrcClient>(this->poller, hostname,
-                                                            nickname, username,
-                                                            realname, jid.domain,
-                                                            *this));
-      std::shared_ptr<IrcClient> irc = this->irc_clients.at(hostname);
-      return irc.get();
+      username = jid.local;
+      realname = this->get_bare_jid();
     }
+  const auto res = this->irc_clients.emplace(hostname,
+                                             std::make_shared<IrcClient>(this->poller, hostname,
+                                                                         nickname, username,
+                                                                         realname, jid.domain,
+                                                                         *this));
+  return res.first->second.get();
 }
 
 IrcClient* Bridge::get_irc_client(const std::string& hostname)
 {
-  try
-    {
-      return this->irc_clients.at(hostname).get();
-    }
-  catch (const std::out_of_range& exception)
-    {
-      throw IRCNotConnected(hostname);
-    }
+  IrcClient* irc = this->find_irc_client(hostname);
+  if (!irc)
+    throw IRCNotConnected(hostname);
+  return irc;
 }
 
 IrcClient* Bridge::find_irc_client(const std::string& hostname) const
 {
-  try
-    {
-      return this->irc_clients.at(hostname).get();
-    }
-  catch (const std::out_of_range& exception)
-    {
-      return nullptr;
-    }
+  const auto it = this->irc_clients.find(hostname);
+  if (it == this->irc_clients.end())
+    return nullptr;
+  return it->second.get();
 }
 
 bool Bridge::join_irc_channel(const Iid& iid, const std::string& nickname, const std::string& password,
-                              const std::string& resource)
+                              const std::string& resource, const HistoryLimit& history_limit)
 {
   const auto hostname = iid.get_server();
   IrcClient* irc = this->make_irc_client(hostname, nickname);
   this->add_resource_to_server(hostname, resource);
   auto res_in_chan = this->is_resource_in_chan(ChannelKey{iid.get_local(), hostname}, resource);
   if (!res_in_chan)
-    this->add_resource_to_chan(ChannelKey{iid.get_local(), hostname}, resource);
+    {
+      this->add_resource_to_chan(ChannelKey{iid.get_local(), hostname}, resource);
+      // Used once the join is complete
+      this->history_limits[std::make_tuple(iid.get_local(), hostname, resource)] = history_limit;
+    }
   if (iid.get_local().empty())
     { // Join the dummy channel
       if (irc->is_welcomed())
@@ -201,6 +212,7 @@ bool Bridge::join_irc_channel(const Iid& iid, const std::string& nickname, const
       return true;
     } else if (!res_in_chan) {
       this->generate_channel_join_for_resource(iid, resource);
+      this->send_room_history(hostname, iid.get_local(), resource);
     }
   return false;
 }
@@ -244,9 +256,13 @@ void Bridge::send_channel_message(const Iid& iid, const std::string& body)
       else
         irc->send_channel_message(iid.get_local(), line);
 
-      for (const auto& resource: this->resources_in_chan[iid.to_tuple()])
+      const auto& resources = this->resources_in_chan[iid.to_tuple()];
+      const auto xmpp_body = this->make_xmpp_body(line, "ISO-8859-1", this->any_resource_wants_xhtml(resources));
+      std::unique_ptr<Xmpp::body> plain_body;
+      for (const auto& resource: resources)
         this->xmpp.send_muc_message(std::to_string(iid), irc->get_own_nick(),
-                                    this->make_xmpp_body(line), this->user_jid + "/" + resource);
+                                    this->xmpp_body_for(xmpp_body, plain_body, resource), this->user_jid + "/" + resource);
+      this->record_muc_line(iid, irc->get_own_nick(), std::get<0>(xmpp_body));
     }
 }
 
@@ -740,12 +756,16 @@ void Bridge::send_message(const Iid& iid, const std::string& nick, const std::st
   const auto encoding = in_encoding_for(*this, iid);
   if (muc)
     {
-      for (const auto& resource: this->resources_in_chan[iid.to_tuple()])
+      const auto& resources = this->resources_in_chan[iid.to_tuple()];
+      const auto xmpp_body = this->make_xmpp_body(body, encoding, this->any_resource_wants_xhtml(resources));
+      std::unique_ptr<Xmpp::body> plain_body;
+      for (const auto& resource: resources)
         {
           this->xmpp.send_muc_message(std::to_string(iid), nick,
-                                      this->make_xmpp_body(body, encoding), this->user_jid + "/" + resource);
+                                      this->xmpp_body_for(xmpp_body, plain_body, resource), this->user_jid + "/" + resource);
 
         }
+      this->record_muc_line(iid, nick, std::get<0>(xmpp_body));
     }
   else
     {
@@ -754,14 +774,20 @@ void Bridge::send_message(const Iid& iid, const std::string& nick, const std::st
       if (it != this->preferred_user_from.end())
         {
           const auto chan_name = Iid(Jid(it->second).local, {}).get_local();
-          for (const auto& resource: this->resources_in_chan[ChannelKey{chan_name, iid.get_server()}])
-            this->xmpp.send_message(it->second, this->make_xmpp_body(body, encoding),
+          const auto& resources = this->resources_in_chan[ChannelKey{chan_name, iid.get_server()}];
+          const auto xmpp_body = this->make_xmpp_body(body, encoding, this->any_resource_wants_xhtml(resources));
+          std::unique_ptr<Xmpp::body> plain_body;
+          for (const auto& resource: resources)
+            this->xmpp.send_message(it->second, this->xmpp_body_for(xmpp_body, plain_body, resource),
                                     this->user_jid + "/" + resource, "chat", true, true);
         }
       else
         {
-          for (const auto& resource: this->resources_in_server[iid.get_server()])
-            this->xmpp.send_message(std::to_string(iid), this->make_xmpp_body(body, encoding),
+          const auto& resources = this->resources_in_server[iid.get_server()];
+          const auto xmpp_body = this->make_xmpp_body(body, encoding, this->any_resource_wants_xhtml(resources));
+          std::unique_ptr<Xmpp::body> plain_body;
+          for (const auto& resource: resources)
+            this->xmpp.send_message(std::to_string(iid), this->xmpp_body_for(xmpp_body, plain_body, resource),
                                     this->user_jid + "/" + resource, "chat", false, true);
         }
     }
@@ -784,6 +810,8 @@ void Bridge::send_muc_leave(Iid&& iid, std::string&& nick, const std::string& me
     for (const auto& res: this->resources_in_chan[iid.to_tuple()])
       this->xmpp.send_muc_leave(std::to_string(iid), std::move(nick), this->make_xmpp_body(message),
                                 this->user_jid + "/" + res, self);
+  if (self && resource.empty())
+    this->close_history_range(iid.get_server(), iid.get_local());
   IrcClient* irc = this->find_irc_client(iid.get_server());
   if (irc && irc->number_of_joined_channels() == 0)
     irc->send_quit_command("");
@@ -818,9 +846,12 @@ void Bridge::send_xmpp_message(const std::string& from, const std::string& autho
     body = msg;
 
   const auto encoding = in_encoding_for(*this, {from, this});
-  for (const auto& resource: this->resources_in_server[from])
+  const auto& resources = this->resources_in_server[from];
+  const auto xmpp_body = this->make_xmpp_body(body, encoding, this->any_resource_wants_xhtml(resources));
+  std::unique_ptr<Xmpp::body> plain_body;
+  for (const auto& resource: resources)
     {
-      this->xmpp.send_message(from, this->make_xmpp_body(body, encoding), this->user_jid + "/" + resource, "chat", false, false);
+      this->xmpp.send_message(from, this->xmpp_body_for(xmpp_body, plain_body, resource), this->user_jid + "/" + resource, "chat", false, false);
     }
 }
 
@@ -828,6 +859,8 @@ void Bridge::send_user_join(const std::string& hostname, const std::string& chan
                             const IrcUser* user, const char user_mode, const bool self)
 {
   const auto resources = this->resources_in_chan[ChannelKey{chan_name, hostname}];
+  if (self)
+    this->open_history_range(hostname, chan_name);
   if (self && resources.empty())
     { // This was a forced join: no client ever asked to join this room,
       // but the server tells us we are in that room anyway.  XMPP can’t
@@ -880,6 +913,97 @@ void Bridge::send_topic(const std::string& hostname, const std::string& chan_nam
 
 void Bridge::send_room_history(const std::string& hostname, const std::string& chan_name)
 {
+  for (const auto& resource: this->resources_in_chan[ChannelKey{chan_name, hostname}])
+    this->send_room_history(hostname, chan_name, resource);
+}
+
+void Bridge::send_room_history(const std::string& hostname, const std::string& chan_name,
+                               const std::string& resource)
+{
+  HistoryLimit history_limit;
+  const auto it = this->history_limits.find(std::make_tuple(chan_name, hostname, resource));
+  if (it != this->history_limits.end())
+    {
+      history_limit = it->second;
+      this->history_limits.erase(it);
+    }
+  int max_lines = history_limit.stanzas;
+  if (max_lines < 0)
+    {
+#ifdef USE_DATABASE
+      max_lines = Database::get_irc_channel_options_with_server_and_global_default(this->user_jid, hostname, chan_name)
+                    .maxHistoryLength.value();
+#else
+      max_lines = 20;
+#endif
+    }
+  std::chrono::system_clock::time_point since;
+  if (history_limit.seconds >= 0)
+    since = std::chrono::system_clock::now() - std::chrono::seconds(history_limit.seconds);
+
+  std::string encoded_chan_name(chan_name);
+  xep0106::encode(encoded_chan_name);
+  const auto muc_name = encoded_chan_name + utils::empty_if_fixed_server("%" + hostname);
+  const auto to = this->user_jid + "/" + resource;
+  std::vector<HistoryLine> lines;
+  const bool complete = RecentHistory::instance().get_last_lines(this->user_jid, hostname, chan_name,
+                                                                 max_lines, since, lines);
+#ifdef USE_DATABASE
+  if (!complete)
+    {
+      // Some of the lines are only in the database
+      auto& xmpp = this->xmpp;
+      const auto start = history_limit.seconds >= 0 ? utils::to_string(std::chrono::system_clock::to_time_t(since)) : "";
+      Database::async("get_muc_logs",
+                      [owner = this->user_jid, chan_name, hostname, max_lines, start]()
+                      {
+                        return Database::get_muc_logs(owner, chan_name, hostname, max_lines, start);
+                      },
+                      [&xmpp, muc_name, to](std::future<std::vector<HistoryLine>> future)
+                      {
+                        try {
+                            for (const auto& line: future.get())
+                              xmpp.send_history_message(muc_name, line.nick, line.body, to,
+                                                        std::chrono::system_clock::to_time_t(line.date));
+                          } catch (const std::exception& e) {
+                            log_error("Failed to get the history of ", muc_name, ": ", e.what());
+                          }
+                      });
+      return;
+    }
+#else
+  static_cast<void>(complete);
+#endif
+  for (const auto& line: lines)
+    this->xmpp.send_history_message(muc_name, line.nick, line.body, to,
+                                    std::chrono::system_clock::to_time_t(line.date));
+}
+
+void Bridge::open_history_range(const std::string& hostname, const std::string& chan_name)
+{
+#ifdef USE_DATABASE
+  if (!this->record_history)
+    return;
+  // The lines received before are all inserted before the range starts
+  HistoryWriter::instance().flush();
+  Database::post("open_history_range", [owner = this->user_jid, hostname, chan_name]()
+  {
+    Database::open_history_range(owner, hostname, chan_name);
+  });
+#endif
+  RecentHistory::instance().open_range(this->user_jid, hostname, chan_name);
+}
+
+void Bridge::close_history_range(const std::string& hostname, const std::string& chan_name)
+{
+#ifdef USE_DATABASE
+  HistoryWriter::instance().flush();
+  Database::post("close_history_range", [owner = this->user_jid, hostname, chan_name]()
+  {
+    Database::close_history_range(owner, hostname, chan_name);
+  });
+#endif
+  RecentHistory::instance().close_range(this->user_jid, hostname, chan_name);
 }
 
 std::string Bridge::get_own_nick(const Iid& iid)
@@ -900,6 +1024,8 @@ void Bridge::kick_muc_user(Iid&& iid, const std::string& target, const std::stri
 {
   for (const auto& resource: this->resources_in_chan[iid.to_tuple()])
       this->xmpp.kick_user(std::to_string(iid), target, reason, author, this->user_jid + "/" + resource, self);
+  if (self)
+    this->close_history_range(iid.get_server(), iid.get_local());
 }
 
 void Bridge::send_nickname_conflict_error(const Iid& iid, const std::string& nickname)
@@ -1071,6 +1197,24 @@ std::size_t Bridge::number_of_resources_in_chan(const Bridge::ChannelKey& channe
   return it->second.size();
 }
 
+bool Bridge::any_resource_wants_xhtml(const std::set<Resource>& resources) const
+{
+  return std::any_of(resources.begin(), resources.end(), [this](const Resource& resource)
+                     {
+                       return this->xmpp.may_support(this->user_jid + "/" + resource, XHTMLIM_NS);
+                     });
+}
+
+const Xmpp::body& Bridge::xmpp_body_for(const Xmpp::body& body, std::unique_ptr<Xmpp::body>& plain_body,
+                                        const Resource& resource) const
+{
+  if (std::get<1>(body).empty() || this->xmpp.may_support(this->user_jid + "/" + resource, XHTMLIM_NS))
+    return body;
+  if (!plain_body)
+    plain_body = std::make_unique<Xmpp::body>(std::get<0>(body), std::string{});
+  return *plain_body;
+}
+
 std::size_t Bridge::number_of_channels_the_resource_is_in(const std::string& irc_hostname, const std::string& resource) const
 {
   std::size_t res = 0;
@@ -1104,9 +1248,22 @@ void Bridge::generate_channel_join_for_resource(const Iid& iid, const std::strin
   this->send_topic(iid.get_server(), iid.get_encoded_local(), channel->topic, channel->topic_author, resource);
 }
 
+void Bridge::record_muc_line(const Iid& iid, const std::string& nick, const std::string& body)
+{
+#ifdef USE_DATABASE
+  if (!this->record_history)
+    return;
+#endif
+  HistoryWriter::instance().log(this->user_jid, {iid.get_server(), iid.get_local(), nick, body,
+                                                 std::chrono::system_clock::now(), XmppComponent::next_id()});
+}
+
 #ifdef USE_DATABASE
 void Bridge::set_record_history(const bool val)
 {
   this->record_history = val;
+  // Let the IrcClient of another user record the channels instead
+  if (!val)
+    HistoryWriter::instance().release(this->user_jid);
 }
 #endif
@@ -29,6 +29,16 @@ struct ResultSetInfo;
  */
 using irc_responder_callback_t = std::function<bool(const std::string& irc_hostname, const IrcMessage& message)>;
 
+/**
+ * The history requested when joining a room, with the <history/> element
+ * of XEP-0045.  A negative value means that no limit was given.
+ */
+struct HistoryLimit
+{
+  int stanzas{-1};
+  int seconds{-1};
+};
+
 /**
  * One bridge is spawned for each XMPP user that uses the component.  The
  * bridge spawns IrcClients when needed (when the user wants to join a
@@ -62,8 +72,24 @@ public:
    */
   const std::string& get_jid() const;
   std::string get_bare_jid() const;
+  /**
+   * Whether the XMPP server connected to us a short time ago: the rooms
+   * joined then are the clients joining again all the rooms they were in,
+   * not a user waiting for the answer.
+   */
+  bool is_rejoining() const;
+  /**
+   * Whether the messages of the user to that IRC server must be refused
+   * for now, because too many are waiting to be sent.
+   */
+  bool is_irc_send_queue_full(const std::string& hostname) const;
 
-  static Xmpp::body make_xmpp_body(const std::string& str, const std::string& encoding = "ISO-8859-1");
+  /**
+   * Convert the IRC message into an XMPP body. The XHTML-IM version is only
+   * generated if xhtml is true.
+   */
+  static Xmpp::body make_xmpp_body(const std::string& str, const std::string& encoding = "ISO-8859-1",
+                                   const bool xhtml = true);
   /***
    **
    ** From XMPP to IRC.
@@ -74,7 +100,8 @@ public:
    * Try to join an irc_channel, does nothing and return true if the channel
    * was already joined.
    */
-  bool join_irc_channel(const Iid& iid, const std::string& nickname, const std::string& password, const std::string& resource);
+  bool join_irc_channel(const Iid& iid, const std::string& nickname, const std::string& password, const std::string& resource,
+                        const HistoryLimit& history_limit={});
 
   void send_channel_message(const Iid& iid, const std::string& body);
   void send_private_message(const Iid& iid, const std::string& body, const std::string& type="PRIVMSG");
@@ -302,6 +329,19 @@ private:
   void remove_resource_from_chan(const ChannelKey& channel_key, const std::string& resource);
   bool is_resource_in_chan(const ChannelKey& channel_key, const std::string& resource) const;
   std::size_t number_of_resources_in_chan(const ChannelKey& channel_key) const;
+  /**
+   * Whether or not at least one of these resources may display XHTML-IM,
+   * according to the capabilities advertised by its client.
+   */
+  bool any_resource_wants_xhtml(const std::set<Resource>& resources) const;
+  /**
+   * Return the given body, or the same body without its XHTML-IM part if
+   * the client of that resource does not support it.  That plain body is
+   * only built once, into plain_body, for all the resources receiving the
+   * same message.
+   */
+  const Xmpp::body& xmpp_body_for(const Xmpp::body& body, std::unique_ptr<Xmpp::body>& plain_body,
+                                  const Resource& resource) const;
 
   void add_resource_to_server(const IrcHostname& irc_hostname, const std::string& resource);
   void remove_resource_from_server(const IrcHostname& irc_hostname, const std::string& resource);
@@ -314,6 +354,17 @@ private:
    * TODO: send message history
    */
   void generate_channel_join_for_resource(const Iid& iid, const std::string& resource);
+  /**
+   * Add a line relayed in a channel to the history, if the user wants it
+   * recorded.
+   */
+  void record_muc_line(const Iid& iid, const std::string& nick, const std::string& body);
+  /**
+   * Make the lines of the channel recorded from now on visible to this
+   * user (if recorded at all), or stop doing so once we left it.
+   */
+  void open_history_range(const std::string& hostname, const std::string& chan_name);
+  void close_history_range(const std::string& hostname, const std::string& chan_name);
   /**
    * A cache of the channels list (as returned by the server on a LIST
    * request), to be re-used on a subsequent XMPP list request that
@@ -321,6 +372,12 @@ private:
    */
   std::map<IrcHostname, ChannelList> channel_list_cache;
 
+  /**
+   * The <history/> limits given by each resource when joining a channel,
+   * until the history is sent to it.
+   */
+  std::map<std::tuple<ChannelName, IrcHostname, Resource>, HistoryLimit> history_limits;
+
 #ifdef USE_DATABASE
   bool record_history { true };
 #endif
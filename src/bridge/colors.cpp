@@ -40,6 +40,70 @@ struct styles_t
   int bg;
 };
 
+namespace
+{
+enum class FormatAction: unsigned char
+{
+  none,
+  bold,
+  color,
+  reset,
+  italic,
+  underline,
+  newline,
+  ignored,
+};
+
+struct FormatTable
+{
+  FormatTable():
+    actions{}
+  {
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_BOLD_CHAR)] = FormatAction::bold;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_COLOR_CHAR)] = FormatAction::color;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_RESET_CHAR)] = FormatAction::reset;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_FIXED_CHAR)] = FormatAction::ignored;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_REVERSE_CHAR)] = FormatAction::ignored;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_REVERSE2_CHAR)] = FormatAction::ignored;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_ITALIC_CHAR)] = FormatAction::italic;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_UNDERLINE_CHAR)] = FormatAction::underline;
+    this->actions[static_cast<unsigned char>(IRC_FORMAT_NEWLINE_CHAR)] = FormatAction::newline;
+  }
+  FormatAction actions[256];
+};
+
+const FormatTable format_table;
+
+/**
+ * Parse the optional “fg[,bg]” color numbers following a color char, and
+ * return the position of the last char that was part of it.
+ */
+std::string::size_type parse_colors(const std::string& s, std::string::size_type pos,
+                                    styles_t& styles)
+{
+  pos++;
+  styles.fg = -1;
+  styles.bg = -1;
+  if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+    {
+      styles.fg = s[pos++] - '0';
+      if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+        styles.fg = styles.fg * 10 + s[pos++] - '0';
+    }
+  if (pos < s.size() && s[pos] == ',')
+    {
+      pos++;
+      if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+        {
+          styles.bg = s[pos++] - '0';
+          if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+            styles.bg = styles.bg * 10 + s[pos++] - '0';
+        }
+    }
+  return pos - 1;
+}
+}
+
 /** We keep the currently-applied CSS styles in a structure. Each time a tag
  * is found, update this style list, then close the current span XML element
  * (if it is open), then reopen it with all the new styles in it.  This is
@@ -48,123 +112,156 @@ struct styles_t
  * and reapply them for each tag, instead of trying to keep a consistent
  * hierarchy of span, strong, em etc tags.  The generated XML is one-level
  * deep only.
-*/
-Xmpp::body irc_format_to_xhtmlim(const std::string& s)
+ *
+ * The XML is written directly.  The only subtlety is that an element can
+ * only be finished with “>” once we know whether it has some content or
+ * not (an empty element is serialized as <span style='…'/>), so the body
+ * and the current span keep a flag telling if their start tag is still
+ * open.
+ */
+bool irc_format_to_serialized_xhtmlim(const std::string& s, std::string& body, std::string& xhtml)
 {
-  if (s.find_first_of(irc_format_char) == std::string::npos)
-    // there is no special formatting at all
-    return std::make_tuple(s, nullptr);
+  body.clear();
+  xhtml.clear();
+  body.reserve(s.size());
+
+  static const char body_start[] = "<body xmlns='" XHTML_NS "'";
+  xhtml.reserve(s.size() + 2 * sizeof(body_start));
+  xhtml += body_start;
 
-  std::string cleaned;
+  bool found_format = false;
+  bool body_start_open = true;
+  bool in_span = false;
+  bool span_start_open = false;
 
   styles_t styles = {false, false, false, -1, -1};
 
-  std::unique_ptr<XmlNode> result = std::make_unique<XmlNode>("body");
-  (*result)["xmlns"] = XHTML_NS;
+  const auto open_content = [&]()
+    {
+      if (body_start_open)
+        {
+          xhtml += '>';
+          body_start_open = false;
+        }
+      if (span_start_open)
+        {
+          xhtml += '>';
+          span_start_open = false;
+        }
+    };
 
-  std::unique_ptr<XmlNode> current_node_up;
-  XmlNode* current_node = result.get();
+  const auto append_text = [&](const std::string::size_type begin, const std::string::size_type end)
+    {
+      if (begin >= end)
+        return;
+      body.append(s, begin, end - begin);
+      open_content();
+      append_sanitized(xhtml, s.data() + begin, end - begin);
+    };
 
   std::string::size_type pos_start = 0;
-  std::string::size_type pos_end;
-
-  while ((pos_end = s.find_first_of(irc_format_char, pos_start)) != std::string::npos)
+  for (std::string::size_type pos_end = 0; pos_end < s.size(); ++pos_end)
     {
-      const std::string txt = s.substr(pos_start, pos_end-pos_start);
-      cleaned += txt;
-      if (current_node->has_children())
-        current_node->get_last_child()->add_to_tail(txt);
-      else
-        current_node->add_to_inner(txt);
-
-      if (s[pos_end] == IRC_FORMAT_BOLD_CHAR)
-        styles.strong = !styles.strong;
-      else if (s[pos_end] == IRC_FORMAT_NEWLINE_CHAR)
-        {
-          current_node->add_child(std::make_unique<XmlNode>("br"));
-          cleaned += '\n';
-        }
-      else if (s[pos_end] == IRC_FORMAT_UNDERLINE_CHAR)
-        styles.underline = !styles.underline;
-      else if (s[pos_end] == IRC_FORMAT_ITALIC_CHAR)
-        styles.italic = !styles.italic;
-      else if (s[pos_end] == IRC_FORMAT_RESET_CHAR)
-        styles = {false, false, false, -1, -1};
-      else if (s[pos_end] == IRC_FORMAT_REVERSE_CHAR)
-        { }                      // TODO
-      else if (s[pos_end] == IRC_FORMAT_REVERSE2_CHAR)
-        { }                      // TODO
-      else if (s[pos_end] == IRC_FORMAT_FIXED_CHAR)
-        { }                      // TODO
-      else if (s[pos_end] == IRC_FORMAT_COLOR_CHAR)
+      const FormatAction action = format_table.actions[static_cast<unsigned char>(s[pos_end])];
+      if (action == FormatAction::none)
+        continue;
+      found_format = true;
+      append_text(pos_start, pos_end);
+
+      switch (action)
         {
-          size_t pos = pos_end + 1;
-          styles.fg = -1;
-          styles.bg = -1;
-          // get the first number following the format char
-          if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
-            {                   // first digit
-              styles.fg = s[pos++] - '0';
-              if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
-                // second digit
-                styles.fg = styles.fg * 10 + s[pos++] - '0';
-            }
-          if (pos < s.size() && s[pos] == ',')
-            {                   // get bg color after the comma
-              pos++;
-              if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
-                {               // first digit
-                  styles.bg = s[pos++] - '0';
-                  if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
-                    // second digit
-                    styles.bg = styles.bg * 10 + s[pos++] - '0';
-                }
-            }
-          pos_end = pos - 1;
+        case FormatAction::bold:
+          styles.strong = !styles.strong;
+          break;
+        case FormatAction::newline:
+          open_content();
+          xhtml += "<br/>";
+          body += '\n';
+          break;
+        case FormatAction::underline:
+          styles.underline = !styles.underline;
+          break;
+        case FormatAction::italic:
+          styles.italic = !styles.italic;
+          break;
+        case FormatAction::reset:
+          styles = {false, false, false, -1, -1};
+          break;
+        case FormatAction::color:
+          pos_end = parse_colors(s, pos_end, styles);
+          break;
+        case FormatAction::ignored:
+        case FormatAction::none:
+          break;
         }
 
       // close opened span, if any
-      if (current_node != result.get())
+      if (in_span)
         {
-          result->add_child(std::move(current_node_up));
-          current_node = result.get();
+          xhtml += span_start_open ? "/>" : "</span>";
+          in_span = false;
+          span_start_open = false;
         }
-      // Take all currently-applied style and create a new span with it
-      std::string styles_str;
-      if (styles.strong)
-        styles_str += "font-weight:bold;";
-      if (styles.underline)
-        styles_str += "text-decoration:underline;";
-      if (styles.italic)
-        styles_str += "font-style:italic;";
-      if (styles.fg != -1)
-        styles_str += "color:"s +
-          irc_colors_to_css[styles.fg % IRC_NUM_COLORS] + ";";
-      if (styles.bg != -1)
-        styles_str += "background-color:"s +
-          irc_colors_to_css[styles.bg % IRC_NUM_COLORS] + ";";
-      if (!styles_str.empty())
+      // Open a new span with all the currently-applied styles
+      if (styles.strong || styles.underline || styles.italic ||
+          styles.fg != -1 || styles.bg != -1)
         {
-          current_node_up = std::make_unique<XmlNode>("span");
-          current_node = current_node_up.get();
-          (*current_node)["style"] = styles_str;
+          open_content();
+          xhtml += "<span style='";
+          if (styles.strong)
+            xhtml += "font-weight:bold;";
+          if (styles.underline)
+            xhtml += "text-decoration:underline;";
+          if (styles.italic)
+            xhtml += "font-style:italic;";
+          if (styles.fg != -1)
+            {
+              xhtml += "color:";
+              xhtml += irc_colors_to_css[styles.fg % IRC_NUM_COLORS];
+              xhtml += ';';
+            }
+          if (styles.bg != -1)
+            {
+              xhtml += "background-color:";
+              xhtml += irc_colors_to_css[styles.bg % IRC_NUM_COLORS];
+              xhtml += ';';
+            }
+          xhtml += '\'';
+          in_span = true;
+          span_start_open = true;
         }
 
       pos_start = pos_end + 1;
     }
 
-  // If some text remains, without any format char, just append that text at
-  // the end of the current node
-  const std::string txt = s.substr(pos_start, pos_end-pos_start);
-  cleaned += txt;
-  if (current_node->has_children())
-    current_node->get_last_child()->add_to_tail(txt);
-  else
-    current_node->add_to_inner(txt);
+  if (!found_format)
+    {
+      // there is no special formatting at all
+      body = s;
+      xhtml.clear();
+      return false;
+    }
+
+  append_text(pos_start, s.size());
 
-  if (current_node != result.get())
-    result->add_child(std::move(current_node_up));
+  if (in_span)
+    xhtml += span_start_open ? "/>" : "</span>";
+  xhtml += body_start_open ? "/>" : "</body>";
+  return true;
+}
 
-  Xmpp::body body_res = std::make_tuple(cleaned, std::move(result));
-  return body_res;
+std::string remove_irc_format(const std::string& s)
+{
+  std::string body;
+  body.reserve(s.size());
+  styles_t styles = {false, false, false, -1, -1};
+  for (std::string::size_type pos = 0; pos < s.size(); ++pos)
+    {
+      const FormatAction action = format_table.actions[static_cast<unsigned char>(s[pos])];
+      if (action == FormatAction::none || action == FormatAction::newline)
+        body += s[pos];
+      else if (action == FormatAction::color)
+        pos = parse_colors(s, pos, styles);
+    }
+  return body;
 }
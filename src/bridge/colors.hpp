@@ -6,19 +6,9 @@
  * vice versa.
  */
 
-#include <string>
-#include <memory>
-#include <tuple>
-
-class XmlNode;
+#include <xmpp/body.hpp>
 
-namespace Xmpp
-{
-// Contains:
-// - an XMPP-valid UTF-8 body
-// - an XML node representing the XHTML-IM body, or null
-  using body = std::tuple<const std::string, std::unique_ptr<XmlNode>>;
-}
+#include <string>
 
 #define IRC_FORMAT_BOLD_CHAR       '\x02' // done
 #define IRC_FORMAT_COLOR_CHAR      '\x03' // done
@@ -44,13 +34,22 @@ static const char irc_format_char[] = {
 };
 
 /**
- * Convert the passed string into an XML tree representing the XHTML version
- * of the message, converting the IRC colors symbols into xhtml-im
- * formatting.
+ * Convert the passed string into the XHTML-IM version of the message,
+ * converting the IRC colors symbols into xhtml-im formatting, in one pass
+ * over the given string and without building any XmlNode: the body cleaned
+ * from any IRC formatting is written into body, and the XHTML-IM <body/>
+ * element is directly serialized (and escaped) into xhtml.  Both strings
+ * are cleared first.
  *
- * Returns the body cleaned from any IRC formatting (but without any xhtml),
- * and the body as XHTML-IM
+ * The given string must be valid UTF-8.  Returns false, with an empty
+ * xhtml, if the string does not contain any formatting at all.
+ */
+bool irc_format_to_serialized_xhtmlim(const std::string& str, std::string& body, std::string& xhtml);
+
+/**
+ * Only return the body cleaned from any IRC formatting, for the clients
+ * that do not want any XHTML-IM.
  */
-Xmpp::body irc_format_to_xhtmlim(const std::string& str);
+std::string remove_irc_format(const std::string& str);
 
 
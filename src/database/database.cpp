@@ -7,78 +7,393 @@
 #include <uuid/uuid.h>
 #include <utils/get_first_non_empty.hpp>
 #include <utils/time.hpp>
+#include <utils/history_writer.hpp>
+#include <utils/history_retention.hpp>
+#include <utils/compression.hpp>
+#include <utils/split.hpp>
+
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
 
 using namespace std::string_literals;
 
 std::unique_ptr<db::BibouDB> Database::db;
+std::unique_ptr<Worker> Database::worker;
+bool Database::is_sqlite = false;
+bool Database::incremental_vacuum = false;
+std::atomic<bool> Database::fulltext_search{false};
+bool Database::fulltext_index = false;
+std::map<int, Database::Dictionary> Database::dictionaries;
+int Database::current_dictionary = 0;
+std::time_t Database::current_dictionary_date = 0;
+bool Database::options_preloaded = false;
+std::unordered_map<std::string, db::GlobalOptions> Database::global_options;
+std::unordered_map<std::string, db::IrcServerOptions> Database::irc_server_options;
+std::unordered_map<std::string, db::IrcChannelOptions> Database::irc_channel_options;
 
-void Database::open(const std::string& filename, const std::string& db_type)
+static const std::string fulltext_table{"MucLogLineFts"};
+static const std::string compression_migration{"compressed bodies"};
+/**
+ * The next id to add to the full-text index, and the last one to add
+ * (lines inserted after the index was created are added as they are
+ * inserted).
+ */
+static const std::string fulltext_migration{"fulltext index"};
+static const std::string fulltext_end_migration{"fulltext index end"};
+
+/**
+ * The dictionaries are trained on the dictionary_samples most recent
+ * lines, once there are at least that many, and replaced after
+ * dictionary_lifetime.
+ */
+static constexpr std::size_t dictionary_size = 16 * 1024;
+static constexpr std::size_t dictionary_samples = 5000;
+static constexpr std::size_t dictionary_min_samples = 1000;
+static constexpr std::time_t dictionary_lifetime = 7 * 24 * 60 * 60;
+/**
+ * The text of the lines whose body can not be decompressed.
+ */
+static const std::string undecodable_body{"[This message could not be read from the history]"};
+
+/**
+ * The token indexed in the room column of the full-text table: the
+ * hexadecimal encoding (like SQLite’s hex()) of server%channel, a single
+ * token for the FTS5 tokenizer.
+ */
+static std::string make_room_token(const std::string& server, const std::string& channel)
 {
-  try
+  static const char digits[] = "0123456789ABCDEF";
+  const auto room = server + "%" + channel;
+  std::string res;
+  res.reserve(room.size() * 2);
+  for (const unsigned char c: room)
     {
-      auto new_db = std::make_unique<db::BibouDB>(db_type,
-                                             "database="s + filename);
-      if (new_db->needsUpgrade())
-        new_db->upgrade();
-      Database::db.reset(new_db.release());
-    } catch (const litesql::DatabaseError& e) {
-      log_error("Failed to open database ", filename, ". ", e.what());
-      throw;
+      res += digits[c >> 4];
+      res += digits[c & 0xf];
+    }
+  return res;
+}
+
+/**
+ * An SQL condition on a MucLogLine row: whether it is in one of the
+ * visibility ranges of that owner in that channel (or in the ones shared
+ * by everyone).
+ */
+static std::string visible_to(const std::string& owner, const std::string& server, const std::string& channel)
+{
+  const auto id = db::MucLogLine::Id.fullName();
+  return "EXISTS (SELECT 1 FROM " + db::MucLogVisibility::table__ + " WHERE (" +
+    (db::MucLogVisibility::Owner == std::string{} || db::MucLogVisibility::Owner == owner).asString() + ") AND " +
+    (db::MucLogVisibility::IrcServerName == server && db::MucLogVisibility::IrcChanName == channel).asString() +
+    " AND " + db::MucLogVisibility::FirstId.fullName() + " <= " + id +
+    " AND (" + db::MucLogVisibility::LastId.fullName() + " = 0 OR " +
+    db::MucLogVisibility::LastId.fullName() + " >= " + id + "))";
+}
+
+static std::string make_options_key(const std::string& owner, const std::string& server="",
+                                    const std::string& channel="")
+{
+  std::string res;
+  res.reserve(owner.size() + server.size() + channel.size() + 2);
+  res += owner;
+  res += '\0';
+  res += server;
+  res += '\0';
+  res += channel;
+  return res;
+}
+
+static std::string make_options_key(const db::GlobalOptions& options)
+{
+  return make_options_key(options.owner.value());
+}
+
+static std::string make_options_key(const db::IrcServerOptions& options)
+{
+  return make_options_key(options.owner.value(), options.server.value());
+}
+
+static std::string make_options_key(const db::IrcChannelOptions& options)
+{
+  return make_options_key(options.owner.value(), options.server.value(), options.channel.value());
+}
+
+template <typename PersistentType>
+static void remember_options(std::unordered_map<std::string, PersistentType>& store, const PersistentType& options)
+{
+  auto key = make_options_key(options);
+  const auto it = store.find(key);
+  if (it == store.end())
+    store.emplace(std::move(key), options);
+  else
+    it->second = options;
+}
+
+/**
+ * Load all the rows of that table in store, and return how many there
+ * were.
+ */
+template <typename PersistentType>
+static std::size_t load_all_options(const db::BibouDB& db, std::unordered_map<std::string, PersistentType>& store)
+{
+  std::size_t rows = 0;
+  for (auto cursor = litesql::select<PersistentType>(db).cursor(); cursor.rowsLeft(); cursor++)
+    {
+      remember_options(store, *cursor);
+      rows++;
+    }
+  return rows;
+}
+
+static bool has_table(const db::BibouDB& db, const std::string& table)
+{
+  try {
+      db.query("SELECT 1 FROM " + table + " LIMIT 1");
+      return true;
+    } catch (const litesql::Except&) {
+      return false;
+    }
+}
+
+/**
+ * The id of the most recent line recorded, or 0.
+ */
+static int get_last_muc_log_id(const db::BibouDB& db)
+{
+  const auto res = db.query("SELECT MAX(" + db::MucLogLine::Id.name() + ") FROM " + db::MucLogLine::table__);
+  if (res.empty() || res[0].empty() || res[0][0].empty() || res[0][0] == "NULL")
+    return 0;
+  return std::stoi(res[0][0]);
+}
+
+/**
+ * End these ranges with the last line recorded.
+ */
+static void close_ranges(const db::BibouDB& db, std::vector<db::MucLogVisibility>&& ranges)
+{
+  const auto last_id = get_last_muc_log_id(db);
+  for (auto& range: ranges)
+    {
+      // No line was received in that range
+      if (range.firstId.value() > last_id)
+        range.del();
+      else
+        {
+          range.lastId = last_id;
+          range.update();
+        }
+    }
+}
+
+/**
+ * An FTS5 query matching the lines of that channel containing all the
+ * words of text.  Each word is quoted, to be searched as is.
+ */
+static std::string make_fulltext_query(const std::string& server, const std::string& channel,
+                                       const std::string& text)
+{
+  std::string res = "room:\"" + make_room_token(server, channel) + "\" AND body:(";
+  std::istringstream is(text);
+  std::string word;
+  bool first = true;
+  while (is >> word)
+    {
+      if (!first)
+        res += ' ';
+      first = false;
+      res += '"';
+      for (const char c: word)
+        {
+          if (c == '"')
+            res += '"';
+          res += c;
+        }
+      res += '"';
     }
+  res += ')';
+  return res;
+}
+
+void Database::open(const std::string& filename, const std::string& db_type)
+{
+  Database::sync("open", [&filename, &db_type]()
+  {
+    try
+      {
+        auto new_db = std::make_unique<db::BibouDB>(db_type,
+                                               "database="s + filename);
+        Database::is_sqlite = db_type == "sqlite3";
+        // Lets compact() release the pages freed by the pruning of the
+        // history.  Only effective if set before the tables are created
+        // (or followed by a VACUUM), a no-op otherwise.
+        if (Database::is_sqlite)
+          new_db->query("PRAGMA auto_vacuum = INCREMENTAL");
+        bool share_legacy_history = false;
+        if (new_db->needsUpgrade())
+          {
+            share_legacy_history = !has_table(*new_db, db::MucLogVisibility::table__);
+            new_db->upgrade();
+          }
+        // Only once the new database can be used: otherwise the previous
+        // one, and its preloaded options, are kept
+        Database::forget_options();
+        Database::db.reset(new_db.release());
+        Database::incremental_vacuum = false;
+        if (Database::is_sqlite)
+          {
+            const auto mode = Database::db->query("PRAGMA auto_vacuum");
+            // 2 is INCREMENTAL
+            Database::incremental_vacuum = !mode.empty() && mode[0][0] == "2";
+            if (!Database::incremental_vacuum)
+              log_warning("The database file does not use the incremental auto_vacuum: the space freed by the "
+                          "pruning of the history can not be released.  Run “PRAGMA auto_vacuum = INCREMENTAL; "
+                          "VACUUM;” on it, with biboumi stopped, to enable it.");
+          }
+        if (share_legacy_history)
+          Database::share_legacy_history();
+        Database::load_dictionaries();
+        Database::create_fulltext_index();
+      } catch (const litesql::DatabaseError& e) {
+        log_error("Failed to open database ", filename, ". ", e.what());
+        throw;
+      }
+  });
+}
+
+void Database::start_worker(std::shared_ptr<Poller> poller)
+{
+  Database::worker = std::make_unique<Worker>(poller);
+}
+
+void Database::stop_worker()
+{
+  Database::close();
+  if (Database::worker)
+    Database::worker->stop();
+  Database::worker.reset(nullptr);
+}
+
+WorkerMetrics Database::get_worker_metrics()
+{
+  if (!Database::worker)
+    return {};
+  return Database::worker->get_metrics();
 }
 
 void Database::set_verbose(const bool val)
 {
-  Database::db->verbose = val;
+  Database::sync("set_verbose", [val]() { Database::db->verbose = val; });
 }
 
 db::GlobalOptions Database::get_global_options(const std::string& owner)
 {
+  if (Database::options_preloaded)
+    {
+      const auto it = Database::global_options.find(make_options_key(owner));
+      if (it != Database::global_options.end())
+        return it->second;
+      db::GlobalOptions options(*Database::db);
+      options.owner = owner;
+      return options;
+    }
   try {
-    auto options = litesql::select<db::GlobalOptions>(*Database::db,
-                                                      db::GlobalOptions::Owner == owner).one();
-    return options;
-  } catch (const litesql::NotFound& e) {
-    db::GlobalOptions options(*Database::db);
-    options.owner = owner;
-    return options;
-  }
+      return litesql::select<db::GlobalOptions>(*Database::db, db::GlobalOptions::Owner == owner).one();
+    } catch (const litesql::NotFound&) {
+      db::GlobalOptions options(*Database::db);
+      options.owner = owner;
+      return options;
+    }
 }
 
 db::IrcServerOptions Database::get_irc_server_options(const std::string& owner,
                                                       const std::string& server)
 {
+  if (Database::options_preloaded)
+    {
+      const auto it = Database::irc_server_options.find(make_options_key(owner, server));
+      if (it != Database::irc_server_options.end())
+        return it->second;
+      db::IrcServerOptions options(*Database::db);
+      options.owner = owner;
+      options.server = server;
+      return options;
+    }
   try {
-    auto options = litesql::select<db::IrcServerOptions>(*Database::db,
-                             db::IrcServerOptions::Owner == owner &&
-                             db::IrcServerOptions::Server == server).one();
-    return options;
-  } catch (const litesql::NotFound& e) {
-    db::IrcServerOptions options(*Database::db);
-    options.owner = owner;
-    options.server = server;
-    // options.update();
-    return options;
-  }
+      return litesql::select<db::IrcServerOptions>(*Database::db,
+                                                   db::IrcServerOptions::Owner == owner &&
+                                                   db::IrcServerOptions::Server == server).one();
+    } catch (const litesql::NotFound&) {
+      db::IrcServerOptions options(*Database::db);
+      options.owner = owner;
+      options.server = server;
+      return options;
+    }
 }
 
 db::IrcChannelOptions Database::get_irc_channel_options(const std::string& owner,
                                                         const std::string& server,
                                                         const std::string& channel)
 {
+  if (Database::options_preloaded)
+    {
+      const auto it = Database::irc_channel_options.find(make_options_key(owner, server, channel));
+      if (it != Database::irc_channel_options.end())
+        return it->second;
+      db::IrcChannelOptions options(*Database::db);
+      options.owner = owner;
+      options.server = server;
+      options.channel = channel;
+      return options;
+    }
   try {
-    auto options = litesql::select<db::IrcChannelOptions>(*Database::db,
-                                                         db::IrcChannelOptions::Owner == owner &&
-                                                         db::IrcChannelOptions::Server == server &&
-                                                         db::IrcChannelOptions::Channel == channel).one();
-    return options;
-  } catch (const litesql::NotFound& e) {
-    db::IrcChannelOptions options(*Database::db);
-    options.owner = owner;
-    options.server = server;
-    options.channel = channel;
-    return options;
-  }
+      return litesql::select<db::IrcChannelOptions>(*Database::db,
+                                                    db::IrcChannelOptions::Owner == owner &&
+                                                    db::IrcChannelOptions::Server == server &&
+                                                    db::IrcChannelOptions::Channel == channel).one();
+    } catch (const litesql::NotFound&) {
+      db::IrcChannelOptions options(*Database::db);
+      options.owner = owner;
+      options.server = server;
+      options.channel = channel;
+      return options;
+    }
+}
+
+std::size_t Database::preload_options()
+{
+  Database::forget_options();
+  std::size_t rows = load_all_options(*Database::db, Database::global_options);
+  rows += load_all_options(*Database::db, Database::irc_server_options);
+  rows += load_all_options(*Database::db, Database::irc_channel_options);
+  Database::options_preloaded = true;
+  return rows;
+}
+
+void Database::forget_options()
+{
+  Database::options_preloaded = false;
+  Database::global_options.clear();
+  Database::irc_server_options.clear();
+  Database::irc_channel_options.clear();
+}
+
+void Database::store_options(const db::GlobalOptions& options)
+{
+  if (Database::options_preloaded)
+    remember_options(Database::global_options, options);
+}
+
+void Database::store_options(const db::IrcServerOptions& options)
+{
+  if (Database::options_preloaded)
+    remember_options(Database::irc_server_options, options);
+}
+
+void Database::store_options(const db::IrcChannelOptions& options)
+{
+  if (Database::options_preloaded)
+    remember_options(Database::irc_channel_options, options);
 }
 
 db::IrcChannelOptions Database::get_irc_channel_options_with_server_default(const std::string& owner,
@@ -120,13 +435,85 @@ db::IrcChannelOptions Database::get_irc_channel_options_with_server_and_global_d
 }
 
 
-std::vector<db::MucLogLine> Database::get_muc_logs(const std::string& chan_name, const std::string& server,
-                                                   int limit, const std::string& start, const std::string& end)
+db::MucLogLine Database::get_muc_log_cursor(const std::string& owner, const std::string& server,
+                                            const std::string& channel, const std::string& uuid)
+{
+  return litesql::select<db::MucLogLine>(*Database::db, db::MucLogLine::Uuid == uuid &&
+                                         litesql::RawExpr(visible_to(owner, server, channel))).one();
+}
+
+namespace
+{
+/**
+ * The lines of a page, in chronological order.  When reversed, they are
+ * added from the most recent one, and there are at most limit of them:
+ * they are written from the end.
+ */
+class Page
 {
+public:
+  Page(const bool reversed, const int limit):
+    reversed(reversed),
+    lines(reversed ? limit : 0),
+    first(lines.size())
+  {
+    if (!reversed && limit >= 0)
+      this->lines.reserve(limit);
+  }
+
+  void add(HistoryLine&& line)
+  {
+    if (this->reversed)
+      this->lines[--this->first] = std::move(line);
+    else
+      this->lines.push_back(std::move(line));
+  }
+
+  std::vector<HistoryLine> take()
+  {
+    this->lines.erase(this->lines.begin(), this->lines.begin() + this->first);
+    return std::move(this->lines);
+  }
+
+private:
+  const bool reversed;
+  std::vector<HistoryLine> lines;
+  std::size_t first;
+};
+}
+
+std::vector<HistoryLine> Database::get_muc_logs(const std::string& owner,
+                                                const std::string& chan_name, const std::string& server,
+                                                int limit, const std::string& start, const std::string& end,
+                                                const std::string& after, const std::string& before)
+{
+  // Both the filter and the order match the (server, channel, date, id)
+  // index, and a page starts right after (or before) the line given as
+  // cursor, so no query ever scans the lines of the previous pages
+  const litesql::RawExpr visible(visible_to(owner, server, chan_name));
   auto request = litesql::select<db::MucLogLine>(*Database::db,
-                                              db::MucLogLine::IrcChanName == chan_name &&
-                                              db::MucLogLine::IrcServerName == server);
-  request.orderBy(db::MucLogLine::Id, false);
+                                              db::MucLogLine::IrcServerName == server &&
+                                              db::MucLogLine::IrcChanName == chan_name && visible);
+  const bool forward = !after.empty();
+  const auto& cursor_uuid = forward ? after : before;
+  if (!cursor_uuid.empty())
+    {
+      // Throws litesql::NotFound if the cursor is unknown, or not visible
+      // to that owner
+      const auto cursor = Database::get_muc_log_cursor(owner, server, chan_name, cursor_uuid);
+      const auto date = cursor.date.value().timeStamp();
+      if (forward)
+        request.where(db::MucLogLine::Date > date ||
+                      (db::MucLogLine::Date == date && db::MucLogLine::Id > cursor.id.value()));
+      else
+        request.where(db::MucLogLine::Date < date ||
+                      (db::MucLogLine::Date == date && db::MucLogLine::Id < cursor.id.value()));
+    }
+  // Only the most recent lines of a limited page need to be read from the
+  // end
+  const bool reversed = !forward && limit >= 0;
+  request.orderBy(db::MucLogLine::Date, !reversed);
+  request.orderBy(db::MucLogLine::Id, !reversed);
 
   if (limit >= 0)
     request.limit(limit);
@@ -142,13 +529,631 @@ std::vector<db::MucLogLine> Database::get_muc_logs(const std::string& chan_name,
       if (end_time != -1)
         request.where(db::MucLogLine::Date <= end_time);
     }
-  const auto& res = request.all();
-  return {res.crbegin(), res.crend()};
+
+  Page page(reversed, limit);
+  for (auto cursor = request.cursor(); cursor.rowsLeft(); cursor++)
+    {
+      const db::MucLogLine& line = *cursor;
+      page.add({server, chan_name, line.nick.value(),
+                Database::decode_body(line.body.value(), line.dictionary.value()),
+                std::chrono::system_clock::from_time_t(line.date.value().timeStamp()),
+                line.uuid.value()});
+    }
+  return page.take();
+}
+
+std::vector<HistoryLine> Database::search_muc_logs(const std::string& owner,
+                                                   const std::string& chan_name, const std::string& server,
+                                                   const std::string& text, int limit,
+                                                   const std::string& start, const std::string& end,
+                                                   const std::string& after, const std::string& before)
+{
+  const auto match = fulltext_table + " MATCH " + litesql::escapeSQL(make_fulltext_query(server, chan_name, text));
+  const auto id = db::MucLogLine::Id.fullName();
+  const auto rank = fulltext_table + ".rank";
+
+  // The room token already restricts the matches to that channel, the
+  // names are only compared in case of a collision
+  std::string query = "SELECT " + db::MucLogLine::Uuid.fullName() + ", " + db::MucLogLine::Nick.fullName() + ", " +
+    db::MucLogLine::Body.fullName() + ", " + db::MucLogLine::Date.fullName() + ", " +
+    db::MucLogLine::Dictionary.fullName() + " FROM " + fulltext_table + " JOIN " + db::MucLogLine::table__ + " ON " + id + " = " + fulltext_table + ".rowid" +
+    " WHERE " + match + " AND " + (db::MucLogLine::IrcServerName == server &&
+                                   db::MucLogLine::IrcChanName == chan_name).asString() +
+    " AND " + visible_to(owner, server, chan_name);
+  if (!start.empty())
+    {
+      const auto start_time = utils::parse_datetime(start);
+      if (start_time != -1)
+        query += " AND " + (db::MucLogLine::Date >= start_time).asString();
+    }
+  if (!end.empty())
+    {
+      const auto end_time = utils::parse_datetime(end);
+      if (end_time != -1)
+        query += " AND " + (db::MucLogLine::Date <= end_time).asString();
+    }
+
+  // Keyset pagination on (rank, id), the rank of the cursor being
+  // computed by the same query
+  const bool forward = before.empty();
+  const auto& cursor_uuid = forward ? after : before;
+  if (!cursor_uuid.empty())
+    {
+      const auto cursor = Database::get_muc_log_cursor(owner, server, chan_name, cursor_uuid);
+      const auto cursor_match = " FROM " + fulltext_table + " WHERE " + match +
+                                " AND rowid = " + std::to_string(cursor.id.value());
+      if (Database::db->query("SELECT rowid" + cursor_match).empty())
+        throw litesql::NotFound();
+      query += " AND (" + rank + ", " + id + ") " + (forward ? ">" : "<") + " (SELECT rank, rowid" + cursor_match + ")";
+    }
+  const bool reversed = !forward && limit >= 0;
+  const std::string order = reversed ? " DESC" : " ASC";
+  query += " ORDER BY " + rank + order + ", " + id + order;
+  if (limit >= 0)
+    query += " LIMIT " + std::to_string(limit);
+
+  Page page(reversed, limit);
+  for (const auto& record: Database::db->query(query))
+    page.add({server, chan_name, record[1], Database::decode_body(record[2], std::stoi(record[4])),
+              std::chrono::system_clock::from_time_t(std::stoll(record[3])), record[0]});
+  return page.take();
+}
+
+void Database::share_legacy_history()
+{
+  // Nobody knows which bridges received these lines: they stay visible
+  // to everyone, like before
+  const auto id = db::MucLogLine::Id.name();
+  const auto channels = Database::db->query("SELECT " + db::MucLogLine::IrcServerName.name() + ", " +
+                                            db::MucLogLine::IrcChanName.name() + ", MIN(" + id + "), MAX(" + id +
+                                            ") FROM " + db::MucLogLine::table__ + " GROUP BY " +
+                                            db::MucLogLine::IrcServerName.name() + ", " +
+                                            db::MucLogLine::IrcChanName.name());
+  if (channels.empty())
+    return;
+  log_info("Sharing the existing history of ", channels.size(), " channels.");
+  Database::db->begin();
+  try {
+      for (const auto& channel: channels)
+        {
+          db::MucLogVisibility range(*Database::db);
+          range.owner = std::string{};
+          range.ircServerName = channel[0];
+          range.ircChanName = channel[1];
+          range.firstId = std::stoi(channel[2]);
+          range.lastId = std::stoi(channel[3]);
+          range.update();
+        }
+      Database::db->commit();
+    } catch (const litesql::Except&) {
+      Database::db->rollback();
+      throw;
+    }
+}
+
+void Database::open_history_range(const std::string& owner, const std::string& server, const std::string& channel)
+{
+  const auto open_ranges = litesql::select<db::MucLogVisibility>(*Database::db,
+                                                                db::MucLogVisibility::Owner == owner &&
+                                                                db::MucLogVisibility::IrcServerName == server &&
+                                                                db::MucLogVisibility::IrcChanName == channel &&
+                                                                db::MucLogVisibility::LastId == 0).count();
+  if (open_ranges != 0)
+    return;
+  db::MucLogVisibility range(*Database::db);
+  range.owner = owner;
+  range.ircServerName = server;
+  range.ircChanName = channel;
+  range.firstId = get_last_muc_log_id(*Database::db) + 1;
+  range.lastId = 0;
+  range.update();
+}
+
+void Database::close_history_range(const std::string& owner, const std::string& server, const std::string& channel)
+{
+  close_ranges(*Database::db, litesql::select<db::MucLogVisibility>(*Database::db,
+                                                                    db::MucLogVisibility::Owner == owner &&
+                                                                    db::MucLogVisibility::IrcServerName == server &&
+                                                                    db::MucLogVisibility::IrcChanName == channel &&
+                                                                    db::MucLogVisibility::LastId == 0).all());
+}
+
+void Database::close_all_history_ranges()
+{
+  close_ranges(*Database::db, litesql::select<db::MucLogVisibility>(*Database::db,
+                                                                    db::MucLogVisibility::LastId == 0).all());
+}
+
+static int get_migration_progress(db::BibouDB& db, const std::string& name, const int default_value)
+{
+  try {
+      return litesql::select<db::MigrationState>(db, db::MigrationState::Name == name).one().progress.value();
+    } catch (const litesql::NotFound&) {
+      return default_value;
+    }
+}
+
+static void set_migration_progress(db::BibouDB& db, const std::string& name, const int progress)
+{
+  db::MigrationState state(db);
+  try {
+      state = litesql::select<db::MigrationState>(db, db::MigrationState::Name == name).one();
+    } catch (const litesql::NotFound&) {
+      state.name = name;
+    }
+  state.progress = progress;
+  state.update();
+}
+
+bool Database::has_fulltext_search()
+{
+  return Database::fulltext_search;
+}
+
+/**
+ * Whether FTS5 can delete the rows of a contentless table (SQLite 3.43 and
+ * later).
+ */
+static bool has_contentless_delete(db::BibouDB& db)
+{
+  const auto version = db.query("SELECT sqlite_version()");
+  if (version.empty())
+    return false;
+  const auto numbers = utils::split(version[0][0], '.');
+  if (numbers.size() < 2)
+    return false;
+  const auto major = std::atoi(numbers[0].data());
+  const auto minor = std::atoi(numbers[1].data());
+  return major > 3 || (major == 3 && minor >= 43);
+}
+
+void Database::create_fulltext_index()
+{
+  Database::fulltext_index = false;
+  Database::fulltext_search = false;
+  if (!Database::is_sqlite)
+    return;
+  try {
+      const bool contentless = has_contentless_delete(*Database::db);
+      const auto table = Database::db->query("SELECT sql FROM sqlite_master WHERE type = 'table' AND name = " +
+                                             litesql::escapeSQL(fulltext_table));
+      // The first versions of the index stored a copy of each body
+      const bool rebuild = !table.empty() && contentless &&
+                           table[0][0].find("contentless_delete") == std::string::npos;
+      if (table.empty() || rebuild)
+        {
+          if (rebuild)
+            log_info("Rebuilding the full-text index of the MUC history, without a copy of the bodies.");
+          else
+            log_info("Creating the full-text index of the MUC history.");
+          Database::db->begin();
+          try {
+              if (rebuild)
+                Database::db->query("DROP TABLE " + fulltext_table);
+              // search_muc_logs() reads the bodies from MucLogLine: the
+              // index does not need its own copy
+              Database::db->query("CREATE VIRTUAL TABLE " + fulltext_table + " USING fts5(body, room" +
+                                  (contentless ? ", content='', contentless_delete=1" : "") + ")");
+              // The existing lines are added later, by index_muc_logs()
+              const auto last = Database::db->query("SELECT MAX(" + db::MucLogLine::Id.name() + ") FROM " +
+                                                    db::MucLogLine::table__);
+              set_migration_progress(*Database::db, fulltext_migration, 1);
+              set_migration_progress(*Database::db, fulltext_end_migration,
+                                     last.empty() || last[0][0].empty() || last[0][0] == "NULL" ?
+                                     0 : std::stoi(last[0][0]));
+              Database::db->commit();
+            } catch (const litesql::Except&) {
+              Database::db->rollback();
+              throw;
+            }
+        }
+      Database::fulltext_index = true;
+      Database::fulltext_search = get_migration_progress(*Database::db, fulltext_migration, 1) >
+                                  get_migration_progress(*Database::db, fulltext_end_migration, 0);
+    } catch (const litesql::Except& e) {
+      log_warning("Full-text search of the MUC history is not available: ", e.what());
+    }
+}
+
+void Database::index_muc_line(const int id, const std::string& body, const std::string& server,
+                              const std::string& channel)
+{
+  Database::db->query("INSERT INTO " + fulltext_table + "(rowid, body, room) VALUES (" + std::to_string(id) + ", " +
+                      litesql::escapeSQL(body) + ", " + litesql::escapeSQL(make_room_token(server, channel)) + ")");
+}
+
+MigrationProgress Database::index_muc_logs(const std::chrono::steady_clock::duration budget,
+                                           const std::size_t batch_size)
+{
+  const auto start = std::chrono::steady_clock::now();
+  const auto deadline = start + budget;
+  MigrationProgress res;
+  if (!Database::fulltext_index || Database::fulltext_search)
+    return res;
+
+  int next_id = get_migration_progress(*Database::db, fulltext_migration, 1);
+  const int last_id = get_migration_progress(*Database::db, fulltext_end_migration, 0);
+  while (next_id <= last_id)
+    {
+      if (std::chrono::steady_clock::now() >= deadline)
+        {
+          res.done = false;
+          break;
+        }
+      const int batch_end = std::min<long>(static_cast<long>(next_id) + static_cast<long>(batch_size) - 1, last_id);
+      Database::db->begin();
+      try {
+          auto request = litesql::select<db::MucLogLine>(*Database::db, db::MucLogLine::Id >= next_id &&
+                                                         db::MucLogLine::Id <= batch_end);
+          request.orderBy(db::MucLogLine::Id);
+          for (const auto& line: request.all())
+            {
+              Database::index_muc_line(line.id.value(), Database::decode_body(line.body.value(), line.dictionary.value()),
+                                       line.ircServerName.value(), line.ircChanName.value());
+              res.rows++;
+            }
+          next_id = batch_end + 1;
+          set_migration_progress(*Database::db, fulltext_migration, next_id);
+          Database::db->commit();
+        } catch (const litesql::Except&) {
+          Database::db->rollback();
+          throw;
+        }
+    }
+  if (next_id > last_id)
+    {
+      log_info("The full-text index of the MUC history is complete.");
+      Database::fulltext_search = true;
+    }
+  res.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  return res;
+}
+
+void Database::add_muc_logs(const std::vector<HistoryLine>& lines)
+{
+  Database::db->begin();
+  try {
+      for (const auto& line: lines)
+        {
+          db::MucLogLine log_line(*Database::db);
+          log_line.uuid = line.uuid.empty() ? Database::gen_uuid() : line.uuid;
+          log_line.ircChanName = line.channel;
+          log_line.ircServerName = line.server;
+          log_line.date = litesql::DateTime(std::chrono::system_clock::to_time_t(line.date));
+          log_line.nick = line.nick;
+          int dictionary;
+          log_line.body = Database::encode_body(line.body, dictionary);
+          log_line.dictionary = dictionary;
+          log_line.update();
+          if (Database::fulltext_index)
+            Database::index_muc_line(log_line.id.value(), line.body, line.server, line.channel);
+        }
+      Database::db->commit();
+    } catch (const litesql::Except&) {
+      Database::db->rollback();
+      throw;
+    }
+}
+
+PruneResult Database::prune_muc_logs(const RetentionRules& rules, const std::size_t first_rule,
+                                     const std::chrono::steady_clock::duration budget,
+                                     const std::size_t batch_size)
+{
+  const auto start = std::chrono::steady_clock::now();
+  const auto deadline = start + budget;
+  const auto now = std::time(nullptr);
+  const auto rule_count = rules.channels.size() + 1;
+
+  PruneResult res;
+  for (std::size_t i = 0; i < rule_count && res.done; ++i)
+    {
+      const auto rule = (first_rule + i) % rule_count;
+      std::vector<litesql::DataSource<db::MucLogLine>> requests;
+      if (rule == 0)
+        {
+          if (rules.max_age.count() == 0)
+            continue;
+          // The global limit does not apply to the channels with their own
+          auto request = litesql::select<db::MucLogLine>(*Database::db,
+                                                         db::MucLogLine::Date < now - rules.max_age.count());
+          for (const auto& channel: rules.channels)
+            if (channel.policy.max_age.count() != 0)
+              request.where(!(db::MucLogLine::IrcServerName == channel.server &&
+                              db::MucLogLine::IrcChanName == channel.channel));
+          requests.push_back(std::move(request));
+        }
+      else
+        requests = Database::channel_prune_requests(rules.channels[rule - 1], now);
+      for (const auto& request: requests)
+        {
+          std::size_t deleted;
+          do
+            {
+              if (std::chrono::steady_clock::now() >= deadline)
+                {
+                  res.next_rule = rule;
+                  res.done = false;
+                  break;
+                }
+              deleted = Database::delete_oldest_muc_logs(request, batch_size);
+              res.rows += deleted;
+            } while (deleted == batch_size);
+          if (!res.done)
+            break;
+        }
+    }
+  res.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  return res;
+}
+
+std::vector<litesql::DataSource<db::MucLogLine>> Database::channel_prune_requests(const ChannelRetention& channel,
+                                                                                 const std::time_t now)
+{
+  std::vector<litesql::DataSource<db::MucLogLine>> res;
+  const auto in_channel = db::MucLogLine::IrcServerName == channel.server &&
+                          db::MucLogLine::IrcChanName == channel.channel;
+  if (channel.policy.max_age.count() != 0)
+    res.push_back(litesql::select<db::MucLogLine>(*Database::db, in_channel &&
+                                                  db::MucLogLine::Date < now - channel.policy.max_age.count()));
+  if (channel.policy.max_rows != 0)
+    {
+      // The most recent line that is not kept, found by following the
+      // (server, channel, date) index for max_rows entries, instead of
+      // counting all the lines of the channel
+      auto kept = litesql::select<db::MucLogLine>(*Database::db, in_channel);
+      kept.orderBy(db::MucLogLine::Date, false);
+      kept.orderBy(db::MucLogLine::Id, false);
+      kept.limit(1);
+      auto boundary_query = kept.idQuery();
+      boundary_query.offset(channel.policy.max_rows);
+      const auto boundary = Database::db->query(boundary_query);
+      if (!boundary.empty())
+        {
+          const auto last = litesql::select<db::MucLogLine>(*Database::db,
+                                                            db::MucLogLine::Id == std::stoi(boundary[0][0])).one();
+          const auto last_date = last.date.value().timeStamp();
+          const auto last_id = last.id.value();
+          res.push_back(litesql::select<db::MucLogLine>(*Database::db, in_channel &&
+                                                        (db::MucLogLine::Date < last_date ||
+                                                         (db::MucLogLine::Date == last_date &&
+                                                          db::MucLogLine::Id <= last_id))));
+        }
+    }
+  return res;
+}
+
+std::size_t Database::delete_oldest_muc_logs(litesql::DataSource<db::MucLogLine> request,
+                                             const std::size_t limit)
+{
+  request.orderBy(db::MucLogLine::Date);
+  request.orderBy(db::MucLogLine::Id);
+  request.limit(limit);
+  // Select the ids first, following the index, then delete these rows
+  // only: the table is locked for as short a time as possible.
+  return Database::delete_muc_logs(Database::db->query(request.idQuery()));
+}
+
+std::size_t Database::delete_muc_logs(const litesql::Records& ids)
+{
+  if (ids.empty())
+    return 0;
+  std::string id_list;
+  for (const auto& record: ids)
+    {
+      if (!id_list.empty())
+        id_list += ',';
+      id_list += record[0];
+    }
+  Database::db->delete_(db::MucLogLine::table__, db::MucLogLine::Id.in(id_list));
+  if (Database::fulltext_index)
+    Database::db->query("DELETE FROM " + fulltext_table + " WHERE rowid IN (" + id_list + ")");
+  return ids.size();
+}
+
+MigrationProgress Database::compress_muc_logs(const std::chrono::steady_clock::duration budget,
+                                              const std::size_t batch_size)
+{
+  const auto start = std::chrono::steady_clock::now();
+  const auto deadline = start + budget;
+  MigrationProgress res;
+#ifdef ZLIB_FOUND
+  if (!Database::is_sqlite)
+    return res;
+  if (Database::current_dictionary == 0 ||
+      std::time(nullptr) - Database::current_dictionary_date >= dictionary_lifetime)
+    Database::train_dictionary();
+  // Not enough lines yet
+  if (Database::current_dictionary == 0)
+    return res;
+
+  db::MigrationState state(*Database::db);
+  try {
+      state = litesql::select<db::MigrationState>(*Database::db,
+                                                  db::MigrationState::Name == compression_migration).one();
+    } catch (const litesql::NotFound&) {
+      state.name = compression_migration;
+      state.progress = 0;
+    }
+  int next_id = state.progress.value();
+  // The lines added from now on are compressed when inserted
+  const int last_id = get_last_muc_log_id(*Database::db);
+  while (next_id <= last_id)
+    {
+      if (std::chrono::steady_clock::now() >= deadline)
+        {
+          res.done = false;
+          break;
+        }
+      const int batch_last_id = std::min<long>(static_cast<long>(next_id) + static_cast<long>(batch_size) - 1,
+                                               last_id);
+      auto lines = litesql::select<db::MucLogLine>(*Database::db,
+                                                   db::MucLogLine::Id >= next_id &&
+                                                   db::MucLogLine::Id <= batch_last_id &&
+                                                   db::MucLogLine::Dictionary == 0).all();
+      Database::db->begin();
+      try {
+          for (auto& line: lines)
+            {
+              int dictionary;
+              auto body = Database::encode_body(line.body.value(), dictionary);
+              // Some lines are smaller as they are
+              if (dictionary == 0)
+                continue;
+              line.body = std::move(body);
+              line.dictionary = dictionary;
+              line.update();
+              res.rows++;
+            }
+          Database::db->commit();
+        } catch (const litesql::Except&) {
+          Database::db->rollback();
+          throw;
+        }
+      next_id = batch_last_id + 1;
+    }
+  if (next_id != state.progress.value())
+    {
+      state.progress = next_id;
+      state.update();
+    }
+#else
+  static_cast<void>(deadline);
+  static_cast<void>(batch_size);
+#endif
+  res.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  return res;
+}
+
+void Database::load_dictionaries()
+{
+  Database::dictionaries.clear();
+  Database::current_dictionary = 0;
+  for (const auto& dictionary: litesql::select<db::MucLogDictionary>(*Database::db)
+         .orderBy(db::MucLogDictionary::Id).all())
+    {
+      Database::dictionaries[dictionary.id.value()].data = dictionary.data.value();
+      Database::current_dictionary = dictionary.id.value();
+      Database::current_dictionary_date = dictionary.date.value().timeStamp();
+    }
+#ifdef ZLIB_FOUND
+  // Only SQLite stores any bytes in a string
+  if (!Database::is_sqlite)
+#endif
+    Database::current_dictionary = 0;
+}
+
+#ifdef ZLIB_FOUND
+void Database::train_dictionary()
+{
+  std::vector<std::string> samples;
+  samples.reserve(dictionary_samples);
+  for (const auto& line: litesql::select<db::MucLogLine>(*Database::db)
+         .orderBy(db::MucLogLine::Id, false).limit(dictionary_samples).all())
+    samples.push_back(Database::decode_body(line.body.value(), line.dictionary.value()));
+  if (samples.size() < dictionary_min_samples)
+    return;
+  auto data = utils::train_dictionary(samples, dictionary_size);
+  if (data.empty())
+    return;
+  db::MucLogDictionary dictionary(*Database::db);
+  dictionary.data = data;
+  dictionary.date = litesql::DateTime(std::time(nullptr));
+  dictionary.update();
+  log_info("Trained a new dictionary of ", data.size(), " bytes, to compress the MUC history.");
+  Database::dictionaries[dictionary.id.value()].data = std::move(data);
+  Database::current_dictionary = dictionary.id.value();
+  Database::current_dictionary_date = dictionary.date.value().timeStamp();
+}
+#endif
+
+std::string Database::encode_body(const std::string& body, int& dictionary)
+{
+  dictionary = 0;
+#ifdef ZLIB_FOUND
+  if (Database::current_dictionary != 0)
+    {
+      auto& current = Database::dictionaries[Database::current_dictionary];
+      if (!current.compressor)
+        current.compressor = std::make_unique<utils::Compressor>(current.data);
+      auto compressed = current.compressor->compress(body);
+      if (compressed.size() < body.size())
+        {
+          dictionary = Database::current_dictionary;
+          return compressed;
+        }
+    }
+#endif
+  return body;
+}
+
+std::string Database::decode_body(const std::string& body, const int dictionary)
+{
+  if (dictionary == 0)
+    return body;
+#ifdef ZLIB_FOUND
+  const auto it = Database::dictionaries.find(dictionary);
+  if (it == Database::dictionaries.end())
+    log_error("A line of history uses an unknown dictionary: ", dictionary);
+  else
+    {
+      try {
+          if (!it->second.decompressor)
+            it->second.decompressor = std::make_unique<utils::Decompressor>(it->second.data);
+          return it->second.decompressor->decompress(body);
+        } catch (const std::runtime_error& e) {
+          log_error("Failed to decompress a line of history: ", e.what());
+        }
+    }
+#else
+  log_error("A line of history is compressed, but zlib is not available.");
+#endif
+  return undecodable_body;
+}
+
+std::size_t Database::collect_dictionaries()
+{
+  std::size_t res = 0;
+  for (auto it = Database::dictionaries.begin(); it != Database::dictionaries.end();)
+    {
+      auto users = litesql::select<db::MucLogLine>(*Database::db, db::MucLogLine::Dictionary == it->first);
+      users.limit(1);
+      if (it->first == Database::current_dictionary || !Database::db->query(users.idQuery()).empty())
+        {
+          ++it;
+          continue;
+        }
+      Database::db->delete_(db::MucLogDictionary::table__, db::MucLogDictionary::Id == it->first);
+      log_info("Deleted the dictionary ", it->first, ", that no line of history uses anymore.");
+      it = Database::dictionaries.erase(it);
+      res++;
+    }
+  return res;
+}
+
+std::size_t Database::compact(const std::size_t pages)
+{
+  if (!Database::is_sqlite)
+    return 0;
+  if (!Database::incremental_vacuum)
+    {
+      Database::db->query("PRAGMA wal_checkpoint(PASSIVE)");
+      return 0;
+    }
+  Database::db->query("PRAGMA incremental_vacuum(" + std::to_string(pages) + ")");
+  const auto free_pages = Database::db->query("PRAGMA freelist_count");
+  const std::size_t res = free_pages.empty() ? 0 : std::stoul(free_pages[0][0]);
+  if (res == 0)
+    Database::db->query("PRAGMA wal_checkpoint(PASSIVE)");
+  return res;
 }
 
 void Database::close()
 {
-  Database::db.reset(nullptr);
+  Database::sync("close", []()
+  {
+    Database::forget_options();
+    Database::db.reset(nullptr);
+  });
 }
 
 std::string Database::gen_uuid()
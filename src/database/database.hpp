@@ -6,12 +6,34 @@
 
 #include "biboudb.hpp"
 
+#include <utils/compression.hpp>
+#include <network/worker.hpp>
+#include <logger/logger.hpp>
+
+#include <unordered_map>
 #include <memory>
+#include <future>
+#include <atomic>
+#include <map>
 
 #include <litesql.hpp>
 #include <chrono>
+#include <ctime>
 
 class Iid;
+class Poller;
+struct HistoryLine;
+struct RetentionRules;
+struct ChannelRetention;
+struct PruneResult;
+struct MigrationProgress;
+
+/**
+ * Once start_worker() has been called, the connection is owned by a
+ * dedicated thread: all the functions below that touch the database must
+ * only be called from a query passed to async() or sync().  The preloaded
+ * options are the exception: they belong to the main thread.
+ */
 
 class Database
 {
@@ -35,6 +57,10 @@ public:
   /**
    * Return the object from the db. Create it beforehand (with all default
    * values) if it is not already present.
+   *
+   * Once the options are preloaded (which open_database() always does),
+   * these only read the rows kept in memory: they are then called directly
+   * from the main thread, which owns these rows, and never from a query.
    */
   static db::GlobalOptions get_global_options(const std::string& owner);
   static db::IrcServerOptions get_irc_server_options(const std::string& owner,
@@ -48,16 +74,292 @@ public:
   static db::IrcChannelOptions get_irc_channel_options_with_server_and_global_default(const std::string& owner,
                                                                                       const std::string& server,
                                                                                       const std::string& channel);
-  static std::vector<db::MucLogLine> get_muc_logs(const std::string& chan_name, const std::string& server,
-                                                  int limit=-1, const std::string& before="", const std::string& after="");
+  /**
+   * Load all the rows of the three options tables in memory, with a single
+   * scan of each, and return how many there were.  Until the database is
+   * opened again, the get_*_options() functions then never query it: all
+   * the changes must go through save_options(), which keeps the rows in
+   * memory up to date.
+   */
+  static std::size_t preload_options();
+  /**
+   * Return at most limit lines of the channel visible to owner, in
+   * chronological order, dated between start and end if given.  These are
+   * the lines following the one with the uuid after, if given.  Otherwise,
+   * the most recent lines, preceding the one with the uuid before if
+   * given.  Throws litesql::NotFound if after or before are not known.
+   */
+  static std::vector<HistoryLine> get_muc_logs(const std::string& owner,
+                                               const std::string& chan_name, const std::string& server,
+                                               int limit=-1, const std::string& start="", const std::string& end="",
+                                               const std::string& after="", const std::string& before="");
+  /**
+   * Return at most limit lines of the channel visible to owner containing
+   * all the words of text, the most relevant first.  The other arguments
+   * have the same meaning as for get_muc_logs(), except that the lines
+   * after or before the cursor are the less or more relevant ones.  Throws
+   * litesql::NotFound if the cursor is not known, or does not match.
+   */
+  static std::vector<HistoryLine> search_muc_logs(const std::string& owner,
+                                                  const std::string& chan_name, const std::string& server,
+                                                  const std::string& text, int limit=-1,
+                                                  const std::string& start="", const std::string& end="",
+                                                  const std::string& after="", const std::string& before="");
+  /**
+   * Whether search_muc_logs() can be used: only with SQLite, if it was
+   * built with FTS5, once all the lines are indexed.  Can be called from
+   * any thread.
+   */
+  static bool has_fulltext_search();
+  /**
+   * Insert all the lines in a single transaction.
+   */
+  static void add_muc_logs(const std::vector<HistoryLine>& lines);
+  /**
+   * The lines recorded from now on are visible to owner, until
+   * close_history_range() is called.  Nothing is done if such a range is
+   * already open.
+   */
+  static void open_history_range(const std::string& owner, const std::string& server, const std::string& channel);
+  static void close_history_range(const std::string& owner, const std::string& server, const std::string& channel);
+  /**
+   * Close the ranges left open, by a previous process that did not exit
+   * cleanly.
+   */
+  static void close_all_history_ranges();
+  /**
+   * Compress the bodies of the lines stored as text, batch_size ids at a
+   * time, until they all are or the budget is exhausted.  A dictionary is
+   * trained first, if there is none yet or if the current one is too old.
+   * Does nothing with another database than SQLite, or without zlib.
+   */
+  static MigrationProgress compress_muc_logs(const std::chrono::steady_clock::duration budget,
+                                             const std::size_t batch_size);
+  /**
+   * Delete the dictionaries that no line uses anymore (except the current
+   * one), and return how many were deleted.
+   */
+  static std::size_t collect_dictionaries();
+  /**
+   * Add the lines stored before the full-text index was created to it, in
+   * order of id, batch_size lines per transaction, until they all are or
+   * the budget is exhausted.  The next call resumes from there, even after
+   * a restart.
+   */
+  static MigrationProgress index_muc_logs(const std::chrono::steady_clock::duration budget,
+                                          const std::size_t batch_size);
+  /**
+   * Delete the lines that the rules do not keep, oldest first, batch_size
+   * rows at a time, starting with the rule first_rule (0 is the global
+   * max_age, then each channel rule), until all the rules are done or the
+   * budget is exhausted.
+   */
+  static PruneResult prune_muc_logs(const RetentionRules& rules, const std::size_t first_rule,
+                                    const std::chrono::steady_clock::duration budget,
+                                    const std::size_t batch_size);
+  /**
+   * With SQLite, release at most pages free pages of the file, and
+   * checkpoint the WAL once none are left.  Returns the number of free
+   * pages remaining (always 0 if the file does not use the incremental
+   * auto_vacuum, which only a VACUUM can change).
+   */
+  static std::size_t compact(const std::size_t pages);
 
   static void close();
   static void open(const std::string& filename, const std::string& db_type="sqlite3");
 
+  /**
+   * Start the thread that owns the connection. The completions of the
+   * asynchronous queries are run by the given poller's loop.
+   */
+  static void start_worker(std::shared_ptr<Poller> poller);
+  /**
+   * Close the database, once all the queued queries are done, and join the
+   * thread.
+   */
+  static void stop_worker();
+  /**
+   * Run the query on the database thread. The callback is then called on
+   * the event loop thread, with a future holding the value returned (or the
+   * exception thrown) by the query.
+   */
+  template <typename Query, typename Callback>
+  static void async(const char* label, Query query, Callback callback)
+  {
+    using result_t = decltype(query());
+    auto task = std::make_shared<std::packaged_task<result_t()>>(std::move(query));
+    if (!Database::worker)
+      {
+        (*task)();
+        callback(task->get_future());
+        return;
+      }
+    Database::worker->post(label,
+                           [task]() { (*task)(); },
+                           [task, callback]() mutable { callback(task->get_future()); });
+  }
+  /**
+   * Run the query on the database thread, and block until its result is
+   * available. Exceptions thrown by the query are rethrown here.
+   */
+  template <typename Query>
+  static auto sync(const char* label, Query query) -> decltype(query())
+  {
+    std::packaged_task<decltype(query())()> task(std::move(query));
+    auto future = task.get_future();
+    if (Database::worker)
+      Database::worker->run(label, [&task]() { task(); });
+    else
+      task();
+    return future.get();
+  }
+  /**
+   * Run the query in the background, without waiting for its result. A
+   * failure is only logged.
+   */
+  template <typename Query>
+  static void post(const char* label, Query query)
+  {
+    Database::async(label, std::move(query),
+                    [label](std::future<void> result)
+                    {
+                      try {
+                          result.get();
+                        } catch (const std::exception& e) {
+                          log_error("Database query ", label, " failed: ", e.what());
+                        }
+                    });
+  }
+  /**
+   * Save the options, and then replace the row kept in memory, if they were
+   * preloaded.  Waits for the query: only used by the configuration
+   * commands, and the row kept must be the one saved (a new one gets its id
+   * when inserted).  A failure is only logged.
+   */
+  template <typename PersistentType>
+  static void save_options(const char* label, PersistentType object)
+  {
+    try {
+        Database::sync(label, [&object]() { object.update(); });
+      } catch (const std::exception& e) {
+        log_error("Database query ", label, " failed: ", e.what());
+        return;
+      }
+    Database::store_options(object);
+  }
+  /**
+   * The depth of the queue of queries, and the time spent running each
+   * kind of query.
+   */
+  static WorkerMetrics get_worker_metrics();
+
 
 private:
   static std::string gen_uuid();
+  /**
+   * Replace the preloaded row of these options, if preload_options() was
+   * called.
+   */
+  static void store_options(const db::GlobalOptions& options);
+  static void store_options(const db::IrcServerOptions& options);
+  static void store_options(const db::IrcChannelOptions& options);
+  static void forget_options();
+  /**
+   * The line with that uuid, if it is visible to owner in that channel.
+   * Throws litesql::NotFound otherwise.
+   */
+  static db::MucLogLine get_muc_log_cursor(const std::string& owner, const std::string& server,
+                                          const std::string& channel, const std::string& uuid);
+  /**
+   * Delete these lines (records whose first value is a MucLogLine id), and
+   * return how many were deleted.
+   */
+  static std::size_t delete_muc_logs(const litesql::Records& ids);
+  /**
+   * Delete at most limit of the oldest lines selected by request, and
+   * return how many were deleted.
+   */
+  static std::size_t delete_oldest_muc_logs(litesql::DataSource<db::MucLogLine> request,
+                                            const std::size_t limit);
+  /**
+   * The requests selecting the lines of that channel that its rule does
+   * not keep: the ones older than its max_age, and the ones older than its
+   * max_rows most recent lines.
+   */
+  static std::vector<litesql::DataSource<db::MucLogLine>> channel_prune_requests(const ChannelRetention& channel,
+                                                                                 const std::time_t now);
+  static bool is_sqlite;
+  /**
+   * Whether the SQLite file uses the incremental auto_vacuum: otherwise
+   * its free pages can not be released by compact().
+   */
+  static bool incremental_vacuum;
+  /**
+   * Create the MucLogLineFts table, if needed.  The table indexes the body
+   * of each line (its rowid being the id of the MucLogLine), and a token
+   * identifying its channel, without storing them.  The existing lines are
+   * added by index_muc_logs().
+   */
+  static void create_fulltext_index();
+  static void index_muc_line(const int id, const std::string& body, const std::string& server,
+                             const std::string& channel);
+  /**
+   * Make the lines recorded before the MucLogVisibility table existed
+   * visible to everyone.
+   */
+  static void share_legacy_history();
+  static void load_dictionaries();
+  /**
+   * Make a dictionary from the most recent lines, and use it to compress
+   * the lines from now on.  Only with zlib.
+   */
+  static void train_dictionary();
+  /**
+   * The body to store for that text, compressed with the current
+   * dictionary if that makes it smaller, and the id of that dictionary (0
+   * if not compressed).
+   */
+  static std::string encode_body(const std::string& body, int& dictionary);
+  /**
+   * The text of that body.  If it can not be decompressed, the error is
+   * logged and a placeholder is returned instead.
+   */
+  static std::string decode_body(const std::string& body, const int dictionary);
+  /**
+   * A preset dictionary, and the streams using it, created the first time
+   * they are needed and then reused for each line.
+   */
+  struct Dictionary
+  {
+    std::string data;
+#ifdef ZLIB_FOUND
+    std::unique_ptr<utils::Compressor> compressor;
+    std::unique_ptr<utils::Decompressor> decompressor;
+#endif
+  };
+  /**
+   * All the dictionaries, by id, and the one used to compress the new
+   * lines (0 if none).
+   */
+  static std::map<int, Dictionary> dictionaries;
+  static int current_dictionary;
+  static std::time_t current_dictionary_date;
+  static std::atomic<bool> fulltext_search;
+  /**
+   * Whether the MucLogLineFts table exists, and must be updated when lines
+   * are added or deleted.
+   */
+  static bool fulltext_index;
+  /**
+   * The rows loaded by preload_options(), by owner (and server, and
+   * channel).
+   */
+  static bool options_preloaded;
+  static std::unordered_map<std::string, db::GlobalOptions> global_options;
+  static std::unordered_map<std::string, db::IrcServerOptions> irc_server_options;
+  static std::unordered_map<std::string, db::IrcChannelOptions> irc_channel_options;
   static std::unique_ptr<db::BibouDB> db;
+  static std::unique_ptr<Worker> worker;
 };
 #endif /* USE_DATABASE */
 
@@ -1,5 +1,5 @@
 #include <utils/tolower.hpp>
-#include <config/config.hpp>
+#include <utils/config_snapshot.hpp>
 #include <bridge/bridge.hpp>
 #include <irc/iid.hpp>
 
@@ -45,9 +45,9 @@ void Iid::set_type(const std::set<char>& chantypes)
 
 void Iid::init(const std::string& iid)
 {
-  const std::string fixed_irc_server = Config::get("fixed_irc_server", "");
+  const auto config = get_config_snapshot();
 
-  if (fixed_irc_server.empty())
+  if (!config->has_fixed_irc_server)
   {
     const std::string::size_type sep = iid.find('%');
     if (sep != std::string::npos)
@@ -64,7 +64,7 @@ void Iid::init(const std::string& iid)
   }
   else
   {
-    this->set_server(fixed_irc_server);
+    this->set_server(config->fixed_irc_server);
     this->set_local(iid);
   }
 }
@@ -101,7 +101,7 @@ const std::string& Iid::get_server() const
 namespace std {
   const std::string to_string(const Iid& iid)
   {
-    if (Config::get("fixed_irc_server", "").empty())
+    if (!get_config_snapshot()->has_fixed_irc_server)
     {
       if (iid.type == Iid::Type::Server)
         return iid.get_server();
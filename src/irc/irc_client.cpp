@@ -1,4 +1,5 @@
 #include <utils/timed_events.hpp>
+#include <utils/history_writer.hpp>
 #include <database/database.hpp>
 #include <irc/irc_message.hpp>
 #include <irc/irc_client.hpp>
@@ -7,10 +8,14 @@
 
 #include <logger/logger.hpp>
 #include <config/config.hpp>
+#include <utils/config_snapshot.hpp>
 #include <utils/tolower.hpp>
 #include <utils/split.hpp>
 #include <utils/string.hpp>
+#include <network/bind_pool.hpp>
+#include <network/poller.hpp>
 
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include <stdexcept>
@@ -139,6 +144,11 @@ IrcClient::IrcClient(std::shared_ptr<Poller> poller, const std::string& hostname
   current_nick(nickname),
   bridge(bridge),
   welcomed(false),
+  reconnect_from_other_address(false),
+  connection_in_progress(false),
+  registration_failure(ConnectionScheduler::Outcome::failed),
+  turn_lines(0),
+  send_queue("SEND"s + hostname + bridge.get_jid(), [this](std::string&& line) { this->send_data(std::move(line)); }),
   chanmodes({"", "", "", ""}),
   chantypes({'#', '&'})
 {
@@ -152,22 +162,20 @@ IrcClient::IrcClient(std::shared_ptr<Poller> poller, const std::string& hostname
                               "other IRC channels of that server.";
 #ifdef USE_DATABASE
   auto options = Database::get_irc_server_options(this->bridge.get_bare_jid(),
-                                                  this->get_hostname());
-  std::vector<std::string> ports = utils::split(options.ports, ';', false);
-  for (auto it = ports.rbegin(); it != ports.rend(); ++it)
-    this->ports_to_try.emplace(*it, false);
+                                                  this->hostname);
 # ifdef BOTAN_FOUND
-  ports = utils::split(options.tlsPorts, ';', false);
-  for (auto it = ports.rbegin(); it != ports.rend(); ++it)
-    this->ports_to_try.emplace(*it, true);
+  for (const auto& port: utils::split(options.tlsPorts, ';', false))
+    this->ports_to_try.emplace_back(port, true);
 # endif // BOTAN_FOUND
+  for (const auto& port: utils::split(options.ports, ';', false))
+    this->ports_to_try.emplace_back(port, false);
 
 #else  // not USE_DATABASE
-  this->ports_to_try.emplace("6667", false); // standard non-encrypted port
 # ifdef BOTAN_FOUND
-  this->ports_to_try.emplace("6670", true);  // non-standard but I want it for some servers
-  this->ports_to_try.emplace("6697", true);  // standard encrypted port
+  this->ports_to_try.emplace_back("6697", true);  // standard encrypted port
+  this->ports_to_try.emplace_back("6670", true);  // non-standard but I want it for some servers
 # endif // BOTAN_FOUND
+  this->ports_to_try.emplace_back("6667", false); // standard non-encrypted port
 #endif // USE_DATABASE
 }
 
@@ -176,59 +184,86 @@ IrcClient::~IrcClient()
   // This event may or may not exist (if we never got connected, it
   // doesn't), but it's ok
   TimedEventsManager::instance().cancel("PING"s + this->hostname + this->bridge.get_jid());
+  TimedEventsManager::instance().cancel("RECONNECT"s + this->hostname + this->bridge.get_jid());
+  this->end_connection_attempt(ConnectionScheduler::Outcome::cancelled);
+  HistoryWriter::instance().release(this->bridge.get_jid(), this->hostname);
 }
 
-void IrcClient::start()
+void IrcClient::start(const ConnectionPriority priority)
 {
-  if (this->is_connecting() || this->is_connected())
+  if (this->is_connecting() || this->is_connected() || this->is_waiting_to_connect())
     return;
-  std::string port;
-  bool tls;
-  std::tie(port, tls) = this->ports_to_try.top();
-  this->ports_to_try.pop();
+  const auto config = get_config_snapshot();
+  auto& scheduler = ConnectionScheduler::instance();
+  scheduler.set_limits(config->irc_connection_concurrency, config->irc_connection_rate);
+  this->admission = scheduler.request(this->hostname, this->bridge.get_bare_jid(),
+                                      this->bridge.is_rejoining() ? ConnectionPriority::reconnect : priority,
+                                      [this]() { this->on_connection_admitted(); });
+  if (this->admission)
+    this->bridge.send_xmpp_message(this->hostname, "", "Waiting before connecting to "s + this->hostname +
+                                   ": too many connections to that server are starting.");
+}
+
+void IrcClient::on_connection_admitted()
+{
+  this->admission.reset();
+  this->connection_in_progress = true;
+  this->registration_failure = ConnectionScheduler::Outcome::failed;
+  const auto& send_rate = get_config_snapshot()->get_irc_send_rate(this->hostname);
+  this->send_queue.set_rate(send_rate.burst, send_rate.rate);
+  std::string ports;
+  for (const auto& port: this->ports_to_try)
+    {
+      if (!ports.empty())
+        ports += ", ";
+      ports += port.first + " (" + (port.second ? "encrypted" : "not encrypted") + ")";
+    }
   this->bridge.send_xmpp_message(this->hostname, "", "Connecting to "s +
-                                  this->hostname + ":" + port + " (" +
-                                  (tls ? "encrypted" : "not encrypted") + ")");
+                                  this->hostname + ":" + ports);
 
-  this->bind_addr = Config::get("outgoing_bind", "");
+  const auto config = get_config_snapshot();
+  this->bind_addr = BindPool::instance().choose(config->outgoing_bind, config->outgoing_bind_policy,
+                                                this->hostname, this->bridge.get_bare_jid());
 
 #ifdef BOTAN_FOUND
 # ifdef USE_DATABASE
   auto options = Database::get_irc_server_options(this->bridge.get_bare_jid(),
-                                                  this->get_hostname());
+                                                  this->hostname);
   this->credential_manager.set_trusted_fingerprint(options.trustedFingerprint);
 # endif
 #endif
-  this->connect(this->hostname, port, tls);
+  this->connect(this->hostname, this->ports_to_try);
+}
+
+void IrcClient::end_connection_attempt(const ConnectionScheduler::Outcome outcome)
+{
+  if (!this->connection_in_progress)
+    return;
+  this->connection_in_progress = false;
+  ConnectionScheduler::instance().done(this->hostname, this->bridge.get_bare_jid(), outcome);
 }
 
 void IrcClient::on_connection_failed(const std::string& reason)
 {
+  this->send_queue.clear();
+  this->end_connection_attempt(ConnectionScheduler::Outcome::failed);
   this->bridge.send_xmpp_message(this->hostname, "",
                                   "Connection failed: "s + reason);
 
-  if (this->hostname_resolution_failed)
-    while (!this->ports_to_try.empty())
-      this->ports_to_try.pop();
-
-  if (this->ports_to_try.empty())
+  // All the ports were tried at once: send an error message for all room
+  // that the user wanted to join
+  for (const auto& tuple: this->channels_to_join)
     {
-      // Send an error message for all room that the user wanted to join
-      for (const auto& tuple: this->channels_to_join)
-        {
-          Iid iid(std::get<0>(tuple) + "%" + this->hostname, this->chantypes);
-          this->bridge.send_presence_error(iid, this->current_nick,
-                                            "cancel", "item-not-found",
-                                            "", reason);
-        }
+      Iid iid(std::get<0>(tuple) + "%" + this->hostname, this->chantypes);
+      this->bridge.send_presence_error(iid, this->current_nick,
+                                        "cancel", "item-not-found",
+                                        "", reason);
     }
-  else                          // try the next port
-    this->start();
 }
 
 void IrcClient::on_connected()
 {
-  const auto webirc_password = Config::get("webirc_password", "");
+  const auto& webirc_password = get_config_snapshot()->webirc_password;
   static std::string resolved_ip;
 
   if (!webirc_password.empty())
@@ -266,7 +301,7 @@ void IrcClient::on_connected()
 
 #ifdef USE_DATABASE
   auto options = Database::get_irc_server_options(this->bridge.get_bare_jid(),
-                                                  this->get_hostname());
+                                                  this->hostname);
   if (!options.pass.value().empty())
     this->send_pass_command(options.pass.value());
 #endif
@@ -274,7 +309,7 @@ void IrcClient::on_connected()
   this->send_nick_command(this->current_nick);
 
 #ifdef USE_DATABASE
-  if (Config::get("realname_customization", "true") == "true")
+  if (get_config_snapshot()->realname_customization)
     {
       if (!options.username.value().empty())
         this->username = options.username.value();
@@ -293,12 +328,24 @@ void IrcClient::on_connected()
 
 void IrcClient::on_connection_close(const std::string& error_msg)
 {
+  this->send_queue.clear();
+  if (this->reconnect_from_other_address)
+    {
+      this->reconnect_from_other_address = false;
+      // The socket is closed right after this call
+      TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::now(),
+                                                          [this]() { this->start(ConnectionPriority::reconnect); },
+                                                          "RECONNECT"s + this->hostname + this->bridge.get_jid()));
+    }
   std::string message = "Connection closed";
   if (!error_msg.empty())
     message += ": " + error_msg;
   else
     message += ".";
   const IrcMessage error{"ERROR", {message}};
+  // Closed before being registered: by the network, or by the server with
+  // an error that on_error() already classified
+  this->end_connection_attempt(this->registration_failure);
   this->on_error(error);
   log_warning(message);
 }
@@ -332,11 +379,20 @@ std::string IrcClient::get_own_nick() const
 
 void IrcClient::parse_in_buffer(const size_t)
 {
+  const auto budget = get_config_snapshot()->irc_read_budget;
   while (true)
     {
       auto pos = this->in_buf.find("\r\n");
       if (pos == std::string::npos)
         break ;
+      // Let the other connections have their turn, the rest is processed
+      // at the next iteration of the poller
+      if (budget != 0 && this->turn_lines >= budget)
+        {
+          this->poller->defer_input(this);
+          break ;
+        }
+      this->turn_lines++;
       IrcMessage message(this->in_buf.substr(0, pos));
       this->in_buf = this->in_buf.substr(pos + 2, std::string::npos);
       log_debug("IRC RECEIVING: (", this->get_hostname(), ") ", message);
@@ -375,9 +431,46 @@ void IrcClient::parse_in_buffer(const size_t)
     }
 }
 
+void IrcClient::on_deferred_input()
+{
+  this->turn_lines = 0;
+  this->parse_in_buffer(0);
+}
+
+void IrcClient::on_input_turn()
+{
+  this->turn_lines = 0;
+}
+
+bool IrcClient::wants_more_input() const
+{
+  const auto budget = get_config_snapshot()->irc_read_budget;
+  return budget == 0 || this->turn_lines < budget;
+}
+
+/**
+ * The commands that go ahead of the messages waiting to be sent: only the
+ * ones that keep the connection alive.  All the others (JOIN, PART,
+ * QUIT…) must keep their order relative to the messages sent before
+ * them.  Before we are registered, everything does.
+ */
+static SendLane get_send_lane(const std::string& command, const bool welcomed)
+{
+  if (!welcomed || command == "PONG" || command == "PING")
+    return SendLane::high;
+  return SendLane::bulk;
+}
+
+bool IrcClient::is_send_queue_full() const
+{
+  const auto max = get_config_snapshot()->irc_send_queue_max;
+  return max != 0 && this->send_queue.size() >= max;
+}
+
 void IrcClient::send_message(IrcMessage&& message)
 {
   log_debug("IRC SENDING: (", this->get_hostname(), ") ", message);
+  const auto lane = get_send_lane(message.command, this->welcomed);
   std::string res;
   if (!message.prefix.empty())
     res += ":" + std::move(message.prefix) + " ";
@@ -393,13 +486,15 @@ void IrcClient::send_message(IrcMessage&& message)
       res += " " + arg;
     }
   res += "\r\n";
-  this->send_data(std::move(res));
+  this->send_queue.push(std::move(res), lane);
 }
 
 void IrcClient::send_raw(const std::string& txt)
 {
   log_debug("IRC SENDING (raw): (", this->get_hostname(), ") ", txt);
-  this->send_data(txt + "\r\n");
+  auto command = txt.substr(0, txt.find(' '));
+  std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+  this->send_queue.push(txt + "\r\n", get_send_lane(command, this->welcomed));
 }
 
 void IrcClient::send_user_command(const std::string& username, const std::string& realname)
@@ -768,6 +863,7 @@ void IrcClient::on_channel_completely_joined(const IrcMessage& message)
   this->bridge.send_user_join(this->hostname, chan_name, channel->get_self(),
                               channel->get_self()->get_most_significant_mode(this->sorted_user_modes), true);
   this->bridge.send_topic(this->hostname, chan_name, channel->topic, channel->topic_author);
+  this->bridge.send_room_history(this->hostname, chan_name);
 }
 
 void IrcClient::on_own_host_received(const IrcMessage& message)
@@ -826,6 +922,9 @@ void IrcClient::on_generic_error(const IrcMessage& message)
   const std::string error_msg = message.arguments.size() >= 3 ?
     message.arguments[2]: "Unspecified error";
   this->send_gateway_message(message.arguments[1] + ": " + error_msg, message.prefix);
+  // ERR_PASSWDMISMATCH, ERR_YOUREBANNEDCREEP: only that user is refused
+  if (!this->welcomed && (message.command == "464" || message.command == "465"))
+    this->registration_failure = ConnectionScheduler::Outcome::rejected;
 }
 
 void IrcClient::on_useronchannel(const IrcMessage& message)
@@ -838,9 +937,10 @@ void IrcClient::on_welcome_message(const IrcMessage& message)
 {
   this->current_nick = message.arguments[0];
   this->welcomed = true;
+  this->end_connection_attempt(ConnectionScheduler::Outcome::connected);
 #ifdef USE_DATABASE
   auto options = Database::get_irc_server_options(this->bridge.get_bare_jid(),
-                                                  this->get_hostname());
+                                                  this->hostname);
   if (!options.afterConnectionCommand.value().empty())
     this->send_raw(options.afterConnectionCommand.value());
 #endif
@@ -886,6 +986,7 @@ void IrcClient::on_part(const IrcMessage& message)
       if (self)
       {
         channel->joined = false;
+        HistoryWriter::instance().release(this->bridge.get_jid(), this->hostname, chan_name);
         this->channels.erase(utils::tolower(chan_name));
         // channel pointer is now invalid
         channel = nullptr;
@@ -894,9 +995,49 @@ void IrcClient::on_part(const IrcMessage& message)
     }
 }
 
+/**
+ * Whether this ERROR message, received before being welcomed, means that
+ * the server refuses more connections from our address.
+ */
+static bool is_connection_limit_error(const std::string& message)
+{
+  const auto lower = utils::tolower(message);
+  for (const auto& pattern: {"too many", "throttl", "connections from your"})
+    if (lower.find(pattern) != std::string::npos)
+      return true;
+  return false;
+}
+
+/**
+ * Whether this ERROR means that the server throttles the connections from
+ * us, and not just that user.
+ */
+static bool is_throttling_error(const std::string& message)
+{
+  const auto lower = utils::tolower(message);
+  for (const auto& pattern: {"throttl", "too fast"})
+    if (lower.find(pattern) != std::string::npos)
+      return true;
+  return false;
+}
+
 void IrcClient::on_error(const IrcMessage& message)
 {
   const std::string leave_message = message.arguments[0];
+  if (!this->welcomed && this->connection_in_progress)
+    this->registration_failure = is_throttling_error(leave_message) ?
+      ConnectionScheduler::Outcome::failed : ConnectionScheduler::Outcome::rejected;
+  if (!this->welcomed && !this->bind_addr.empty() && is_connection_limit_error(leave_message))
+    {
+      BindPool::instance().reject(this->bind_addr, this->hostname);
+      const auto& addresses = get_config_snapshot()->outgoing_bind;
+      // Only if there is another address left to try
+      this->reconnect_from_other_address =
+        std::any_of(addresses.begin(), addresses.end(), [this](const std::string& address)
+                    {
+                      return !BindPool::instance().is_rejected(address, this->hostname);
+                    });
+    }
   // The user is out of all the channels
   for (auto it = this->channels.begin(); it != this->channels.end(); ++it)
   {
@@ -911,6 +1052,7 @@ void IrcClient::on_error(const IrcMessage& message)
     this->bridge.send_muc_leave(std::move(iid), std::move(own_nick), leave_message, true);
   }
   this->channels.clear();
+  HistoryWriter::instance().release(this->bridge.get_jid(), this->hostname);
   this->send_gateway_message("ERROR: "s + leave_message);
 }
 
@@ -984,7 +1126,10 @@ void IrcClient::on_kick(const IrcMessage& message)
     return ;
   const bool self = channel->get_self()->nick == target;
   if (self)
-    channel->joined = false;
+    {
+      channel->joined = false;
+      HistoryWriter::instance().release(this->bridge.get_jid(), this->hostname, chan_name);
+    }
   IrcUser author(message.prefix);
   Iid iid;
   iid.set_local(chan_name);
@@ -1156,7 +1301,8 @@ void IrcClient::leave_dummy_channel(const std::string& exit_message)
 bool IrcClient::abort_on_invalid_cert() const
 {
 #ifdef USE_DATABASE
-  auto options = Database::get_irc_server_options(this->bridge.get_bare_jid(), this->hostname);
+  auto options = Database::get_irc_server_options(this->bridge.get_bare_jid(),
+                                                  this->hostname);
   return options.verifyCert.value();
 #endif
   return true;
@@ -1,11 +1,13 @@
 #pragma once
 
 
+#include <irc/irc_send_queue.hpp>
 #include <irc/irc_message.hpp>
 #include <irc/irc_channel.hpp>
 #include <irc/iid.hpp>
 
 #include <network/tcp_socket_handler.hpp>
+#include <network/connection_scheduler.hpp>
 #include <network/resolver.hpp>
 
 #include <unordered_map>
@@ -13,7 +15,6 @@
 #include <memory>
 #include <vector>
 #include <string>
-#include <stack>
 #include <map>
 #include <set>
 
@@ -38,9 +39,23 @@ public:
   IrcClient& operator=(IrcClient&&) = delete;
 
   /**
-   * Connect to the IRC server
+   * Connect to the IRC server, once the ConnectionScheduler lets us.  The
+   * joins coming while the clients rejoin their rooms get the priority of a
+   * reconnection.
    */
-  void start();
+  void start(const ConnectionPriority priority=ConnectionPriority::interactive);
+  /**
+   * Whether we are queued in the ConnectionScheduler, before connecting
+   */
+  bool is_waiting_to_connect() const
+  { return this->admission != nullptr; }
+  /**
+   * Whether too many lines are waiting to be sent to the server, to
+   * accept more messages from the user.
+   */
+  bool is_send_queue_full() const;
+  SendQueueMetrics get_send_queue_metrics() const
+  { return this->send_queue.get_metrics(); }
   /**
    * Called when the connection to the server cannot be established
    */
@@ -58,6 +73,19 @@ public:
    * complete messages from it.
    */
   void parse_in_buffer(const size_t) override final;
+  void on_deferred_input() override final;
+  /**
+   * Each turn of the poller processes up to irc_read_budget lines, from as
+   * many reads as needed.  The rest waits for the next turns.
+   */
+  void on_input_turn() override final;
+  bool wants_more_input() const override final;
+  /**
+   * What we read from the server is only forwarded to the XMPP server:
+   * stop reading when it cannot keep up.
+   */
+  bool can_pause_receiving() const override final
+  { return true; }
 #ifdef BOTAN_FOUND
   virtual bool abort_on_invalid_cert() const override final;
 #endif
@@ -76,7 +104,7 @@ public:
   /**
    * Serialize the given message into a line, and send that into the socket
    * (actually, into our out_buf and signal the poller that we want to wach
-   * for send events to be ready)
+   * for send events to be ready), once the send queue lets it go.
    */
   void send_message(IrcMessage&& message);
   void send_raw(const std::string& txt);
@@ -294,6 +322,15 @@ public:
 
   std::set<char> get_chantypes() const { return this->chantypes; }
 private:
+  /**
+   * Called by the ConnectionScheduler when our connection can start.
+   */
+  void on_connection_admitted();
+  /**
+   * Tell the ConnectionScheduler how our connection attempt ended, if it
+   * has not been told yet.
+   */
+  void end_connection_attempt(const ConnectionScheduler::Outcome outcome);
   /**
    * The hostname of the server we are connected to.
    */
@@ -347,6 +384,36 @@ private:
    * has been established, we are authentified and we have a nick)
    */
   bool welcomed;
+  /**
+   * Set when the server refused the connection because too many come from
+   * our address: once it is closed, we connect again from another one.
+   */
+  bool reconnect_from_other_address;
+  /**
+   * Our request in the ConnectionScheduler queue, while we wait in it.
+   */
+  ConnectionScheduler::Ticket admission;
+  /**
+   * Set from the time the ConnectionScheduler started our connection, until
+   * we tell it how that ended.
+   */
+  bool connection_in_progress;
+  /**
+   * How the connection in progress failed, if it is closed before being
+   * registered: failed if the network, or a throttling, closed it;
+   * rejected if the server refused that user (a wrong password, a ban,
+   * too many connections from our address…).
+   */
+  ConnectionScheduler::Outcome registration_failure;
+  /**
+   * The lines processed during the current turn of the poller.
+   */
+  std::size_t turn_lines;
+  /**
+   * All the lines sent to the server go through it, to not be
+   * disconnected for flooding.
+   */
+  IrcSendQueue send_queue;
   /**
    * See http://www.irc.org/tech_docs/draft-brocklesby-irc-isupport-03.txt section 3.3
    * We store the possible chanmodes in this object.
@@ -375,11 +442,11 @@ private:
    */
   std::vector<char> sorted_user_modes;
   /**
-   * A list of ports to which we will try to connect, in reverse. Each port
+   * The ports to which we try to connect, by order of preference. Each port
    * is associated with a boolean telling if we should use TLS or not if the
    * connection succeeds on that port.
    */
-  std::stack<std::pair<std::string, bool>> ports_to_try;
+  Ports ports_to_try;
   /**
    * A set of (lowercase) nicknames to which we sent a private message.
    */
@@ -0,0 +1,97 @@
+#include <irc/irc_send_queue.hpp>
+#include <utils/timed_events.hpp>
+
+#include <algorithm>
+
+IrcSendQueue::IrcSendQueue(const std::string& timer_name, Sender sender):
+  timer_name(timer_name),
+  sender(std::move(sender)),
+  refill_time(std::chrono::steady_clock::now())
+{
+}
+
+IrcSendQueue::~IrcSendQueue()
+{
+  TimedEventsManager::instance().cancel(this->timer_name);
+}
+
+void IrcSendQueue::set_rate(const std::size_t burst, const double rate)
+{
+  this->refill(std::chrono::steady_clock::now());
+  const auto new_burst = std::max<std::size_t>(burst, 1);
+  // A bigger bucket comes with the additional tokens
+  this->tokens = std::min<double>(this->tokens + new_burst - this->burst, new_burst);
+  this->burst = new_burst;
+  this->rate = rate;
+  this->flush();
+}
+
+void IrcSendQueue::push(std::string&& line, const SendLane lane)
+{
+  this->lanes[static_cast<int>(lane)].push_back({std::move(line), std::chrono::steady_clock::now()});
+  this->metrics.max_depth = std::max(this->metrics.max_depth, this->size());
+  // Otherwise the timer is already set
+  if (this->size() == 1)
+    this->flush();
+}
+
+void IrcSendQueue::clear()
+{
+  for (auto& lane: this->lanes)
+    lane.clear();
+  this->tokens = this->burst;
+  this->refill_time = std::chrono::steady_clock::now();
+  TimedEventsManager::instance().cancel(this->timer_name);
+}
+
+std::size_t IrcSendQueue::size() const
+{
+  return this->lanes[0].size() + this->lanes[1].size();
+}
+
+SendQueueMetrics IrcSendQueue::get_metrics() const
+{
+  auto metrics = this->metrics;
+  metrics.depth = this->size();
+  return metrics;
+}
+
+void IrcSendQueue::refill(const std::chrono::steady_clock::time_point& now)
+{
+  this->tokens = std::min<double>(this->burst, this->tokens + this->rate *
+                                  std::chrono::duration<double>(now - this->refill_time).count());
+  this->refill_time = now;
+}
+
+void IrcSendQueue::flush()
+{
+  const auto now = std::chrono::steady_clock::now();
+  if (this->rate > 0)
+    this->refill(now);
+  while (this->size() > 0)
+    {
+      if (this->rate > 0 && this->tokens < 1)
+        {
+          const auto delay = std::chrono::duration<double>((1 - this->tokens) / this->rate);
+          const auto time_point = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay);
+          if (!TimedEventsManager::instance().reschedule(this->timer_name, time_point))
+            TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::time_point(time_point),
+                                                                [this]() { this->flush(); }, this->timer_name));
+          return;
+        }
+      auto& lane = !this->lanes[0].empty() ? this->lanes[0] : this->lanes[1];
+      auto line = std::move(lane.front());
+      lane.pop_front();
+      if (this->rate > 0)
+        this->tokens -= 1;
+      const auto delay = std::chrono::duration_cast<std::chrono::milliseconds>(now - line.since);
+      this->metrics.sent++;
+      if (delay.count() > 0)
+        {
+          this->metrics.delayed++;
+          this->metrics.total_delay += delay;
+          this->metrics.max_delay = std::max(this->metrics.max_delay, delay);
+        }
+      this->sender(std::move(line.data));
+    }
+}
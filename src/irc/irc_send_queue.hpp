@@ -0,0 +1,97 @@
+#pragma once
+
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <string>
+#include <deque>
+
+/**
+ * The lines of the high lane are sent before the ones of the bulk lane,
+ * which keep their order.
+ */
+enum class SendLane
+{
+  high,
+  bulk,
+};
+
+struct SendQueueMetrics
+{
+  /**
+   * The lines waiting right now, and the most that ever waited at once.
+   */
+  std::size_t depth{0};
+  std::size_t max_depth{0};
+  std::uint64_t sent{0};
+  /**
+   * The lines that could not be sent right away, and how long they waited.
+   */
+  std::uint64_t delayed{0};
+  std::chrono::milliseconds total_delay{0};
+  std::chrono::milliseconds max_delay{0};
+};
+
+/**
+ * Pace the lines sent to an IRC server, so that it does not disconnect us
+ * for flooding it: a token bucket lets `burst` lines go at once, and then
+ * `rate` lines per second.  The lines that must wait are queued, and sent
+ * from a timed event.
+ */
+class IrcSendQueue
+{
+public:
+  using Sender = std::function<void(std::string&&)>;
+
+  /**
+   * timer_name must be unique to this queue.
+   */
+  explicit IrcSendQueue(const std::string& timer_name, Sender sender);
+  ~IrcSendQueue();
+  IrcSendQueue(const IrcSendQueue&) = delete;
+  IrcSendQueue(IrcSendQueue&&) = delete;
+  IrcSendQueue& operator=(const IrcSendQueue&) = delete;
+  IrcSendQueue& operator=(IrcSendQueue&&) = delete;
+
+  /**
+   * A rate of 0 means no limit.
+   */
+  void set_rate(const std::size_t burst, const double rate);
+  /**
+   * Send that line (with its \r\n) as soon as the rate allows it.
+   */
+  void push(std::string&& line, const SendLane lane);
+  /**
+   * Drop the queued lines and give back all the tokens, when the
+   * connection is closed.
+   */
+  void clear();
+  std::size_t size() const;
+  SendQueueMetrics get_metrics() const;
+
+private:
+  /**
+   * Send the lines that can be sent now, and set the timer for the next
+   * one if some remain.
+   */
+  void flush();
+  void refill(const std::chrono::steady_clock::time_point& now);
+
+  struct Line
+  {
+    std::string data;
+    std::chrono::steady_clock::time_point since;
+  };
+  /**
+   * Indexed by lane.
+   */
+  std::deque<Line> lanes[2];
+  const std::string timer_name;
+  Sender sender;
+  std::size_t burst{1};
+  double rate{0};
+  double tokens{1};
+  std::chrono::steady_clock::time_point refill_time;
+  SendQueueMetrics metrics;
+};
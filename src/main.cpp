@@ -8,8 +8,16 @@
 
 #ifdef CARES_FOUND
 # include <network/dns_handler.hpp>
+#else
+# include <network/resolver.hpp>
 #endif
+#include <database/database.hpp>
+#include <utils/history_writer.hpp>
+#include <utils/history_retention.hpp>
 
+#include "biboumi.h"
+
+#include <algorithm>
 #include <atomic>
 #include <signal.h>
 
@@ -82,12 +90,6 @@ int main(int ac, char** av)
   if (hostname.empty())
     return config_help("hostname");
 
-  try {
-      open_database();
-    } catch (...) {
-      return 1;
-    }
-
   // Block the signals we want to manage. They will be unblocked only during
   // the epoll_pwait or ppoll calls. This avoids some race conditions,
   // explained in man 2 pselect on linux
@@ -120,12 +122,33 @@ int main(int ac, char** av)
   sigaction(SIGUSR2, &on_sigusr, nullptr);
 
   auto p = std::make_shared<Poller>();
+  p->set_max_events(static_cast<std::size_t>(std::max(Config::get_int("poller_max_events",
+                                                                      Poller::default_max_events), 1)));
+
+  // Started once the signals are blocked, so that they are only ever
+  // received by this thread
+#ifdef USE_DATABASE
+  Database::start_worker(p);
+#endif
+  try {
+      open_database();
+    } catch (...) {
+      return 1;
+    }
+#ifdef USE_DATABASE
+  // No bridge is in any channel yet
+  Database::sync("close_all_history_ranges", []() { Database::close_all_history_ranges(); });
+  HistoryRetention::instance().start();
+#endif
+
   auto xmpp_component =
     std::make_shared<BiboumiComponent>(p, hostname, password);
   xmpp_component->start();
 
 #ifdef CARES_FOUND
-  DNSHandler::instance.watch_dns_sockets(p);
+  DNSHandler::instance.watch_sockets(p);
+#else
+  Resolver::start_pool(p);
 #endif
   auto timeout = TimedEventsManager::instance().get_timeout();
   while (p->poll(timeout) != -1)
@@ -145,6 +168,13 @@ int main(int ac, char** av)
       xmpp_component->shutdown();
       // Cancel the timer for a potential reconnection
       TimedEventsManager::instance().cancel("XMPP reconnection");
+#ifdef CARES_FOUND
+      // Do not wait for the DNS queries in progress
+      DNSHandler::instance.stop_watching();
+#endif
+#ifdef USE_DATABASE
+      HistoryRetention::instance().stop();
+#endif
     }
     if (reload)
     {
@@ -183,10 +213,6 @@ int main(int ac, char** av)
       xmpp_component->close();
     if (exiting && p->size() == 1 && xmpp_component->is_document_open())
       xmpp_component->close_document();
-#ifdef CARES_FOUND
-    if (!exiting)
-      DNSHandler::instance.watch_dns_sockets(p);
-#endif
     if (exiting) // If we are exiting, do not wait for any timed event
       timeout = utils::no_timeout;
     else
@@ -194,6 +220,13 @@ int main(int ac, char** av)
   }
 #ifdef CARES_FOUND
   DNSHandler::instance.destroy();
+#else
+  Resolver::stop_pool();
+#endif
+#ifdef USE_DATABASE
+  // Write the history lines still pending, before the database is closed
+  HistoryWriter::instance().flush();
+  Database::stop_worker();
 #endif
   if (!xmpp_component->ever_auth)
     return 1; // To signal that the process did not properly start
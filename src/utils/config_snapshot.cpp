@@ -0,0 +1,77 @@
+#include <utils/config_snapshot.hpp>
+#include <config/config.hpp>
+#include <utils/split.hpp>
+#include <logger/logger.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <atomic>
+
+static std::shared_ptr<const ConfigSnapshot> current_snapshot;
+
+/**
+ * Parse the rules of the form server:burst:rate, separated by spaces.
+ */
+static std::unordered_map<std::string, IrcSendRate> parse_send_rates(const std::string& rules)
+{
+  std::unordered_map<std::string, IrcSendRate> res;
+  for (const auto& rule: utils::split(rules, ' ', false))
+    {
+      const auto fields = utils::split(rule, ':');
+      if (fields.size() != 3 || fields[0].empty())
+        {
+          log_warning("Ignoring invalid IRC send rate: ", rule);
+          continue;
+        }
+      res[fields[0]] = {static_cast<std::size_t>(std::max(std::atoi(fields[1].data()), 1)),
+                        std::max(std::atof(fields[2].data()), 0.0)};
+    }
+  return res;
+}
+
+ConfigSnapshot::ConfigSnapshot():
+  generation(Config::get_generation()),
+  fixed_irc_server(Config::get("fixed_irc_server", "")),
+  has_fixed_irc_server(!fixed_irc_server.empty()),
+  realname_from_jid(Config::get("realname_from_jid", "false") == "true"),
+  realname_customization(Config::get("realname_customization", "true") == "true"),
+  outgoing_bind(utils::split(Config::get("outgoing_bind", ""), ' ', false)),
+  outgoing_bind_policy(to_bind_policy(Config::get("outgoing_bind_policy", "round-robin"))),
+  irc_connection_concurrency(std::max(Config::get_int("irc_connection_concurrency", 4), 0)),
+  irc_connection_rate(std::max(std::atof(Config::get("irc_connection_rate", "2").data()), 0.0)),
+  irc_send_rate({static_cast<std::size_t>(std::max(Config::get_int("irc_send_burst", 5), 1)),
+                 std::max(std::atof(Config::get("irc_send_rate", "1").data()), 0.0)}),
+  irc_server_send_rates(parse_send_rates(Config::get("irc_server_send_rates", ""))),
+  irc_send_queue_max(std::max(Config::get_int("irc_send_queue_max", 100), 0)),
+  irc_read_budget(std::max(Config::get_int("irc_read_budget", 100), 0)),
+  history_retention(parse_retention_rules(Config::get("history_max_age", ""),
+                                          Config::get("history_channel_retention", ""))),
+  history_compaction_hour(Config::get_int("history_compaction_hour", 4)),
+  webirc_password(Config::get("webirc_password", "")),
+  admin(Config::get("admin", ""))
+{
+}
+
+const IrcSendRate& ConfigSnapshot::get_irc_send_rate(const std::string& server) const
+{
+  const auto it = this->irc_server_send_rates.find(server);
+  if (it == this->irc_server_send_rates.end())
+    return this->irc_send_rate;
+  return it->second;
+}
+
+std::shared_ptr<const ConfigSnapshot> get_config_snapshot()
+{
+  auto snapshot = std::atomic_load(&current_snapshot);
+  if (!snapshot || snapshot->generation != Config::get_generation())
+    {
+      publish_config_snapshot();
+      snapshot = std::atomic_load(&current_snapshot);
+    }
+  return snapshot;
+}
+
+void publish_config_snapshot()
+{
+  std::atomic_store(&current_snapshot, std::shared_ptr<const ConfigSnapshot>(std::make_shared<ConfigSnapshot>()));
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <utils/history_retention.hpp>
+#include <network/bind_pool.hpp>
+
+#include <unordered_map>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * How many lines can be sent to an IRC server at once, and then per
+ * second.  A rate of 0 means no limit.
+ */
+struct IrcSendRate
+{
+  std::size_t burst;
+  double rate;
+};
+
+/**
+ * The configuration values that are read on hot paths (for each stanza, or
+ * each new IRC connection), parsed once into their final type.
+ *
+ * A snapshot is immutable.  A new one is built whenever the configuration
+ * changes, and published by atomically swapping the shared pointer
+ * returned by get_config_snapshot(): readers keep using the snapshot they
+ * got until they release it, and never look up a string in the Config
+ * map.
+ */
+struct ConfigSnapshot
+{
+  /**
+   * Read all the values from Config
+   */
+  ConfigSnapshot();
+
+  const unsigned long generation;
+
+  const std::string fixed_irc_server;
+  const bool has_fixed_irc_server;
+  const bool realname_from_jid;
+  const bool realname_customization;
+  /**
+   * The addresses to bind the IRC connections to, and how to choose one.
+   */
+  const std::vector<std::string> outgoing_bind;
+  const BindPolicy outgoing_bind_policy;
+  /**
+   * How many connections to the same IRC server can be in progress at
+   * once, and how many can be started per second.  0 means no limit.
+   */
+  const std::size_t irc_connection_concurrency;
+  const double irc_connection_rate;
+  /**
+   * The send rate of the servers that are not in irc_server_send_rates.
+   */
+  const IrcSendRate irc_send_rate;
+  const std::unordered_map<std::string, IrcSendRate> irc_server_send_rates;
+  /**
+   * Above that number of lines waiting to be sent to an IRC server, the
+   * messages of the user are refused.  0 means no limit.
+   */
+  const std::size_t irc_send_queue_max;
+  /**
+   * How many of the lines received from an IRC server are processed at
+   * once, before letting the other connections have their turn.  0 means
+   * no limit.
+   */
+  const std::size_t irc_read_budget;
+  /**
+   * The history_max_age and history_channel_retention rules, and the hour
+   * during which the database file is compacted.
+   */
+  const RetentionRules history_retention;
+  const int history_compaction_hour;
+  const std::string webirc_password;
+  const std::string admin;
+
+  const IrcSendRate& get_irc_send_rate(const std::string& server) const;
+};
+
+/**
+ * Returns the current snapshot.  If the configuration changed since that
+ * snapshot was built (Config::set(), Config::read_conf()…), a new one is
+ * published first.
+ */
+std::shared_ptr<const ConfigSnapshot> get_config_snapshot();
+/**
+ * Build a snapshot from the current configuration and publish it.
+ */
+void publish_config_snapshot();
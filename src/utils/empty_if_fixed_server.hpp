@@ -3,20 +3,20 @@
 
 #include <string>
 
-#include <config/config.hpp>
+#include <utils/config_snapshot.hpp>
 
 namespace utils
 {
   inline std::string empty_if_fixed_server(std::string&& str)
   {
-    if (!Config::get("fixed_irc_server", "").empty())
+    if (get_config_snapshot()->has_fixed_irc_server)
       return {};
     return str;
   }
 
   inline std::string empty_if_fixed_server(const std::string& str)
   {
-    if (!Config::get("fixed_irc_server", "").empty())
+    if (get_config_snapshot()->has_fixed_irc_server)
       return {};
     return str;
   }
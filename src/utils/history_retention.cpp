@@ -0,0 +1,296 @@
+#include <utils/history_retention.hpp>
+#include <utils/timed_events.hpp>
+#include <utils/config_snapshot.hpp>
+#include <utils/split.hpp>
+#include <logger/logger.hpp>
+
+#include <algorithm>
+#include <sstream>
+#include <ctime>
+
+#ifdef USE_DATABASE
+# include <database/database.hpp>
+#endif
+
+static constexpr std::chrono::seconds one_day{24 * 60 * 60};
+
+/**
+ * Parse a positive number, or return 0 if that’s not one (or if it’s
+ * unreasonably big).
+ */
+static std::size_t parse_count(const std::string& value)
+{
+  if (value.empty() || value.size() > 9 ||
+      !std::all_of(value.begin(), value.end(), [](const char c) { return c >= '0' && c <= '9'; }))
+    return 0;
+  return std::stoul(value);
+}
+
+bool RetentionRules::empty() const
+{
+  return this->max_age.count() == 0 && this->channels.empty();
+}
+
+RetentionRules parse_retention_rules(const std::string& max_age, const std::string& channel_rules)
+{
+  RetentionRules rules;
+  rules.max_age = one_day * parse_count(max_age);
+
+  std::istringstream is(channel_rules);
+  std::string rule;
+  while (is >> rule)
+    {
+      // A trailing empty field is not returned by split()
+      const auto fields = utils::split(rule, ':');
+      const auto percent = fields[0].rfind('%');
+      if (fields.size() < 2 || fields.size() > 3 || percent == std::string::npos || percent == 0 || percent == fields[0].size() - 1)
+        {
+          log_warning("Ignoring invalid history retention rule: ", rule);
+          continue;
+        }
+      ChannelRetention channel;
+      channel.channel = fields[0].substr(0, percent);
+      channel.server = fields[0].substr(percent + 1);
+      channel.policy.max_age = one_day * parse_count(fields[1]);
+      if (fields.size() == 3)
+        channel.policy.max_rows = parse_count(fields[2]);
+      if (channel.policy.max_age.count() == 0 && channel.policy.max_rows == 0)
+        continue;
+      rules.channels.push_back(std::move(channel));
+    }
+  return rules;
+}
+
+#ifdef USE_DATABASE
+/**
+ * How many free pages are released by each compaction job.
+ */
+static constexpr std::size_t compaction_pages = 256;
+/**
+ * How many compaction jobs are run each day at most, even if some free
+ * pages remain (other processes may keep freeing them).
+ */
+static constexpr std::size_t max_compaction_passes = 64;
+
+static std::tm get_local_time()
+{
+  const auto now = std::time(nullptr);
+  std::tm res;
+  ::localtime_r(&now, &res);
+  return res;
+}
+
+HistoryRetention::HistoryRetention(const std::chrono::milliseconds budget, const std::size_t batch_size,
+                                   const std::chrono::milliseconds busy_interval,
+                                   const std::chrono::milliseconds idle_interval):
+  budget(budget),
+  batch_size(std::max<std::size_t>(batch_size, 1)),
+  busy_interval(busy_interval),
+  idle_interval(idle_interval),
+  timer_name("history retention")
+{
+}
+
+HistoryRetention& HistoryRetention::instance()
+{
+  static HistoryRetention retention;
+  return retention;
+}
+
+void HistoryRetention::start()
+{
+  this->running = true;
+  this->schedule(this->busy_interval);
+}
+
+void HistoryRetention::stop()
+{
+  if (this->running)
+    TimedEventsManager::instance().cancel(this->timer_name);
+  this->running = false;
+}
+
+void HistoryRetention::schedule(const std::chrono::milliseconds delay)
+{
+  if (!this->running)
+    return;
+  TimedEventsManager::instance().cancel(this->timer_name);
+  TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::now() + delay,
+                                                      [this]() { this->tick(); }, this->timer_name));
+}
+
+void HistoryRetention::tick()
+{
+  if (this->job_pending)
+    return;
+  if (!this->indexing_done)
+    {
+      this->index_history();
+      return;
+    }
+  if (!this->compression_done)
+    {
+      this->compress_history();
+      return;
+    }
+  // The rules are parsed once per configuration change, and the snapshot
+  // is immutable: the database thread can keep reading it
+  auto config = get_config_snapshot();
+  if (config->history_retention.empty())
+    {
+      this->compression_done = false;
+      this->collect_dictionaries();
+      return;
+    }
+  this->job_pending = true;
+  Database::async("prune_muc_logs",
+                  [config = std::move(config), first_rule = this->next_rule, budget = this->budget,
+                   batch_size = this->batch_size]()
+                  {
+                    return Database::prune_muc_logs(config->history_retention, first_rule, budget, batch_size);
+                  },
+                  [this](std::future<PruneResult> future)
+                  {
+                    this->job_pending = false;
+                    PruneResult result;
+                    try {
+                        result = future.get();
+                      } catch (const std::exception& e) {
+                        log_error("Failed to prune the MUC history: ", e.what());
+                        this->schedule(this->idle_interval);
+                        return;
+                      }
+                    this->metrics.ticks++;
+                    this->metrics.rows_pruned += result.rows;
+                    this->metrics.time_spent += result.elapsed;
+                    this->metrics.max_tick = std::max(this->metrics.max_tick, result.elapsed);
+                    if (result.rows > 0)
+                      log_debug("Pruned ", result.rows, " lines of history in ", result.elapsed.count(), "us");
+                    this->next_rule = result.done ? 0 : result.next_rule;
+                    if (result.done)
+                      {
+                        this->compression_done = false;
+                        this->collect_dictionaries();
+                      }
+                    else
+                      this->schedule(this->busy_interval);
+                  });
+}
+
+void HistoryRetention::index_history()
+{
+  this->job_pending = true;
+  Database::async("index_muc_logs",
+                  [budget = this->budget, batch_size = this->batch_size]()
+                  {
+                    return Database::index_muc_logs(budget, batch_size);
+                  },
+                  [this](std::future<MigrationProgress> future)
+                  {
+                    this->job_pending = false;
+                    MigrationProgress progress;
+                    try {
+                        progress = future.get();
+                      } catch (const std::exception& e) {
+                        log_error("Failed to index the MUC history: ", e.what());
+                        this->schedule(this->idle_interval);
+                        return;
+                      }
+                    this->metrics.lines_indexed += progress.rows;
+                    this->metrics.time_spent += progress.elapsed;
+                    this->metrics.max_tick = std::max(this->metrics.max_tick, progress.elapsed);
+                    this->indexing_done = progress.done;
+                    this->schedule(this->busy_interval);
+                  });
+}
+
+void HistoryRetention::compress_history()
+{
+  this->job_pending = true;
+  Database::async("compress_muc_logs",
+                  [budget = this->budget, batch_size = this->batch_size]()
+                  {
+                    return Database::compress_muc_logs(budget, batch_size);
+                  },
+                  [this](std::future<MigrationProgress> future)
+                  {
+                    this->job_pending = false;
+                    MigrationProgress progress;
+                    try {
+                        progress = future.get();
+                      } catch (const std::exception& e) {
+                        log_error("Failed to compress the MUC history: ", e.what());
+                        this->schedule(this->idle_interval);
+                        return;
+                      }
+                    this->metrics.bodies_compressed += progress.rows;
+                    this->metrics.time_spent += progress.elapsed;
+                    this->metrics.max_tick = std::max(this->metrics.max_tick, progress.elapsed);
+                    this->compression_done = progress.done;
+                    this->schedule(this->busy_interval);
+                  });
+}
+
+void HistoryRetention::collect_dictionaries()
+{
+  this->job_pending = true;
+  Database::async("collect_dictionaries", []() { return Database::collect_dictionaries(); },
+                  [this](std::future<std::size_t> future)
+                  {
+                    this->job_pending = false;
+                    try {
+                        this->metrics.dictionaries_deleted += future.get();
+                      } catch (const std::exception& e) {
+                        log_error("Failed to delete the unused dictionaries: ", e.what());
+                      }
+                    this->compact();
+                  });
+}
+
+RetentionMetrics HistoryRetention::get_metrics() const
+{
+  return this->metrics;
+}
+
+bool HistoryRetention::in_compaction_window() const
+{
+  return get_local_time().tm_hour == get_config_snapshot()->history_compaction_hour;
+}
+
+void HistoryRetention::compact()
+{
+  const auto today = get_local_time().tm_yday;
+  if (!this->in_compaction_window() || this->compacted_day == today)
+    {
+      this->schedule(this->idle_interval);
+      return;
+    }
+  if (this->compaction_day != today)
+    {
+      this->compaction_day = today;
+      this->compaction_passes = 0;
+    }
+  this->job_pending = true;
+  Database::async("compact_database", []() { return Database::compact(compaction_pages); },
+                  [this, today](std::future<std::size_t> future)
+                  {
+                    this->job_pending = false;
+                    std::size_t free_pages = 0;
+                    try {
+                        free_pages = future.get();
+                      } catch (const std::exception& e) {
+                        log_error("Failed to compact the database: ", e.what());
+                      }
+                    this->metrics.compactions++;
+                    if (free_pages != 0 && ++this->compaction_passes >= max_compaction_passes)
+                      {
+                        log_info("Stopping the compaction of the database for today, ", free_pages,
+                                 " free pages remaining.");
+                        free_pages = 0;
+                      }
+                    if (free_pages == 0)
+                      this->compacted_day = today;
+                    this->schedule(free_pages == 0 ? this->idle_interval : this->busy_interval);
+                  });
+}
+#endif
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "biboumi.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+
+/**
+ * How long the lines of the history are kept.  A zero value means no
+ * limit.
+ */
+struct RetentionPolicy
+{
+  std::chrono::seconds max_age{0};
+  std::size_t max_rows{0};
+};
+
+struct ChannelRetention
+{
+  std::string server;
+  std::string channel;
+  RetentionPolicy policy;
+};
+
+/**
+ * The global max_age applies to all the channels without their own
+ * max_age.  A channel max_rows applies in addition to its max_age.
+ */
+struct RetentionRules
+{
+  std::chrono::seconds max_age{0};
+  std::vector<ChannelRetention> channels;
+
+  bool empty() const;
+};
+
+/**
+ * Parse the history_max_age option (a number of days), and the
+ * history_channel_retention one: a list of rules separated by spaces, each
+ * of the form “channel%server:days:rows”, where days or rows may be empty.
+ * Invalid rules are ignored.
+ */
+RetentionRules parse_retention_rules(const std::string& max_age, const std::string& channel_rules);
+
+/**
+ * What one tick of pruning did.  next_rule is the rule to resume from, if
+ * the budget was exhausted before all the rules were done.
+ */
+struct PruneResult
+{
+  std::size_t rows{0};
+  std::size_t next_rule{0};
+  bool done{true};
+  std::chrono::microseconds elapsed{0};
+};
+
+/**
+ * What one tick of a migration of the stored lines (indexing or
+ * compressing them) did.
+ */
+struct MigrationProgress
+{
+  std::size_t rows{0};
+  bool done{true};
+  std::chrono::microseconds elapsed{0};
+};
+
+struct RetentionMetrics
+{
+  std::uint64_t rows_pruned{0};
+  std::uint64_t ticks{0};
+  std::chrono::microseconds time_spent{0};
+  std::chrono::microseconds max_tick{0};
+  std::uint64_t compactions{0};
+  std::uint64_t bodies_compressed{0};
+  std::uint64_t dictionaries_deleted{0};
+  /**
+   * The lines added to the full-text index after its creation.
+   */
+  std::uint64_t lines_indexed{0};
+};
+
+#ifdef USE_DATABASE
+/**
+ * Remove the lines of the MUC history that are older than the configured
+ * retention, in the background.
+ *
+ * A timer posts a pruning job to the database thread.  Each job deletes
+ * the oldest matching lines, in batches of batch_size rows following the
+ * (server, channel, date) index, and stops once budget is spent, so that
+ * the other queries never wait more than a few milliseconds behind it.  The
+ * next job is scheduled busy_interval later if some work remains, and
+ * idle_interval later otherwise.
+ *
+ * First, the lines stored before the full-text index was created are added
+ * to it, the same way.  Then, before each pruning pass, the lines stored as text are compressed (which also trains
+ * a new dictionary from time to time), and after it the dictionaries that
+ * no line uses anymore are deleted.
+ *
+ * During the hour set by history_compaction_hour, the free pages of the
+ * SQLite file are also released, a few at a time and for a bounded number
+ * of jobs per day, and the WAL is checkpointed.
+ */
+class HistoryRetention
+{
+public:
+  explicit HistoryRetention(const std::chrono::milliseconds budget=std::chrono::milliseconds(5),
+                            const std::size_t batch_size=200,
+                            const std::chrono::milliseconds busy_interval=std::chrono::milliseconds(250),
+                            const std::chrono::milliseconds idle_interval=std::chrono::minutes(1));
+  ~HistoryRetention() = default;
+  HistoryRetention(const HistoryRetention&) = delete;
+  HistoryRetention(HistoryRetention&&) = delete;
+  HistoryRetention& operator=(const HistoryRetention&) = delete;
+  HistoryRetention& operator=(HistoryRetention&&) = delete;
+
+  static HistoryRetention& instance();
+
+  void start();
+  void stop();
+  /**
+   * Run one tick now, instead of waiting for the timer.
+   */
+  void tick();
+  RetentionMetrics get_metrics() const;
+
+private:
+  void schedule(const std::chrono::milliseconds delay);
+  /**
+   * One step of the indexing of the lines stored before the full-text
+   * index was created.
+   */
+  void index_history();
+  /**
+   * One step of the compression of the lines stored as text.
+   */
+  void compress_history();
+  /**
+   * Delete the dictionaries that no line uses anymore, after each pruning
+   * pass, and then compact.
+   */
+  void collect_dictionaries();
+  bool in_compaction_window() const;
+  void compact();
+
+  const std::chrono::milliseconds budget;
+  const std::size_t batch_size;
+  const std::chrono::milliseconds busy_interval;
+  const std::chrono::milliseconds idle_interval;
+  const std::string timer_name;
+
+  bool running{false};
+  /**
+   * Whether a job is queued on the database thread.  No other tick is run
+   * until it completes.
+   */
+  bool job_pending{false};
+  std::size_t next_rule{0};
+  bool indexing_done{false};
+  /**
+   * Whether all the lines were compressed, since the last pruning pass.
+   */
+  bool compression_done{false};
+  /**
+   * The day (tm_yday) of the last compaction that released all the free
+   * pages, or that ran max_compaction_passes jobs.
+   */
+  int compacted_day{-1};
+  /**
+   * How many compaction jobs were run on compaction_day.
+   */
+  int compaction_day{-1};
+  std::size_t compaction_passes{0};
+  RetentionMetrics metrics;
+};
+#endif
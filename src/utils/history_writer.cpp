@@ -0,0 +1,128 @@
+#include <utils/history_writer.hpp>
+#include <utils/recent_history.hpp>
+#include <utils/timed_events.hpp>
+#include <utils/tolower.hpp>
+#include <logger/logger.hpp>
+
+#include <algorithm>
+
+#ifdef USE_DATABASE
+# include <database/database.hpp>
+#endif
+
+using namespace std::string_literals;
+
+static std::string make_channel_key(const std::string& server, const std::string& channel)
+{
+  return server + '\0' + utils::tolower(channel);
+}
+
+static std::string make_timer_name()
+{
+  static unsigned int count = 0;
+  return "history flush "s + std::to_string(count++);
+}
+
+HistoryWriter::HistoryWriter(sink_t sink, const std::size_t batch_size,
+                             const std::chrono::milliseconds max_age,
+                             RecentHistory* recent_history):
+  sink(std::move(sink)),
+  batch_size(std::max<std::size_t>(batch_size, 1)),
+  max_age(max_age),
+  timer_name(make_timer_name()),
+  recent_history(recent_history)
+{
+}
+
+HistoryWriter::~HistoryWriter()
+{
+  // The timer only exists while some lines are pending
+  if (!this->pending.empty())
+    TimedEventsManager::instance().cancel(this->timer_name);
+}
+
+HistoryWriter& HistoryWriter::instance()
+{
+#ifdef USE_DATABASE
+  static HistoryWriter writer([](std::vector<HistoryLine>&& lines)
+  {
+    const auto size = lines.size();
+    Database::async("add_muc_logs",
+                    [lines = std::move(lines)]() { Database::add_muc_logs(lines); },
+                    [size](std::future<void> result)
+                    {
+                      try {
+                          result.get();
+                        } catch (const std::exception& e) {
+                          log_error("Failed to write ", size, " lines of history: ", e.what());
+                        }
+                    });
+  }, 256, std::chrono::milliseconds(200), &RecentHistory::instance());
+#else
+  static HistoryWriter writer([](std::vector<HistoryLine>&&) {}, 256, std::chrono::milliseconds(200),
+                              &RecentHistory::instance());
+#endif
+  return writer;
+}
+
+bool HistoryWriter::log(const std::string& receiver, HistoryLine&& line)
+{
+  auto key = make_channel_key(line.server, line.channel);
+  const auto it = this->recorders.find(key);
+  if (it == this->recorders.end())
+    this->recorders.emplace(std::move(key), Recorder{receiver, line.server});
+  else if (it->second.receiver != receiver)
+    {
+      this->metrics.duplicates++;
+      return false;
+    }
+
+  if (this->pending.empty())
+    TimedEventsManager::instance().add_event(TimedEvent(std::chrono::steady_clock::now() + this->max_age,
+                                                        [this]() { this->flush(); }, this->timer_name));
+  if (this->recent_history)
+    this->recent_history->add(line);
+  this->pending.push_back(std::move(line));
+  this->metrics.lines++;
+  if (this->pending.size() >= this->batch_size)
+    this->flush();
+  return true;
+}
+
+void HistoryWriter::flush()
+{
+  TimedEventsManager::instance().cancel(this->timer_name);
+  if (this->pending.empty())
+    return;
+  std::vector<HistoryLine> lines;
+  lines.reserve(this->batch_size);
+  lines.swap(this->pending);
+  this->metrics.batches++;
+  this->sink(std::move(lines));
+}
+
+HistoryWriterMetrics HistoryWriter::get_metrics() const
+{
+  auto metrics = this->metrics;
+  metrics.pending = this->pending.size();
+  return metrics;
+}
+
+void HistoryWriter::release(const std::string& receiver, const std::string& server,
+                            const std::string& channel)
+{
+  if (!channel.empty())
+    {
+      const auto it = this->recorders.find(make_channel_key(server, channel));
+      if (it != this->recorders.end() && it->second.receiver == receiver)
+        this->recorders.erase(it);
+      return;
+    }
+  for (auto it = this->recorders.begin(); it != this->recorders.end();)
+    {
+      if (it->second.receiver == receiver && (server.empty() || it->second.server == server))
+        it = this->recorders.erase(it);
+      else
+        ++it;
+    }
+}
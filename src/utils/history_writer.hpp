@@ -0,0 +1,115 @@
+#pragma once
+
+#include "biboumi.h"
+
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+
+/**
+ * A message relayed in a channel, waiting to be written in the MUC
+ * history.
+ */
+struct HistoryLine
+{
+  std::string server;
+  std::string channel;
+  std::string nick;
+  std::string body;
+  std::chrono::system_clock::time_point date;
+  std::string uuid;
+};
+
+class RecentHistory;
+
+struct HistoryWriterMetrics
+{
+  std::uint64_t lines{0};
+  /**
+   * Lines received by an IrcClient that is not the one recording that
+   * channel.
+   */
+  std::uint64_t duplicates{0};
+  std::uint64_t batches{0};
+  std::size_t pending{0};
+};
+
+/**
+ * Collect the lines to record in the history, and hand them to a sink in
+ * batches, once batch_size lines are pending or when the oldest pending
+ * line is max_age old.  With the database sink, each batch is inserted in
+ * a single transaction, on the database thread.
+ *
+ * The same IRC channel may be joined by several users: each of their
+ * IrcClients then receives the same messages.  The first IrcClient that
+ * logs a line in a channel becomes the one recording it, and the lines
+ * received by the others are ignored, whatever their content.  Once it is
+ * released (it left the channel, or got disconnected), the next IrcClient
+ * logging a line in that channel takes over.
+ */
+class HistoryWriter
+{
+public:
+  using sink_t = std::function<void(std::vector<HistoryLine>&&)>;
+
+  /**
+   * Each line accepted is also added to recent_history, if not null.
+   */
+  explicit HistoryWriter(sink_t sink, const std::size_t batch_size=256,
+                         const std::chrono::milliseconds max_age=std::chrono::milliseconds(200),
+                         RecentHistory* recent_history=nullptr);
+  ~HistoryWriter();
+  HistoryWriter(const HistoryWriter&) = delete;
+  HistoryWriter(HistoryWriter&&) = delete;
+  HistoryWriter& operator=(const HistoryWriter&) = delete;
+  HistoryWriter& operator=(HistoryWriter&&) = delete;
+
+  /**
+   * The writer inserting the lines in the MucLogLine table (or only in the
+   * RecentHistory instance, without a database).
+   */
+  static HistoryWriter& instance();
+
+  /**
+   * Queue a line received by the given IrcClient, identified by the JID of
+   * its bridge (and line.server).  Returns false if another IrcClient is
+   * recording that channel.
+   */
+  bool log(const std::string& receiver, HistoryLine&& line);
+  /**
+   * The IrcClient of that receiver, on that server, stops recording that
+   * channel, or all its channels if it is empty.  With an empty server, it
+   * applies to all the IrcClients of that receiver.
+   */
+  void release(const std::string& receiver, const std::string& server="",
+               const std::string& channel="");
+  /**
+   * Hand all the pending lines to the sink now.
+   */
+  void flush();
+  HistoryWriterMetrics get_metrics() const;
+
+private:
+  struct Recorder
+  {
+    std::string receiver;
+    std::string server;
+  };
+
+  const sink_t sink;
+  const std::size_t batch_size;
+  const std::chrono::milliseconds max_age;
+  const std::string timer_name;
+  RecentHistory* const recent_history;
+
+  std::vector<HistoryLine> pending;
+  /**
+   * The IrcClient recording each channel, keyed by server and lowercase
+   * channel name.
+   */
+  std::unordered_map<std::string, Recorder> recorders;
+  HistoryWriterMetrics metrics;
+};
@@ -0,0 +1,293 @@
+#include <utils/recent_history.hpp>
+
+#include <algorithm>
+
+static std::string make_key(const std::string& server, const std::string& channel)
+{
+  auto key = server;
+  key += '\0';
+  key += channel;
+  return key;
+}
+
+static std::size_t line_memory(const HistoryLine& line)
+{
+  return sizeof(HistoryLine) + line.server.size() + line.channel.size() +
+         line.nick.size() + line.body.size() + line.uuid.size();
+}
+
+static std::size_t owner_memory(const std::string& owner)
+{
+  return owner.size() + sizeof(std::string) + sizeof(std::uint64_t) + sizeof(std::vector<int>);
+}
+
+constexpr std::uint64_t RecentHistory::open_range_end;
+
+bool RecentHistory::OwnerRanges::is_known(const std::uint64_t seq) const
+{
+  return seq >= this->known_from;
+}
+
+bool RecentHistory::OwnerRanges::is_visible(const std::uint64_t seq) const
+{
+  return std::any_of(this->ranges.begin(), this->ranges.end(),
+                     [seq](const Range& range) { return range.first <= seq && seq <= range.last; });
+}
+
+std::uint64_t RecentHistory::Channel::next_seq() const
+{
+  return this->first_seq + this->lines.size();
+}
+
+RecentHistory::RecentHistory(const std::size_t lines_per_channel, const std::size_t memory_cap):
+  lines_per_channel(std::max<std::size_t>(lines_per_channel, 1)),
+  memory_cap(memory_cap)
+{
+}
+
+RecentHistory& RecentHistory::instance()
+{
+  static RecentHistory history;
+  return history;
+}
+
+void RecentHistory::add(const HistoryLine& line)
+{
+  Channel& channel = this->find_or_create(make_key(line.server, line.channel));
+  channel.lines.push_back(line);
+  this->metrics.memory += line_memory(line);
+  if (channel.lines.size() > this->lines_per_channel)
+    this->pop_front(channel);
+  this->evict();
+}
+
+void RecentHistory::open_range(const std::string& owner, const std::string& server, const std::string& channel_name)
+{
+  Channel& channel = this->find_or_create(make_key(server, channel_name));
+  const auto seq = channel.next_seq();
+  auto it = channel.owners.find(owner);
+  if (it == channel.owners.end())
+    {
+      it = channel.owners.emplace(owner, OwnerRanges{seq, {}}).first;
+      this->metrics.memory += owner_memory(owner);
+    }
+  auto& ranges = it->second.ranges;
+  if (!ranges.empty() && ranges.back().last == open_range_end)
+    return;
+  // Forget the ranges of lines that are not in memory anymore
+  const auto old = std::find_if(ranges.begin(), ranges.end(),
+                                [&channel](const Range& range) { return range.last >= channel.first_seq; });
+  this->metrics.memory -= std::distance(ranges.begin(), old) * sizeof(Range);
+  ranges.erase(ranges.begin(), old);
+  ranges.push_back({seq, open_range_end});
+  this->metrics.memory += sizeof(Range);
+  this->evict();
+}
+
+void RecentHistory::close_range(const std::string& owner, const std::string& server, const std::string& channel_name)
+{
+  Channel* channel = this->find(make_key(server, channel_name));
+  if (!channel)
+    return;
+  const auto it = channel->owners.find(owner);
+  if (it == channel->owners.end())
+    return;
+  auto& ranges = it->second.ranges;
+  if (ranges.empty() || ranges.back().last != open_range_end)
+    return;
+  if (ranges.back().first == channel->next_seq())
+    {
+      ranges.pop_back();
+      this->metrics.memory -= sizeof(Range);
+    }
+  else
+    ranges.back().last = channel->next_seq() - 1;
+}
+
+bool RecentHistory::get_last_lines(const std::string& owner, const std::string& server,
+                                   const std::string& channel_name, const int max_lines,
+                                   const std::chrono::system_clock::time_point since,
+                                   std::vector<HistoryLine>& lines)
+{
+  lines.clear();
+  if (max_lines == 0)
+    return true;
+  const Channel* channel = this->find(make_key(server, channel_name));
+  if (!channel || channel->owners.count(owner) == 0)
+    {
+      this->metrics.misses++;
+      return false;
+    }
+  const auto& ranges = channel->owners.at(owner);
+  // Complete once a line older than since, or enough lines, are found
+  bool complete = false;
+  bool known = true;
+  auto seq = channel->next_seq();
+  for (auto it = channel->lines.rbegin(); it != channel->lines.rend() && !complete; ++it)
+    {
+      --seq;
+      if (it->date < since)
+        complete = true;
+      else if (!ranges.is_known(seq))
+        known = false;
+      else if (ranges.is_visible(seq))
+        {
+          lines.push_back(*it);
+          complete = max_lines > 0 && lines.size() == static_cast<std::size_t>(max_lines);
+        }
+    }
+  std::reverse(lines.begin(), lines.end());
+  if (!complete || !known)
+    {
+      this->metrics.misses++;
+      return false;
+    }
+  this->metrics.hits++;
+  return true;
+}
+
+bool RecentHistory::get_page(const std::string& owner, const std::string& server, const std::string& channel_name,
+                             const std::size_t limit, const std::time_t start, const std::time_t end,
+                             const std::string& after, const std::string& before,
+                             std::vector<HistoryLine>& lines)
+{
+  const Channel* channel = this->find(make_key(server, channel_name));
+  if (!channel || channel->lines.empty() || channel->owners.count(owner) == 0)
+    {
+      this->metrics.misses++;
+      return false;
+    }
+  const auto& ring = channel->lines;
+  const auto& ranges = channel->owners.at(owner);
+  const auto seq_of = [channel, &ring](std::deque<HistoryLine>::const_iterator it)
+  {
+    return channel->first_seq + static_cast<std::uint64_t>(std::distance(ring.begin(), it));
+  };
+  const auto matches = [start, end](const HistoryLine& line)
+  {
+    const auto date = std::chrono::system_clock::to_time_t(line.date);
+    return (start == -1 || date >= start) && (end == -1 || date <= end);
+  };
+  // The cursor must be a line that owner can see
+  const auto find_uuid = [&ring, &ranges, &seq_of](const std::string& uuid)
+  {
+    const auto it = std::find_if(ring.begin(), ring.end(),
+                                 [&uuid](const HistoryLine& line) { return line.uuid == uuid; });
+    if (it == ring.end() || !ranges.is_known(seq_of(it)) || !ranges.is_visible(seq_of(it)))
+      return ring.end();
+    return it;
+  };
+
+  std::vector<HistoryLine> res;
+  bool known = true;
+  if (!after.empty())
+    {
+      // Everything following a line we know is in memory
+      auto it = find_uuid(after);
+      if (it == ring.end())
+        {
+          this->metrics.misses++;
+          return false;
+        }
+      for (++it; it != ring.end() && res.size() < limit; ++it)
+        if (matches(*it) && ranges.is_visible(seq_of(it)))
+          res.push_back(*it);
+    }
+  else
+    {
+      auto it = ring.end();
+      if (!before.empty())
+        {
+          it = find_uuid(before);
+          if (it == ring.end())
+            {
+              this->metrics.misses++;
+              return false;
+            }
+        }
+      while (it != ring.begin() && res.size() < limit && known)
+        {
+          --it;
+          if (!matches(*it))
+            continue;
+          const auto seq = seq_of(it);
+          if (!ranges.is_known(seq))
+            known = false;
+          else if (ranges.is_visible(seq))
+            res.push_back(*it);
+        }
+      // Older lines, only in the database, may also match, unless they are
+      // all excluded by the start date
+      if (!known || (res.size() < limit &&
+                     (start == -1 || std::chrono::system_clock::to_time_t(ring.front().date) >= start)))
+        {
+          this->metrics.misses++;
+          return false;
+        }
+      std::reverse(res.begin(), res.end());
+    }
+  this->metrics.hits++;
+  lines = std::move(res);
+  return true;
+}
+
+RecentHistoryMetrics RecentHistory::get_metrics() const
+{
+  return this->metrics;
+}
+
+void RecentHistory::clear()
+{
+  this->channels.clear();
+  this->index.clear();
+  this->metrics = {};
+}
+
+RecentHistory::Channel* RecentHistory::find(const std::string& key)
+{
+  const auto it = this->index.find(key);
+  if (it == this->index.end())
+    return nullptr;
+  this->channels.splice(this->channels.begin(), this->channels, it->second);
+  return &this->channels.front();
+}
+
+RecentHistory::Channel& RecentHistory::find_or_create(const std::string& key)
+{
+  Channel* channel = this->find(key);
+  if (channel)
+    return *channel;
+  this->channels.push_front({key, {}, 0, {}});
+  this->index.emplace(key, this->channels.begin());
+  this->metrics.memory += key.size();
+  this->metrics.channels++;
+  return this->channels.front();
+}
+
+void RecentHistory::pop_front(Channel& channel)
+{
+  this->metrics.memory -= line_memory(channel.lines.front());
+  channel.lines.pop_front();
+  channel.first_seq++;
+}
+
+void RecentHistory::evict()
+{
+  while (this->metrics.memory > this->memory_cap && this->channels.size() > 1)
+    {
+      const auto& channel = this->channels.back();
+      this->metrics.memory -= channel.key.size();
+      for (const auto& line: channel.lines)
+        this->metrics.memory -= line_memory(line);
+      for (const auto& owner: channel.owners)
+        this->metrics.memory -= owner_memory(owner.first) + owner.second.ranges.size() * sizeof(Range);
+      this->index.erase(channel.key);
+      this->channels.pop_back();
+      this->metrics.channels--;
+      this->metrics.evictions++;
+    }
+  // A single channel bigger than the cap only keeps its newest lines
+  while (this->metrics.memory > this->memory_cap && !this->channels.empty() &&
+         this->channels.front().lines.size() > 1)
+    this->pop_front(this->channels.front());
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <utils/history_writer.hpp>
+
+#include <unordered_map>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+
+struct RecentHistoryMetrics
+{
+  /**
+   * Queries entirely answered from memory, and the ones that needed the
+   * database.
+   */
+  std::uint64_t hits{0};
+  std::uint64_t misses{0};
+  /**
+   * Number of channels evicted to stay under the memory cap.
+   */
+  std::uint64_t evictions{0};
+  std::size_t memory{0};
+  std::size_t channels{0};
+};
+
+/**
+ * The last lines relayed in each channel, shared by all the bridges.
+ *
+ * The lines of a channel are always a suffix of its whole history: all the
+ * lines recorded since the oldest one we keep.  A query for lines more
+ * recent than that one can thus be answered without the database.
+ *
+ * Each owner only sees the lines received while one of its bridges was in
+ * the channel: the ranges of lines, mirroring the MucLogVisibility rows,
+ * opened when joining and closed when leaving.  The lines older than the
+ * first range known in memory for an owner may be visible through an older
+ * range, only in the database, so a query that needs them is a miss.
+ *
+ * Each channel keeps at most lines_per_channel lines, and the least
+ * recently used channels are evicted when the total memory used exceeds
+ * memory_cap.
+ */
+class RecentHistory
+{
+public:
+  explicit RecentHistory(const std::size_t lines_per_channel=100,
+                         const std::size_t memory_cap=16*1024*1024);
+  ~RecentHistory() = default;
+  RecentHistory(const RecentHistory&) = delete;
+  RecentHistory(RecentHistory&&) = delete;
+  RecentHistory& operator=(const RecentHistory&) = delete;
+  RecentHistory& operator=(RecentHistory&&) = delete;
+
+  static RecentHistory& instance();
+
+  void add(const HistoryLine& line);
+  /**
+   * Make the lines added from now on visible to owner, until close_range()
+   * is called.  Does nothing if a range is already open.
+   */
+  void open_range(const std::string& owner, const std::string& server, const std::string& channel);
+  void close_range(const std::string& owner, const std::string& server, const std::string& channel);
+  /**
+   * The history sent when joining a room: at most max_lines lines (all of
+   * them if negative), not older than since.  Returns false if some lines
+   * may be missing from lines, because they are not in memory anymore, or
+   * because we don’t know if they are visible to owner.
+   */
+  bool get_last_lines(const std::string& owner, const std::string& server, const std::string& channel,
+                      const int max_lines, const std::chrono::system_clock::time_point since,
+                      std::vector<HistoryLine>& lines);
+  /**
+   * Same semantics as Database::get_muc_logs, with the dates already
+   * parsed (-1 if not given).  Returns false, without touching lines, if
+   * the answer may include lines that are not in memory anymore, or if
+   * the cursor is not known.
+   */
+  bool get_page(const std::string& owner, const std::string& server, const std::string& channel,
+                const std::size_t limit, const std::time_t start, const std::time_t end,
+                const std::string& after, const std::string& before,
+                std::vector<HistoryLine>& lines);
+  RecentHistoryMetrics get_metrics() const;
+  void clear();
+
+private:
+  /**
+   * The sequence numbers of the first and last lines of a range, last
+   * being open_range_end while the range is open.
+   */
+  struct Range
+  {
+    std::uint64_t first;
+    std::uint64_t last;
+  };
+  struct OwnerRanges
+  {
+    /**
+     * The sequence number of the first line added after the first range
+     * was opened.  The visibility of the lines before it is unknown.
+     */
+    std::uint64_t known_from;
+    std::vector<Range> ranges;
+
+    bool is_known(const std::uint64_t seq) const;
+    bool is_visible(const std::uint64_t seq) const;
+  };
+  struct Channel
+  {
+    std::string key;
+    std::deque<HistoryLine> lines;
+    /**
+     * The sequence number of lines.front().
+     */
+    std::uint64_t first_seq{0};
+    std::unordered_map<std::string, OwnerRanges> owners;
+
+    std::uint64_t next_seq() const;
+  };
+  static constexpr std::uint64_t open_range_end = UINT64_MAX;
+  /**
+   * Return the channel, marked as the most recently used one, or nullptr.
+   */
+  Channel* find(const std::string& key);
+  Channel& find_or_create(const std::string& key);
+  void pop_front(Channel& channel);
+  void evict();
+
+  const std::size_t lines_per_channel;
+  const std::size_t memory_cap;
+  /**
+   * Most recently used first.
+   */
+  std::list<Channel> channels;
+  std::unordered_map<std::string, std::list<Channel>::iterator> index;
+  RecentHistoryMetrics metrics;
+};
@@ -1,11 +1,14 @@
 #include <utils/reload.hpp>
 #include <database/database.hpp>
 #include <config/config.hpp>
+#include <utils/config_snapshot.hpp>
 #include <utils/xdg.hpp>
 #include <logger/logger.hpp>
 
 #include "biboumi.h"
 
+#include <chrono>
+
 void open_database()
 {
 #ifdef USE_DATABASE
@@ -13,12 +16,19 @@ void open_database()
   log_info("Opening database: ", db_filename);
   Database::open(db_filename);
   log_info("database successfully opened.");
+  // The options are then read from memory by the main thread, without
+  // waiting for the database thread
+  const auto start = std::chrono::steady_clock::now();
+  const auto rows = Database::sync("preload_options", []() { return Database::preload_options(); });
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  log_info("Loaded ", rows, " options in ", elapsed.count(), "ms.");
 #endif
 }
 
 void reload_process()
 {
   Config::read_conf();
+  publish_config_snapshot();
   // Destroy the logger instance, to be recreated the next time a log
   // line needs to be written
   Logger::instance().reset();
@@ -1,10 +1,16 @@
 #include <xmpp/biboumi_adhoc_commands.hpp>
 #include <xmpp/biboumi_component.hpp>
-#include <config/config.hpp>
+#include <utils/config_snapshot.hpp>
+#include <utils/history_writer.hpp>
+#include <utils/recent_history.hpp>
+#include <utils/history_retention.hpp>
 #include <utils/string.hpp>
 #include <utils/split.hpp>
 #include <xmpp/jid.hpp>
+#include <network/bind_pool.hpp>
+#include <network/connection_scheduler.hpp>
 #include <algorithm>
+#include <map>
 
 #include <biboumi.h>
 
@@ -117,7 +123,8 @@ void ConfigureGlobalStep1(XmppComponent&, AdhocSession& session, XmlNode& comman
   const Jid owner(session.get_owner_jid());
   const Jid target(session.get_target_jid());
 
-  auto options = Database::get_global_options(owner.bare());
+  const auto owner_jid = owner.bare();
+  auto options = Database::get_global_options(owner_jid);
 
   XmlNode x("jabber:x:data:x");
   x["type"] = "form";
@@ -166,7 +173,8 @@ void ConfigureGlobalStep2(XmppComponent& xmpp_component, AdhocSession& session,
   if (x)
     {
       const Jid owner(session.get_owner_jid());
-      auto options = Database::get_global_options(owner.bare());
+      const auto owner_jid = owner.bare();
+      auto options = Database::get_global_options(owner_jid);
       for (const XmlNode* field: x->get_children("field", "jabber:x:data"))
         {
           const XmlNode* value = field->get_child("value", "jabber:x:data");
@@ -184,7 +192,7 @@ void ConfigureGlobalStep2(XmppComponent& xmpp_component, AdhocSession& session,
             }
         }
 
-      options.update();
+      Database::save_options("update_global_options", std::move(options));
 
       command_node.delete_all_children();
       XmlNode note("note");
@@ -206,10 +214,10 @@ void ConfigureIrcServerStep1(XmppComponent&, AdhocSession& session, XmlNode& com
   const Jid owner(session.get_owner_jid());
   const Jid target(session.get_target_jid());
   std::string server_domain;
-  if ((server_domain = Config::get("fixed_irc_server", "")).empty())
+  if ((server_domain = get_config_snapshot()->fixed_irc_server).empty())
     server_domain = target.local;
-  auto options = Database::get_irc_server_options(owner.local + "@" + owner.domain,
-                                                  server_domain);
+  const auto owner_jid = owner.local + "@" + owner.domain;
+  auto options = Database::get_irc_server_options(owner_jid, server_domain);
 
   XmlNode x("jabber:x:data:x");
   x["type"] = "form";
@@ -307,7 +315,7 @@ void ConfigureIrcServerStep1(XmppComponent&, AdhocSession& session, XmlNode& com
   after_cnt_cmd.add_child(required);
   x.add_child(std::move(after_cnt_cmd));
 
-  if (Config::get("realname_customization", "true") == "true")
+  if (get_config_snapshot()->realname_customization)
     {
       XmlNode username("field");
       username["var"] = "username";
@@ -376,10 +384,10 @@ void ConfigureIrcServerStep2(XmppComponent&, AdhocSession& session, XmlNode& com
       const Jid owner(session.get_owner_jid());
       const Jid target(session.get_target_jid());
       std::string server_domain;
-      if ((server_domain = Config::get("fixed_irc_server", "")).empty())
+      if ((server_domain = get_config_snapshot()->fixed_irc_server).empty())
         server_domain = target.local;
-      auto options = Database::get_irc_server_options(owner.local + "@" + owner.domain,
-                                                      server_domain);
+      const auto owner_jid = owner.local + "@" + owner.domain;
+      auto options = Database::get_irc_server_options(owner_jid, server_domain);
       for (const XmlNode* field: x->get_children("field", "jabber:x:data"))
         {
           const XmlNode* value = field->get_child("value", "jabber:x:data");
@@ -447,7 +455,7 @@ void ConfigureIrcServerStep2(XmppComponent&, AdhocSession& session, XmlNode& com
 
         }
 
-      options.update();
+      Database::save_options("update_irc_server_options", std::move(options));
 
       command_node.delete_all_children();
       XmlNode note("note");
@@ -469,8 +477,8 @@ void ConfigureIrcChannelStep1(XmppComponent&, AdhocSession& session, XmlNode& co
   const Jid owner(session.get_owner_jid());
   const Jid target(session.get_target_jid());
   const Iid iid(target.local, {});
-  auto options = Database::get_irc_channel_options_with_server_default(owner.local + "@" + owner.domain,
-                                                                       iid.get_server(), iid.get_local());
+  const auto owner_jid = owner.local + "@" + owner.domain;
+  auto options = Database::get_irc_channel_options_with_server_default(owner_jid, iid.get_server(), iid.get_local());
 
   XmlNode x("jabber:x:data:x");
   x["type"] = "form";
@@ -522,8 +530,8 @@ void ConfigureIrcChannelStep2(XmppComponent&, AdhocSession& session, XmlNode& co
       const Jid owner(session.get_owner_jid());
       const Jid target(session.get_target_jid());
       const Iid iid(target.local, {});
-      auto options = Database::get_irc_channel_options(owner.local + "@" + owner.domain,
-                                                       iid.get_server(), iid.get_local());
+      const auto owner_jid = owner.local + "@" + owner.domain;
+      auto options = Database::get_irc_channel_options(owner_jid, iid.get_server(), iid.get_local());
       for (const XmlNode* field: x->get_children("field", "jabber:x:data"))
         {
           const XmlNode* value = field->get_child("value", "jabber:x:data");
@@ -537,7 +545,7 @@ void ConfigureIrcChannelStep2(XmppComponent&, AdhocSession& session, XmlNode& co
             options.encodingIn = value->get_inner();
         }
 
-      options.update();
+      Database::save_options("update_irc_channel_options", std::move(options));
 
       command_node.delete_all_children();
       XmlNode note("note");
@@ -558,7 +566,7 @@ void ConfigureIrcChannelStep2(XmppComponent&, AdhocSession& session, XmlNode& co
 void DisconnectUserFromServerStep1(XmppComponent& xmpp_component, AdhocSession& session, XmlNode& command_node)
 {
   const Jid owner(session.get_owner_jid());
-  if (owner.bare() != Config::get("admin", ""))
+  if (owner.bare() != get_config_snapshot()->admin)
     { // A non-admin is not allowed to disconnect other users, only
       // him/herself, so we just skip this step
       auto next_step = session.get_next_step();
@@ -720,3 +728,128 @@ void DisconnectUserFromServerStep3(XmppComponent& xmpp_component, AdhocSession&
   note.set_inner(msg);
   command_node.add_child(std::move(note));
 }
+
+void ListOutgoingAddresses(XmppComponent&, AdhocSession&, XmlNode& command_node)
+{
+  const auto& addresses = get_config_snapshot()->outgoing_bind;
+  const auto& pool = BindPool::instance();
+  std::string text;
+  for (const auto& address: addresses)
+    text += address + ": " + std::to_string(pool.get_connections(address)) + " connections\n";
+  // The addresses removed from the configuration, still used by some connections
+  for (const auto& count: pool.get_counts())
+    if (std::find(addresses.begin(), addresses.end(), count.first) == addresses.end())
+      text += count.first + ": " + std::to_string(count.second) + " connections (not configured anymore)\n";
+  if (text.empty())
+    text = "No outgoing address is configured.";
+  command_node.delete_all_children();
+  XmlNode note("note");
+  note["type"] = "info";
+  note.set_inner(text);
+  command_node.add_child(std::move(note));
+}
+
+void ListIrcSendQueues(XmppComponent& xmpp_component, AdhocSession&, XmlNode& command_node)
+{
+  auto& biboumi_component = static_cast<BiboumiComponent&>(xmpp_component);
+  struct ServerQueues
+  {
+    std::size_t connections{0};
+    SendQueueMetrics metrics;
+  };
+  std::map<std::string, ServerQueues> servers;
+  for (Bridge* bridge: biboumi_component.get_bridges())
+    for (const auto& pair: bridge->get_irc_clients())
+      {
+        const auto metrics = pair.second->get_send_queue_metrics();
+        auto& server = servers[pair.first];
+        server.connections++;
+        server.metrics.depth += metrics.depth;
+        server.metrics.max_depth = std::max(server.metrics.max_depth, metrics.max_depth);
+        server.metrics.sent += metrics.sent;
+        server.metrics.delayed += metrics.delayed;
+        server.metrics.total_delay += metrics.total_delay;
+        server.metrics.max_delay = std::max(server.metrics.max_delay, metrics.max_delay);
+      }
+  std::string text;
+  for (const auto& pair: servers)
+    {
+      const auto& metrics = pair.second.metrics;
+      text += pair.first + ": " + std::to_string(pair.second.connections) + " connections, " +
+          std::to_string(metrics.depth) + " lines waiting (at most " + std::to_string(metrics.max_depth) +
+          " in a queue), " + std::to_string(metrics.sent) + " sent, " + std::to_string(metrics.delayed) +
+          " delayed";
+      if (metrics.delayed > 0)
+        text += " by " + std::to_string(metrics.total_delay.count() / metrics.delayed) + "ms on average, " +
+            std::to_string(metrics.max_delay.count()) + "ms at most";
+      const auto& scheduler = ConnectionScheduler::instance();
+      const auto queued = scheduler.get_queued(pair.first);
+      const auto in_progress = scheduler.get_in_progress(pair.first);
+      const auto backoff = std::chrono::duration_cast<std::chrono::seconds>(scheduler.get_backoff(pair.first));
+      if (queued > 0 || in_progress > 0)
+        text += ", " + std::to_string(in_progress) + " connecting, " + std::to_string(queued) +
+            " waiting to connect";
+      if (backoff.count() > 0)
+        text += ", no connection for " + std::to_string(backoff.count()) + "s";
+      text += "\n";
+    }
+  if (text.empty())
+    text = "No IRC connection.\n";
+  const auto connections = ConnectionScheduler::instance().get_metrics();
+  const auto describe_wait = [](const ConnectionQueueWait& wait)
+  {
+    std::string res = std::to_string(wait.admitted);
+    if (wait.admitted > 0)
+      res += " (waited " + std::to_string(wait.total.count() / wait.admitted) + "ms on average, " +
+          std::to_string(wait.max.count()) + "ms at most)";
+    return res;
+  };
+  text += "Connections started: " + describe_wait(connections.interactive) + " for a user, " +
+      describe_wait(connections.reconnect) + " to reconnect, " + std::to_string(connections.queued) +
+      " waiting, " + std::to_string(connections.failures) + " failures, " + std::to_string(connections.rejections) +
+      " refused by the server";
+  command_node.delete_all_children();
+  XmlNode note("note");
+  note["type"] = "info";
+  note.set_inner(text);
+  command_node.add_child(std::move(note));
+}
+
+void ShowStatistics(XmppComponent&, AdhocSession&, XmlNode& command_node)
+{
+  const auto jidprep = get_jidprep_cache_metrics();
+  std::string text = "JID preparation cache: " + std::to_string(jidprep.size) + " entries, " +
+      std::to_string(jidprep.hits) + " hits, " + std::to_string(jidprep.misses) + " misses, " +
+      std::to_string(jidprep.evictions) + " evictions\n";
+  const auto writer = HistoryWriter::instance().get_metrics();
+  text += "History: " + std::to_string(writer.lines) + " lines recorded in " + std::to_string(writer.batches) +
+      " batches, " + std::to_string(writer.pending) + " pending, " + std::to_string(writer.duplicates) +
+      " received again by other users ignored\n";
+  const auto recent = RecentHistory::instance().get_metrics();
+  text += "Recent history in memory: " + std::to_string(recent.channels) + " channels, " +
+      std::to_string(recent.memory / 1024) + " KiB, " + std::to_string(recent.hits) + " queries answered, " +
+      std::to_string(recent.misses) + " sent to the database, " + std::to_string(recent.evictions) +
+      " channels evicted\n";
+#ifdef USE_DATABASE
+  const auto worker = Database::get_worker_metrics();
+  text += "Database queries: " + std::to_string(worker.queue_depth) + " waiting (at most " +
+      std::to_string(worker.max_queue_depth) + ")\n";
+  const std::map<std::string, JobMetrics> jobs(worker.jobs.begin(), worker.jobs.end());
+  for (const auto& pair: jobs)
+    text += "  " + pair.first + ": " + std::to_string(pair.second.count) + " run in " +
+        std::to_string(pair.second.total.count() / std::max<std::uint64_t>(pair.second.count, 1)) +
+        "µs on average, " + std::to_string(pair.second.max.count()) + "µs at most\n";
+  const auto retention = HistoryRetention::instance().get_metrics();
+  text += "History maintenance: " + std::to_string(retention.rows_pruned) + " lines pruned, " +
+      std::to_string(retention.lines_indexed) + " indexed, " + std::to_string(retention.bodies_compressed) +
+      " compressed, " + std::to_string(retention.dictionaries_deleted) + " dictionaries deleted, " +
+      std::to_string(retention.compactions) + " compactions, in " + std::to_string(retention.ticks) + " jobs (" +
+      std::to_string(retention.time_spent.count() / 1000) + "ms in total, " +
+      std::to_string(retention.max_tick.count() / 1000) + "ms at most)\n";
+#endif
+  command_node.delete_all_children();
+  XmlNode note("note");
+  note["type"] = "info";
+  note.set_inner(text);
+  command_node.add_child(std::move(note));
+}
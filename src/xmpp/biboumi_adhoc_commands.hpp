@@ -22,3 +22,7 @@ void ConfigureIrcChannelStep2(XmppComponent&, AdhocSession& session, XmlNode& co
 void DisconnectUserFromServerStep1(XmppComponent&, AdhocSession& session, XmlNode& command_node);
 void DisconnectUserFromServerStep2(XmppComponent&, AdhocSession& session, XmlNode& command_node);
 void DisconnectUserFromServerStep3(XmppComponent&, AdhocSession& session, XmlNode& command_node);
+
+void ListOutgoingAddresses(XmppComponent&, AdhocSession& session, XmlNode& command_node);
+void ListIrcSendQueues(XmppComponent&, AdhocSession& session, XmlNode& command_node);
+void ShowStatistics(XmppComponent&, AdhocSession& session, XmlNode& command_node);
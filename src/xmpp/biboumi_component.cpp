@@ -7,7 +7,8 @@
 #include <xmpp/adhoc_command.hpp>
 #include <xmpp/biboumi_adhoc_commands.hpp>
 #include <bridge/list_element.hpp>
-#include <config/config.hpp>
+#include <utils/config_snapshot.hpp>
+#include <utils/recent_history.hpp>
 #include <utils/sha1.hpp>
 #include <utils/time.hpp>
 #include <xmpp/jid.hpp>
@@ -52,24 +53,28 @@ BiboumiComponent::BiboumiComponent(std::shared_ptr<Poller> poller, const std::st
   irc_server_adhoc_commands_handler(*this),
   irc_channel_adhoc_commands_handler(*this)
 {
-  this->stanza_handlers.emplace("presence",
-                                std::bind(&BiboumiComponent::handle_presence, this,std::placeholders::_1));
-  this->stanza_handlers.emplace("message",
-                                std::bind(&BiboumiComponent::handle_message, this,std::placeholders::_1));
-  this->stanza_handlers.emplace("iq",
-                                std::bind(&BiboumiComponent::handle_iq, this,std::placeholders::_1));
+  this->set_stanza_handler(StanzaName::presence,
+                           std::bind(&BiboumiComponent::handle_presence, this,std::placeholders::_1));
+  this->set_stanza_handler(StanzaName::message,
+                           std::bind(&BiboumiComponent::handle_message, this,std::placeholders::_1));
+  this->set_stanza_handler(StanzaName::iq,
+                           std::bind(&BiboumiComponent::handle_iq, this,std::placeholders::_1));
 
   this->adhoc_commands_handler.add_command("ping", {{&PingStep1}, "Do a ping", false});
   this->adhoc_commands_handler.add_command("hello", {{&HelloStep1, &HelloStep2}, "Receive a custom greeting", false});
   this->adhoc_commands_handler.add_command("disconnect-user", {{&DisconnectUserStep1, &DisconnectUserStep2}, "Disconnect selected users from the gateway", true});
   this->adhoc_commands_handler.add_command("disconnect-from-irc-server", {{&DisconnectUserFromServerStep1, &DisconnectUserFromServerStep2, &DisconnectUserFromServerStep3}, "Disconnect from the selected IRC servers", false});
   this->adhoc_commands_handler.add_command("reload", {{&Reload}, "Reload biboumi’s configuration", true});
+  this->adhoc_commands_handler.add_command("flush-dns-cache", {{&FlushDnsCache}, "Forget the resolved IRC server addresses", true});
+  this->adhoc_commands_handler.add_command("outgoing-addresses", {{&ListOutgoingAddresses}, "Show the number of IRC connections from each outgoing address", true});
+  this->adhoc_commands_handler.add_command("irc-send-queues", {{&ListIrcSendQueues}, "Show the lines and the connections waiting for each IRC server", true});
+  this->adhoc_commands_handler.add_command("statistics", {{&ShowStatistics}, "Show the counters of biboumi’s caches and history", true});
 
 #ifdef USE_DATABASE
   AdhocCommand configure_server_command({&ConfigureIrcServerStep1, &ConfigureIrcServerStep2}, "Configure a few settings for that IRC server", false);
   AdhocCommand configure_global_command({&ConfigureGlobalStep1, &ConfigureGlobalStep2}, "Configure a few settings", false);
 
-  if (!Config::get("fixed_irc_server", "").empty())
+  if (get_config_snapshot()->has_fixed_irc_server)
     this->adhoc_commands_handler.add_command("configure", configure_server_command);
   else
     this->adhoc_commands_handler.add_command("configure", configure_global_command);
@@ -94,7 +99,10 @@ void BiboumiComponent::clean()
   {
     it->second->clean();
     if (it->second->active_clients() == 0)
-      it = this->bridges.erase(it);
+      {
+        this->entity_caps.forget_bare_jid(it->first);
+        it = this->bridges.erase(it);
+      }
     else
       ++it;
   }
@@ -125,6 +133,14 @@ void BiboumiComponent::handle_presence(const Stanza& stanza)
   Jid from(from_str);
   Iid iid(to.local, bridge);
 
+  if (type.empty())
+    {
+      if (const XmlNode* caps = stanza.get_child("c", CAPS_NS))
+        this->handle_entity_caps(from_str, to_str, *caps);
+    }
+  else if (type == "unavailable")
+    this->entity_caps.forget_jid(from_str);
+
   // An error stanza is sent whenever we exit this function without
   // disabling this scopeguard.  If error_type and error_name are not
   // changed, the error signaled is internal-server-error. Change their
@@ -149,8 +165,17 @@ void BiboumiComponent::handle_presence(const Stanza& stanza)
             bridge->send_irc_nick_change(iid, to.resource);
           const XmlNode* x = stanza.get_child("x", MUC_NS);
           const XmlNode* password = x ? x->get_child("password", MUC_NS): nullptr;
+          const XmlNode* history = x ? x->get_child("history", MUC_NS): nullptr;
+          HistoryLimit history_limit;
+          if (history)
+            {
+              if (!history->get_tag("maxstanzas").empty())
+                history_limit.stanzas = std::atoi(history->get_tag("maxstanzas").data());
+              if (!history->get_tag("seconds").empty())
+                history_limit.seconds = std::atoi(history->get_tag("seconds").data());
+            }
           bridge->join_irc_channel(iid, to.resource, password ? password->get_inner(): "",
-                                   from.resource);
+                                   from.resource, history_limit);
         }
       else if (type == "unavailable")
         {
@@ -175,6 +200,59 @@ void BiboumiComponent::handle_presence(const Stanza& stanza)
   stanza_error.disable();
 }
 
+void BiboumiComponent::handle_entity_caps(const std::string& full_jid, const std::string& to,
+                                          const XmlNode& caps)
+{
+  const std::string ver = caps.get_tag("ver");
+  const std::string node = caps.get_tag("node");
+  // The legacy format (without hash), and the other hash functions, cannot
+  // be verified: the features of these clients stay unknown
+  if (ver.empty() || node.empty() || caps.get_tag("hash") != "sha-1")
+    return;
+  if (!this->entity_caps.set_jid_ver(full_jid, ver))
+    return;
+
+  // That client build is not known yet, ask its features.  They are then
+  // used for every client advertising the same verification string, so
+  // they are only saved if they match it.
+  Stanza iq("iq");
+  iq["type"] = "get";
+  iq["id"] = "caps_"s + this->next_id();
+  iq["from"] = to;
+  iq["to"] = full_jid;
+  XmlNode query("query");
+  query["xmlns"] = DISCO_INFO_NS;
+  query["node"] = node + "#" + ver;
+  iq.add_child(std::move(query));
+
+  auto result_cb = [this, ver, full_jid](Bridge*, const Stanza& stanza)
+    {
+      const XmlNode* query = stanza.get_child("query", DISCO_INFO_NS);
+      if (stanza.get_tag("type") != "result" || !query)
+        {
+          this->entity_caps.query_failed(ver);
+          return;
+        }
+      if (EntityCaps::compute_ver(*query) != ver)
+        {
+          log_warning("The features of ", full_jid, " do not match its verification string ", ver);
+          this->entity_caps.query_failed(ver);
+          return;
+        }
+      std::set<std::string> features;
+      for (const XmlNode* feature: query->get_children("feature", DISCO_INFO_NS))
+        features.insert(feature->get_tag("var"));
+      this->entity_caps.set_features(ver, std::move(features));
+    };
+  this->waiting_iq[iq.get_tag("id")] = result_cb;
+  this->send_stanza(iq);
+}
+
+bool BiboumiComponent::may_support(const std::string& full_jid, const std::string& feature) const
+{
+  return this->entity_caps.may_support(full_jid, feature);
+}
+
 void BiboumiComponent::handle_message(const Stanza& stanza)
 {
   std::string from_str = stanza.get_tag("from");
@@ -199,6 +277,19 @@ void BiboumiComponent::handle_message(const Stanza& stanza)
     });
   const XmlNode* body = stanza.get_child("body", COMPONENT_NS);
 
+  // Do not let the lines of a user pile up, when the server is slower
+  // than they are
+  if (body && type != "error" && bridge->is_irc_send_queue_full(iid.get_server()))
+    {
+      this->send_stanza_error("message", from_str, to_str, id,
+                              "wait", "resource-constraint",
+                              "Too many messages are waiting to be sent to IRC server "s +
+                              iid.get_server() + ", try again later",
+                              true);
+      stanza_error.disable();
+      return;
+    }
+
   try {                         // catch IRCNotConnected exceptions
   if (type == "groupchat" && iid.type == Iid::Type::Channel)
     {
@@ -472,7 +563,7 @@ void BiboumiComponent::handle_iq(const Stanza& stanza)
               if (to.local.empty())
                 {               // Get biboumi's adhoc commands
                   this->send_adhoc_commands_list(id, from, this->served_hostname,
-                                                 (Config::get("admin", "") ==
+                                                 (get_config_snapshot()->admin ==
                                                   from_jid.bare()),
                                                  this->adhoc_commands_handler);
                   stanza_error.disable();
@@ -480,7 +571,7 @@ void BiboumiComponent::handle_iq(const Stanza& stanza)
               else if (iid.type == Iid::Type::Server)
                 {               // Get the server's adhoc commands
                   this->send_adhoc_commands_list(id, from, to_str,
-                                                 (Config::get("admin", "") ==
+                                                 (get_config_snapshot()->admin ==
                                                   from_jid.bare()),
                                                  this->irc_server_adhoc_commands_handler);
                   stanza_error.disable();
@@ -488,7 +579,7 @@ void BiboumiComponent::handle_iq(const Stanza& stanza)
               else if (iid.type == Iid::Type::Channel)
                 {               // Get the channel's adhoc commands
                   this->send_adhoc_commands_list(id, from, to_str,
-                                                 (Config::get("admin", "") ==
+                                                 (get_config_snapshot()->admin ==
                                                   from_jid.bare()),
                                                  this->irc_channel_adhoc_commands_handler);
                   stanza_error.disable();
@@ -567,6 +658,17 @@ void BiboumiComponent::handle_iq(const Stanza& stanza)
             }
         }
     }
+  else if (type == "error")
+    {
+      // Never answer an error with an error
+      stanza_error.disable();
+      const auto it = this->waiting_iq.find(id);
+      if (it != this->waiting_iq.end())
+        {
+          it->second(bridge, stanza);
+          this->waiting_iq.erase(it);
+        }
+    }
   }
   catch (const IRCNotConnected& ex)
     {
@@ -582,6 +684,11 @@ void BiboumiComponent::handle_iq(const Stanza& stanza)
 }
 
 #ifdef USE_DATABASE
+/**
+ * The largest page of archived messages sent for one MAM query.
+ */
+static constexpr size_t max_mam_page_size = 100;
+
 bool BiboumiComponent::handle_mam_request(const Stanza& stanza)
 {
     std::string id = stanza.get_tag("id");
@@ -599,6 +706,7 @@ bool BiboumiComponent::handle_mam_request(const Stanza& stanza)
         std::string start;
         std::string end;
 		std::string maxq;
+        std::string fulltext;
         const XmlNode* x = query->get_child("x", DATAFORM_NS);
         if (x)
           {
@@ -617,6 +725,13 @@ bool BiboumiComponent::handle_mam_request(const Stanza& stanza)
                     value = field->get_child("value", DATAFORM_NS);
                     if (value)
                       end = value->get_inner();
+                  }
+                else if (field->get_tag("var") == "fulltext" ||
+                         field->get_tag("var") == "{urn:xmpp:fulltext:0}fulltext")
+                  {
+                    value = field->get_child("value", DATAFORM_NS);
+                    if (value)
+                      fulltext = value->get_inner();
                   }
 				else if(field->get_tag("var") == "max"){
 					value = field->get_child("value", DATAFORM_NS);
@@ -625,66 +740,157 @@ bool BiboumiComponent::handle_mam_request(const Stanza& stanza)
 				}
               }
           }
-		size_t max_messsages = maxq.empty() ? 20 : std::min(20, std::stoi(maxq));
-        const auto lines = Database::get_muc_logs(iid.get_local(), iid.get_server(), max_messsages+1, start, end);
-
-		size_t count = 0;
-		std::string first_id = "";
-		std::string last_id;
-		bool complete = true;
-        for (auto it = lines.rbegin(); it != lines.rend(); it++)
-        {
-		  if(count++ >= max_messsages){
-			  complete = false;
-			  break;
-		  }
-		  const db::MucLogLine &line = *it;
-		  last_id = line.uuid;
-		  if(first_id.empty())
-			  first_id = line.uuid;
-          if (!line.nick.value().empty())
-        	this->send_archived_message(line, to.full(), from.full(), query_id);
-
-        }
+        // Result Set Management: the uuid of a line is used as a cursor
+        std::string after;
+        std::string before;
+        const XmlNode* set_node = query->get_child("set", RSM_NS);
+        if (set_node)
+          {
+            const XmlNode* max = set_node->get_child("max", RSM_NS);
+            if (max)
+              maxq = max->get_inner();
+            const XmlNode* after_node = set_node->get_child("after", RSM_NS);
+            if (after_node)
+              after = after_node->get_inner();
+            const XmlNode* before_node = set_node->get_child("before", RSM_NS);
+            if (before_node)
+              before = before_node->get_inner();
+          }
+        const int requested_max = std::atoi(maxq.data());
+        const size_t max_messsages = maxq.empty() || requested_max < 0 ?
+                                     20 : std::min(max_mam_page_size, static_cast<size_t>(requested_max));
+        const auto chan_name = iid.get_local();
+        const auto server = iid.get_server();
+        auto send_results = [this, id, from = from.full(), to = to.full(), query_id, max_messsages]
+          (std::future<std::vector<HistoryLine>> result, const bool forward)
+          {
+            std::vector<HistoryLine> lines;
+            try {
+                lines = result.get();
+              } catch (const litesql::NotFound&) {
+                this->send_stanza_error("iq", from, to, id, "cancel",
+                                        "item-not-found", "", true);
+                return;
+              } catch (const std::exception& e) {
+                log_error("Failed to retrieve the MUC logs: ", e.what());
+                this->send_stanza_error("iq", from, to, id, "wait",
+                                        "internal-server-error", "", true);
+                return;
+              }
+            this->send_mam_results(lines, max_messsages, forward, id, from, to, query_id);
+          };
+        if (!fulltext.empty())
+          {
+            if (!Database::has_fulltext_search())
+              {
+                this->send_stanza_error("iq", from.full(), to.full(), id, "cancel",
+                                        "feature-not-implemented", "Full-text search is not available", true);
+                return true;
+              }
+            // Ranked by relevance: the extra line is the least relevant
+            // one, unless paging backward
+            const bool forward = before.empty();
+            Database::async("search_muc_logs",
+                            [owner = from.bare(), chan_name, server, fulltext, max_messsages, start, end, after, before]()
+                            {
+                              return Database::search_muc_logs(owner, chan_name, server, fulltext, max_messsages+1,
+                                                               start, end, after, before);
+                            },
+                            [send_results, forward](std::future<std::vector<HistoryLine>> result)
+                            {
+                              send_results(std::move(result), forward);
+                            });
+            return true;
+          }
+        const bool forward = !after.empty();
+        // One more line than requested, to know whether the result is complete
+        std::vector<HistoryLine> recent_lines;
+        if (RecentHistory::instance().get_page(from.bare(), server, chan_name, max_messsages+1,
+                                               start.empty() ? -1 : utils::parse_datetime(start),
+                                               end.empty() ? -1 : utils::parse_datetime(end),
+                                               after, before, recent_lines))
+          {
+            this->send_mam_results(recent_lines, max_messsages, forward, id, from.full(), to.full(), query_id);
+            return true;
+          }
+        Database::async("get_muc_logs",
+                        [owner = from.bare(), chan_name, server, max_messsages, start, end, after, before]()
+                        {
+                          return Database::get_muc_logs(owner, chan_name, server, max_messsages+1, start, end,
+                                                        after, before);
+                        },
+                        [send_results, forward](std::future<std::vector<HistoryLine>> result)
+                        {
+                          send_results(std::move(result), forward);
+                        });
+        return true;
+      }
+  return false;
+}
 
-		XmlNode finiq("message");
-		finiq["queryid"] = query_id;
-		finiq["from"] = to.full();
-		finiq["to"] = from.full();
+void BiboumiComponent::send_mam_results(const std::vector<HistoryLine>& lines, const size_t max_messsages,
+                                        const bool forward, const std::string& id, const std::string& from, const std::string& to,
+                                        const std::string& query_id)
+{
+  // The extra line is the one farthest from the cursor: the most recent one
+  // when paging forward, the oldest one otherwise
+  const bool complete = lines.size() <= max_messsages;
+  auto begin = lines.begin();
+  auto end = lines.end();
+  if (!complete)
+    {
+      if (forward)
+        --end;
+      else
+        ++begin;
+    }
 
-		XmlNode fin("fin");
-		fin["xmlns"] = MAM_NS0;;
-		fin["queryid"] = query_id;
-		fin["complete"] = std::to_string(complete);
+  size_t count = 0;
+  std::string first_id;
+  std::string last_id;
+  for (auto it = begin; it != end; ++it)
+    {
+      const HistoryLine& line = *it;
+      if (first_id.empty())
+        first_id = line.uuid;
+      last_id = line.uuid;
+      count++;
+      if (!line.nick.empty())
+        this->send_archived_message(line, to, from, query_id);
+    }
 
-		XmlNode set("set");
-		set["xmlns"] = "http://jabber.org/protocol/rsm";
+  XmlNode finiq("message");
+  finiq["queryid"] = query_id;
+  finiq["from"] = to;
+  finiq["to"] = from;
 
-		XmlNode first("first");
-		first["index"] = "0";
-		first.set_inner(first_id);
-		XmlNode last("last");
-		last.set_inner(last_id);
-		XmlNode countN("count");
-		countN.set_inner(std::to_string(count));
+  XmlNode fin("fin");
+  fin["xmlns"] = MAM_NS0;
+  fin["queryid"] = query_id;
+  fin["complete"] = std::to_string(complete);
 
+  XmlNode set("set");
+  set["xmlns"] = RSM_NS;
 
-		set.add_child(std::move(first));
-		set.add_child(std::move(last));
-		set.add_child(std::move(countN));
-		fin.add_child(std::move(set));
-		finiq.add_child(std::move(fin));
+  XmlNode first("first");
+  first.set_inner(first_id);
+  XmlNode last("last");
+  last.set_inner(last_id);
+  XmlNode countN("count");
+  countN.set_inner(std::to_string(count));
 
-		this->send_stanza(finiq);
+  set.add_child(std::move(first));
+  set.add_child(std::move(last));
+  set.add_child(std::move(countN));
+  fin.add_child(std::move(set));
+  finiq.add_child(std::move(fin));
 
+  this->send_stanza(finiq);
 
-        this->send_iq_result_full_jid(id, from.full(), to.full());
-        return true;
-      }
-  return false;
+  this->send_iq_result_full_jid(id, from, to);
 }
 
-void BiboumiComponent::send_archived_message(const db::MucLogLine& log_line, const std::string& from, const std::string& to,
+void BiboumiComponent::send_archived_message(const HistoryLine& log_line, const std::string& from, const std::string& to,
                                              const std::string& queryid)
 {
     Stanza message("message");
@@ -695,24 +901,24 @@ void BiboumiComponent::send_archived_message(const db::MucLogLine& log_line, con
     result["xmlns"] = MAM_NS0;
     if (!queryid.empty())
       result["queryid"] = queryid;
-    result["id"] = log_line.uuid.value();
+    result["id"] = log_line.uuid;
 
     XmlNode forwarded("forwarded");
     forwarded["xmlns"] = FORWARD_NS;
 
     XmlNode delay("delay");
     delay["xmlns"] = DELAY_NS;
-    delay["stamp"] = utils::to_string(log_line.date.value().timeStamp());
+    delay["stamp"] = utils::to_string(std::chrono::system_clock::to_time_t(log_line.date));
 
     forwarded.add_child(std::move(delay));
 
     XmlNode submessage("message");
     submessage["xmlns"] = CLIENT_NS;
-    submessage["from"] = from + "/" + log_line.nick.value();
+    submessage["from"] = from + "/" + log_line.nick;
     submessage["type"] = "groupchat";
 
     XmlNode body("body");
-    body.set_inner(log_line.body.value());
+    body.set_inner(log_line.body);
     submessage.add_child(std::move(body));
 
     forwarded.add_child(std::move(submessage));
@@ -726,29 +932,19 @@ void BiboumiComponent::send_archived_message(const db::MucLogLine& log_line, con
 
 Bridge* BiboumiComponent::get_user_bridge(const std::string& user_jid)
 {
-  auto bare_jid = Jid{user_jid}.bare();
-  try
-    {
-      return this->bridges.at(bare_jid).get();
-    }
-  catch (const std::out_of_range& exception)
-    {
-      this->bridges.emplace(bare_jid, std::make_unique<Bridge>(bare_jid, *this, this->poller));
-      return this->bridges.at(bare_jid).get();
-    }
+  auto bare_jid = JidView{user_jid}.bare();
+  auto it = this->bridges.find(bare_jid);
+  if (it == this->bridges.end())
+    it = this->bridges.emplace(bare_jid, std::make_unique<Bridge>(bare_jid, *this, this->poller)).first;
+  return it->second.get();
 }
 
 Bridge* BiboumiComponent::find_user_bridge(const std::string& full_jid)
 {
-  auto bare_jid = Jid{full_jid}.bare();
-  try
-    {
-      return this->bridges.at(bare_jid).get();
-    }
-  catch (const std::out_of_range& exception)
-    {
-      return nullptr;
-    }
+  const auto it = this->bridges.find(JidView{full_jid}.bare());
+  if (it == this->bridges.end())
+    return nullptr;
+  return it->second.get();
 }
 
 std::vector<Bridge*> BiboumiComponent::get_bridges() const
@@ -2,6 +2,7 @@
 
 
 #include <xmpp/xmpp_component.hpp>
+#include <xmpp/entity_caps.hpp>
 
 #include <bridge/bridge.hpp>
 
@@ -9,15 +10,13 @@
 #include <string>
 #include <map>
 
-namespace db
-{
-class MucLogLine;
-}
 struct ListElement;
+struct HistoryLine;
+class Jid;
 
 /**
- * A callback called when the waited iq result is received (it is matched
- * against the iq id)
+ * A callback called when the waited iq result, or error, is received (it is
+ * matched against the iq id)
  */
 using iq_responder_callback_t = std::function<void(Bridge* bridge, const Stanza& stanza)>;
 
@@ -45,6 +44,12 @@ public:
    */
   std::vector<Bridge*> get_bridges() const;
 
+  /**
+   * Whether or not the client of that full JID may support the given
+   * feature, according to the entity capabilities it advertised.
+   */
+  bool may_support(const std::string& full_jid, const std::string& feature) const;
+
   /**
    * Send a "close" message to all our connected peers.  That message
    * depends on the protocol used (this may be a QUIT irc message, or a
@@ -96,12 +101,30 @@ public:
   void handle_iq(const Stanza& stanza);
 
 #ifdef USE_DATABASE
+  /**
+   * Answer from the RecentHistory if the page is entirely in memory,
+   * otherwise query the archive on the database thread, and send the
+   * results once they are available.
+   */
   bool handle_mam_request(const Stanza& stanza);
-  void send_archived_message(const db::MucLogLine& log_line, const std::string& from, const std::string& to,
+  /**
+   * Send the lines of one page of the archive, followed by the
+   * <fin/> message.  lines may contain one more line than max_messsages,
+   * in which case the page is not complete.
+   */
+  void send_mam_results(const std::vector<HistoryLine>& lines, const size_t max_messsages,
+                        const bool forward, const std::string& id, const std::string& from, const std::string& to,
+                        const std::string& query_id);
+  void send_archived_message(const HistoryLine& log_line, const std::string& from, const std::string& to,
                              const std::string& queryid);
 #endif
 
 private:
+  /**
+   * Record the XEP-0115 capabilities found in a presence, and send a
+   * disco#info query if that verification string is not known yet.
+   */
+  void handle_entity_caps(const std::string& full_jid, const std::string& to, const XmlNode& caps);
   /**
    * Return the bridge associated with the bare JID. Create a new one
    * if none already exist.
@@ -111,8 +134,8 @@ private:
   /**
    * A map of id -> callback.  When we want to wait for an iq result, we add
    * the callback to this map, with the iq id as the key. When an iq result
-   * is received, we look for a corresponding callback in this map. If
-   * found, we call it and remove it.
+   * or error is received, we look for a corresponding callback in this
+   * map. If found, we call it and remove it.
    */
   std::map<std::string, iq_responder_callback_t> waiting_iq;
 
@@ -121,6 +144,11 @@ private:
    * jid
    */
   std::unordered_map<std::string, std::unique_ptr<Bridge>> bridges;
+  /**
+   * The features of the clients of all our users, shared by all the
+   * bridges.
+   */
+  EntityCaps entity_caps;
 
   AdhocCommandsHandler irc_server_adhoc_commands_handler;
   AdhocCommandsHandler irc_channel_adhoc_commands_handler;
@@ -3,7 +3,153 @@
 #include <bridge/colors.hpp>
 #include <xmpp/xmpp_stanza.hpp>
 
+#include <chrono>
 #include <memory>
+#include <vector>
+
+using namespace std::string_literals;
+
+namespace
+{
+const char* irc_colors_to_css[] = {
+  "white", "black", "blue", "green", "indianred", "red", "magenta", "brown",
+  "yellow", "lightgreen", "cyan", "lightcyan", "lightblue", "lightmagenta",
+  "gray", "white",
+};
+const int IRC_NUM_COLORS = sizeof(irc_colors_to_css) / sizeof(*irc_colors_to_css);
+
+struct styles_t
+{
+  bool strong;
+  bool underline;
+  bool italic;
+  int fg;
+  int bg;
+};
+
+/**
+ * The previous conversion, building an XmlNode tree: it is kept as a
+ * reference for irc_format_to_serialized_xhtmlim().
+ */
+std::tuple<const std::string, std::unique_ptr<XmlNode>> irc_format_to_xhtmlim(const std::string& s)
+{
+  if (s.find_first_of(irc_format_char) == std::string::npos)
+    // there is no special formatting at all
+    return std::make_tuple(s, nullptr);
+
+  std::string cleaned;
+
+  styles_t styles = {false, false, false, -1, -1};
+
+  std::unique_ptr<XmlNode> result = std::make_unique<XmlNode>("body");
+  (*result)["xmlns"] = "http://www.w3.org/1999/xhtml";
+
+  std::unique_ptr<XmlNode> current_node_up;
+  XmlNode* current_node = result.get();
+
+  std::string::size_type pos_start = 0;
+  std::string::size_type pos_end;
+
+  while ((pos_end = s.find_first_of(irc_format_char, pos_start)) != std::string::npos)
+    {
+      const std::string txt = s.substr(pos_start, pos_end-pos_start);
+      cleaned += txt;
+      if (current_node->has_children())
+        current_node->get_last_child()->add_to_tail(txt);
+      else
+        current_node->add_to_inner(txt);
+
+      if (s[pos_end] == IRC_FORMAT_BOLD_CHAR)
+        styles.strong = !styles.strong;
+      else if (s[pos_end] == IRC_FORMAT_NEWLINE_CHAR)
+        {
+          current_node->add_child(std::make_unique<XmlNode>("br"));
+          cleaned += '\n';
+        }
+      else if (s[pos_end] == IRC_FORMAT_UNDERLINE_CHAR)
+        styles.underline = !styles.underline;
+      else if (s[pos_end] == IRC_FORMAT_ITALIC_CHAR)
+        styles.italic = !styles.italic;
+      else if (s[pos_end] == IRC_FORMAT_RESET_CHAR)
+        styles = {false, false, false, -1, -1};
+      else if (s[pos_end] == IRC_FORMAT_REVERSE_CHAR)
+        { }                      // TODO
+      else if (s[pos_end] == IRC_FORMAT_REVERSE2_CHAR)
+        { }                      // TODO
+      else if (s[pos_end] == IRC_FORMAT_FIXED_CHAR)
+        { }                      // TODO
+      else if (s[pos_end] == IRC_FORMAT_COLOR_CHAR)
+        {
+          size_t pos = pos_end + 1;
+          styles.fg = -1;
+          styles.bg = -1;
+          // get the first number following the format char
+          if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+            {                   // first digit
+              styles.fg = s[pos++] - '0';
+              if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+                // second digit
+                styles.fg = styles.fg * 10 + s[pos++] - '0';
+            }
+          if (pos < s.size() && s[pos] == ',')
+            {                   // get bg color after the comma
+              pos++;
+              if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+                {               // first digit
+                  styles.bg = s[pos++] - '0';
+                  if (pos < s.size() && s[pos] >= '0' && s[pos] <= '9')
+                    // second digit
+                    styles.bg = styles.bg * 10 + s[pos++] - '0';
+                }
+            }
+          pos_end = pos - 1;
+        }
+
+      // close opened span, if any
+      if (current_node != result.get())
+        {
+          result->add_child(std::move(current_node_up));
+          current_node = result.get();
+        }
+      // Take all currently-applied style and create a new span with it
+      std::string styles_str;
+      if (styles.strong)
+        styles_str += "font-weight:bold;";
+      if (styles.underline)
+        styles_str += "text-decoration:underline;";
+      if (styles.italic)
+        styles_str += "font-style:italic;";
+      if (styles.fg != -1)
+        styles_str += "color:"s +
+          irc_colors_to_css[styles.fg % IRC_NUM_COLORS] + ";";
+      if (styles.bg != -1)
+        styles_str += "background-color:"s +
+          irc_colors_to_css[styles.bg % IRC_NUM_COLORS] + ";";
+      if (!styles_str.empty())
+        {
+          current_node_up = std::make_unique<XmlNode>("span");
+          current_node = current_node_up.get();
+          (*current_node)["style"] = styles_str;
+        }
+
+      pos_start = pos_end + 1;
+    }
+
+  // If some text remains, without any format char, just append that text at
+  // the end of the current node
+  const std::string txt = s.substr(pos_start, pos_end-pos_start);
+  cleaned += txt;
+  if (current_node->has_children())
+    current_node->get_last_child()->add_to_tail(txt);
+  else
+    current_node->add_to_inner(txt);
+
+  if (current_node != result.get())
+    result->add_child(std::move(current_node_up));
+
+  return std::make_tuple(cleaned, std::move(result));
+}
+}
 
 TEST_CASE("IRC colors parsing")
 {
@@ -52,3 +198,73 @@ TEST_CASE("IRC colors parsing")
   CHECK(cleaned_up == "test\ncoucou");
   CHECK(xhtml->to_string() == "<body xmlns='http://www.w3.org/1999/xhtml'>test<br/>coucou</body>");
 }
+
+TEST_CASE("Single-pass IRC colors conversion")
+{
+  const std::vector<std::string> inputs = {
+    "",
+    "normal",
+    "\x02" "bold",
+    "normal\x02" "bold\x1F" "under-and-bold\x1F" "bold\x02" " normal"
+    "\x03" "5red\x03" ",5default-on-red\x03" "10,2cyan-on-blue",
+    "\x03",
+    "\x03" ",a",
+    "\x03" ",",
+    "[\x1D" "\x03" "13dolphin-emu/dolphin\x1D" "] \x03" "03foo\x0F commented on #283 (Add support for the guide button to XInput): \x1F" "\x03" "02http://example.com\x03",
+    "test\ncoucou",
+    "\n",
+    "\x02" "bold\nstill bold\n",
+    "\x03" "04,12<a href='x'> & \"quoted\"\x0F" ">",
+    "\x1D" "\x1F" "italique, souligné, ça marche ☺\x0F" "é",
+    "ignored\x12" "reverse\x16" "and\x11" "fixed",
+    "\x03" "99,99out of range\x03" "3",
+    "\x02\x02\x1F\x1F",
+    "\x0F" "a\x0F" "b\x0F" "c",
+  };
+  for (const auto& input: inputs)
+    {
+      std::unique_ptr<XmlNode> xhtml;
+      std::string cleaned_up;
+      std::tie(cleaned_up, xhtml) = irc_format_to_xhtmlim(input);
+
+      std::string body;
+      std::string serialized;
+      const bool formatted = irc_format_to_serialized_xhtmlim(input, body, serialized);
+
+      INFO(input);
+      CHECK(body == cleaned_up);
+      CHECK(remove_irc_format(input) == cleaned_up);
+      CHECK(formatted == static_cast<bool>(xhtml));
+      if (xhtml)
+        CHECK(serialized == xhtml->to_string());
+      else
+        CHECK(serialized.empty());
+    }
+}
+
+TEST_CASE("IRC colors conversion throughput", "[.][benchmark]")
+{
+  const std::string input = "0e46ab by \x03" "03Pierre Dindon\x0F [\x03" "09" "0\x0F|\x03" "09" "1\x0F|\x03" "04" "0\x0F] \x1F" "\x03" "02http://example.net/Ojrh4P\x03 media: avoid pop-in effect when loading thumbnails by specifying an explicit size";
+  const int iterations = 100000;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    {
+      auto res = irc_format_to_xhtmlim(input);
+      std::get<1>(res)->to_string();
+    }
+  const auto tree_duration = std::chrono::steady_clock::now() - start;
+
+  std::string body;
+  std::string xhtml;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    irc_format_to_serialized_xhtmlim(input, body, xhtml);
+  const auto single_pass_duration = std::chrono::steady_clock::now() - start;
+
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  WARN("XmlNode tree: " << duration_cast<microseconds>(tree_duration).count() << "µs, single pass: "
+       << duration_cast<microseconds>(single_pass_duration).count() << "µs, for "
+       << iterations << " messages");
+}
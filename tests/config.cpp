@@ -4,6 +4,7 @@
 #include <iostream>
 
 #include <config/config.hpp>
+#include <utils/config_snapshot.hpp>
 
 TEST_CASE("Config basic")
 {
@@ -57,3 +58,27 @@ TEST_CASE("Config get_int")
   res = Config::get_int("number", -1);
   CHECK(res == 0);
 }
+
+TEST_CASE("Config snapshot")
+{
+  Config::set("fixed_irc_server", "");
+  Config::set("realname_from_jid", "true");
+  const auto first = get_config_snapshot();
+  CHECK_FALSE(first->has_fixed_irc_server);
+  CHECK(first->realname_from_jid);
+  CHECK(first->realname_customization);
+  // Nothing changed, the same snapshot is used
+  CHECK(get_config_snapshot() == first);
+
+  Config::set("fixed_irc_server", "irc.example.com");
+  const auto second = get_config_snapshot();
+  CHECK(second != first);
+  CHECK(second->has_fixed_irc_server);
+  CHECK(second->fixed_irc_server == "irc.example.com");
+  // The previous snapshot is left untouched
+  CHECK_FALSE(first->has_fixed_irc_server);
+
+  Config::set("fixed_irc_server", "");
+  Config::set("realname_from_jid", "false");
+  CHECK_FALSE(get_config_snapshot()->realname_from_jid);
+}
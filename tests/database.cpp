@@ -1,14 +1,23 @@
 #include "catch.hpp"
 
 #include <database/database.hpp>
+#include <utils/history_writer.hpp>
+#include <utils/history_retention.hpp>
+#include <utils/compression.hpp>
 
 #include <config/config.hpp>
 
+#include <algorithm>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+
 TEST_CASE("Database")
 {
 #ifdef USE_DATABASE
   Database::open(":memory:");
   Database::set_verbose(false);
+  const std::string owner{"zouzou@example.com"};
 
   SECTION("Basic retrieve and update")
     {
@@ -92,6 +101,571 @@ TEST_CASE("Database")
         }
     }
 
+  SECTION("Options preload")
+    {
+      auto g = Database::get_global_options(owner);
+      g.maxHistoryLength = 42;
+      Database::save_options("update_global_options", g);
+      auto c = Database::get_irc_channel_options(owner, "irc.example.com", "#foo");
+      c.encodingIn = "latin-1";
+      Database::save_options("update_irc_channel_options", c);
+
+      CHECK(Database::preload_options() == 2);
+      CHECK(Database::get_global_options(owner).maxHistoryLength.value() == 42);
+      CHECK(Database::get_irc_channel_options(owner, "irc.example.com", "#foo").encodingIn.value() == "latin-1");
+      CHECK(Database::get_irc_channel_options(owner, "irc.example.com", "#bar").encodingIn.value() == "");
+
+      // The changes are seen, without querying the database again
+      auto s = Database::get_irc_server_options(owner, "irc.example.com");
+      s.encodingIn = "utf-8";
+      Database::save_options("update_irc_server_options", s);
+      CHECK(Database::get_irc_channel_options_with_server_default(owner, "irc.example.com", "#bar").encodingIn.value() == "utf-8");
+      c = Database::get_irc_channel_options(owner, "irc.example.com", "#foo");
+      c.encodingIn = "cp1252";
+      Database::save_options("update_irc_channel_options", c);
+      CHECK(Database::get_irc_channel_options(owner, "irc.example.com", "#foo").encodingIn.value() == "cp1252");
+      CHECK(Database::count<db::IrcChannelOptions>() == 1);
+    }
+
+  SECTION("MUC logs keyset pagination")
+    {
+      std::vector<HistoryLine> lines;
+      for (int i = 0; i < 10; ++i)
+        lines.push_back({"irc.example.com", "#foo", "nick", std::to_string(i), std::chrono::system_clock::now(), ""});
+      lines.push_back({"irc.example.com", "#bar", "nick", "other", std::chrono::system_clock::now(), ""});
+      Database::open_history_range(owner, "irc.example.com", "#foo");
+      Database::add_muc_logs(lines);
+
+      auto last = Database::get_muc_logs(owner, "#foo", "irc.example.com", 3);
+      REQUIRE(last.size() == 3);
+      CHECK(last[0].body == "7");
+      CHECK(last[2].body == "9");
+
+      auto previous = Database::get_muc_logs(owner, "#foo", "irc.example.com", 3, "", "", "", last[0].uuid);
+      REQUIRE(previous.size() == 3);
+      CHECK(previous[0].body == "4");
+      CHECK(previous[2].body == "6");
+
+      auto next = Database::get_muc_logs(owner, "#foo", "irc.example.com", 5, "", "", previous[2].uuid);
+      REQUIRE(next.size() == 3);
+      CHECK(next[0].body == "7");
+
+      CHECK_THROWS_AS(Database::get_muc_logs(owner, "#foo", "irc.example.com", 3, "", "", "unknown-uuid"),
+                      litesql::NotFound);
+    }
+
+  SECTION("MUC logs full-text search")
+    {
+      REQUIRE(Database::has_fulltext_search());
+      std::vector<HistoryLine> lines;
+      for (int i = 0; i < 10; ++i)
+        lines.push_back({"irc.example.com", "#foo", "nick", "the build " + std::to_string(i) + " is broken",
+                         std::chrono::system_clock::now(), ""});
+      lines.push_back({"irc.example.com", "#foo", "nick", "broken broken broken build", std::chrono::system_clock::now(), ""});
+      lines.push_back({"irc.example.com", "#foo", "nick", "unrelated", std::chrono::system_clock::now(), ""});
+      lines.push_back({"irc.example.com", "#bar", "nick", "broken build", std::chrono::system_clock::now(), ""});
+      Database::open_history_range(owner, "irc.example.com", "#foo");
+      Database::open_history_range(owner, "irc.example.com", "#bar");
+      Database::add_muc_logs(lines);
+
+      auto found = Database::search_muc_logs(owner, "#foo", "irc.example.com", "broken BUILD");
+      REQUIRE(found.size() == 11);
+      // The most relevant line first
+      CHECK(found[0].body == "broken broken broken build");
+      CHECK(Database::search_muc_logs(owner, "#foo", "irc.example.com", "\"build\" OR unrelated").empty());
+      CHECK(Database::search_muc_logs(owner, "#bar", "irc.example.com", "broken").size() == 1);
+
+      auto first = Database::search_muc_logs(owner, "#foo", "irc.example.com", "broken build", 4);
+      REQUIRE(first.size() == 4);
+      auto next = Database::search_muc_logs(owner, "#foo", "irc.example.com", "broken build", 4, "", "", first[3].uuid);
+      REQUIRE(next.size() == 4);
+      CHECK(next[0].uuid == found[4].uuid);
+      auto previous = Database::search_muc_logs(owner, "#foo", "irc.example.com", "broken build", 2, "", "", "", next[0].uuid);
+      REQUIRE(previous.size() == 2);
+      CHECK(previous[0].uuid == found[2].uuid);
+      CHECK(previous[1].uuid == found[3].uuid);
+
+      CHECK_THROWS_AS(Database::search_muc_logs(owner, "#foo", "irc.example.com", "unrelated", 4, "", "", first[0].uuid),
+                      litesql::NotFound);
+    }
+
+  SECTION("MUC logs retention")
+    {
+      const auto now = std::chrono::system_clock::now();
+      std::vector<HistoryLine> lines;
+      for (int i = 0; i < 10; ++i)
+        {
+          const auto date = now - std::chrono::hours(24 * (10 - i) - 1);
+          lines.push_back({"irc.example.com", "#foo", "nick", std::to_string(i), date, ""});
+          lines.push_back({"irc.example.com", "#bar", "nick", std::to_string(i), date, ""});
+          lines.push_back({"irc.example.com", "#baz", "nick", std::to_string(i), date, ""});
+        }
+      for (const auto& channel: {"#foo", "#bar", "#baz"})
+        Database::open_history_range(owner, "irc.example.com", channel);
+      Database::add_muc_logs(lines);
+
+      // Everything older than 5 days, except in #bar which keeps 8 days,
+      // and only the last 2 lines of #baz
+      const auto rules = parse_retention_rules("5", "#bar%irc.example.com:8: #baz%irc.example.com::2");
+      auto result = Database::prune_muc_logs(rules, 0, std::chrono::seconds(10), 2);
+      CHECK(result.done);
+      CHECK(result.rows == 5 + 2 + 8);
+      CHECK(Database::get_muc_logs(owner, "#foo", "irc.example.com").front().body == "5");
+      CHECK(Database::get_muc_logs(owner, "#bar", "irc.example.com").front().body == "2");
+      CHECK(Database::get_muc_logs(owner, "#baz", "irc.example.com").size() == 2);
+
+      result = Database::prune_muc_logs(rules, 0, std::chrono::seconds(10), 2);
+      CHECK(result.rows == 0);
+      // No time left: nothing is done, and the next tick resumes there
+      result = Database::prune_muc_logs(rules, 1, std::chrono::seconds(0), 2);
+      CHECK_FALSE(result.done);
+      CHECK(result.next_rule == 1);
+    }
+
+  SECTION("MUC logs visibility")
+    {
+      const std::string other{"moumou@example.com"};
+      const auto line = [](const std::string& body) -> std::vector<HistoryLine>
+      {
+        return {{"irc.example.com", "#foo", "nick", body, std::chrono::system_clock::now(), ""}};
+      };
+      Database::open_history_range(owner, "irc.example.com", "#foo");
+      Database::add_muc_logs(line("0"));
+      Database::open_history_range(other, "irc.example.com", "#foo");
+      Database::add_muc_logs(line("1"));
+      Database::close_history_range(owner, "irc.example.com", "#foo");
+      Database::add_muc_logs(line("2"));
+      Database::close_history_range(other, "irc.example.com", "#foo");
+      Database::add_muc_logs(line("3"));
+
+      const auto seen = Database::get_muc_logs(owner, "#foo", "irc.example.com");
+      REQUIRE(seen.size() == 2);
+      CHECK(seen.back().body == "1");
+      const auto other_seen = Database::get_muc_logs(other, "#foo", "irc.example.com");
+      REQUIRE(other_seen.size() == 2);
+      CHECK(other_seen.back().body == "2");
+      CHECK(Database::get_muc_logs("nobody@example.com", "#foo", "irc.example.com").empty());
+      // A line that was not visible can’t be used as a cursor
+      CHECK_THROWS_AS(Database::get_muc_logs(owner, "#foo", "irc.example.com", 3, "", "", other_seen.back().uuid),
+                      litesql::NotFound);
+      CHECK(Database::search_muc_logs(owner, "#foo", "irc.example.com", "2").empty());
+      CHECK(Database::search_muc_logs(other, "#foo", "irc.example.com", "2").size() == 1);
+
+      // Rejoining, from two resources: a single range is open
+      Database::open_history_range(owner, "irc.example.com", "#foo");
+      Database::open_history_range(owner, "irc.example.com", "#foo");
+      Database::add_muc_logs(line("4"));
+      CHECK(Database::count<db::MucLogVisibility>() == 3);
+      CHECK(Database::get_muc_logs(owner, "#foo", "irc.example.com").back().body == "4");
+
+      // After a restart, the ranges left open are closed
+      Database::close_all_history_ranges();
+      Database::add_muc_logs(line("5"));
+      CHECK(Database::get_muc_logs(owner, "#foo", "irc.example.com").back().body == "4");
+    }
+
+  SECTION("MUC logs legacy repeats")
+    {
+      // Lines recorded before the history was shared, visible to everyone:
+      // the same line said several times in the same second is kept as is
+      const auto now = std::chrono::system_clock::now();
+      std::vector<HistoryLine> lines;
+      for (int repeat = 0; repeat < 3; ++repeat)
+        lines.push_back({"irc.example.com", "#foo", "nick", "hello", now, ""});
+      Database::open_history_range("", "irc.example.com", "#foo");
+      Database::add_muc_logs(lines);
+      Database::close_history_range("", "irc.example.com", "#foo");
+      // A shared line, identical to a legacy one
+      Database::open_history_range(owner, "irc.example.com", "#foo");
+      Database::add_muc_logs({{"irc.example.com", "#foo", "nick", "hello", now, ""}});
+
+      const auto rules = parse_retention_rules("", "#foo%irc.example.com::10");
+      CHECK(Database::prune_muc_logs(rules, 0, std::chrono::seconds(10), 2).rows == 0);
+      CHECK(Database::get_muc_logs("nobody@example.com", "#foo", "irc.example.com").size() == 3);
+      const auto seen = Database::get_muc_logs(owner, "#foo", "irc.example.com");
+      REQUIRE(seen.size() == 4);
+      for (const auto& line: seen)
+        CHECK(line.body == "hello");
+    }
+
+#ifdef ZLIB_FOUND
+  SECTION("MUC logs compression")
+    {
+      Database::open_history_range(owner, "irc.example.com", "#foo");
+      std::vector<HistoryLine> lines;
+      for (int i = 0; i < 999; ++i)
+        lines.push_back({"irc.example.com", "#foo", "nick", "the build " + std::to_string(i) + " is broken again",
+                         std::chrono::system_clock::now(), ""});
+      Database::add_muc_logs(lines);
+      // Not enough lines to train a dictionary
+      auto progress = Database::compress_muc_logs(std::chrono::seconds(10), 100);
+      CHECK(progress.done);
+      CHECK(progress.rows == 0);
+
+      Database::add_muc_logs({{"irc.example.com", "#foo", "nick", "the build is green", std::chrono::system_clock::now(), ""}});
+      progress = Database::compress_muc_logs(std::chrono::seconds(10), 100);
+      CHECK(progress.done);
+      CHECK(progress.rows > 900);
+      auto last = Database::get_muc_logs(owner, "#foo", "irc.example.com", 2);
+      REQUIRE(last.size() == 2);
+      CHECK(last[0].body == "the build 998 is broken again");
+      CHECK(last[1].body == "the build is green");
+      CHECK(Database::search_muc_logs(owner, "#foo", "irc.example.com", "998").size() == 1);
+
+      // The new lines are compressed when inserted
+      Database::add_muc_logs({{"irc.example.com", "#foo", "nick", "the build is broken again",
+                               std::chrono::system_clock::now(), ""}});
+      CHECK(Database::compress_muc_logs(std::chrono::seconds(10), 100).rows == 0);
+      CHECK(Database::get_muc_logs(owner, "#foo", "irc.example.com", 1)[0].body == "the build is broken again");
+      // The current dictionary is never deleted
+      CHECK(Database::collect_dictionaries() == 0);
+    }
+#endif
+
+  Database::close();
+#endif
+}
+
+/**
+ * Page through the whole history of a channel in a table of
+ * BIBOUMI_BENCH_ROWS lines (1M by default, set it to 50000000 to reproduce
+ * a large instance), spread over 100 channels.
+ */
+TEST_CASE("MUC logs pagination", "[.][benchmark]")
+{
+#ifdef USE_DATABASE
+  const char* env = std::getenv("BIBOUMI_BENCH_ROWS");
+  const std::size_t rows = env ? std::strtoull(env, nullptr, 10) : 1000000;
+  Database::open("mam_benchmark.sqlite");
+  const std::string owner{"bench@example.com"};
+  if (Database::count<db::MucLogLine>() < rows)
+    {
+      Database::open_history_range(owner, "irc.example.com", "#chan42");
+      std::vector<HistoryLine> lines;
+      for (std::size_t i = Database::count<db::MucLogLine>(); i < rows; ++i)
+        {
+          lines.push_back({"irc.example.com", "#chan" + std::to_string(i % 100), "nick",
+                           "line " + std::to_string(i), std::chrono::system_clock::now(), ""});
+          if (lines.size() == 10000)
+            {
+              Database::add_muc_logs(lines);
+              lines.clear();
+            }
+        }
+      Database::add_muc_logs(lines);
+    }
+
+  const auto start = std::chrono::steady_clock::now();
+  std::size_t pages = 0;
+  std::size_t total = 0;
+  std::string before;
+  while (true)
+    {
+      const auto page = Database::get_muc_logs(owner, "#chan42", "irc.example.com", 100, "", "", "", before);
+      pages++;
+      total += page.size();
+      if (page.size() < 100 || pages == 1000)
+        break;
+      before = page.front().uuid;
+    }
+  const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  WARN(pages << " pages (" << total << " lines) of a " << rows << " lines table in "
+       << elapsed.count() << "us, " << elapsed.count() / pages << "us per page");
+  Database::close();
+#endif
+}
+
+/**
+ * Search the history of a channel in a table of BIBOUMI_BENCH_ROWS lines
+ * (1M by default, set it to 10000000 for the target size), spread over
+ * 100 channels.
+ */
+TEST_CASE("MUC logs full-text search", "[.][benchmark]")
+{
+#ifdef USE_DATABASE
+  const char* env = std::getenv("BIBOUMI_BENCH_ROWS");
+  const std::size_t rows = env ? std::strtoull(env, nullptr, 10) : 1000000;
+  Database::open("fts_benchmark.sqlite");
+  REQUIRE(Database::has_fulltext_search());
+  const std::string owner{"bench@example.com"};
+  const std::vector<std::string> words = {"build", "broken", "release", "merge", "review", "tests", "crash",
+                                          "linux", "window", "patch", "commit", "branch", "config", "server"};
+  if (Database::count<db::MucLogLine>() < rows)
+    {
+      Database::open_history_range(owner, "irc.example.com", "#chan42");
+      std::vector<HistoryLine> lines;
+      for (std::size_t i = Database::count<db::MucLogLine>(); i < rows; ++i)
+        {
+          std::string body = "line " + std::to_string(i);
+          for (std::size_t j = 0; j < 6; ++j)
+            body += " " + words[(i * 7 + j * j * 3 + i / (j + 1)) % words.size()];
+          lines.push_back({"irc.example.com", "#chan" + std::to_string(i % 100), "nick",
+                           std::move(body), std::chrono::system_clock::now(), ""});
+          if (lines.size() == 10000)
+            {
+              Database::add_muc_logs(lines);
+              lines.clear();
+            }
+        }
+      Database::add_muc_logs(lines);
+    }
+
+  const std::vector<std::string> queries = {"build", "broken build", "crash linux", "line 4242", "nothing",
+                                            "merge review tests", "release"};
+  std::vector<long> latencies;
+  for (const auto& query: queries)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      const auto page = Database::search_muc_logs(owner, "#chan42", "irc.example.com", query, 21);
+      const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+      latencies.push_back(elapsed.count());
+      WARN("\"" << query << "\": " << page.size() << " lines in " << elapsed.count() << "us");
+    }
+  std::sort(latencies.begin(), latencies.end());
+  WARN("Median " << latencies[latencies.size() / 2] << "us, worst " << latencies.back() << "us, on a "
+       << rows << " lines table");
+  CHECK(latencies.back() < 50000);
+  Database::close();
+#endif
+}
+
+#ifdef USE_DATABASE
+static std::size_t file_size(const std::string& filename)
+{
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  return file ? static_cast<std::size_t>(file.tellg()) : 0;
+}
+#endif
+
+/**
+ * The size of the history of BIBOUMI_BENCH_LINES lines (100000 by
+ * default), spread over 10 channels, each joined by BIBOUMI_BENCH_BRIDGES
+ * bridges (20 by default): first with one copy of each line per bridge, as
+ * recorded before the history was shared, then with each line stored once
+ * and a visibility range per bridge.
+ */
+TEST_CASE("MUC logs storage", "[.][benchmark]")
+{
+#ifdef USE_DATABASE
+  const char* lines_env = std::getenv("BIBOUMI_BENCH_LINES");
+  const std::size_t total = lines_env ? std::strtoull(lines_env, nullptr, 10) : 100000;
+  const char* bridges_env = std::getenv("BIBOUMI_BENCH_BRIDGES");
+  const std::size_t bridges = bridges_env ? std::strtoull(bridges_env, nullptr, 10) : 20;
+  const auto write_history = [&](const std::string& filename, const std::size_t copies) -> std::size_t
+  {
+    std::remove(filename.c_str());
+    Database::open(filename);
+    const auto date = std::chrono::system_clock::now();
+    for (std::size_t channel = 0; channel < 10; ++channel)
+      {
+        const std::string chan_name = "#chan" + std::to_string(channel);
+        if (copies == 1)
+          for (std::size_t bridge = 0; bridge < bridges; ++bridge)
+            Database::open_history_range("user" + std::to_string(bridge) + "@example.com", "irc.example.com",
+                                         chan_name);
+        else
+          Database::open_history_range("", "irc.example.com", chan_name);
+      }
+    std::vector<HistoryLine> lines;
+    for (std::size_t i = 0; i < total; ++i)
+      {
+        for (std::size_t copy = 0; copy < copies; ++copy)
+          lines.push_back({"irc.example.com", "#chan" + std::to_string(i % 10), "nick",
+                           "line " + std::to_string(i) + " of the history", date, ""});
+        if (lines.size() >= 10000)
+          {
+            Database::add_muc_logs(lines);
+            lines.clear();
+          }
+      }
+    Database::add_muc_logs(lines);
+    Database::close_all_history_ranges();
+    Database::close();
+    const auto size = file_size(filename);
+    std::remove(filename.c_str());
+    return size;
+  };
+  const auto copied = write_history("storage_benchmark_copies.sqlite", bridges);
+  const auto shared = write_history("storage_benchmark_shared.sqlite", 1);
+
+  WARN(total << " lines received by " << bridges << " bridges: " << copied / total << " bytes per line with "
+       << "a copy per bridge, " << shared / total << " bytes per line shared");
+  CHECK(shared * 2 < copied);
+#endif
+}
+
+#if defined(USE_DATABASE) && defined(ZLIB_FOUND)
+/**
+ * The messages used by the compression benchmark: the lines of the file
+ * BIBOUMI_BENCH_CORPUS if set, otherwise some generated ones.
+ */
+static std::vector<std::string> load_corpus()
+{
+  std::vector<std::string> res;
+  const char* corpus = std::getenv("BIBOUMI_BENCH_CORPUS");
+  if (corpus)
+    {
+      std::ifstream file(corpus);
+      std::string line;
+      while (std::getline(file, line))
+        if (!line.empty())
+          res.push_back(line);
+    }
+  if (res.empty())
+    {
+      const std::vector<std::string> words = {"the", "build", "is", "broken", "again", "I", "think", "we", "should",
+                                              "merge", "this", "patch", "before", "the", "release", "can", "you",
+                                              "review", "my", "branch", "please", "it", "works", "for", "me", "on",
+                                              "linux", "but", "not", "windows", "https://example.com/issues/"};
+      for (std::size_t i = 0; i < 10000; ++i)
+        {
+          std::string line = "nick" + std::to_string(i % 17) + ":";
+          for (std::size_t j = 0; j < 4 + i % 9; ++j)
+            line += " " + words[(i * 13 + j * 7 + i / 5) % words.size()];
+          res.push_back(std::move(line));
+        }
+    }
+  return res;
+}
+#endif
+
+/**
+ * The size of BIBOUMI_BENCH_ROWS lines (200000 by default) taken from the
+ * corpus, spread over 100 channels, stored as text and then compressed,
+ * and the time spent to get 1000 pages of history in each case.
+ */
+TEST_CASE("MUC logs compression", "[.][benchmark]")
+{
+#if defined(USE_DATABASE) && defined(ZLIB_FOUND)
+  const char* env = std::getenv("BIBOUMI_BENCH_ROWS");
+  const std::size_t rows = env ? std::strtoull(env, nullptr, 10) : 200000;
+  const auto corpus = load_corpus();
+  const std::string owner{"bench@example.com"};
+
+  const auto fill = [&corpus](const std::size_t first, const std::size_t last)
+  {
+    std::vector<HistoryLine> lines;
+    for (std::size_t i = first; i < last; ++i)
+      {
+        lines.push_back({"irc.example.com", "#chan" + std::to_string(i % 100), "nick", corpus[i % corpus.size()],
+                         std::chrono::system_clock::now(), ""});
+        if (lines.size() == 10000)
+          {
+            Database::add_muc_logs(lines);
+            lines.clear();
+          }
+      }
+    Database::add_muc_logs(lines);
+  };
+  const auto page_through = [&owner]()
+  {
+    const auto start = std::chrono::steady_clock::now();
+    std::string before;
+    for (int pages = 0; pages < 1000; ++pages)
+      {
+        const auto page = Database::get_muc_logs(owner, "#chan42", "irc.example.com", 100, "", "", "", before);
+        if (page.size() < 100)
+          break;
+        before = page.front().uuid;
+      }
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  };
+
+  const std::string plain_file{"compression_benchmark_plain.sqlite"};
+  std::remove(plain_file.c_str());
+  Database::open(plain_file);
+  Database::open_history_range(owner, "irc.example.com", "#chan42");
+  fill(0, rows);
+  const auto plain_time = page_through();
+  Database::close();
+
+  // The first lines train the dictionary, all the next ones are
+  // compressed when inserted
+  const std::string compressed_file{"compression_benchmark.sqlite"};
+  std::remove(compressed_file.c_str());
+  Database::open(compressed_file);
+  Database::open_history_range(owner, "irc.example.com", "#chan42");
+  const auto warmup = std::min<std::size_t>(rows, 5000);
+  fill(0, warmup);
+  const auto train_start = std::chrono::steady_clock::now();
+  Database::compress_muc_logs(std::chrono::seconds(60), 1000);
+  const auto train_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - train_start);
+  fill(warmup, rows);
+  const auto compressed_time = page_through();
+  Database::close();
+
+  const auto plain_size = file_size(plain_file);
+  const auto compressed_size = file_size(compressed_file);
+  WARN(rows << " lines: " << plain_size / rows << " bytes per line as text, " << compressed_size / rows
+       << " compressed (ratio " << static_cast<double>(compressed_size) / plain_size << ", full-text index included)");
+  WARN("Dictionary trained in " << train_time.count() << "ms. 1000 pages of history in " << plain_time.count()
+       << "us as text, " << compressed_time.count() << "us compressed");
+  CHECK(compressed_size < plain_size);
+  std::remove(plain_file.c_str());
+  std::remove(compressed_file.c_str());
+#endif
+}
+
+/**
+ * The time needed to get the global and server options of
+ * BIBOUMI_BENCH_USERS users (50000 by default), like when they all
+ * reconnect after a restart, with and without preloading them.
+ */
+TEST_CASE("Options preload", "[.][benchmark]")
+{
+#ifdef USE_DATABASE
+  const char* env = std::getenv("BIBOUMI_BENCH_USERS");
+  const std::size_t users = env ? std::strtoull(env, nullptr, 10) : 50000;
+  const std::string filename{"options_benchmark.sqlite"};
+  const auto user = [](const std::size_t i) { return "user" + std::to_string(i) + "@example.com"; };
+  Database::open(filename);
+  if (Database::count<db::GlobalOptions>() < users)
+    {
+      db::BibouDB connection("sqlite3", "database=" + filename);
+      connection.begin();
+      for (std::size_t i = Database::count<db::GlobalOptions>(); i < users; ++i)
+        {
+          db::GlobalOptions global(connection);
+          global.owner = user(i);
+          global.update();
+          db::IrcServerOptions server(connection);
+          server.owner = user(i);
+          server.server = "irc.example.com";
+          server.update();
+          db::IrcChannelOptions channel(connection);
+          channel.owner = user(i);
+          channel.server = "irc.example.com";
+          channel.channel = "#chan" + std::to_string(i % 100);
+          channel.update();
+        }
+      connection.commit();
+    }
+
+  const auto get_all = [users, &user]()
+  {
+    for (std::size_t i = 0; i < users; ++i)
+      {
+        Database::get_global_options(user(i));
+        Database::get_irc_server_options(user(i), "irc.example.com");
+      }
+  };
+  using ms = std::chrono::milliseconds;
+
+  auto start = std::chrono::steady_clock::now();
+  get_all();
+  const auto cold = std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start);
+
+  Database::open(filename);
+  start = std::chrono::steady_clock::now();
+  const auto rows = Database::preload_options();
+  const auto preload = std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start);
+  start = std::chrono::steady_clock::now();
+  get_all();
+  const auto warm = std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start);
+
+  WARN(users << " users, one query each: " << cold.count() << "ms");
+  WARN(users << " users, preloaded (" << rows << " rows): " << (preload + warm).count() << "ms ("
+       << preload.count() << "ms to load, " << warm.count() << "ms to get them)");
   Database::close();
 #endif
 }
@@ -0,0 +1,92 @@
+#include "catch.hpp"
+
+#include <xmpp/entity_caps.hpp>
+#include <xmpp/xmpp_component.hpp>
+#include <xmpp/xmpp_stanza.hpp>
+#include <utils/timed_events.hpp>
+
+TEST_CASE("Entity capabilities cache")
+{
+  EntityCaps caps;
+
+  // Nothing is known: assume everything is supported
+  CHECK(caps.may_support("a@example.com/foo", "feature"));
+
+  CHECK(caps.set_jid_ver("a@example.com/foo", "ver1"));
+  // Only one query for the same client build
+  CHECK_FALSE(caps.set_jid_ver("b@example.com/bar", "ver1"));
+  CHECK(caps.may_support("a@example.com/foo", "feature"));
+
+  caps.set_features("ver1", {"other"});
+  CHECK(caps.size() == 1);
+  CHECK_FALSE(caps.may_support("a@example.com/foo", "feature"));
+  CHECK_FALSE(caps.may_support("b@example.com/bar", "feature"));
+  CHECK(caps.may_support("a@example.com/foo", "other"));
+  CHECK_FALSE(caps.set_jid_ver("c@example.com/baz", "ver1"));
+
+  CHECK(caps.set_jid_ver("a@example.com/foo", "ver2"));
+  CHECK(caps.may_support("a@example.com/foo", "feature"));
+  caps.set_features("ver2", {"feature"});
+  CHECK(caps.may_support("a@example.com/foo", "feature"));
+
+  caps.forget_bare_jid("b@example.com");
+  CHECK(caps.may_support("b@example.com/bar", "feature"));
+  CHECK_FALSE(caps.may_support("c@example.com/baz", "feature"));
+}
+
+TEST_CASE("Entity capabilities verification string")
+{
+  // The example of XEP-0115 §5.2
+  XmlNode query("query");
+  query["xmlns"] = DISCO_INFO_NS;
+  XmlNode identity("identity");
+  identity["xmlns"] = DISCO_INFO_NS;
+  identity["category"] = "client";
+  identity["type"] = "pc";
+  identity["name"] = "Exodus 0.9.1";
+  query.add_child(std::move(identity));
+  for (const auto& var: {"http://jabber.org/protocol/disco#info", "http://jabber.org/protocol/disco#items",
+                         "http://jabber.org/protocol/muc", "http://jabber.org/protocol/caps"})
+    {
+      XmlNode feature("feature");
+      feature["xmlns"] = DISCO_INFO_NS;
+      feature["var"] = var;
+      query.add_child(std::move(feature));
+    }
+  CHECK(EntityCaps::compute_ver(query) == "QgayPKawpkPSDYmwT/WM94uAlu0=");
+
+  // One more feature, advertised with the same verification string
+  XmlNode feature("feature");
+  feature["xmlns"] = DISCO_INFO_NS;
+  feature["var"] = XHTMLIM_NS;
+  query.add_child(std::move(feature));
+  CHECK(EntityCaps::compute_ver(query) != "QgayPKawpkPSDYmwT/WM94uAlu0=");
+
+  EntityCaps caps;
+  CHECK(caps.set_jid_ver("a@example.com/foo", "ver1"));
+  caps.query_failed("ver1");
+  // Asked again
+  CHECK(caps.set_jid_ver("b@example.com/bar", "ver1"));
+  caps.set_features("ver1", {"other"});
+  CHECK_FALSE(caps.may_support("a@example.com/foo", "feature"));
+  caps.forget_jid("a@example.com/foo");
+  CHECK(caps.may_support("a@example.com/foo", "feature"));
+  CHECK_FALSE(caps.may_support("b@example.com/bar", "feature"));
+}
+
+TEST_CASE("Entity capabilities query timeout")
+{
+  EntityCaps caps(std::chrono::milliseconds(0));
+  CHECK(caps.set_jid_ver("a@example.com/foo", "ver1"));
+  CHECK_FALSE(caps.set_jid_ver("b@example.com/bar", "ver1"));
+
+  // Never answered: the next client advertising it is asked again
+  TimedEventsManager::instance().execute_expired_events();
+  CHECK(caps.set_jid_ver("b@example.com/bar", "ver1"));
+
+  // Answered in time: nothing happens on timeout
+  caps.set_features("ver1", {"other"});
+  TimedEventsManager::instance().execute_expired_events();
+  CHECK_FALSE(caps.set_jid_ver("c@example.com/baz", "ver1"));
+  CHECK_FALSE(caps.may_support("a@example.com/foo", "feature"));
+}
@@ -0,0 +1,242 @@
+#include "catch.hpp"
+
+#include <utils/history_writer.hpp>
+#include <utils/recent_history.hpp>
+#include <utils/history_retention.hpp>
+#include <utils/timed_events.hpp>
+#include <logger/logger.hpp>
+
+#include "biboumi.h"
+#ifdef USE_DATABASE
+# include <database/database.hpp>
+#endif
+
+#include <thread>
+
+static HistoryLine make_line(const std::string& channel, const std::string& body,
+                             const std::chrono::system_clock::time_point date=std::chrono::system_clock::now())
+{
+  static unsigned int count = 0;
+  return {"irc.example.com", channel, "nick", body, date, "uuid-" + std::to_string(count++)};
+}
+
+TEST_CASE("History writer batches")
+{
+  std::vector<std::vector<HistoryLine>> batches;
+  HistoryWriter writer([&batches](std::vector<HistoryLine>&& lines) { batches.push_back(std::move(lines)); },
+                       3, std::chrono::milliseconds(10));
+
+  SECTION("By size")
+    {
+      for (int i = 0; i < 7; ++i)
+        CHECK(writer.log("owner@example.com", make_line("#chan", "line " + std::to_string(i))));
+      CHECK(batches.size() == 2);
+      CHECK(batches[0].size() == 3);
+      CHECK(batches[1][2].body == "line 5");
+      CHECK(writer.get_metrics().pending == 1);
+      writer.flush();
+      CHECK(batches.size() == 3);
+      CHECK(batches[2][0].body == "line 6");
+      CHECK(writer.get_metrics().batches == 3);
+      writer.flush();
+      CHECK(batches.size() == 3);
+    }
+  SECTION("By age")
+    {
+      writer.log("owner@example.com", make_line("#chan", "hello"));
+      CHECK(batches.empty());
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      TimedEventsManager::instance().execute_expired_events();
+      CHECK(batches.size() == 1);
+      CHECK(writer.get_metrics().pending == 0);
+    }
+  SECTION("One IrcClient records each channel")
+    {
+      CHECK(writer.log("a@example.com", make_line("#chan", "hello")));
+      CHECK_FALSE(writer.log("b@example.com", make_line("#chan", "hello")));
+      // Same text in another channel, joined first by b
+      CHECK(writer.log("b@example.com", make_line("#other", "hello")));
+      CHECK_FALSE(writer.log("a@example.com", make_line("#Other", "hello")));
+      // Said again: a genuine repeat, recorded again
+      CHECK(writer.log("a@example.com", make_line("#chan", "hello")));
+      CHECK(writer.log("a@example.com", make_line("#chan", "hello")));
+      CHECK_FALSE(writer.log("b@example.com", make_line("#chan", "hello")));
+      // a leaves #chan: b takes over
+      writer.release("a@example.com", "irc.example.com", "#CHAN");
+      CHECK(writer.log("b@example.com", make_line("#chan", "hi")));
+      CHECK_FALSE(writer.log("a@example.com", make_line("#chan", "hi")));
+      // b gets disconnected from the server
+      writer.release("b@example.com", "irc.example.com");
+      CHECK(writer.log("a@example.com", make_line("#other", "bye")));
+      CHECK(writer.log("a@example.com", make_line("#chan", "bye")));
+      const auto metrics = writer.get_metrics();
+      CHECK(metrics.lines == 7);
+      CHECK(metrics.duplicates == 4);
+    }
+}
+
+TEST_CASE("Recent history")
+{
+  RecentHistory history(5);
+  const auto now = std::chrono::system_clock::now();
+  const std::string owner{"a@example.com"};
+  history.open_range(owner, "irc.example.com", "#chan");
+  std::vector<std::string> uuids;
+  for (int i = 0; i < 8; ++i)
+    {
+      auto line = make_line("#chan", std::to_string(i), now - std::chrono::minutes(8 - i));
+      uuids.push_back(line.uuid);
+      history.add(line);
+    }
+  std::vector<HistoryLine> lines;
+
+  SECTION("Join history")
+    {
+      // The older lines are only in the database
+      CHECK_FALSE(history.get_last_lines(owner, "irc.example.com", "#chan", -1, {}, lines));
+      REQUIRE(lines.size() == 5);
+      CHECK(lines.front().body == "3");
+      CHECK(history.get_last_lines(owner, "irc.example.com", "#chan", 2, {}, lines));
+      REQUIRE(lines.size() == 2);
+      CHECK(lines.front().body == "6");
+      CHECK(history.get_last_lines(owner, "irc.example.com", "#chan", 10, now - std::chrono::seconds(150), lines));
+      REQUIRE(lines.size() == 2);
+      CHECK(lines.back().body == "7");
+      CHECK_FALSE(history.get_last_lines(owner, "irc.example.com", "#other", 10, {}, lines));
+      CHECK(lines.empty());
+      CHECK(history.get_metrics().hits == 2);
+      CHECK(history.get_metrics().misses == 2);
+    }
+  SECTION("Archive pages")
+    {
+      CHECK(history.get_page(owner, "irc.example.com", "#chan", 3, -1, -1, "", "", lines));
+      REQUIRE(lines.size() == 3);
+      CHECK(lines.front().body == "5");
+      CHECK(history.get_page(owner, "irc.example.com", "#chan", 2, -1, -1, "", lines.front().uuid, lines));
+      REQUIRE(lines.size() == 2);
+      CHECK(lines.front().body == "3");
+      // Line 2 is only in the database
+      CHECK_FALSE(history.get_page(owner, "irc.example.com", "#chan", 2, -1, -1, "", lines.front().uuid, lines));
+      CHECK(lines.front().body == "3");
+      // Unless it is excluded by the start date
+      const auto start = std::chrono::system_clock::to_time_t(now - std::chrono::seconds(270));
+      CHECK(history.get_page(owner, "irc.example.com", "#chan", 3, start, -1, "", uuids[6], lines));
+      REQUIRE(lines.size() == 2);
+      CHECK(lines.front().body == "4");
+      CHECK(history.get_page(owner, "irc.example.com", "#chan", 10, -1, -1, uuids[4], "", lines));
+      REQUIRE(lines.size() == 3);
+      CHECK(lines.front().body == "5");
+      CHECK_FALSE(history.get_page(owner, "irc.example.com", "#chan", 10, -1, -1, uuids[0], "", lines));
+      CHECK(history.get_metrics().misses == 2);
+    }
+  SECTION("Visibility")
+    {
+      // b only sees the lines received while it was in the channel
+      const std::string other{"b@example.com"};
+      history.open_range(other, "irc.example.com", "#chan");
+      history.add(make_line("#chan", "8", now));
+      history.add(make_line("#chan", "9", now));
+      history.close_range(other, "irc.example.com", "#chan");
+      const auto after_leave = make_line("#chan", "10", now);
+      history.add(after_leave);
+
+      const auto start = std::chrono::system_clock::to_time_t(now);
+      CHECK(history.get_page(other, "irc.example.com", "#chan", 10, start, -1, "", "", lines));
+      REQUIRE(lines.size() == 2);
+      CHECK(lines.front().body == "8");
+      CHECK(lines.back().body == "9");
+      CHECK(history.get_last_lines(other, "irc.example.com", "#chan", 10, now - std::chrono::seconds(30), lines));
+      CHECK(lines.size() == 2);
+      // Whether the older lines are visible is only known by the database
+      CHECK_FALSE(history.get_page(other, "irc.example.com", "#chan", 10, -1, -1, "", "", lines));
+      CHECK_FALSE(history.get_page("c@example.com", "irc.example.com", "#chan", 10, start, -1, "", "", lines));
+      // A cursor must be visible too
+      CHECK_FALSE(history.get_page(other, "irc.example.com", "#chan", 10, -1, -1, after_leave.uuid, "", lines));
+
+      // a never left
+      CHECK(history.get_last_lines(owner, "irc.example.com", "#chan", 1, {}, lines));
+      REQUIRE(lines.size() == 1);
+      CHECK(lines.front().body == "10");
+
+      history.open_range(other, "irc.example.com", "#chan");
+      history.add(make_line("#chan", "11", now));
+      CHECK(history.get_page(other, "irc.example.com", "#chan", 10, start, -1, "", "", lines));
+      REQUIRE(lines.size() == 3);
+      CHECK(lines.back().body == "11");
+    }
+  SECTION("Memory cap")
+    {
+      RecentHistory small(100, 4096);
+      for (int i = 0; i < 100; ++i)
+        {
+          if (i == 99)
+            small.open_range(owner, "irc.example.com", "#chan49");
+          small.add(make_line("#chan" + std::to_string(i % 50), std::string(100, 'x')));
+        }
+      const auto metrics = small.get_metrics();
+      CHECK(metrics.memory <= 4096);
+      CHECK(metrics.channels < 50);
+      CHECK(metrics.evictions > 0);
+      // The most recently used channel is kept
+      CHECK(small.get_last_lines(owner, "irc.example.com", "#chan49", 1, {}, lines));
+      CHECK(lines.size() == 1);
+    }
+}
+
+TEST_CASE("History retention rules")
+{
+  Logger::instance().reset();
+  auto rules = parse_retention_rules("", "");
+  CHECK(rules.empty());
+
+  rules = parse_retention_rules("30", "#foo%irc.example.com:7: #bar%irc.example.com::1000 "
+                                "#baz%irc.example.com:2:50 invalid #nothing%irc.example.com::");
+  CHECK(rules.max_age == std::chrono::hours(24 * 30));
+  REQUIRE(rules.channels.size() == 3);
+  CHECK(rules.channels[0].channel == "#foo");
+  CHECK(rules.channels[0].server == "irc.example.com");
+  CHECK(rules.channels[0].policy.max_age == std::chrono::hours(24 * 7));
+  CHECK(rules.channels[0].policy.max_rows == 0);
+  CHECK(rules.channels[1].policy.max_age.count() == 0);
+  CHECK(rules.channels[1].policy.max_rows == 1000);
+  CHECK(rules.channels[2].policy.max_rows == 50);
+
+  CHECK(parse_retention_rules("-1", "#foo%irc.example.com:x:").empty());
+}
+
+TEST_CASE("History writer throughput", "[.][benchmark]")
+{
+#ifdef USE_DATABASE
+  Database::open(":memory:");
+#endif
+  std::size_t written = 0;
+  HistoryWriter writer([&written](std::vector<HistoryLine>&& lines)
+                       {
+#ifdef USE_DATABASE
+                         Database::add_muc_logs(lines);
+#endif
+                         written += lines.size();
+                       });
+  // Each line is received by the bridges of 5 users joined in the channel
+  const std::vector<std::string> owners = {"a@example.com", "b@example.com", "c@example.com",
+                                           "d@example.com", "e@example.com"};
+  for (const std::size_t rate: {1000, 10000, 50000})
+    {
+      written = 0;
+      const auto start = std::chrono::steady_clock::now();
+      for (std::size_t i = 0; i < rate; ++i)
+        {
+          const auto body = "message number " + std::to_string(i) + " in a moderately busy channel";
+          for (const auto& owner: owners)
+            writer.log(owner, make_line("#chan" + std::to_string(i % 16), body));
+        }
+      writer.flush();
+      const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+      CHECK(written == rate);
+      WARN("One second at " << rate << " lines/s handled in " << elapsed.count() << "us ("
+           << (rate * 1000000 / std::max<long>(elapsed.count(), 1)) << " lines/s sustainable)");
+    }
+#ifdef USE_DATABASE
+  Database::close();
+#endif
+}
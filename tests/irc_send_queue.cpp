@@ -0,0 +1,59 @@
+#include "catch.hpp"
+
+#include <irc/irc_send_queue.hpp>
+
+#include <utils/timed_events.hpp>
+
+#include <thread>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("IRC send queue")
+{
+  std::vector<std::string> sent;
+  IrcSendQueue queue("test send queue", [&sent](std::string&& line) { sent.push_back(std::move(line)); });
+
+  SECTION("Without limit")
+    {
+      for (int i = 0; i < 10; ++i)
+        queue.push("PRIVMSG #a :" + std::to_string(i), SendLane::bulk);
+      CHECK(sent.size() == 10);
+      CHECK(queue.size() == 0);
+    }
+  SECTION("Burst, then paced, with the high lane first")
+    {
+      queue.set_rate(2, 200);
+      queue.push("PRIVMSG #a :1", SendLane::bulk);
+      queue.push("PRIVMSG #a :2", SendLane::bulk);
+      queue.push("PRIVMSG #a :3", SendLane::bulk);
+      queue.push("PART #a", SendLane::bulk);
+      queue.push("PONG :x", SendLane::high);
+      CHECK(sent.size() == 2);
+      CHECK(queue.size() == 3);
+      CHECK(queue.get_metrics().max_depth == 3);
+      while (queue.size() > 0)
+        {
+          std::this_thread::sleep_for(2ms);
+          TimedEventsManager::instance().execute_expired_events();
+        }
+      const std::vector<std::string> expected{"PRIVMSG #a :1", "PRIVMSG #a :2", "PONG :x",
+                                              "PRIVMSG #a :3", "PART #a"};
+      CHECK(sent == expected);
+      const auto metrics = queue.get_metrics();
+      CHECK(metrics.sent == 5);
+      CHECK(metrics.delayed == 3);
+      CHECK(metrics.max_delay >= 5ms);
+    }
+  SECTION("Clear")
+    {
+      queue.set_rate(1, 1);
+      queue.push("PRIVMSG #a :1", SendLane::bulk);
+      queue.push("PRIVMSG #a :2", SendLane::bulk);
+      queue.clear();
+      CHECK(queue.size() == 0);
+      CHECK(TimedEventsManager::instance().cancel("test send queue") == 0);
+      // All the tokens are back
+      queue.push("PRIVMSG #a :3", SendLane::bulk);
+      CHECK(sent.size() == 2);
+    }
+}
@@ -16,6 +16,19 @@ TEST_CASE("Jid")
   CHECK(jid2.domain == "ツ.coucou");
   CHECK(jid2.resource == "coucou@coucou/coucou");
 
+  const std::string full("♥@ツ.coucou/coucou@coucou/coucou");
+  JidView view1(full);
+  CHECK(view1.local == "♥");
+  CHECK(view1.domain == "ツ.coucou");
+  CHECK(view1.resource == "coucou@coucou/coucou");
+  CHECK(view1.bare() == "♥@ツ.coucou");
+
+  const std::string domain("ツ.coucou");
+  JidView view2(domain);
+  CHECK(view2.local.empty());
+  CHECK(view2.domain == "ツ.coucou");
+  CHECK(view2.resource.empty());
+
   // Jidprep
   const std::string badjid("~zigougou™@EpiK-7D9D1FDE.poez.io/Boujour/coucou/slt™");
   const std::string correctjid = jidprep(badjid);
@@ -23,8 +36,10 @@ TEST_CASE("Jid")
   CHECK(correctjid == "~zigougoutm@epik-7d9d1fde.poez.io/Boujour/coucou/sltTM");
   // Check that the cache does not break things when we prep the same string
   // multiple times
+  const auto hits = get_jidprep_cache_metrics().hits;
   CHECK(jidprep(badjid) == "~zigougoutm@epik-7d9d1fde.poez.io/Boujour/coucou/sltTM");
   CHECK(jidprep(badjid) == "~zigougoutm@epik-7d9d1fde.poez.io/Boujour/coucou/sltTM");
+  CHECK(get_jidprep_cache_metrics().hits == hits + 2);
 
   const std::string badjid2("Zigougou@poez.io");
   const std::string correctjid2 = jidprep(badjid2);
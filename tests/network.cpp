@@ -0,0 +1,966 @@
+#include "catch.hpp"
+
+#include <network/worker.hpp>
+#include <network/dns_cache.hpp>
+#include <network/tcp_socket_handler.hpp>
+#include <network/connection_metrics.hpp>
+#include <network/connection_scheduler.hpp>
+#include <network/bind_pool.hpp>
+#include <network/resolver.hpp>
+#include <network/poller.hpp>
+#include <logger/logger.hpp>
+#include <utils/timed_events.hpp>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <future>
+
+using namespace std::chrono_literals;
+
+TEST_CASE("Worker completions")
+{
+  // Failing jobs are logged from the worker thread
+  Logger::instance().reset();
+  auto poller = std::make_shared<Poller>();
+  Worker worker(poller);
+
+  SECTION("Completions run on the poller thread, in order")
+    {
+      std::vector<int> results;
+      std::vector<std::thread::id> threads;
+      for (int i = 0; i < 3; ++i)
+        worker.post("test",
+                    [&threads]() { threads.push_back(std::this_thread::get_id()); },
+                    [&results, i]() { results.push_back(i); });
+      // The eventfd is only watched while completions are expected
+      CHECK(poller->size() == 1);
+      while (results.size() < 3)
+        CHECK(poller->poll(1s) >= 0);
+      CHECK(results == std::vector<int>({0, 1, 2}));
+      CHECK(poller->size() == 0);
+      for (const auto& id: threads)
+        CHECK(id != std::this_thread::get_id());
+
+      const auto metrics = worker.get_metrics();
+      CHECK(metrics.queue_depth == 0);
+      CHECK(metrics.max_queue_depth >= 1);
+      CHECK(metrics.jobs.at("test").count == 3);
+    }
+  SECTION("Blocking run")
+    {
+      std::thread::id id;
+      worker.run("sync", [&id]() { id = std::this_thread::get_id(); });
+      CHECK(id != std::this_thread::get_id());
+      CHECK(poller->size() == 0);
+    }
+  SECTION("A failing job still completes")
+    {
+      bool completed = false;
+      worker.post("fail", []() { throw std::runtime_error("failure"); },
+                  [&completed]() { completed = true; });
+      while (!completed)
+        CHECK(poller->poll(1s) >= 0);
+      CHECK(worker.get_metrics().jobs.at("fail").count == 1);
+    }
+  SECTION("Queued jobs are run before stopping")
+    {
+      std::promise<void> release;
+      auto released = release.get_future().share();
+      int done = 0;
+      worker.post("block", [released]() { released.wait(); }, {});
+      for (int i = 0; i < 10; ++i)
+        worker.post("count", [&done]() { done++; }, {});
+      CHECK(worker.get_metrics().queue_depth >= 10);
+      release.set_value();
+      worker.stop();
+      CHECK(done == 10);
+      // Once stopped, jobs are run inline
+      bool inline_completion = false;
+      worker.post("inline", [&done]() { done++; }, [&inline_completion]() { inline_completion = true; });
+      CHECK(done == 11);
+      CHECK(inline_completion);
+    }
+}
+
+#ifndef CARES_FOUND
+TEST_CASE("Resolver pool")
+{
+  Logger::instance().reset();
+  auto poller = std::make_shared<Poller>();
+  Resolver::start_pool(poller, 2);
+  // The answers of the previous sections would be given right away
+  Resolver::get_cache().flush();
+
+  SECTION("The callback runs on the poller thread")
+    {
+      Resolver resolver;
+      std::string result;
+      resolver.resolve("localhost", "6667",
+                       [&result](const struct addrinfo* addr) { result = addr_to_string(addr); },
+                       [](const char*) {});
+      CHECK(resolver.is_resolving());
+      while (resolver.is_resolving())
+        CHECK(poller->poll(1s) >= 0);
+      CHECK(resolver.is_resolved());
+      CHECK((result == "127.0.0.1" || result == "::1"));
+    }
+  SECTION("A resolver destroyed or cleared before the result is not called")
+    {
+      bool called = false;
+      {
+        Resolver resolver;
+        resolver.resolve("localhost", "6667",
+                         [&called](const struct addrinfo*) { called = true; },
+                         [&called](const char*) { called = true; });
+      }
+      Resolver resolver;
+      resolver.resolve("localhost", "6667",
+                       [&called](const struct addrinfo*) { called = true; },
+                       [&called](const char*) { called = true; });
+      resolver.clear();
+      CHECK_FALSE(resolver.is_resolving());
+      while (poller->size() > 0)
+        CHECK(poller->poll(1s) >= 0);
+      CHECK_FALSE(called);
+    }
+  Resolver::stop_pool();
+}
+#endif
+
+TEST_CASE("DNS cache")
+{
+  std::vector<std::pair<std::string, DNSCache::LookupCallback>> lookups;
+  DNSCache cache([&lookups](const std::string& hostname, DNSCache::LookupCallback callback)
+                 {
+                   lookups.emplace_back(hostname, std::move(callback));
+                 });
+  auto make_answer = [](const int count)
+    {
+      DNSAnswer answer;
+      answer.addresses.resize(count);
+      for (auto& address: answer.addresses)
+        address.ss_family = AF_INET;
+      return answer;
+    };
+  std::vector<std::size_t> results;
+  auto callback = [&results](const DNSAnswer& answer) { results.push_back(answer.addresses.size()); };
+
+  SECTION("The queries during a lookup share it, the next ones use its answer")
+    {
+      cache.resolve("irc.example.com", callback);
+      cache.resolve("irc.example.com", callback);
+      cache.resolve("other.example.com", callback);
+      CHECK(lookups.size() == 2);
+      CHECK(results.empty());
+      lookups[0].second(make_answer(2), 60s);
+      CHECK(results == std::vector<std::size_t>({2, 2}));
+      cache.resolve("irc.example.com", callback);
+      CHECK(lookups.size() == 2);
+      CHECK(results.size() == 3);
+
+      const auto metrics = cache.get_metrics();
+      CHECK(metrics.hits == 1);
+      CHECK(metrics.misses == 2);
+      CHECK(metrics.coalesced == 1);
+      CHECK(metrics.entries == 2);
+    }
+  SECTION("An expired answer is looked up again")
+    {
+      cache.resolve("irc.example.com", callback);
+      lookups[0].second(make_answer(1), 0s);
+      cache.resolve("irc.example.com", callback);
+      CHECK(lookups.size() == 2);
+      CHECK(results.size() == 1);
+    }
+  SECTION("Failures are kept too")
+    {
+      cache.resolve("nowhere.example.com", callback);
+      DNSAnswer answer;
+      answer.error = "Domain name not found";
+      lookups[0].second(std::move(answer), DNSCache::not_found_ttl);
+      std::string error;
+      cache.resolve("nowhere.example.com", [&error](const DNSAnswer& answer) { error = answer.error; });
+      CHECK(lookups.size() == 1);
+      CHECK(error == "Domain name not found");
+    }
+  SECTION("A waiter can query the same hostname again")
+    {
+      cache.resolve("irc.example.com", [&cache, &callback](const DNSAnswer&)
+                    {
+                      cache.resolve("irc.example.com", callback);
+                    });
+      lookups[0].second(make_answer(3), 60s);
+      CHECK(results == std::vector<std::size_t>({3}));
+      CHECK(lookups.size() == 1);
+    }
+  SECTION("Flushing keeps the lookups in progress")
+    {
+      cache.resolve("irc.example.com", callback);
+      lookups[0].second(make_answer(1), 60s);
+      cache.resolve("other.example.com", callback);
+      CHECK(cache.flush() == 1);
+      CHECK(cache.get_metrics().entries == 1);
+      lookups[1].second(make_answer(1), 60s);
+      CHECK(results.size() == 2);
+      cache.resolve("irc.example.com", callback);
+      CHECK(lookups.size() == 3);
+    }
+}
+
+TEST_CASE("DNS cache size")
+{
+  std::vector<DNSCache::LookupCallback> lookups;
+  DNSCache cache([&lookups](const std::string&, DNSCache::LookupCallback callback)
+                 {
+                   lookups.push_back(std::move(callback));
+                 }, 2);
+  auto callback = [](const DNSAnswer&) {};
+
+  SECTION("The answers that expire first make room for the new ones")
+    {
+      cache.resolve("a.example.com", callback);
+      lookups.back()(DNSAnswer{}, 60s);
+      cache.resolve("b.example.com", callback);
+      lookups.back()(DNSAnswer{}, 30s);
+      cache.resolve("c.example.com", callback);
+      lookups.back()(DNSAnswer{}, 60s);
+      CHECK(cache.get_metrics().entries == 2);
+      CHECK(cache.get_metrics().evicted == 1);
+      cache.resolve("a.example.com", callback);
+      CHECK(lookups.size() == 3);
+      cache.resolve("b.example.com", callback);
+      CHECK(lookups.size() == 4);
+    }
+  SECTION("The expired answers are removed first, never the lookups in progress")
+    {
+      cache.resolve("a.example.com", callback);
+      cache.resolve("b.example.com", callback);
+      lookups.back()(DNSAnswer{}, 0s);
+      cache.resolve("c.example.com", callback);
+      CHECK(cache.get_metrics().entries == 2);
+      CHECK(cache.get_metrics().evicted == 1);
+      cache.resolve("d.example.com", callback);
+      CHECK(cache.get_metrics().entries == 3);
+      CHECK(lookups.size() == 4);
+    }
+}
+
+namespace
+{
+class TestConnection: public TCPSocketHandler
+{
+public:
+  explicit TestConnection(std::shared_ptr<Poller> poller):
+    TCPSocketHandler(poller)
+  {}
+  ~TestConnection() = default;
+  void on_connected() override final
+  { this->result = "connected to " + this->port + (this->use_tls ? " (tls)": ""); }
+  void on_connection_failed(const std::string& reason) override final
+  { this->result = "failed: " + reason; }
+  void on_connection_close(const std::string&) override final {}
+  void parse_in_buffer(const size_t) override final {}
+  void bind_to(const std::string& address)
+  { this->bind_addr = address; }
+
+  std::string result;
+};
+
+/**
+ * A listening socket on the loopback, on a port chosen by the system.
+ */
+socket_t listen_on_loopback(std::string& port)
+{
+  const socket_t socket = ::socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t len = sizeof(addr);
+  ::bind(socket, reinterpret_cast<struct sockaddr*>(&addr), len);
+  ::listen(socket, 4);
+  ::getsockname(socket, reinterpret_cast<struct sockaddr*>(&addr), &len);
+  port = std::to_string(ntohs(addr.sin_port));
+  return socket;
+}
+}
+
+TEST_CASE("Connection attempts")
+{
+  Logger::instance().reset();
+  auto poller = std::make_shared<Poller>();
+  ConnectionMetrics::instance().clear();
+  std::string open_port;
+  const socket_t listening = listen_on_loopback(open_port);
+  // A port that nobody listens on anymore
+  std::string closed_port;
+  ::close(listen_on_loopback(closed_port));
+
+  auto run = [&poller](TestConnection& connection)
+    {
+      while (connection.result.empty())
+        {
+          auto timeout = TimedEventsManager::instance().get_timeout();
+          if (timeout == utils::no_timeout || timeout > 1s)
+            timeout = 1s;
+          CHECK(poller->poll(timeout) >= 0);
+          TimedEventsManager::instance().execute_expired_events();
+        }
+    };
+
+  SECTION("The first port that accepts the connection is used")
+    {
+      TestConnection connection(poller);
+      connection.connect("127.0.0.1", {{closed_port, true}, {open_port, false}});
+      run(connection);
+      CHECK(connection.result == "connected to " + open_port);
+      CHECK(connection.is_connected());
+      CHECK(poller->size() == 1);
+      const auto stats = ConnectionMetrics::instance().get("127.0.0.1");
+      CHECK(stats.connections == 1);
+      CHECK(stats.failures == 0);
+      CHECK(stats.p99 < TCPSocketHandler::connection_attempt_timeout);
+      connection.close();
+    }
+  SECTION("The ports without TLS are only tried once the TLS ones failed")
+    {
+      std::string tls_port;
+      const socket_t tls_listening = listen_on_loopback(tls_port);
+      TestConnection connection(poller);
+      connection.connect("127.0.0.1", {{open_port, false}, {tls_port, true}});
+      run(connection);
+      CHECK(connection.result == "connected to " + tls_port + " (tls)");
+      connection.close();
+      ::close(tls_listening);
+    }
+  SECTION("The connection fails once all the ports failed")
+    {
+      TestConnection connection(poller);
+      connection.connect("127.0.0.1", {{closed_port, true}, {closed_port, false}});
+      run(connection);
+      CHECK(connection.result == "failed: Connection refused");
+      CHECK_FALSE(connection.is_connecting());
+      CHECK(ConnectionMetrics::instance().get("127.0.0.1").failures == 1);
+    }
+  SECTION("The bind address is released once the connection failed or is closed")
+    {
+      auto& pool = BindPool::instance();
+      pool.clear();
+      TestConnection connection(poller);
+      connection.bind_to(pool.choose({"127.0.0.1"}, BindPolicy::round_robin, "127.0.0.1", "a@example.com"));
+      connection.connect("127.0.0.1", {{closed_port, false}});
+      CHECK(pool.get_connections("127.0.0.1") == 1);
+      run(connection);
+      CHECK(pool.get_connections("127.0.0.1") == 0);
+
+      connection.result.clear();
+      connection.bind_to(pool.choose({"127.0.0.1"}, BindPolicy::round_robin, "127.0.0.1", "a@example.com"));
+      connection.connect("127.0.0.1", {{open_port, false}});
+      run(connection);
+      CHECK(pool.get_connections("127.0.0.1") == 1);
+      connection.close();
+      CHECK(pool.get_connections("127.0.0.1") == 0);
+    }
+  // Destroy the cancelled attempts
+  TimedEventsManager::instance().execute_expired_events();
+  CHECK(poller->size() == 0);
+  ::close(listening);
+}
+
+TEST_CASE("Connection metrics")
+{
+  auto& metrics = ConnectionMetrics::instance();
+  metrics.clear();
+  CHECK(metrics.get("irc.example.com").connections == 0);
+  for (int i = 1; i <= 100; ++i)
+    metrics.record_success("irc.example.com", std::chrono::milliseconds(i));
+  metrics.record_failure("irc.example.com");
+  auto stats = metrics.get("irc.example.com");
+  CHECK(stats.connections == 100);
+  CHECK(stats.failures == 1);
+  CHECK(stats.p50 == 50ms);
+  CHECK(stats.p90 == 90ms);
+  CHECK(stats.p99 == 99ms);
+  // Only the last connections are kept
+  for (std::size_t i = 0; i < ConnectionMetrics::max_samples; ++i)
+    metrics.record_success("irc.example.com", 1000ms);
+  stats = metrics.get("irc.example.com");
+  CHECK(stats.p50 == 1000ms);
+  CHECK(stats.connections == 100 + ConnectionMetrics::max_samples);
+  metrics.clear();
+}
+
+TEST_CASE("Bind address pool")
+{
+  auto& pool = BindPool::instance();
+  pool.clear();
+  const std::vector<std::string> addresses{"192.0.2.1", "192.0.2.2", "192.0.2.3"};
+
+  CHECK(pool.choose({}, BindPolicy::round_robin, "irc.example.com", "a@example.com").empty());
+
+  SECTION("Round-robin")
+    {
+      CHECK(pool.choose(addresses, BindPolicy::round_robin, "irc.example.com", "a@example.com") == "192.0.2.1");
+      CHECK(pool.choose(addresses, BindPolicy::round_robin, "irc.example.com", "a@example.com") == "192.0.2.2");
+      CHECK(pool.choose(addresses, BindPolicy::round_robin, "irc.example.com", "a@example.com") == "192.0.2.3");
+      CHECK(pool.choose(addresses, BindPolicy::round_robin, "irc.example.com", "a@example.com") == "192.0.2.1");
+    }
+  SECTION("Least connections to the same server")
+    {
+      pool.acquire("192.0.2.1", "irc.example.com");
+      pool.acquire("192.0.2.2", "irc.example.com");
+      pool.acquire("192.0.2.3", "irc.example.com");
+      pool.acquire("192.0.2.3", "irc.example.com");
+      pool.acquire("192.0.2.1", "other.example.com");
+      CHECK(pool.choose(addresses, BindPolicy::least_connections, "irc.example.com", "a@example.com") == "192.0.2.2");
+      CHECK(pool.choose(addresses, BindPolicy::least_connections, "other.example.com", "a@example.com") == "192.0.2.2");
+      CHECK(pool.get_connections("192.0.2.3") == 2);
+      CHECK(pool.get_connections("192.0.2.1", "irc.example.com") == 1);
+      pool.release("192.0.2.3", "irc.example.com");
+      pool.release("192.0.2.3", "irc.example.com");
+      CHECK(pool.get_connections("192.0.2.3") == 0);
+      const std::vector<std::pair<std::string, std::size_t>> counts{{"192.0.2.1", 2}, {"192.0.2.2", 3}};
+      CHECK(pool.get_counts() == counts);
+    }
+  SECTION("The chosen address is counted until it is released")
+    {
+      CHECK(pool.choose(addresses, BindPolicy::least_connections, "irc.example.com", "a@example.com") == "192.0.2.1");
+      CHECK(pool.choose(addresses, BindPolicy::least_connections, "irc.example.com", "b@example.com") == "192.0.2.2");
+      CHECK(pool.get_connections("192.0.2.1", "irc.example.com") == 1);
+      pool.release("192.0.2.1", "irc.example.com");
+      CHECK(pool.choose(addresses, BindPolicy::least_connections, "irc.example.com", "c@example.com") == "192.0.2.1");
+    }
+  SECTION("Sticky")
+    {
+      const auto address = pool.choose(addresses, BindPolicy::sticky, "irc.example.com", "a@example.com");
+      for (int i = 0; i < 5; ++i)
+        CHECK(pool.choose(addresses, BindPolicy::sticky, "irc.example.com", "a@example.com") == address);
+    }
+  SECTION("Rejected addresses are avoided for that server only")
+    {
+      const auto address = pool.choose(addresses, BindPolicy::sticky, "irc.example.com", "a@example.com");
+      pool.reject(address, "irc.example.com");
+      CHECK(pool.is_rejected(address, "irc.example.com"));
+      CHECK_FALSE(pool.is_rejected(address, "other.example.com"));
+      CHECK(pool.choose(addresses, BindPolicy::sticky, "irc.example.com", "a@example.com") != address);
+      CHECK(pool.choose(addresses, BindPolicy::sticky, "other.example.com", "a@example.com") == address);
+      for (const auto& other: addresses)
+        pool.reject(other, "irc.example.com");
+      // They are all rejected: use them anyway
+      CHECK(pool.choose(addresses, BindPolicy::sticky, "irc.example.com", "a@example.com") == address);
+    }
+  pool.clear();
+}
+
+TEST_CASE("Connection scheduler")
+{
+  auto& scheduler = ConnectionScheduler::instance();
+  scheduler.clear();
+  std::vector<std::string> started;
+  auto start = [&started](const std::string& name)
+  {
+    return [&started, name]() { started.push_back(name); };
+  };
+
+  SECTION("Concurrency limit and priorities")
+    {
+      scheduler.set_limits(2, 0);
+      CHECK(scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::reconnect, start("a")) == nullptr);
+      CHECK(scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::reconnect, start("b")) == nullptr);
+      auto c = scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::reconnect, start("c"));
+      auto d = scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("d"));
+      auto e = scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::reconnect, start("e"));
+      // Other servers are not limited by this one
+      CHECK(scheduler.request("other.example.com", "a@example.com", ConnectionPriority::reconnect, start("f")) == nullptr);
+      CHECK(c != nullptr);
+      CHECK(scheduler.get_queued("irc.example.com") == 3);
+      CHECK(scheduler.get_in_progress("irc.example.com") == 2);
+
+      // A cancelled request is skipped
+      e.reset();
+      CHECK(scheduler.get_queued("irc.example.com") == 2);
+
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::connected);
+      TimedEventsManager::instance().execute_expired_events();
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::cancelled);
+      TimedEventsManager::instance().execute_expired_events();
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::connected);
+      TimedEventsManager::instance().execute_expired_events();
+      const std::vector<std::string> expected{"a", "b", "f", "d", "c"};
+      CHECK(started == expected);
+
+      const auto metrics = scheduler.get_metrics();
+      CHECK(metrics.interactive.admitted == 1);
+      CHECK(metrics.reconnect.admitted == 4);
+      CHECK(metrics.queued == 0);
+    }
+  SECTION("Rate limit")
+    {
+      scheduler.set_limits(1, 1000);
+      CHECK(scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("a")) == nullptr);
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::connected);
+      TimedEventsManager::instance().execute_expired_events();
+      // The token is not back yet
+      auto b = scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("b"));
+      CHECK(b != nullptr);
+      std::this_thread::sleep_for(5ms);
+      TimedEventsManager::instance().execute_expired_events();
+      CHECK(started.size() == 2);
+      CHECK(scheduler.get_metrics().interactive.max >= 1ms);
+    }
+  SECTION("Exponential backoff after failures")
+    {
+      scheduler.set_limits(0, 0);
+      CHECK(scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("a")) == nullptr);
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::failed);
+      auto backoff = scheduler.get_backoff("irc.example.com");
+      CHECK(backoff > ConnectionScheduler::min_backoff / 2 - 100ms);
+      CHECK(backoff <= ConnectionScheduler::min_backoff);
+      auto b = scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("b"));
+      CHECK(b != nullptr);
+      CHECK(started.size() == 1);
+
+      // Each failure doubles it
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::failed);
+      backoff = scheduler.get_backoff("irc.example.com");
+      CHECK(backoff > ConnectionScheduler::min_backoff - 100ms);
+      CHECK(backoff <= ConnectionScheduler::min_backoff * 2);
+      CHECK(scheduler.get_backoff("other.example.com") == std::chrono::steady_clock::duration::zero());
+      CHECK(scheduler.get_metrics().failures == 2);
+    }
+  SECTION("A rejection only delays the connections of that user")
+    {
+      scheduler.set_limits(0, 0);
+      CHECK(scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("a")) == nullptr);
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::rejected);
+      CHECK(scheduler.get_backoff("irc.example.com") == std::chrono::steady_clock::duration::zero());
+      CHECK(scheduler.get_backoff("irc.example.com", "a@example.com") > ConnectionScheduler::min_backoff / 2 - 100ms);
+      auto b = scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("b"));
+      CHECK(b != nullptr);
+      // Not stuck behind that user's request
+      CHECK(scheduler.request("irc.example.com", "c@example.com", ConnectionPriority::reconnect, start("c")) == nullptr);
+      const std::vector<std::string> expected{"a", "c"};
+      CHECK(started == expected);
+      CHECK(scheduler.get_metrics().rejections == 1);
+      CHECK(scheduler.get_metrics().failures == 0);
+    }
+  SECTION("The idle servers are forgotten")
+    {
+      scheduler.set_limits(0, 0);
+      CHECK(scheduler.request("irc.example.com", "a@example.com", ConnectionPriority::interactive, start("a")) == nullptr);
+      CHECK(scheduler.request("other.example.com", "a@example.com", ConnectionPriority::interactive, start("b")) == nullptr);
+      scheduler.done("irc.example.com", "a@example.com", ConnectionScheduler::Outcome::connected);
+      scheduler.done("other.example.com", "a@example.com", ConnectionScheduler::Outcome::failed);
+      TimedEventsManager::instance().execute_expired_events();
+      // The failure still delays the connections to the other one
+      CHECK(scheduler.size() == 1);
+      CHECK(scheduler.get_backoff("other.example.com") > std::chrono::steady_clock::duration::zero());
+    }
+  scheduler.clear();
+  CHECK(scheduler.get_queued("irc.example.com") == 0);
+}
+
+namespace
+{
+/**
+ * One end of a socketpair, counting the times it is told to read.
+ */
+class TestReader: public SocketHandler
+{
+public:
+  TestReader(std::shared_ptr<Poller> poller, const socket_t socket, const bool pausable):
+    SocketHandler(poller, socket),
+    pausable(pausable)
+  {}
+  void on_recv() override final
+  {
+    char buf[64];
+    ::read(this->socket, buf, sizeof(buf));
+    this->received++;
+  }
+  void on_send() override final {}
+  void connect() override final {}
+  bool is_connected() const override final
+  { return true; }
+  bool can_pause_receiving() const override final
+  { return this->pausable; }
+
+  const bool pausable;
+  int received{0};
+};
+}
+
+TEST_CASE("Pause the receive events")
+{
+  auto poller = std::make_shared<Poller>();
+  int irc[2];
+  int xmpp[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, irc) == 0);
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, xmpp) == 0);
+  TestReader irc_reader(poller, irc[0], true);
+  TestReader xmpp_reader(poller, xmpp[0], false);
+  poller->add_socket_handler(&irc_reader);
+  poller->add_socket_handler(&xmpp_reader);
+
+  poller->pause_receiving();
+  CHECK(poller->is_receiving_paused());
+  CHECK(::write(irc[1], "a", 1) == 1);
+  CHECK(::write(xmpp[1], "a", 1) == 1);
+  poller->poll(10ms);
+  CHECK(irc_reader.received == 0);
+  CHECK(xmpp_reader.received == 1);
+  // Still waiting in the socket
+  poller->poll(10ms);
+  CHECK(irc_reader.received == 0);
+
+  poller->resume_receiving();
+  CHECK_FALSE(poller->is_receiving_paused());
+  poller->poll(10ms);
+  CHECK(irc_reader.received == 1);
+
+  poller->remove_socket_handler(irc[0]);
+  poller->remove_socket_handler(xmpp[0]);
+  for (const int fd: {irc[0], irc[1], xmpp[0], xmpp[1]})
+    ::close(fd);
+}
+
+namespace
+{
+/**
+ * Reads lines from one end of a socketpair, processing at most budget of
+ * them at once, like IrcClient.
+ */
+class TestLineReader: public SocketHandler
+{
+public:
+  TestLineReader(std::shared_ptr<Poller> poller, const socket_t socket, const std::size_t budget):
+    SocketHandler(poller, socket),
+    budget(budget)
+  {}
+  void on_recv() override final
+  {
+    // Like several reads of TCPSocketHandler in the same turn
+    char buf[65536];
+    const auto size = ::read(this->socket, buf, sizeof(buf));
+    if (size > 0)
+      this->in_buf.append(buf, size);
+    this->process();
+  }
+  void on_deferred_input() override final
+  { this->process(); }
+  void on_send() override final {}
+  void connect() override final {}
+  bool is_connected() const override final
+  { return true; }
+
+  std::vector<std::string> lines;
+  std::function<void(const std::string&)> on_line;
+
+private:
+  void process()
+  {
+    std::size_t processed = 0;
+    while (true)
+      {
+        const auto pos = this->in_buf.find('\n');
+        if (pos == std::string::npos)
+          break;
+        if (this->budget != 0 && processed == this->budget)
+          {
+            this->poller->defer_input(this);
+            break;
+          }
+        processed++;
+        this->lines.push_back(this->in_buf.substr(0, pos));
+        this->in_buf.erase(0, pos + 1);
+        if (this->on_line)
+          this->on_line(this->lines.back());
+      }
+  }
+
+  const std::size_t budget;
+  std::string in_buf;
+};
+}
+
+TEST_CASE("Deferred input")
+{
+  auto poller = std::make_shared<Poller>();
+  int list[2];
+  int chat[2];
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, list) == 0);
+  REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, chat) == 0);
+  TestLineReader list_reader(poller, list[0], 10);
+  TestLineReader chat_reader(poller, chat[0], 10);
+  poller->add_socket_handler(&list_reader);
+  poller->add_socket_handler(&chat_reader);
+
+  std::string flood;
+  for (int i = 0; i < 100; ++i)
+    flood += "322 #channel" + std::to_string(i) + " 42 :topic\n";
+  CHECK(::write(list[1], flood.data(), flood.size()) == static_cast<ssize_t>(flood.size()));
+  poller->poll(10ms);
+  CHECK(list_reader.lines.size() == 10);
+
+  // The chat line does not wait for the whole list
+  CHECK(::write(chat[1], "hello\n", 6) == 6);
+  poller->poll(10ms);
+  CHECK(chat_reader.lines.size() == 1);
+  CHECK(list_reader.lines.size() == 20);
+
+  // Some deferred input remains: it does not wait for the timeout
+  const auto start = std::chrono::steady_clock::now();
+  int iterations = 0;
+  while (list_reader.lines.size() < 100)
+    {
+      poller->poll(1s);
+      iterations++;
+    }
+  CHECK(iterations == 8);
+  CHECK(std::chrono::steady_clock::now() - start < 500ms);
+  CHECK(list_reader.lines.back() == "322 #channel99 42 :topic");
+
+  // Reading from that socket again
+  CHECK(::write(list[1], "323 :End of /LIST\n", 18) == 18);
+  poller->poll(10ms);
+  CHECK(list_reader.lines.back() == "323 :End of /LIST");
+
+  SECTION("No deferred input is processed while receiving is paused")
+    {
+      class PausableReader: public TestLineReader
+      {
+      public:
+        using TestLineReader::TestLineReader;
+        bool can_pause_receiving() const override final
+        { return true; }
+      };
+      int irc[2];
+      REQUIRE(::socketpair(AF_UNIX, SOCK_STREAM, 0, irc) == 0);
+      PausableReader irc_reader(poller, irc[0], 1);
+      poller->add_socket_handler(&irc_reader);
+      CHECK(::write(irc[1], "a\nb\n", 4) == 4);
+      poller->poll(10ms);
+      CHECK(irc_reader.lines.size() == 1);
+      poller->pause_receiving();
+      poller->poll(10ms);
+      CHECK(irc_reader.lines.size() == 1);
+      poller->resume_receiving();
+      poller->poll(10ms);
+      CHECK(irc_reader.lines.size() == 2);
+      poller->remove_socket_handler(irc[0]);
+      ::close(irc[0]);
+      ::close(irc[1]);
+    }
+
+  poller->remove_socket_handler(list[0]);
+  poller->remove_socket_handler(chat[0]);
+  for (const int fd: {list[0], list[1], chat[0], chat[1]})
+    ::close(fd);
+}
+
+namespace
+{
+/**
+ * A TCP connection reading IRC lines, processing at most budget of them
+ * in each turn of the poller, like IrcClient.
+ */
+class TestIrcReader: public TCPSocketHandler
+{
+public:
+  TestIrcReader(std::shared_ptr<Poller> poller, const std::size_t budget):
+    TCPSocketHandler(poller),
+    budget(budget)
+  {}
+  ~TestIrcReader() = default;
+  void on_connected() override final {}
+  void on_connection_failed(const std::string&) override final {}
+  void on_connection_close(const std::string&) override final {}
+  void parse_in_buffer(const size_t) override final
+  {
+    while (true)
+      {
+        const auto pos = this->in_buf.find("\r\n");
+        if (pos == std::string::npos)
+          break;
+        if (this->budget != 0 && this->turn_lines >= this->budget)
+          {
+            this->poller->defer_input(this);
+            break;
+          }
+        this->turn_lines++;
+        this->lines++;
+        const auto line = this->in_buf.substr(0, pos);
+        this->in_buf.erase(0, pos + 2);
+        if (this->on_line)
+          this->on_line(line);
+      }
+  }
+  void on_deferred_input() override final
+  {
+    this->turn_lines = 0;
+    this->parse_in_buffer(0);
+  }
+
+  std::size_t lines{0};
+  std::function<void(const std::string&)> on_line;
+
+protected:
+  void on_input_turn() override final
+  { this->turn_lines = 0; }
+  bool wants_more_input() const override final
+  { return this->budget == 0 || this->turn_lines < this->budget; }
+
+private:
+  const std::size_t budget;
+  std::size_t turn_lines{0};
+};
+
+/**
+ * Connect that reader to the listening socket, and return the accepted end.
+ */
+socket_t connect_reader(const std::shared_ptr<Poller>& poller, TestIrcReader& reader,
+                        const socket_t listening, const std::string& port)
+{
+  reader.connect("127.0.0.1", port, false);
+  while (!reader.is_connected())
+    {
+      poller->poll(10ms);
+      TimedEventsManager::instance().execute_expired_events();
+    }
+  return ::accept(listening, nullptr, nullptr);
+}
+}
+
+TEST_CASE("Read budget")
+{
+  auto poller = std::make_shared<Poller>();
+  std::string port;
+  const socket_t listening = listen_on_loopback(port);
+  // About 20KiB: several reads of TCPSocketHandler
+  std::string flood;
+  for (int i = 0; i < 1000; ++i)
+    flood += "322 nick #chan" + std::to_string(1000 + i) + " 4\r\n";
+
+  SECTION("The budget spans several reads")
+    {
+      TestIrcReader reader(poller, 500);
+      const socket_t remote = connect_reader(poller, reader, listening, port);
+      CHECK(::write(remote, flood.data(), flood.size()) == static_cast<ssize_t>(flood.size()));
+      poller->poll(1s);
+      CHECK(reader.lines == 500);
+      while (reader.lines < 1000)
+        poller->poll(1s);
+      reader.close();
+      ::close(remote);
+    }
+  SECTION("Without a budget, everything is read at once")
+    {
+      TestIrcReader reader(poller, 0);
+      const socket_t remote = connect_reader(poller, reader, listening, port);
+      CHECK(::write(remote, flood.data(), flood.size()) == static_cast<ssize_t>(flood.size()));
+      poller->poll(1s);
+      CHECK(reader.lines == 1000);
+      CHECK(reader.is_connected());
+      reader.close();
+      ::close(remote);
+    }
+  TimedEventsManager::instance().execute_expired_events();
+  ::close(listening);
+}
+
+namespace
+{
+/**
+ * The latencies of the lines received on a connection, one per
+ * millisecond, while another one receives a 60000 lines LIST.
+ */
+std::vector<std::chrono::microseconds> measure_list_flood(const std::size_t budget)
+{
+  auto poller = std::make_shared<Poller>();
+  std::string port;
+  const socket_t listening = listen_on_loopback(port);
+  TestIrcReader list_reader(poller, budget);
+  TestIrcReader chat_reader(poller, budget);
+  const socket_t list = connect_reader(poller, list_reader, listening, port);
+  const socket_t chat = connect_reader(poller, chat_reader, listening, port);
+
+  // Some work for each line, like forwarding it to the XMPP server
+  list_reader.on_line = [](const std::string&)
+    {
+      const auto start = std::chrono::steady_clock::now();
+      while (std::chrono::steady_clock::now() - start < 5us);
+    };
+  std::vector<std::chrono::microseconds> latencies;
+  bool chat_done = false;
+  chat_reader.on_line = [&latencies, &chat_done](const std::string& line)
+    {
+      if (line == "end")
+        {
+          chat_done = true;
+          return;
+        }
+      const std::chrono::steady_clock::time_point sent(std::chrono::steady_clock::duration(std::stoll(line)));
+      latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sent));
+    };
+
+  const std::size_t list_size = 60000;
+  std::atomic<bool> list_sent{false};
+  std::thread list_writer([list, &list_sent]()
+    {
+      std::string flood;
+      for (std::size_t i = 0; i < list_size; ++i)
+        flood += ":irc.example.com 322 nick #channel" + std::to_string(i) + " 42 :[+nt] Some topic\r\n";
+      std::size_t written = 0;
+      while (written < flood.size())
+        written += std::max<ssize_t>(::write(list, flood.data() + written, flood.size() - written), 0);
+      list_sent = true;
+    });
+  std::thread chat_writer([chat, &list_sent]()
+    {
+      while (!list_sent)
+        {
+          const auto line = std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "\r\n";
+          ::write(chat, line.data(), line.size());
+          std::this_thread::sleep_for(1ms);
+        }
+      ::write(chat, "end\r\n", 5);
+    });
+  while (list_reader.lines < list_size || !chat_done)
+    poller->poll(1s);
+  list_writer.join();
+  chat_writer.join();
+
+  list_reader.close();
+  chat_reader.close();
+  TimedEventsManager::instance().execute_expired_events();
+  for (const int fd: {list, chat, listening})
+    ::close(fd);
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+}
+
+TEST_CASE("Read latency during a LIST flood", "[.][benchmark]")
+{
+  const auto unlimited = measure_list_flood(0);
+  const auto budgeted = measure_list_flood(100);
+  REQUIRE(!unlimited.empty());
+  REQUIRE(!budgeted.empty());
+  auto percentile = [](const std::vector<std::chrono::microseconds>& latencies, const double p)
+    {
+      return latencies[static_cast<std::size_t>(p * (latencies.size() - 1))].count();
+    };
+  WARN("No budget: p50 " << percentile(unlimited, 0.5) << "µs, p99 " << percentile(unlimited, 0.99)
+       << "µs, max " << unlimited.back().count() << "µs");
+  WARN("Budget of 100 lines: p50 " << percentile(budgeted, 0.5) << "µs, p99 " << percentile(budgeted, 0.99)
+       << "µs, max " << budgeted.back().count() << "µs");
+  CHECK(percentile(budgeted, 0.99) <= percentile(unlimited, 0.99));
+}
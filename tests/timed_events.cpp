@@ -59,3 +59,20 @@ TEST_CASE("Test timed event cancellation")
   CHECK(TimedEventsManager::instance().cancel("deux") == 2);
   CHECK(TimedEventsManager::instance().get_timeout() == utils::no_timeout);
 }
+
+TEST_CASE("Test timed event rescheduling")
+{
+  auto now = std::chrono::steady_clock::now();
+  std::string executed;
+  TimedEventsManager::instance().add_event(TimedEvent(now + 1h, [&executed](){ executed += "un"; }, "un"));
+  TimedEventsManager::instance().add_event(TimedEvent(now + 2h, [&executed](){ executed += "deux"; }, "deux"));
+
+  CHECK_FALSE(TimedEventsManager::instance().reschedule("trois", now));
+  CHECK(TimedEventsManager::instance().reschedule("deux", now));
+  CHECK(TimedEventsManager::instance().size() == 2);
+  CHECK(TimedEventsManager::instance().get_timeout() == 0ms);
+  CHECK(TimedEventsManager::instance().execute_expired_events() == 1);
+  CHECK(executed == "deux");
+  CHECK(TimedEventsManager::instance().get_timeout() > 59min);
+  CHECK(TimedEventsManager::instance().cancel("un") == 1);
+}
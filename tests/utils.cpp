@@ -6,8 +6,11 @@
 #include <utils/split.hpp>
 #include <utils/xdg.hpp>
 #include <utils/empty_if_fixed_server.hpp>
+#include <config/config.hpp>
 #include <utils/get_first_non_empty.hpp>
 #include <utils/time.hpp>
+#include <utils/lru_cache.hpp>
+#include <utils/compression.hpp>
 
 using namespace std::string_literals;
 
@@ -140,3 +143,74 @@ TEST_CASE("parse_datetime")
   CHECK(utils::parse_datetime("1970-01-02T00:00:12*00:00") == -1);
   CHECK(utils::parse_datetime("1970-01-02T00:00:12+0000") == -1);
 }
+
+TEST_CASE("LRU cache")
+{
+  utils::LruCache<std::string, int> cache(2);
+  CHECK(cache.get("a") == nullptr);
+  cache.put("a", 1);
+  cache.put("b", 2);
+  REQUIRE(cache.get("a") != nullptr);
+  CHECK(*cache.get("a") == 1);
+  // "b" is now the least recently used
+  cache.put("c", 3);
+  CHECK(cache.size() == 2);
+  CHECK(cache.get("b") == nullptr);
+  CHECK(*cache.get("c") == 3);
+  cache.put("c", 4);
+  CHECK(*cache.get("c") == 4);
+  CHECK(*cache.get("a") == 1);
+
+  const auto metrics = cache.get_metrics();
+  CHECK(metrics.hits == 5);
+  CHECK(metrics.misses == 2);
+  CHECK(metrics.evictions == 1);
+  CHECK(metrics.size == 2);
+
+  cache.clear();
+  CHECK(cache.size() == 0);
+}
+
+#ifdef ZLIB_FOUND
+TEST_CASE("Compression with a dictionary")
+{
+  const std::vector<std::string> samples = {"the build is broken again", "who broke the build?",
+                                            "the release is tomorrow", "the build is green",
+                                            "notes are ready"};
+  const auto dictionary = utils::train_dictionary(samples, 64);
+  CHECK(dictionary.size() <= 64);
+  // The most common word is last
+  CHECK(dictionary.substr(dictionary.size() - 4) == "the ");
+  CHECK(dictionary.find("build ") != std::string::npos);
+  // Seen once
+  CHECK(dictionary.find("release") == std::string::npos);
+
+  const std::string text = "the build is broken, the build is late";
+  const auto compressed = utils::compress(text, dictionary);
+  CHECK(compressed.find('\0') == std::string::npos);
+  CHECK(compressed.size() < utils::compress(text, "").size());
+  CHECK(utils::decompress(compressed, dictionary) == text);
+  CHECK(utils::decompress(utils::compress("", dictionary), dictionary).empty());
+
+  // Every byte value survives
+  std::string binary;
+  for (int i = 0; i < 1024; ++i)
+    binary += static_cast<char>(i * 7);
+  CHECK(utils::decompress(utils::compress(binary, ""), "") == binary);
+
+  CHECK_THROWS_AS(utils::decompress(compressed.substr(0, compressed.size() / 2), dictionary), std::runtime_error);
+  CHECK_THROWS_AS(utils::decompress("\x01\x03", dictionary), std::runtime_error);
+
+  // The same streams, reset for each string
+  utils::Compressor compressor(dictionary);
+  utils::Decompressor decompressor(dictionary);
+  for (const auto& sample: samples)
+    {
+      const auto res = compressor.compress(sample);
+      CHECK(res == utils::compress(sample, dictionary));
+      CHECK(decompressor.decompress(res) == sample);
+    }
+  CHECK_THROWS_AS(decompressor.decompress(compressed.substr(0, compressed.size() / 2)), std::runtime_error);
+  CHECK(decompressor.decompress(compressed) == text);
+}
+#endif
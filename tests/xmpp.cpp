@@ -2,6 +2,12 @@
 
 #include <xmpp/xmpp_parser.hpp>
 #include <xmpp/auth.hpp>
+#include <xmpp/stanza_template.hpp>
+#include <xmpp/xmpp_component.hpp>
+
+#include <unordered_map>
+#include <stdexcept>
+#include <chrono>
 
 TEST_CASE("Test basic XML parsing")
 {
@@ -52,3 +58,169 @@ TEST_CASE("handshake_digest")
   const auto res = get_handshake_digest("id1234", "S4CR3T");
   CHECK(res == "c92901b5d376ad56269914da0cce3aab976847df");
 }
+
+TEST_CASE("Stanza templates are identical to XmlNode serialization")
+{
+  const std::vector<std::string> values = {"", "simple", "<&'\">", "sémantique ☺", "a\x01b", "\xe9t\xe9"};
+  const std::string from = "#chan%irc.example.com@biboumi.example.com/nick";
+  const std::string to = "user@example.com/resource";
+
+  for (const auto& value: values)
+    {
+      INFO(value);
+      for (const auto& xhtml: {std::string{}, std::string{"<body xmlns='http://www.w3.org/1999/xhtml'>a<br/>b</body>"}})
+        {
+          Stanza message("message");
+          message["to"] = to;
+          message["from"] = from + value;
+          message["type"] = "groupchat";
+          XmlNode body("body");
+          body.set_inner(value);
+          message.add_child(std::move(body));
+          if (!xhtml.empty())
+            {
+              XmlNode html("html");
+              html["xmlns"] = XHTMLIM_NS;
+              html.set_raw_inner(std::string(xhtml));
+              message.add_child(std::move(html));
+            }
+          CHECK(stanza_template::muc_message(from + value, to, value, xhtml) == message.to_string());
+        }
+
+      for (const bool self: {false, true})
+        {
+          Stanza presence("presence");
+          presence["to"] = to;
+          presence["from"] = from;
+          XmlNode x("x");
+          x["xmlns"] = MUC_USER_NS;
+          XmlNode item("item");
+          if (!value.empty())
+            {
+              item["affiliation"] = value;
+              item["role"] = value + "role";
+              item["jid"] = value + "@example.com";
+            }
+          x.add_child(std::move(item));
+          if (self)
+            {
+              XmlNode status("status");
+              status["code"] = "110";
+              x.add_child(std::move(status));
+            }
+          presence.add_child(std::move(x));
+          CHECK(stanza_template::user_join(from, to, value, value.empty() ? "" : value + "role",
+                                           value.empty() ? "" : value + "@example.com", self) == presence.to_string());
+        }
+
+      for (const bool self: {false, true})
+        {
+          Stanza presence("presence");
+          presence["to"] = to;
+          presence["from"] = from;
+          presence["type"] = "unavailable";
+          XmlNode x("x");
+          x["xmlns"] = MUC_USER_NS;
+          if (self)
+            {
+              XmlNode status("status");
+              status["code"] = "110";
+              x.add_child(std::move(status));
+            }
+          presence.add_child(std::move(x));
+          if (!value.empty())
+            {
+              XmlNode status("status");
+              status.set_inner(value);
+              presence.add_child(std::move(status));
+            }
+          CHECK(stanza_template::muc_leave(from, to, value, self) == presence.to_string());
+        }
+
+      for (const bool self: {false, true})
+        {
+          Stanza presence("presence");
+          presence["to"] = to;
+          presence["from"] = from;
+          presence["type"] = "unavailable";
+          XmlNode x("x");
+          x["xmlns"] = MUC_USER_NS;
+          XmlNode item("item");
+          item["nick"] = value;
+          x.add_child(std::move(item));
+          XmlNode status("status");
+          status["code"] = "303";
+          x.add_child(std::move(status));
+          if (self)
+            {
+              XmlNode status2("status");
+              status2["code"] = "110";
+              x.add_child(std::move(status2));
+            }
+          presence.add_child(std::move(x));
+          CHECK(stanza_template::nick_change(from, to, value, self) == presence.to_string());
+        }
+    }
+}
+
+TEST_CASE("Stanza names interning")
+{
+  CHECK(to_stanza_name("message") == StanzaName::message);
+  CHECK(to_stanza_name("presence") == StanzaName::presence);
+  CHECK(to_stanza_name("iq") == StanzaName::iq);
+  CHECK(to_stanza_name("handshake") == StanzaName::handshake);
+  CHECK(to_stanza_name("error") == StanzaName::error);
+  CHECK(to_stanza_name("") == StanzaName::unknown);
+  CHECK(to_stanza_name("messagE") == StanzaName::unknown);
+  CHECK(to_stanza_name("stream") == StanzaName::unknown);
+}
+
+TEST_CASE("Stanza dispatch overhead", "[.][benchmark]")
+{
+  const std::vector<Stanza> stanzas = {Stanza{"message"}, Stanza{"presence"}, Stanza{"iq"}, Stanza{"unknown"}};
+  const int iterations = 1000000;
+  std::size_t handled = 0;
+  const stanza_handler_t handler = [&handled](const Stanza&) { handled++; };
+
+  // What XmppComponent::on_stanza used to do
+  std::unordered_map<std::string, stanza_handler_t> map_handlers;
+  for (const auto& name: {"message", "presence", "iq"})
+    map_handlers.emplace(name, handler);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    {
+      const Stanza& stanza = stanzas[i % stanzas.size()];
+      stanza_handler_t found;
+      try
+        {
+          found = map_handlers.at(stanza.get_name());
+        }
+      catch (const std::out_of_range&)
+        {
+          continue;
+        }
+      found(stanza);
+    }
+  const auto map_duration = std::chrono::steady_clock::now() - start;
+
+  std::array<stanza_handler_t, stanza_names_count> array_handlers;
+  for (const auto name: {StanzaName::message, StanzaName::presence, StanzaName::iq})
+    array_handlers[static_cast<std::size_t>(name)] = handler;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i)
+    {
+      const Stanza& stanza = stanzas[i % stanzas.size()];
+      const StanzaName name = to_stanza_name(stanza.get_name());
+      if (name == StanzaName::unknown || !array_handlers[static_cast<std::size_t>(name)])
+        continue;
+      array_handlers[static_cast<std::size_t>(name)](stanza);
+    }
+  const auto array_duration = std::chrono::steady_clock::now() - start;
+
+  using std::chrono::duration_cast;
+  using std::chrono::nanoseconds;
+  WARN("Per stanza: map lookup " << duration_cast<nanoseconds>(map_duration).count() / iterations
+       << "ns, interned name " << duration_cast<nanoseconds>(array_duration).count() / iterations << "ns");
+  CHECK(handled == 2 * 3 * iterations / 4);
+  CHECK(array_duration < map_duration);
+}